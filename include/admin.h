@@ -7,9 +7,11 @@
 #include "log.h"
 #include "transport.h"
 #include "nvme.h"
+#include "ctrl.h"
 
 
 
+#define FEATURE_ARBITRATION 0x01
 #define FEATURE_NUMBER_OF_QUEUES 0x07
 #define FEATURE_ASYNC_EVENT_CONFIG 0x0b
 #define FEATURE_CONTROLLER_RESET 0x20
@@ -19,10 +21,23 @@
  * Starts command processing loop for the admin queue of the subsystem
  * controller. Returns if the connection is broken.
  */
-void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd);
+void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd, struct nvme_ctrl* ctrl);
 
-void admin_identify(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
+void admin_identify(struct nvme_ctrl* ctrl, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
 
-void admin_set_features(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
+void admin_set_features(struct nvme_ctrl* ctrl, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
+
+/*
+ * Processes the vendor-specific Clone Namespace command, which creates a
+ * copy-on-write clone of the namespace in NSID, or a read-only snapshot of
+ * it if bit 0 of cdw10 is set. The new NSID is returned in dw0.
+ */
+void admin_clone_ns(struct nvme_cmd* cmd, struct nvme_status* status);
+
+/*
+ * Processes a Get Log Page command for the SMART / Health Information,
+ * Changed Namespace List and Commands Supported and Effects pages.
+ */
+void admin_get_log(struct nvme_ctrl* ctrl, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,107 @@
+#ifndef __AER_H
+#define __AER_H
+
+#include <pthread.h>
+
+#include "types.h"
+#include "transport.h"
+#include "stats.h"
+
+/*
+ * Asynchronous events of an admin or discovery queue. The Asynchronous
+ * Event Requests a host submits are parked as slots, holding no thread and
+ * no blocking call, until an event is posted, from whichever thread causes
+ * it. Posting wakes the queue's thread through the eventfd, which it waits
+ * on along with its socket, and that thread sends the completions, so it
+ * stays the only one sending on the socket.
+ *
+ * An event the host has enabled with Asynchronous Event Configuration is
+ * reported once, by a parked AER or the next one to arrive, and events of
+ * its kind are then masked until the host reads its log page: the Changed
+ * Namespace List for Namespace Attribute Changed, the discovery log for
+ * Discovery Log Page Change.
+ */
+#define AER_SLOTS       4       /* AERL + 1 */
+#define AER_CHANGED_MAX 1024    /* entries of the Changed Namespace List */
+
+enum aer_event {
+	AER_NS_CHANGED   = 1 << 0,
+	AER_DISC_CHANGED = 1 << 1,
+};
+
+/*
+ * Asynchronous Event Configuration bits of the events
+ */
+#define AEC_NS_ATTR     (1U << 8)
+#define AEC_DISC_CHANGE (1U << 31)
+
+struct aer_slot {
+	u16 cid;
+	struct stats_cmd st;
+};
+
+struct aer {
+	pthread_mutex_t lock;
+	int wake;                   /* eventfd */
+	int discovery;              /* of a discovery controller */
+	u32 config;                 /* Asynchronous Event Configuration */
+	struct aer_slot slots[AER_SLOTS];
+	u32 nr_slots;               /* AERs parked, oldest first */
+	u32 pending;                /* events to report */
+	u32 masked;                 /* events reported, log page not read yet */
+	u32 changed[AER_CHANGED_MAX];
+	u32 nr_changed;             /* more than AER_CHANGED_MAX on overflow */
+	struct aer* next;
+};
+
+/*
+ * Sets up the events of an admin queue, or of a discovery queue if
+ * discovery is set, and registers them for events. Returns 0 on success
+ * or -1 on error.
+ */
+int aer_open(struct aer* a, int discovery);
+
+void aer_close(struct aer* a);
+
+/*
+ * Parks an AER of the calling queue, taking its stats. Returns 0, or the
+ * status field to complete it with right away if all slots are taken.
+ */
+u16 aer_submit(struct aer* a, u16 cid);
+
+/*
+ * Sets the Asynchronous Event Configuration, dropping events the queue
+ * does not report, and returns what it was set to.
+ */
+u32 aer_set_config(struct aer* a, u32 config);
+
+/*
+ * Waits until the socket is readable, completing parked AERs whenever
+ * events are posted. sqhd is the submission queue head to report. Returns
+ * 0 if a command can be received or -1 if the connection failed.
+ */
+int aer_wait(struct aer* a, sock_t socket, u16 sqhd);
+
+/*
+ * Posts Namespace Attribute Changed for nsid to every admin queue.
+ */
+void aer_ns_changed(u32 nsid);
+
+/*
+ * Posts Discovery Log Page Change to every discovery queue.
+ */
+void aer_disc_changed(void);
+
+/*
+ * Fills in the Changed Namespace List of a, 1024 NSIDs, and unless rae
+ * (Retain Asynchronous Event) is set clears it and unmasks its event.
+ */
+void aer_changed_log(struct aer* a, u32* list, int rae);
+
+/*
+ * Unmasks Discovery Log Page Change once the host read the log, unless
+ * rae is set.
+ */
+void aer_disc_log_read(struct aer* a, int rae);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef __ARB_H
+#define __ARB_H
+
+#include <pthread.h>
+
+#include "types.h"
+
+/*
+ * Command arbiter shared by the I/O queues of all controllers. Every queue
+ * runs on its own thread, so without it the OS scheduler decides whose
+ * command runs next. With the arbiter enabled only a fixed number of
+ * commands execute at once, and each time one finishes the next is picked
+ * as NVMe weighted round robin with urgent priority class does:
+ *
+ *   - urgent queues first, round robin among them;
+ *   - then high, medium and low, taking up to HPW+1, MPW+1 and LPW+1
+ *     commands from each class per round;
+ *   - within a class round robin over the queues, taking up to 2^AB
+ *     commands (the arbitration burst, unlimited for 7) from a queue before
+ *     moving to the next.
+ *
+ * The queue's class comes from its host (prio= in --qos-host), and the
+ * burst and weights from --arb-burst and --arb-weights. Since the arbiter
+ * spans every host, no single host may change them: Set Features
+ * Arbitration fails as not changeable.
+ */
+enum arb_class {
+	ARB_URGENT,
+	ARB_HIGH,
+	ARB_MEDIUM,
+	ARB_LOW,
+	ARB_CLASSES,
+};
+
+#define ARB_RAB 3                   /* recommended arbitration burst */
+
+/*
+ * Arbitration state of one I/O queue. Owned by the queue's thread.
+ */
+struct arb_queue {
+	int class;
+	int waiting;                    /* blocked in arb_enter */
+	int granted;
+	pthread_cond_t cond;
+	struct arb_queue* next;         /* ring of the queues of its class */
+	struct arb_queue* prev;
+};
+
+/*
+ * Enables the arbiter with slots commands executing at once. Must be
+ * called before any queue is added.
+ */
+void arb_init(u32 slots);
+
+/*
+ * Adds and removes a queue of the given class. Both are no-ops while the
+ * arbiter is disabled.
+ */
+void arb_queue_add(struct arb_queue* aq, int class);
+void arb_queue_del(struct arb_queue* aq);
+
+/*
+ * Waits until the arbiter lets the queue execute a command. Every
+ * arb_enter is paired with an arb_exit once the command has run.
+ */
+void arb_enter(struct arb_queue* aq);
+void arb_exit(struct arb_queue* aq);
+
+/*
+ * Sets the arbitration burst, 2^ab commands or unlimited for 7, and the
+ * commands the high, medium and low classes take per round, 1 to 256
+ * each. Return 0, or -1 if a value is out of range.
+ */
+int arb_set_burst(u32 ab);
+int arb_set_weights(u32 high, u32 medium, u32 low);
+
+/*
+ * Returns the class named by name (urgent, high, medium or low), or -1.
+ */
+int arb_class_parse(const char* name);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include "types.h"
+#include "transport.h"
+
+/*
+ * PDU capture: every PDU header received or sent is appended to a
+ * memory-mapped ring file as a fixed-layout record, optionally followed by
+ * a sample of the PDU data. Writers claim slots with a single atomic add,
+ * so capturing costs one copy per PDU and no locks or system calls.
+ */
+#define CAPTURE_MAGIC     "NVMECAP1"
+#define CAPTURE_SLOT_SIZE 256
+#define CAPTURE_HDR_SIZE  4096
+#define CAPTURE_PSH_MAX   120
+
+enum capture_dir {
+	CAPTURE_RX = 0,  /* host to target */
+	CAPTURE_TX = 1,  /* target to host */
+};
+
+struct capture_file_hdr {
+	char magic[8];
+	u32  slot_size;
+	u32  payload_bytes;
+	u64  nr_slots;
+	u64  head;           /* next free slot index, never wraps */
+	u64  start_realtime; /* wall clock at capture start, in ns */
+};
+
+/*
+ * A record occupies nslots consecutive slots (modulo the ring size): this
+ * header, then sampled bytes of PDU data. seq is written last, as the slot
+ * index plus one, so a reader can tell complete records from torn ones.
+ */
+struct capture_record {
+	u64 seq;
+	u64 ts;         /* ns since capture start */
+	u32 conn;       /* connection number, in order of first PDU */
+	u16 qid;        /* 0xffff until the queue is connected */
+	u8  dir;
+	u8  nslots;
+	u32 data_len;   /* PDU data length (plen - hlen) */
+	u32 sampled;    /* data bytes stored after this header */
+	struct pdu_header hdr;
+	u8  psh[CAPTURE_PSH_MAX];
+};
+
+extern struct capture_file_hdr* capture_map;
+
+/*
+ * Creates the capture file at path with room for nr_slots slots, sampling
+ * up to payload_bytes of each PDU's data. Connect data is always kept in
+ * full so that captures can be replayed. Returns 0 on success or -1.
+ */
+int capture_open(const char* path, u64 nr_slots, u32 payload_bytes);
+
+void capture_write(int dir, const struct pdu_header* hdr, const void* psh, const void* data);
+
+/*
+ * Records a PDU if capturing is enabled.
+ */
+static inline void capture_pdu(int dir, const struct pdu_header* hdr, const void* psh, const void* data) {
+	if (capture_map)
+		capture_write(dir, hdr, psh, data);
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __CLOCK_H
+#define __CLOCK_H
+
+#include <time.h>
+
+#include "types.h"
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static inline u64 clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#endif
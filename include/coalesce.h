@@ -0,0 +1,67 @@
+#ifndef __COALESCE_H
+#define __COALESCE_H
+
+#include <pthread.h>
+
+#include "types.h"
+
+struct nvme_ns;
+struct coalesce_run;
+
+/*
+ * Write coalescing. Writes to a namespace with coalescing are not written
+ * by the I/O queue but gathered into runs of LBA-contiguous writes, from
+ * any queue, each of which a flusher thread writes with a single vectored
+ * backend call, through the namespace's writev if it has one, once the
+ * run is coalesce_max long or coalesce_us after its first write arrived.
+ * Every host write still completes on its own, once its run is written.
+ *
+ * A write that overlaps an open run closes it and starts a run of its
+ * own, and runs are written in the order they were started, one at a
+ * time, so overlapping writes reach the backend in the order they
+ * arrived.
+ *
+ * Options, added to the namespace spec along with "coalesce":
+ *   coalesce_us=N window (100), coalesce_max=BYTES run length (1M).
+ */
+#define COALESCE_MAX_RUNS 64
+
+struct coalesce {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct nvme_ns* ns;
+	u64 window_ns;
+	u32 max_nlb;
+	u32 nr_runs;
+	struct coalesce_run* runs;  /* open runs, oldest first */
+	struct coalesce_run* last;
+	pthread_t thread;
+	int stop;                   /* the flusher is to exit */
+
+	/* counters, read with relaxed atomics */
+	u64 writes;                 /* host writes coalesced */
+	u64 batches;                /* backend writes they took */
+};
+
+/*
+ * Sets up coalescing for ns from the options of its spec and starts its
+ * flusher. Returns NULL on error.
+ */
+struct coalesce* coalesce_create(struct nvme_ns* ns, const char* opts);
+
+/*
+ * Stops the flusher of c and frees it. Only for a coalescer that never had
+ * writes submitted.
+ */
+void coalesce_destroy(struct coalesce* c);
+
+/*
+ * Queues a write of nlb blocks at lba from buf, which the coalescer takes
+ * ownership of. done is called with the status field of the backend write
+ * from the flusher thread once it is written. Returns 0, or -1 if the
+ * write could not be queued, in which case buf is still the caller's.
+ */
+int coalesce_submit(struct coalesce* c, void* buf, u64 lba, u32 nlb,
+		void (*done)(void* arg, u16 sf), void* arg);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef __CRC_H
+#define __CRC_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+/*
+ * CRC-16/T10-DIF (polynomial 0x8BB7, not reflected, no final XOR), the guard
+ * tag of NVMe protection information. Continues from crc, which is 0 for a
+ * new buffer. Uses carry-less multiplication where the CPU has it.
+ */
+u16 crc_t10dif(u16 crc, const void* buf, size_t len);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __CTRL_H
+#define __CTRL_H
+
+#include <pthread.h>
+
+#include "types.h"
+#include "nvme.h"
+#include "stats.h"
+#include "qos.h"
+#include "aer.h"
+#include "keepalive.h"
+
+/*
+ * A queue of a controller, registered so that the controller can tear
+ * down its connection.
+ */
+struct ctrl_queue {
+	sock_t socket;
+	struct ctrl_queue* next;
+};
+
+/*
+ * A controller of the NVM subsystem, created by the Connect command of an
+ * admin queue and shared with the I/O queues that connect to it by cntlid.
+ * Each queue holds a reference; the controller is freed with the last one.
+ * A controller whose keep-alive timer expires is dead: its queues are shut
+ * down and no more can connect to it.
+ */
+struct nvme_ctrl {
+	u16  cntlid;
+	int  refs;
+	int  dead;
+	struct ctrl_queue* queues;      /* under the registry lock */
+	struct keepalive ka;
+	char hostnqn[256];
+	struct qos_limit* qos;          /* limits of the host, NULL if none */
+	struct stats_counters retired;  /* counters of queues already closed */
+	struct aer aer;                 /* events of the admin queue */
+	struct nvme_ctrl* next;
+};
+
+/*
+ * Allocates a controller with a new cntlid for the host in params. Returns
+ * NULL on error.
+ */
+struct nvme_ctrl* ctrl_create(const struct nvme_connect_params* params);
+
+/*
+ * Looks up the controller an I/O queue connect refers to and takes a
+ * reference. Returns NULL if no such controller exists for that host.
+ */
+struct nvme_ctrl* ctrl_get(const struct nvme_connect_params* params);
+
+/*
+ * Drops a queue's reference to the controller.
+ */
+void ctrl_put(struct nvme_ctrl* ctrl);
+
+/*
+ * Registers the connection of a queue of ctrl, shutting it down right away
+ * if the controller is dead, and unregisters it once the queue is done.
+ */
+void ctrl_queue_add(struct nvme_ctrl* ctrl, struct ctrl_queue* q, sock_t socket);
+void ctrl_queue_del(struct nvme_ctrl* ctrl, struct ctrl_queue* q);
+
+/*
+ * Starts enforcing the Keep Alive Timeout of the admin queue's Connect
+ * command, in milliseconds; 0 disables it. Returns 0 on success or -1 on
+ * error.
+ */
+int ctrl_set_kato(struct nvme_ctrl* ctrl, u32 kato_ms);
+
+/*
+ * Calls fn for every live controller with the registry lock held.
+ */
+void ctrl_for_each(void (*fn)(struct nvme_ctrl* ctrl, void* arg), void* arg);
+
+#endif
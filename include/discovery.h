@@ -4,9 +4,22 @@
 #include "log.h"
 #include "transport.h"
 #include "nvme.h"
+#include "aer.h"
+#include "keepalive.h"
 
 #define DISCOVERY_NQN "nqn.2014-08.org.nvmexpress.discovery"
 
+/*
+ * Sets the port advertised in the discovery log page entries.
+ */
+void discovery_set_port(int port);
+
+/*
+ * Bumps the generation counter of the discovery log and posts Discovery
+ * Log Page Change to the discovery controllers that asked for it.
+ */
+void discovery_changed(void);
+
 /*
  * Starts command processing loop for the admin queue of the discovery
  * controller. Returns if the connection is broken.
@@ -19,7 +32,14 @@ void start_discovery_queue(sock_t socket, struct nvme_cmd* conn_cmd);
 void discovery_identify(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
 
 /*
- * Processes a get log page command.
+ * Processes a get log page command, which unmasks Discovery Log Page
+ * Change events in a.
+ */
+void discovery_get_log(struct aer* a, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
+
+/*
+ * Processes a set features command; only Asynchronous Event Configuration
+ * is supported.
  */
-void discovery_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
+void discovery_set_features(struct aer* a, struct nvme_cmd* cmd, struct nvme_status* status);
 
@@ -0,0 +1,28 @@
+#ifndef __FP_H
+#define __FP_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+/*
+ * Block fingerprints for deduplication. fp_hash is a 64-bit
+ * multiply-accumulate hash in the style of XXH3, with eight lanes that
+ * map onto SSE2 registers; it is fast and well distributed but not
+ * collision resistant, so equal fingerprints must be confirmed by
+ * comparing the data. fp_hash and fp_is_zero take a length that is a
+ * multiple of 64 bytes.
+ */
+u64 fp_hash(const void* buf, size_t len);
+
+/*
+ * Returns whether all len bytes at buf are zero.
+ */
+int fp_is_zero(const void* buf, size_t len);
+
+/*
+ * Returns whether the len bytes at a and b are equal, of any length.
+ */
+int fp_equal(const void* a, const void* b, size_t len);
+
+#endif
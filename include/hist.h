@@ -0,0 +1,40 @@
+#ifndef __HIST_H
+#define __HIST_H
+
+#include "types.h"
+
+/*
+ * Log-linear (HDR-style) histogram: every power of two is split into
+ * 2^HIST_SUB_BITS linear sub-buckets, giving about 6% relative precision
+ * over the whole range. Values at or above 2^HIST_MAX_BITS are clamped.
+ * A histogram has a single writer; other threads may read it at any time
+ * without locking and see a slightly stale but consistent-enough view.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+	u64 count;
+	u64 sum;
+	u64 max;
+	u32 buckets[HIST_BUCKETS];
+};
+
+/*
+ * Adds a value to the histogram. Must only be called by its owner thread.
+ */
+void hist_record(struct hist* h, u64 value);
+
+/*
+ * Returns the value at percentile p (0..100), i.e. the highest value
+ * equivalent to the bucket holding it. Returns 0 for an empty histogram.
+ */
+u64 hist_percentile(const struct hist* h, double p);
+
+/*
+ * Adds the contents of src to dst. dst must not be shared.
+ */
+void hist_merge(struct hist* dst, const struct hist* src);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __HOST_H
+#define __HOST_H
+
+#include "types.h"
+#include "nvme.h"
+#include "transport.h"
+
+/*
+ * Minimal NVMe/TCP host side, used by the replay and benchmark tools and
+ * by namespace mirroring. It
+ * only sets up connections and frames commands; the callers decide how
+ * commands are pipelined and how responses are consumed.
+ */
+#define HOST_NQN "nqn.2014-08.org.nvmexpress:uuid:nvme-tcp-tools"
+
+/*
+ * Opens a TCP connection to addr:port and exchanges ICReq/ICResp. Returns
+ * the socket or -1 on error.
+ */
+sock_t host_open(const char* addr, int port);
+
+/*
+ * Sends a Fabrics Connect for queue qid of subsystem subnqn and waits for
+ * its response. cntlid must be 0xffff for an admin queue and the value
+ * returned in *cntlid_out by the admin Connect for I/O queues. Returns the
+ * NVMe status code of the response, or -1 on a transport error.
+ */
+int host_connect(sock_t socket, const char* subnqn, const char* hostnqn, u16 qid,
+		u16 qsize, u16 cntlid, u32 kato, u16* cntlid_out);
+
+/*
+ * Sends a command capsule, with in-capsule data if len is not 0. Returns 0
+ * on success or -1 on error.
+ */
+int host_send_cmd(sock_t socket, struct nvme_cmd* cmd, void* data, u32 len);
+
+/*
+ * Sends an admin or fabrics command without in-capsule data and waits for
+ * its completion, copying C2H data to data as with host_wait. Returns the
+ * NVMe status code or -1 on a transport error.
+ */
+int host_admin_cmd(sock_t socket, struct nvme_cmd* cmd, void* data, u32 len);
+
+/*
+ * Sets CC.EN through a Property Set on an admin queue. Returns the NVMe
+ * status code or -1 on a transport error.
+ */
+int host_enable(sock_t socket);
+
+/*
+ * Receives PDUs until a response capsule arrives and copies it to status.
+ * C2H data, if any, is copied to data as long as it fits in len bytes.
+ * Returns 0 on success or -1 on error.
+ */
+int host_wait(sock_t socket, struct nvme_status* status, void* data, u32 len);
+
+#endif
@@ -8,12 +8,63 @@
 #include "log.h"
 #include "transport.h"
 #include "nvme.h"
+#include "ctrl.h"
+#include "rangelock.h"
 
 
-void start_io_queue(sock_t socket, struct nvme_cmd* conn_cmd);
+void start_io_queue(sock_t socket, struct nvme_cmd* conn_cmd, struct nvme_ctrl* ctrl);
 
 void io_cmd_read(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
 
-void io_cmd_write(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer); 
+/*
+ * Reads the data of a Read command from its namespace into a new buffer
+ * of *len bytes, which the caller sends and frees. Returns NULL with the
+ * status set on error.
+ */
+void* io_cmd_read_prepare(struct nvme_cmd* cmd, struct nvme_status* status, u32* len);
+
+/*
+ * Writes the in-capsule data of a Write command to its namespace and frees
+ * *data_buffer, except after a successful write to a mirrored namespace,
+ * where it returns with the range still locked in *held for the caller to
+ * pass the data on to the mirror and then unlock it, and for a namespace
+ * with write coalescing, where the caller passes it on, unwritten, to the
+ * coalescer.
+ */
+void io_cmd_write(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer,
+                  struct rl_held* held);
+
+/*
+ * Compares the in-capsule data of a Compare command with the stored
+ * blocks, failing with Compare Failure if they differ, and frees
+ * *data_buffer.
+ */
+void io_cmd_compare(struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer);
+
+/*
+ * Executes a fused Compare and Write pair atomically: no other command sees
+ * or changes the blocks between the compare and the write, which only
+ * happens if the data matched, straight to the backend even on a
+ * namespace with write coalescing. A Compare that fails or does not
+ * match aborts the Write, and a malformed Write the Compare. Frees
+ * *cmp_data, and *data_buffer as io_cmd_write does.
+ */
+void io_cmd_compare_write(struct nvme_cmd* cmp, struct nvme_status* cmp_status, void** cmp_data,
+                          struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer,
+                          struct rl_held* held);
+
+/*
+ * Flushes one namespace, or all of them for NSID 0xffffffff.
+ */
+void io_cmd_flush(struct nvme_cmd* cmd, struct nvme_status* status);
+
+/*
+ * Zoned namespace commands. Zone Append returns the LBA it wrote in dw0
+ * and dw1 of the completion; Zone Management Receive returns a buffer of
+ * *len bytes holding the zone report, which the caller sends and frees.
+ */
+void io_cmd_zone_append(struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer);
+void io_cmd_zone_send(struct nvme_cmd* cmd, struct nvme_status* status);
+void* io_cmd_zone_recv(struct nvme_cmd* cmd, struct nvme_status* status, u32* len);
 
 #endif 
\ No newline at end of file
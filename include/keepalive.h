@@ -0,0 +1,53 @@
+#ifndef __KEEPALIVE_H
+#define __KEEPALIVE_H
+
+#include "types.h"
+#include "clock.h"
+#include "timer.h"
+
+/*
+ * Keep Alive Timeout enforcement. Every controller with a KATO has a timer
+ * on one timing wheel shared by all of them, run by a single reaper
+ * thread, so thousands of controllers cost one thread and a timer each.
+ *
+ * Any command a controller receives restarts its keep-alive timer
+ * (Traffic Based Keep Alive), so the hot path only stores the time of the
+ * traffic, at most once per tick. The wheel is not touched then: when a
+ * timer fires, the reaper checks the last traffic and either re-queues
+ * the timer at the new deadline or calls expire.
+ */
+#define KA_TICK_NS  100000000UL     /* 100ms, the KAS granularity */
+
+struct keepalive {
+	struct timer timer;
+	u64 kato_ns;                /* 0 if not enforced */
+	u64 last;                   /* last traffic, read and written with relaxed atomics */
+	void (*expire)(struct keepalive* ka);
+};
+
+/*
+ * Starts enforcing a KATO of kato_ms, if not 0. expire is called on the
+ * reaper thread, with the wheel locked, once no command arrived for that
+ * long; it must not call ka_stop. Returns 0 on success or -1 on error.
+ */
+int ka_start(struct keepalive* ka, u32 kato_ms, void (*expire)(struct keepalive* ka));
+
+/*
+ * Stops enforcing the KATO, waiting for an expire call in progress.
+ */
+void ka_stop(struct keepalive* ka);
+
+/*
+ * Restarts the keep-alive timer on traffic.
+ */
+static inline void ka_touch(struct keepalive* ka) {
+	u64 now;
+	if (!ka->kato_ns)
+		return;
+	// a store per tick at most, so the queues of a controller share the line
+	now = clock_ns();
+	if (now - __atomic_load_n(&ka->last, __ATOMIC_RELAXED) >= KA_TICK_NS)
+		__atomic_store_n(&ka->last, now, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -17,12 +17,25 @@ typedef void (*log_LockFn)(void *udata, int lock);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+/*
+ * Messages below LOG_MIN_LEVEL are compiled out entirely, arguments
+ * included. Override at build time, e.g. make LOG_MIN_LEVEL=LOG_INFO.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_TRACE
+#endif
+
+#define log_at(level, ...) do { \
+    if ((level) >= LOG_MIN_LEVEL) \
+      log_log((level), __FILE__, __LINE__, __VA_ARGS__); \
+  } while (0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
 
 void log_set_udata(void *udata);
 void log_set_lock(log_LockFn fn);
@@ -30,6 +43,20 @@ void log_set_fp(FILE *fp);
 void log_set_level(int level);
 void log_set_quiet(int enable);
 
+/*
+ * Switches to asynchronous logging. Callers then only append a compact
+ * binary record (format pointer plus raw arguments) to a per-thread
+ * lock-free ring; a background thread formats and writes them. The format
+ * string and file name must therefore be string literals, which is the case
+ * for all the log_* macros. Returns 0 on success or -1 on error.
+ */
+int log_set_async(int enable);
+
+/*
+ * Writes out every record queued so far. No-op in synchronous mode.
+ */
+void log_flush(void);
+
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
 #endif
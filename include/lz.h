@@ -0,0 +1,25 @@
+#ifndef __LZ_H
+#define __LZ_H
+
+#include "types.h"
+
+/*
+ * Byte-oriented LZ77 codec using the LZ4 block format: a sequence of
+ * (literal run, match) pairs, each introduced by a token byte holding both
+ * lengths, with 16-bit match offsets. The compressor is a single-probe
+ * hash matcher that favours speed over ratio.
+ */
+
+/*
+ * Compresses len bytes at src into at most cap bytes at dst. Returns the
+ * compressed size, or 0 if it would not fit in cap.
+ */
+u32 lz_compress(const void* src, u32 len, void* dst, u32 cap);
+
+/*
+ * Decompresses clen bytes at src, which must expand to exactly len bytes,
+ * into dst. Returns 0 on success or -1 if the input is corrupt.
+ */
+int lz_decompress(const void* src, u32 clen, void* dst, u32 len);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdio.h>
+
+/*
+ * Starts a thread serving Prometheus text-format metrics over HTTP. addr is
+ * either "unix:PATH" for a Unix domain socket or "[HOST:]PORT" for TCP, with
+ * HOST defaulting to 127.0.0.1. Returns 0 on success or -1 on error.
+ */
+int metrics_start(const char* addr);
+
+/*
+ * Writes all connection, controller and queue metrics to fp in the
+ * Prometheus text exposition format.
+ */
+void metrics_write(FILE* fp);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef __MIRROR_H
+#define __MIRROR_H
+
+#include "types.h"
+
+struct nvme_ns;
+struct mirror_conn;
+
+/*
+ * Mirroring of a namespace's writes to a namespace of a peer NVMe/TCP
+ * target. Once a write has succeeded locally it is sent to the peer over
+ * a set of pipelined I/O queue connections, each keeping up to qd writes
+ * in flight. Writes are routed to a connection by 1 MiB LBA region and the
+ * peer executes each connection's commands in order, so overlapping writes
+ * reach the peer in the order they were submitted.
+ *
+ * In sync mode a write completes once the peer has acknowledged it, and a
+ * peer error status is returned to the host. In async mode it completes
+ * right away while the replication log, the data sent but not yet
+ * acknowledged, has room for it; when the log is full writes wait for the
+ * peer like in sync mode until it drains.
+ *
+ * A connection that fails, or whose peer leaves writes unacknowledged for
+ * mirror_timeout, is not reestablished: its writes, and all later ones
+ * routed to it, complete without reaching the peer and are counted as
+ * errors, so the primary keeps serving with the mirror degraded.
+ *
+ * Only plain writes are replicated, so zoned namespaces cannot be mirrored.
+ *
+ * Options, added to the namespace spec:
+ *   mirror=ADDR:PORT, mirror_nsid=N (peer namespace, default the same
+ *   NSID), mirror_mode=sync|async (sync), mirror_log=BYTES (64M),
+ *   mirror_conns=N (4), mirror_qd=N writes in flight per connection (32),
+ *   mirror_timeout=MS (10000).
+ */
+#define MIRROR_NQN "nqn.2014-08.org.nvmexpress:uuid:nvme-tcp-mirror"
+
+enum mirror_mode {
+	MIRROR_SYNC,
+	MIRROR_ASYNC,
+};
+
+struct mirror {
+	int mode;
+	u32 nsid;                   /* peer NSID */
+	u32 lba_shift;
+	u32 region_shift;           /* log2 of the routing region in blocks */
+	u64 log_max;
+	u32 qd;
+	u32 nr_conns;
+	u32 timeout_ms;             /* for the peer to acknowledge a write */
+	sock_t admin;               /* admin queue the peer's controller lives on */
+	struct mirror_conn* conns;
+
+	/* counters and gauges, updated with relaxed atomics */
+	u64 writes;                 /* writes sent to the peer */
+	u64 errors;                 /* writes the peer failed or never got */
+	u64 stalls;                 /* async writes that waited for a full log */
+	u64 lag_bytes;              /* async data not yet acknowledged */
+	u64 lag_writes;
+	u64 lag_ns;                 /* replication delay of the last async write */
+	u64 connected;              /* connections still up */
+};
+
+/*
+ * Connects to the peer named in the options of ns and checks its namespace
+ * geometry. Returns NULL on error.
+ */
+struct mirror* mirror_create(const struct nvme_ns* ns, const char* opts);
+
+/*
+ * Disconnects from the peer and frees m, which must not have had writes
+ * submitted yet.
+ */
+void mirror_destroy(struct mirror* m);
+
+/*
+ * Replicates nlb blocks at lba from buf, which the mirror takes ownership
+ * of. Returns 1 if the write has to wait for the peer, in which case done
+ * is called with the peer's status field from a mirror thread once it has
+ * it, or 0 if it can complete now and done is never called. A NULL done
+ * never waits.
+ */
+int mirror_submit(struct mirror* m, void* buf, u64 lba, u32 nlb,
+		void (*done)(void* arg, u16 sf), void* arg);
+
+#endif
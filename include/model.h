@@ -0,0 +1,78 @@
+#ifndef __MODEL_H
+#define __MODEL_H
+
+#include <pthread.h>
+
+#include "types.h"
+
+struct nvme_ns;
+
+/*
+ * Timing model of a NAND SSD behind a namespace. It does not delay
+ * anything itself: for each command it works out, from the state of the
+ * flash channels and dies, when a real drive would have completed it, and
+ * the I/O queue holds the completion back until then.
+ *
+ * Geometry: channels x dies per channel, each die programming and reading
+ * planes pages at once. Logical pages are striped across dies for reads;
+ * writes land in a write buffer and are programmed on the dies in
+ * round-robin order, and a write only completes once there is buffer space
+ * for it. After the whole physical capacity has been programmed once, each
+ * die stalls for a garbage-collection cycle (valid page copies plus an
+ * erase) every time it fills a block.
+ *
+ * Options, added to the namespace spec along with "model":
+ *   channels=N (8), dies=N (4), planes=N (2), page=BYTES (16K),
+ *   ppb=N pages per block (256), t_read=US (50), t_prog=US (500),
+ *   t_erase=US (3000), xfer=MB/s per channel (800), wbuf=BYTES (16M, 0 for
+ *   write-through), op=PERCENT overprovisioning (25), precondition (start
+ *   in steady state, with garbage collection already active).
+ */
+struct model_die {
+	u64 busy_until;
+	u64 programmed;             /* pages programmed so far */
+};
+
+struct model {
+	pthread_mutex_t lock;
+	u32 channels;
+	u32 nr_dies;
+	u64 page_bytes;             /* multi-plane page */
+	u32 lba_shift;
+	u64 t_read;
+	u64 t_prog;
+	u64 t_erase;
+	u64 xfer_mbps;
+	u32 ppb;
+	u64 free_pages;             /* per die, before garbage collection starts */
+	u64 gc_stall;               /* ns a die is busy per reclaimed block */
+
+	u64* chan_busy;
+	struct model_die* dies;
+	u32 next_die;               /* write point */
+	u64 partial;                /* buffered bytes not yet filling a page */
+
+	u64* wbuf;                  /* per page slot, time its program completes */
+	u32 wbuf_slots;
+	u64 programs;               /* pages handed to the dies so far */
+	u64 last_program;           /* completion of the latest program */
+};
+
+/*
+ * Creates a model for ns from the options of its spec. Returns NULL on
+ * error.
+ */
+struct model* model_create(const struct nvme_ns* ns, const char* opts);
+
+/*
+ * Accounts a read or write of nlb blocks at lba submitted at now and
+ * returns the time at which it completes.
+ */
+u64 model_submit(struct model* m, int write, u64 lba, u32 nlb, u64 now);
+
+/*
+ * Returns the time at which everything buffered before now is on flash.
+ */
+u64 model_flush(struct model* m, u64 now);
+
+#endif
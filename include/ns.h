@@ -0,0 +1,166 @@
+#ifndef __NS_H
+#define __NS_H
+
+#include <sys/uio.h>
+
+#include "types.h"
+#include "nvme.h"
+
+/*
+ * Namespaces of the subsystem. Every namespace is served by a backend type
+ * which provides the data path through ns_ops; the I/O queue only checks
+ * the command against the namespace geometry and forwards it.
+ */
+#define NS_MAX 1024
+
+struct nvme_ns;
+struct model;
+struct qos_limit;
+struct mirror;
+struct readahead;
+struct coalesce;
+struct range_lock;
+
+/*
+ * Data path of a namespace. Each call covers nlb blocks starting at lba,
+ * already checked against the namespace size, and returns an NVMe status
+ * field (0 on success). Calls may come from several I/O queues at once,
+ * but reads and writes never overlap a write in flight; see rangelock.h.
+ */
+struct ns_ops {
+	u16 (*read)(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb);
+	u16 (*write)(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb);
+	u16 (*flush)(struct nvme_ns* ns);  /* optional */
+
+	/*
+	 * Optional: writes nlb blocks at lba gathered from iovcnt buffers,
+	 * which together hold exactly that much, in one backend I/O.
+	 */
+	u16 (*writev)(struct nvme_ns* ns, const struct iovec* iov, int iovcnt, u64 lba, u32 nlb);
+
+	/*
+	 * Zoned namespaces only. append writes at the write pointer of the
+	 * zone starting at zslba and returns the LBA written in *lba.
+	 * zone_send applies a Zone Send Action to the zone at slba, or to
+	 * every zone if all is set. zone_recv fills a zone report of len
+	 * bytes, starting at the zone containing slba.
+	 */
+	u16 (*append)(struct nvme_ns* ns, const void* buf, u64 zslba, u32 nlb, u64* lba);
+	u16 (*zone_send)(struct nvme_ns* ns, u64 slba, u8 action, int all);
+	u16 (*zone_recv)(struct nvme_ns* ns, void* buf, u32 len, u64 slba, u8 filter, int partial);
+};
+
+/*
+ * A backend type, selected by the TYPE part of a namespace spec. create
+ * sets up ops and priv from the comma-separated options; nsid, lba_shift
+ * and nsze are already filled in. The optional clone sets up ns, with the
+ * geometry of parent, to share parent's current contents, read-only if
+ * readonly is set. Both return 0 on success or -1 on error.
+ */
+struct ns_type {
+	const char* name;
+	int (*create)(struct nvme_ns* ns, const char* opts);
+	int (*clone)(struct nvme_ns* ns, struct nvme_ns* parent, int readonly);
+};
+
+/*
+ * Space accounting of backends that reduce data, updated with relaxed
+ * atomics. The reduction ratio is logical_bytes / physical_bytes.
+ */
+struct ns_reduction {
+	u64 logical_bytes;      /* host data held, not counting zeroes */
+	u64 physical_bytes;     /* memory it takes */
+	u64 compress_ns;        /* time spent in the codec */
+	u64 decompress_ns;
+};
+
+struct nvme_ns {
+	u32 nsid;
+	u32 lba_shift;
+	u64 nsze;               /* size in logical blocks */
+	const struct ns_type* type;
+	const struct ns_ops* ops;
+	void* priv;
+	struct range_lock* locks;  /* serialize overlapping commands, see rangelock.h */
+	struct model* model;    /* device timing model, if enabled */
+	struct qos_limit* qos;  /* IOPS and bandwidth limits, if any */
+	struct mirror* mirror;  /* peer that writes are replicated to, if any */
+	struct readahead* ra;   /* sequential read-ahead, if enabled */
+	struct coalesce* coalesce;  /* write coalescing, if enabled */
+	u16 ms;                 /* metadata bytes per block, 0 or 8 */
+	u8  pi_type;            /* protection information type 1-3, 0 for none */
+	u8* meta;               /* metadata of every block, see pi.h */
+	struct ns_reduction* reduction;  /* set by reducing backends */
+	u8  wp;                 /* write protected, e.g. a read-only snapshot */
+
+	u8  csi;                /* command set, CSI_NVM or CSI_ZNS */
+	u64 zsze;               /* zoned: zone size in blocks */
+	u32 mar;                /* zoned: max active zones, 0 for no limit */
+	u32 mor;                /* zoned: max open zones, 0 for no limit */
+};
+
+extern const struct ns_type ns_null_type;
+extern const struct ns_type ns_pattern_type;
+extern const struct ns_type ns_zns_type;
+extern const struct ns_type ns_compress_type;
+extern const struct ns_type ns_dedup_type;
+extern const struct ns_type ns_cow_type;
+extern const struct ns_type ns_stripe_type;
+extern const struct ns_type ns_tier_type;
+
+/*
+ * Creates a namespace from a spec of the form TYPE[:OPTION,...] and gives
+ * it the next free NSID. Options common to all types are size=BYTES (with
+ * an optional K/M/G/T suffix, default 1G), bs=BYTES (default 4096),
+ * model, which puts the device timing model of model.h in front of it,
+ * iops=N and bw=BYTES, the QoS limits of qos.h, ms=8 or pi=1|2|3 for 8
+ * bytes of metadata per block, holding protection information of the
+ * given type with pi (see pi.h), mirror=ADDR:PORT, which replicates
+ * writes to a peer target as described in mirror.h, readahead, which
+ * prefetches ahead of sequential streams as described in readahead.h, and
+ * coalesce, which merges adjacent writes as described in coalesce.h.
+ * Returns the NSID or -1 on error.
+ */
+int ns_add(const char* spec);
+
+/*
+ * Creates a namespace sharing the contents of namespace nsid, which must
+ * be of a type that supports cloning, as a writable clone or, if readonly
+ * is set, as a read-only snapshot. It gets the next free NSID and none of
+ * the parent's QoS limits or device model. Returns the NSID, 0 if no NSID
+ * is free, or -1 on error.
+ */
+int ns_clone(u32 nsid, int readonly);
+
+/*
+ * Returns the namespace with the given NSID, or NULL if it is not active.
+ */
+struct nvme_ns* ns_get(u32 nsid);
+
+/*
+ * Returns the highest NSID in use, which is reported as the number of
+ * namespaces in Identify Controller.
+ */
+u32 ns_max_nsid(void);
+
+/*
+ * Looks up key in a comma-separated option list. Returns a pointer to its
+ * value, to an empty string for a flag without a value, or NULL if the key
+ * is not present. The value ends at the next comma.
+ */
+const char* ns_opt(const char* opts, const char* key);
+
+/*
+ * Opens a backing file or block device for reading and writing, which has
+ * to hold bytes; a regular file is created or extended as needed. Returns
+ * the descriptor or -1 on error.
+ */
+int ns_file_open(const char* path, u64 bytes);
+
+/*
+ * Returns the numeric value of key, accepting K/M/G/T suffixes, or def if
+ * the key is not present.
+ */
+u64 ns_opt_u64(const char* opts, const char* key, u64 def);
+
+#endif
@@ -47,14 +47,39 @@ enum nvme_opcodes {
 	OPC_GET_LOG  = 0x2,
 	OPC_IDENTIFY = 0x6,
 	OPC_SET_FEATURES = 0x9,
+	OPC_ASYNC_EVENT = 0xc,
 	OPC_FABRICS  = 0x7f,
 	OPC_KEEP_ALIVE = 0x18,
+	OPC_VS_CLONE_NS = 0xc0,  /* vendor specific, see admin_clone_ns() */
 };
 
 enum nvme_io_commands {
 	IO_CMD_FLUSH = 0x0,
 	IO_CMD_WRITE = 0x1,
 	IO_CMD_READ  = 0x2,
+	IO_CMD_COMPARE = 0x8,
+	IO_CMD_ZONE_MGMT_SEND = 0x79,
+	IO_CMD_ZONE_MGMT_RECV = 0x7a,
+	IO_CMD_ZONE_APPEND    = 0x7d,
+};
+
+/*
+ * Protection information field (PRINFO) in cdw12 of Read and Write
+ */
+enum nvme_prinfo {
+	PRINFO_PRACT     = 1U << 29,  /* controller inserts and strips PI */
+	PRINFO_PRCHK_GUARD = 1U << 28,
+	PRINFO_PRCHK_APP = 1U << 27,
+	PRINFO_PRCHK_REF = 1U << 26,
+};
+
+/*
+ * Fused operation (FUSE) in the flags of a command
+ */
+enum nvme_fuse {
+	FUSE_MASK   = 0x3,
+	FUSE_FIRST  = 0x1,
+	FUSE_SECOND = 0x2,
 };
 
 enum fabrics_commands {
@@ -67,24 +92,60 @@ enum identify_cns {
 	CNS_ID_NS   = 0x0,
 	CNS_ID_CTRL = 0x1,
 	CNS_ID_ACTIVE_NSID = 0x2,
-	CNS_ID_NS_LIST = 0x3,
+	CNS_ID_NS_DESC = 0x3,
+	CNS_ID_CS_NS   = 0x5,
+	CNS_ID_CS_CTRL = 0x6,
+};
+
+/*
+ * Command set identifiers (CSI)
+ */
+enum nvme_csi {
+	CSI_NVM = 0x0,
+	CSI_ZNS = 0x2,
 };
 
 enum nvme_sc_type {
 	SCT_GENERIC  = 0,
 	SCT_CMD_SPEC = 1,
+	SCT_MEDIA    = 2,
 };
 
 enum nvme_sc {
 	SC_SUCCESS         = 0x0,
 	SC_INVALID_OPCODE  = 0x1,
 	SC_INVALID_FIELD   = 0x2,
+	SC_INTERNAL        = 0x6,
+	SC_ABORTED_FAILED_FUSED  = 0x9,
+	SC_ABORTED_MISSING_FUSED = 0xA,
+	SC_INVALID_NS      = 0xB,
 	SC_COMMAND_SEQ     = 0xC,
+	SC_SGL_LENGTH      = 0xD,
+	SC_AER_LIMIT       = 0x05,  /* command specific */
+	SC_FEATURE_NOT_CHANGEABLE = 0x0E, /* command specific */
+	SC_NSID_UNAVAILABLE = 0x16, /* command specific */
+	SC_NS_WRITE_PROTECTED = 0x20,
+	SC_LBA_RANGE       = 0x80,
+	SC_WRITE_FAULT     = 0x80,  /* media errors */
+	SC_UNRECOVERED_READ = 0x81, /* media errors */
 	SC_CONNECT_INVALID = 0x82,
+	SC_GUARD_CHECK     = 0x82,  /* media errors */
+	SC_APP_TAG_CHECK   = 0x83,
+	SC_REF_TAG_CHECK   = 0x84,
+	SC_COMPARE_FAILURE = 0x85,
+	SC_ZONE_BOUNDARY   = 0xB8,  /* zoned command set specific */
+	SC_ZONE_FULL       = 0xB9,
+	SC_ZONE_READ_ONLY  = 0xBA,
+	SC_ZONE_OFFLINE    = 0xBB,
+	SC_ZONE_INVALID_WRITE = 0xBC,
+	SC_ZONE_TOO_MANY_ACTIVE = 0xBD,
+	SC_ZONE_TOO_MANY_OPEN = 0xBE,
+	SC_ZONE_INVALID_TRANSITION = 0xBF,
 };
 
 enum nvme_log {
 	LOG_HEALTH_INFO = 0x2,
+	LOG_CHANGED_NS = 0x4,
 	LOG_COMMANDS_SUPPORTED = 0x5,
 	LOG_DISCOVERY = 0x70,
 };
@@ -106,9 +167,15 @@ struct identify_active_namespace_list_data {
 struct identify_namespace_descriptor {
     u8 NIDT;          // offset: 0
     u8 NIDL;          // offset: 1
+    u8 resvd[2];
     u8 NID[16];       // offset: 4~19
 };
 
+enum nvme_nidt {
+	NIDT_UUID = 0x3,
+	NIDT_CSI  = 0x4,
+};
+
 struct nvme_identify_ctrl {
 	u16  vid;
 	u16  ssvid;
@@ -247,33 +314,52 @@ struct nvme_discovery_log_page {
 };
 #define NVME_DISCOVERY_LOG_PAGE_LEN sizeof(struct nvme_discovery_log_page)
 
-// struct nvme_smart_log {
-// 	u8			critical_warning;
-// 	u8			temperature[2];
-// 	u8			avail_spare;
-// 	u8			spare_thresh;
-// 	u8			percent_used;
-// 	u8			endu_grp_crit_warn_sumry;
-// 	u8			rsvd7[25];
-// 	u8			data_units_read[16];
-// 	u8			data_units_written[16];
-// 	u8			host_reads[16];
-// 	u8			host_writes[16];
-// 	u8			ctrl_busy_time[16];
-// 	u8			power_cycles[16];
-// 	u8			power_on_hours[16];
-// 	u8			unsafe_shutdowns[16];
-// 	u8			media_errors[16];
-// 	u8			num_err_log_entries[16];
-// 	u32			warning_temp_time;
-// 	u32			critical_comp_time;
-// 	u16			temp_sensor[8];
-// 	u32			thm_temp1_trans_count;
-// 	u32			thm_temp2_trans_count;
-// 	u32			thm_temp1_total_time;
-// 	u32			thm_temp2_total_time;
-// 	u8			rsvd232[280];
-// };
+struct nvme_smart_log {
+	u8			critical_warning;
+	u8			temperature[2];
+	u8			avail_spare;
+	u8			spare_thresh;
+	u8			percent_used;
+	u8			endu_grp_crit_warn_sumry;
+	u8			rsvd7[25];
+	u8			data_units_read[16];
+	u8			data_units_written[16];
+	u8			host_reads[16];
+	u8			host_writes[16];
+	u8			ctrl_busy_time[16];
+	u8			power_cycles[16];
+	u8			power_on_hours[16];
+	u8			unsafe_shutdowns[16];
+	u8			media_errors[16];
+	u8			num_err_log_entries[16];
+	u32			warning_temp_time;
+	u32			critical_comp_time;
+	u16			temp_sensor[8];
+	u32			thm_temp1_trans_count;
+	u32			thm_temp2_trans_count;
+	u32			thm_temp1_total_time;
+	u32			thm_temp2_total_time;
+	u8			rsvd232[280];
+};
+#define NVME_SMART_LOG_LEN sizeof(struct nvme_smart_log)
+
+/*
+ * Commands Supported and Effects log page, one entry per opcode.
+ */
+struct nvme_effects_log {
+	u32 acs[256];
+	u32 iocs[256];
+	u8  resvd[2048];
+};
+#define NVME_EFFECTS_LOG_LEN sizeof(struct nvme_effects_log)
+
+enum nvme_cmd_effects {
+	EFFECTS_CSUPP = 1 << 0,  /* command supported */
+	EFFECTS_LBCC  = 1 << 1,  /* logical block content change */
+	EFFECTS_NCC   = 1 << 2,  /* namespace capability change */
+	EFFECTS_NIC   = 1 << 3,  /* namespace inventory change */
+	EFFECTS_CCC   = 1 << 4,  /* controller capability change */
+};
 
 /*
  * Returns a status field dword based on the given status code and type.
@@ -294,6 +380,7 @@ static const char* nvme_opcode_name(u8 opcode) {
         case 0x0C: return "Asynchronous Event Request";
         case 0x18: return "Keep Alive";
         case 0x7F: return "Fabrics";
+        case 0xC0: return "Clone Namespace (vendor specific)";
         default:   return "Unknown / Reserved";
     }
 }
@@ -307,6 +394,9 @@ static const char* nvme_io_opcode_name(u8 opcode) {
 		case 0x08: return "Compare";
 		case 0x09: return "Write Zeroes";
 		case 0x0A: return "Dataset Management";
+		case 0x79: return "Zone Management Send";
+		case 0x7A: return "Zone Management Receive";
+		case 0x7D: return "Zone Append";
 		default:   return "Unknown / Reserved";
 	}
 }
@@ -462,4 +552,75 @@ struct nvme_id_ns {
 };
 #define NVME_ID_NS_LEN sizeof(struct nvme_id_ns)
 
+/*
+ * Zoned Namespace Command Set structures
+ */
+struct nvme_zns_lbafe {
+	u64 zsze;
+	u8  zdes;
+	u8  resvd[7];
+};
+
+struct nvme_id_ns_zns {
+	u16 zoc;
+	u16 ozcs;
+	u32 mar;
+	u32 mor;
+	u32 rrl;
+	u32 frl;
+	u8  resvd20[2796];
+	struct nvme_zns_lbafe lbafe[64];
+	u8  vs[256];
+};
+
+struct nvme_id_ctrl_zns {
+	u8 zasl;
+	u8 resvd1[4095];
+};
+
+enum nvme_zone_state {
+	ZONE_EMPTY     = 0x1,
+	ZONE_IMP_OPEN  = 0x2,
+	ZONE_EXP_OPEN  = 0x3,
+	ZONE_CLOSED    = 0x4,
+	ZONE_READ_ONLY = 0xd,
+	ZONE_FULL      = 0xe,
+	ZONE_OFFLINE   = 0xf,
+};
+
+enum nvme_zone_send_action {
+	ZSA_CLOSE   = 0x1,
+	ZSA_FINISH  = 0x2,
+	ZSA_OPEN    = 0x3,
+	ZSA_RESET   = 0x4,
+	ZSA_OFFLINE = 0x5,
+};
+
+struct nvme_zone_report_hdr {
+	u64 nr_zones;
+	u8  resvd[56];
+};
+
+struct nvme_zone_desc {
+	u8  zt;                 /* 2: sequential write required */
+	u8  zs;                 /* zone state in bits 7:4 */
+	u8  za;
+	u8  zai;
+	u8  resvd4[4];
+	u64 zcap;
+	u64 zslba;
+	u64 wp;
+	u8  resvd32[32];
+};
+
+/*
+ * End-to-end protection information, the 8 bytes of metadata of a block
+ * formatted with PI. All fields are big-endian.
+ */
+struct nvme_pi {
+	u16 guard;              /* CRC-16/T10-DIF of the block data */
+	u16 app_tag;
+	u32 ref_tag;
+};
+
 #endif
@@ -0,0 +1,36 @@
+#ifndef __PATTERN_H
+#define __PATTERN_H
+
+#include "types.h"
+
+/*
+ * Deterministic block contents derived from (NSID, LBA, generation), so
+ * that a host can verify data without the target storing it. A block is a
+ * sequence of little-endian 64-bit words w[i] = x ^ (x >> 31) with
+ * x = seed + i * PATTERN_STEP, and seed = pattern_seed(nsid, lba, gen).
+ */
+#define PATTERN_STEP 0x9e3779b97f4a7c15UL
+
+/*
+ * Returns the seed of block lba in generation gen of namespace nsid.
+ */
+static inline u64 pattern_seed(u32 nsid, u64 lba, u32 gen) {
+	u64 z = lba ^ ((u64) nsid << 40) ^ ((u64) gen << 56) ^ ((u64) gen << 20);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * Fills one block of len bytes, a multiple of 32, with the pattern for
+ * seed.
+ */
+void pattern_fill(void* buf, u32 len, u64 seed);
+
+/*
+ * Returns 0 if the block of len bytes matches the pattern for seed, or
+ * nonzero otherwise.
+ */
+int pattern_check(const void* buf, u32 len, u64 seed);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __PI_H
+#define __PI_H
+
+#include "types.h"
+#include "nvme.h"
+#include "ns.h"
+
+/*
+ * Metadata and end-to-end protection information (T10 DIF) of namespaces
+ * formatted with 8 bytes of metadata per block. NVMe over Fabrics only
+ * carries metadata interleaved with the data (extended LBAs), so a Read or
+ * Write transfers nlb blocks of data followed by their metadata, unless
+ * PRACT is set on a PI namespace: then the host transfers data only and
+ * the target generates PI on write and strips it on read.
+ *
+ * PRCHK selects the guard, application and reference tag checks made on
+ * PI the host sends and on PI stored with the data before it is returned.
+ * A block whose application tag is 0xFFFF (and, for type 3, reference tag
+ * 0xFFFFFFFF) is never checked, which covers blocks never written.
+ */
+
+/*
+ * Returns the number of bytes a Read or Write of nlb blocks transfers.
+ */
+u32 pi_xfer_len(const struct nvme_ns* ns, const struct nvme_cmd* cmd, u32 nlb);
+
+/*
+ * Writes nlb blocks at lba from buf, laid out as pi_xfer_len describes,
+ * checking and storing their metadata. buf is rearranged in the process.
+ * Returns an NVMe status field.
+ */
+u16 pi_write(struct nvme_ns* ns, const struct nvme_cmd* cmd, void* buf, u64 lba, u32 nlb);
+
+/*
+ * Reads nlb blocks at lba into buf, of pi_xfer_len bytes, checking their
+ * metadata and adding it unless PRACT strips it. Returns an NVMe status
+ * field.
+ */
+u16 pi_read(struct nvme_ns* ns, const struct nvme_cmd* cmd, void* buf, u64 lba, u32 nlb);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __QOS_H
+#define __QOS_H
+
+#include "types.h"
+
+/*
+ * Quality of service limits on the I/O path. A namespace and a host (by
+ * its NQN) can each have an IOPS and a bandwidth ceiling; every Read, Write
+ * and Zone Append is charged to both, and a command over a limit is held
+ * back on its queue until it conforms rather than failed.
+ *
+ * A host can also have a guaranteed floor, min_iops and min_bw: as long as
+ * it stays under its floor its commands are still charged to the namespace
+ * limits but never wait for them, so tenants without a floor absorb the
+ * throttling.
+ */
+
+/*
+ * Token bucket in its virtual scheduling form: tat is the time at which the
+ * bucket would be full again. A charge of cost units moves tat forward by
+ * cost / rate and conforms while tat stays within burst_ns of now. The
+ * update is a single compare-and-swap, so a bucket is shared by the queues
+ * of all connections without a lock. A rate of 0 means no limit.
+ */
+struct token_bucket {
+	u64 rate;                   /* units per second */
+	u64 burst_ns;               /* bucket depth, as time at rate */
+	u64 tat;                    /* theoretical arrival time */
+};
+
+/*
+ * Sets up a bucket of rate units per second, rate 0 meaning no limit, that
+ * holds burst_ms worth of them.
+ */
+void tb_init(struct token_bucket* tb, u64 rate, u64 burst_ms);
+
+/*
+ * Charges cost units at now and returns the time at which the charge
+ * conforms.
+ */
+u64 tb_charge(struct token_bucket* tb, u64 cost, u64 now);
+
+struct qos_limit {
+	struct token_bucket iops;
+	struct token_bucket bw;     /* bytes */
+	struct token_bucket min_iops;
+	struct token_bucket min_bw;
+	int arb_class;              /* hosts: arbitration class of arb.h */
+	u64 throttled;              /* commands held back by this limit */
+	u64 throttle_ns;            /* total time they were held back */
+};
+
+/*
+ * Creates a limit from the options iops=N, bw=BYTES (per second, with an
+ * optional K/M/G/T suffix), min_iops=N, min_bw=BYTES, burst=MS (bucket
+ * depth, default 10) and prio=urgent|high|medium|low (arbitration class,
+ * default medium). Returns NULL on error.
+ */
+struct qos_limit* qos_create(const char* opts);
+
+/*
+ * Adds the limits of a host from a spec of the form HOSTNQN,OPTION,...
+ * with the options of qos_create. Returns 0 on success or -1 on error.
+ */
+int qos_host_add(const char* spec);
+
+/*
+ * Returns the limits of the host with the given NQN, or NULL if it has
+ * none.
+ */
+struct qos_limit* qos_host_get(const char* hostnqn);
+
+/*
+ * Calls fn for every host with limits.
+ */
+void qos_host_for_each(void (*fn)(const char* hostnqn, const struct qos_limit* lim, void* arg), void* arg);
+
+/*
+ * Charges a command transferring bytes to the limits of its host and its
+ * namespace, either of which may be NULL, and returns the time at which it
+ * may execute: now if it is within all of them. The delay is counted
+ * against whichever limit caused it.
+ */
+u64 qos_admit(struct qos_limit* host, struct qos_limit* ns, u64 bytes, u64 now);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __RANGELOCK_H
+#define __RANGELOCK_H
+
+#include "types.h"
+
+/*
+ * LBA range locks of a namespace. The LBA space is cut into granules of
+ * RL_GRANULE bytes, which are hashed into a fixed table of lock words,
+ * each on a cache line of its own. A command locks the slots of every
+ * granule it touches, shared for reads and exclusive for writes, so only
+ * commands on overlapping ranges (or, rarely, granules that collide in
+ * the table) wait for each other, and commands on disjoint ranges touch
+ * no common cache line.
+ *
+ * The slots a command needs are sorted and taken in ascending order, with
+ * duplicates dropped, so no two commands can deadlock; a range of more
+ * than RL_HELD_MAX granules takes every slot. A contended slot is waited
+ * for on a futex. A waiting writer holds back readers that come after it,
+ * so a stream of overlapping reads cannot starve a write.
+ */
+#define RL_SLOTS        1024
+#define RL_GRANULE      (64 << 10)
+#define RL_HELD_MAX     128
+
+struct rl_slot {
+	u32 word;                   /* RL_WRITER, the waiter bits and the reader count */
+} __attribute__((aligned(64)));
+
+struct range_lock {
+	u32 granule_shift;          /* log2 of the granule in blocks */
+	struct rl_slot* slots;
+};
+
+/*
+ * The slots a command holds, filled in by range_lock.
+ */
+struct rl_held {
+	u16 slots[RL_HELD_MAX];     /* ascending */
+	u32 nr;                     /* RL_SLOTS for every slot */
+	int excl;
+};
+
+/*
+ * Sets up the range locks of a namespace with blocks of 1 << lba_shift
+ * bytes. Returns NULL on error.
+ */
+struct range_lock* range_lock_create(u32 lba_shift);
+
+void range_lock_destroy(struct range_lock* rl);
+
+/*
+ * Locks nlb blocks at lba, exclusively if excl is set, and records what
+ * it took in h for range_unlock.
+ */
+void range_lock(struct range_lock* rl, struct rl_held* h, u64 lba, u64 nlb, int excl);
+
+void range_unlock(struct range_lock* rl, struct rl_held* h);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef __READAHEAD_H
+#define __READAHEAD_H
+
+#include <pthread.h>
+
+#include "types.h"
+
+struct nvme_ns;
+struct ra_seg;
+
+/*
+ * Read-ahead for sequential streams. Every Read of a namespace with
+ * read-ahead is matched against a small table of streams by its starting
+ * LBA: a read that starts where a stream's last read ended continues it,
+ * anything else starts a new stream in place of the least recently used
+ * one, preferring streams that never went sequential, and the prefetched
+ * data of the stream it replaces is dropped.
+ *
+ * From its second sequential read on, a stream has the blocks ahead of it
+ * prefetched by worker threads into a bounded cache of fixed-size
+ * segments. The window starts at two segments and doubles with every read
+ * served from the cache, up to ra_max; a read that finds its blocks still
+ * being fetched waits for them instead of reading them again. A segment is
+ * freed once a read has consumed its end. Writes drop the cached blocks
+ * they overlap, and a prefetch in flight over them is discarded when it
+ * completes.
+ *
+ * Options, added to the namespace spec along with "readahead":
+ *   ra_cache=BYTES (16M), ra_seg=BYTES segment size (128K), ra_max=BYTES
+ *   window per stream (2M), ra_streams=N (8), ra_workers=N (2).
+ */
+#define RA_MAX_STREAMS 64
+
+struct ra_stream {
+	u64 next;                   /* LBA the stream is expected to read next */
+	u64 ahead;                  /* end of the blocks prefetched for it */
+	u32 seq;                    /* sequential reads in a row */
+	u32 window;                 /* read-ahead window in blocks */
+	u64 used;                   /* LRU stamp */
+};
+
+struct readahead {
+	pthread_mutex_t lock;
+	pthread_cond_t done;        /* a prefetch completed or was dropped */
+	pthread_cond_t work;        /* a prefetch was queued */
+	struct nvme_ns* ns;
+	u32 seg_nlb;
+	u32 max_window;             /* in blocks */
+	u32 nr_streams;
+	u32 nr_segs;
+	u64 clock;
+	struct ra_stream streams[RA_MAX_STREAMS];
+	struct ra_seg* segs;
+	struct ra_seg* head;        /* prefetches waiting for a worker */
+	struct ra_seg* tail;
+	pthread_t* workers;
+	u32 nr_workers;             /* started */
+	int stop;                   /* workers are to exit */
+
+	/* counters, updated under the lock and read with relaxed atomics */
+	u64 hits;                   /* reads served from the cache */
+	u64 misses;                 /* sequential reads that were not */
+	u64 prefetched_bytes;
+	u64 wasted_bytes;           /* prefetched, then dropped unread */
+};
+
+/*
+ * Sets up read-ahead for ns from the options of its spec and starts its
+ * workers. Returns NULL on error.
+ */
+struct readahead* ra_create(struct nvme_ns* ns, const char* opts);
+
+/*
+ * Stops the workers of ra and frees it. Only for read-ahead that never
+ * served a read.
+ */
+void ra_destroy(struct readahead* ra);
+
+/*
+ * Reads nlb blocks at lba into buf, from the cache if they were
+ * prefetched and from the namespace otherwise, and prefetches ahead of the
+ * stream the read belongs to. Returns an NVMe status field.
+ */
+u16 ra_read(struct readahead* ra, void* buf, u64 lba, u32 nlb);
+
+/*
+ * Drops cached and in-flight data of nlb blocks at lba, after they were
+ * written.
+ */
+void ra_invalidate(struct readahead* ra, u64 lba, u64 nlb);
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdio.h>
+
+#include "types.h"
+#include "clock.h"
+#include "hist.h"
+
+/*
+ * Points in the life of a command at which a timestamp is taken.
+ */
+enum stats_stamp {
+	STAMP_HDR,      /* PDU header of the command capsule received */
+	STAMP_CAPSULE,  /* whole capsule, including in-capsule data, received */
+	STAMP_SUBMIT,   /* command handed to its handler / the backend */
+	STAMP_DONE,     /* backend finished, before any data is sent */
+	STAMP_DATA,     /* first C2H data PDU sent */
+	STAMP_RESP,     /* response capsule sent */
+	STAMP_COUNT,
+};
+
+/*
+ * Intervals between stamps that are aggregated into histograms.
+ */
+enum stats_stage {
+	STAGE_CAPSULE,  /* HDR -> CAPSULE: receiving the capsule from the network */
+	STAGE_DISPATCH, /* CAPSULE -> SUBMIT: parsing and dispatch */
+	STAGE_BACKEND,  /* SUBMIT -> DONE: executing against storage */
+	STAGE_DATA,     /* DONE -> DATA: time to first data byte on the wire */
+	STAGE_RESP,     /* DONE -> RESP: sending data and response */
+	STAGE_TOTAL,    /* HDR -> RESP */
+	STAGE_COUNT,
+};
+
+enum stats_queue_kind {
+	QUEUE_DISCOVERY,
+	QUEUE_ADMIN,
+	QUEUE_IO,
+};
+
+struct stats_opcode {
+	struct hist stages[STAGE_COUNT];
+};
+
+/*
+ * Monotonic counters kept per queue and folded into the controller's totals
+ * when the queue goes away.
+ */
+struct stats_counters {
+	u64 commands;
+	u64 reads;
+	u64 writes;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 pdus_rx[16];
+	u64 pdus_tx[16];
+	u64 allocs;
+	u64 alloc_bytes;
+	u64 busy_ns;     /* time I/O commands were outstanding */
+	u64 throttled;   /* I/O commands held back by QoS limits */
+};
+
+/*
+ * Per-queue statistics. Only the thread running the queue writes to it, so
+ * nothing on the command path takes a lock; readers load the counters with
+ * relaxed atomics.
+ */
+struct queue_stats {
+	int kind;
+	u16 cntlid;
+	u16 qid;
+	u64 ts[STAMP_COUNT];
+	int opcode;
+	u64 outstanding;
+	struct stats_counters c;
+	struct stats_counters* retired;
+	struct stats_opcode* opcodes[256];
+	struct queue_stats* next;
+};
+
+/*
+ * Stamps of a command whose completion is deferred while the queue moves
+ * on to the next one.
+ */
+struct stats_cmd {
+	int opcode;
+	u64 ts[STAMP_COUNT];
+};
+
+extern __thread struct queue_stats* stats_cur;
+
+/*
+ * Registers statistics for the queue run by the calling thread. The queue's
+ * counters are added to retired, if given, when it is closed.
+ */
+void stats_queue_open(int kind, u16 cntlid, u16 qid, struct stats_counters* retired);
+
+/*
+ * Unregisters and frees the calling thread's queue statistics, logging a
+ * latency summary.
+ */
+void stats_queue_close(void);
+
+/*
+ * Marks the command received by the calling thread as submitted to its
+ * handler with the given opcode.
+ */
+void stats_cmd_begin(u8 opcode);
+
+/*
+ * Records the stage latencies of the current command once its response has
+ * been sent.
+ */
+void stats_cmd_complete(void);
+
+/*
+ * Moves the stamps of the current command into sc, leaving the queue free
+ * for the next command, and puts them back once it completes.
+ */
+void stats_cmd_park(struct stats_cmd* sc);
+void stats_cmd_resume(const struct stats_cmd* sc);
+
+/*
+ * Writes p50/p99/p99.9 per stage for every queue and opcode seen so far.
+ */
+void stats_report(FILE* fp);
+
+/*
+ * Adds the counters of every live queue of controller cntlid, plus retired,
+ * to sum.
+ */
+void stats_sum(struct stats_counters* sum, u16 cntlid, const struct stats_counters* retired);
+
+const char* stats_stage_name(int stage);
+const char* stats_kind_name(int kind);
+
+/*
+ * Calls fn for every live queue with the registry lock held.
+ */
+void stats_for_each(void (*fn)(const struct queue_stats* qs, void* arg), void* arg);
+
+/*
+ * Connection counters, updated once per accepted connection.
+ */
+void stats_conn_open(void);
+void stats_conn_close(void);
+void stats_conns(u64* total, u64* active);
+
+/*
+ * Increments a counter of the calling thread's queue. Only ever called by
+ * the owner, so a plain load and store is enough.
+ */
+#define stats_add(field, n) do { \
+		if (stats_cur) \
+			__atomic_store_n(&stats_cur->field, stats_cur->field + (n), __ATOMIC_RELAXED); \
+	} while (0)
+
+#define stats_alloc(bytes) do { \
+		stats_add(c.allocs, 1); \
+		stats_add(c.alloc_bytes, bytes); \
+	} while (0)
+
+static inline void stats_stamp(int stamp) {
+	if (stats_cur)
+		stats_cur->ts[stamp] = clock_ns();
+}
+
+/*
+ * Like stats_stamp but keeps the first timestamp taken for a command.
+ */
+static inline void stats_stamp_once(int stamp) {
+	if (stats_cur && !stats_cur->ts[stamp])
+		stats_cur->ts[stamp] = clock_ns();
+}
+
+#endif
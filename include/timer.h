@@ -0,0 +1,61 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include "types.h"
+
+/*
+ * Hashed timing wheel. Timers are hashed by expiry tick into a fixed ring
+ * of slots; a timer more than one revolution away stays in its slot until
+ * its round comes up. Adding and removing a timer is O(1) and a wheel is
+ * owned by a single thread, so there is no locking.
+ */
+#define TIMER_WHEEL_BITS 10
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timer {
+	u64 expires;                /* CLOCK_MONOTONIC time in ns */
+	void (*fn)(struct timer* t);
+	struct timer* next;
+	struct timer** pprev;       /* NULL while the timer is not queued */
+};
+
+struct timer_wheel {
+	u64 tick_ns;
+	u64 cur;                    /* first tick not yet processed */
+	u32 count;
+	struct timer* slots[TIMER_WHEEL_SLOTS];
+};
+
+/*
+ * Initializes an empty wheel with the given tick length, starting at now.
+ */
+void timer_wheel_init(struct timer_wheel* w, u64 tick_ns, u64 now);
+
+/*
+ * Queues t, whose expires and fn must be set. A timer that is already due
+ * fires on the next timer_run.
+ */
+void timer_add(struct timer_wheel* w, struct timer* t);
+
+/*
+ * Removes t from the wheel if it is queued.
+ */
+void timer_del(struct timer_wheel* w, struct timer* t);
+
+static inline int timer_pending(const struct timer* t) {
+	return t->pprev != NULL;
+}
+
+/*
+ * Calls fn for every timer that expired at or before now. Callbacks may
+ * add and remove timers, including the one that fired.
+ */
+void timer_run(struct timer_wheel* w, u64 now);
+
+/*
+ * Returns the time at which timer_run should next be called, which may be
+ * early but never late, or (u64) -1 if the wheel is empty.
+ */
+u64 timer_next(const struct timer_wheel* w);
+
+#endif
@@ -45,6 +45,11 @@ struct psh_c2hdata {
 };
 #define PSH_C2HDATA_LEN sizeof(struct psh_c2hdata)
 
+/*
+ * Returns the name of a PDU type, or "Unknown".
+ */
+const char* pdu_type_name(u8 type);
+
 /*
  * Receives complete transport-level PDU and returns its type. psh_buffer and
  * data_buffer reference pointers that are set to buffers allocated for a
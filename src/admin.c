@@ -2,6 +2,10 @@
 #include <string.h>
 #include "admin.h"
 #include "nvme.h"
+#include "stats.h"
+#include "ns.h"
+#include "arb.h"
+#include "aer.h"
 
 
 /* Forward declaration */
@@ -13,12 +17,12 @@ void response_keep_alive(sock_t socket, struct nvme_cmd* cmd, struct nvme_status
  *   이후 반복문 내에서 명령을 수신하여 각 커맨드 핸들러를 호출한 후 상태 정보를 채워 최종적으로
  *   send_status()를 통해 응답을 전송합니다.
  */
-void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
+void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd, struct nvme_ctrl* ctrl) {
     log_info("Starting new admin queue");
     u16 qsize = conn_cmd->cdw11 & 0xffff;
     u16 sqhd = 2;
     struct nvme_properties props = {
-        .cap  = ((u64)1 << 37) | (4 << 24) | (1 << 16) | 127,
+        .cap  = ((u64)1 << 43) | ((u64)1 << 37) | (4 << 24) | (1 << 16) | 127,  // CSS: NVM and I/O command sets
         .vs   = 0x10400,
         .cc   = 0x460001,
         .csts = 0,
@@ -26,21 +30,35 @@ void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
 
     /* 초기 응답 전송 (예: Admin Queue 생성 완료) */
     struct nvme_status status = {
-        .dw0  = 1,
+        .dw0  = ctrl->cntlid,
         .dw1  = 0,
         .sqhd = 1,
         .sqid = 0,
         .cid  = conn_cmd->cid,
         .sf   = 0,
     };
+    stats_queue_open(QUEUE_ADMIN, ctrl->cntlid, 0, &ctrl->retired);
+    if (aer_open(&ctrl->aer, 0)) {
+        stats_queue_close();
+        return;
+    }
+    if (ctrl_set_kato(ctrl, conn_cmd->cdw12))
+        status.sf = make_sf(SCT_GENERIC, SC_INTERNAL);
     if (send_status(socket, &status)) {
         log_warn("Failed to send initial response");
-        return;
+        goto out;
     }
+    // the host was told the Connect failed
+    if (status.sf)
+        goto out;
 
     /* 명령 처리 루프 */
     struct nvme_cmd* cmd;
     while (1) {
+        // completes AERs as their events come in until a command does
+        if (aer_wait(&ctrl->aer, socket, sqhd ? sqhd - 1 : qsize - 1))
+            goto out;
+
         /* 상태 구조체 초기화 및 큐 헤드 업데이트 */
         memset(&status, 0, sizeof(status));
         status.sqhd = sqhd++;
@@ -49,10 +67,12 @@ void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
         cmd = recv_cmd(socket, NULL);
         if (!cmd) {
             log_warn("Failed to receive command");
-            return;
+            goto out;
         }
         status.cid = cmd->cid;
         log_debug("Got command: 0x%02x (%s)", cmd->opcode, nvme_opcode_name(cmd->opcode));
+        stats_cmd_begin(cmd->opcode);
+        ka_touch(&ctrl->ka);
 
         if (cmd->opcode == OPC_FABRICS) {
             /* Fabrics 전용 처리 */
@@ -62,17 +82,27 @@ void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
             /* 일반 NVMe Admin 명령 처리 */
             switch (cmd->opcode) {
                 case OPC_IDENTIFY:
-                    admin_identify(socket, cmd, &status);
+                    admin_identify(ctrl, socket, cmd, &status);
                     break;
                 case OPC_GET_LOG:
-                    // discovery_get_log(socket, cmd, &status);
+                    admin_get_log(ctrl, socket, cmd, &status);
                     break;
                 case OPC_SET_FEATURES:
-                    admin_set_features(socket, cmd, &status);
+                    admin_set_features(ctrl, socket, cmd, &status);
+                    break;
+                case OPC_ASYNC_EVENT:
+                    // parked until an event comes in, completed by aer_wait
+                    if (!(status.sf = aer_submit(&ctrl->aer, cmd->cid))) {
+                        free(cmd);
+                        continue;
+                    }
                     break;
                 case OPC_KEEP_ALIVE:  // Keep Alive
                     response_keep_alive(socket, cmd, &status);
                     break;
+                case OPC_VS_CLONE_NS:
+                    admin_clone_ns(cmd, &status);
+                    break;
                 default:
                     status.sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
                     break;
@@ -81,13 +111,18 @@ void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
         else {
             status.sf = make_sf(SCT_GENERIC, SC_COMMAND_SEQ);
         }
+        stats_stamp_once(STAMP_DONE);
 
         free(cmd);
         if (send_status(socket, &status)) {
             log_warn("Failed to send response");
-            return;
+            goto out;
         }
     }
+
+out:
+    aer_close(&ctrl->aer);
+    stats_queue_close();
 }
 
 /*
@@ -96,39 +131,33 @@ void start_admin_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
  * - 데이터 단계가 필요한 경우 send_data()로 전송한 후,
  *   최종 상태 정보는 admin queue 루프에서 send_status()로 전송됩니다.
  */
-void admin_identify(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
+void admin_identify(struct nvme_ctrl* ctrl, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
 	log_debug("Admin Identify: CNS=0x%02x (%s), NSID=0x%08x", cmd->cdw10 & 0xFF, identify_cns_name(cmd->cdw10 & 0xFF), cmd->nsid);
 
-    switch (cmd->cdw10) {
+    switch (cmd->cdw10 & 0xff) {
         case CNS_ID_NS: {
-            /* Namespace Identify 처리 - 더미 구현 */
-			if(cmd->nsid == 1){
-
+            struct nvme_ns* ns = ns_get(cmd->nsid);
+            if (!ns) {
+                log_warn("Namespace ID %d is not supported", cmd->nsid);
+                status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+                break;
+            }
             struct nvme_id_ns id_ns;
             memset(&id_ns, 0, sizeof(id_ns));
-
-            /* LBA: 1GiB (Block size: 4096 Bytes) */
-            id_ns.nsze   = 1024 * 1024 * 1024 / 4096;  // 총 논리 블록 수
-            id_ns.ncap   = id_ns.nsze;                // capacity는 size와 동일
-            id_ns.nuse   = id_ns.nsze;                // 사용된 블록 수 (예시)
-            id_ns.nsfeat = 0;                        // 추가 기능 없음
-            id_ns.nlbaf  = 9;                        // 지원하는 LBA 포맷 수 (예: 1)
-            id_ns.flbas  = 0;                        // 기본 LBA 포맷 사용
-            id_ns.mc     = 0;                        // 메타데이터 없음
-            id_ns.dpc    = 0;
-            id_ns.dps    = 0;
-            id_ns.nmic   = 0;
-            memset(&(id_ns.rescap), 0, sizeof(id_ns.rescap));
-            id_ns.fpi    = 0;
-			id_ns.lbaf[0].ds = 12;  // 2^11 = 4k
-	
-            /* 실제 NVMe Identify Namespace 응답은 NVME_ID_NS_LEN (예: 4096바이트)만큼 전송되어야 함 */
+            id_ns.nsze   = ns->nsze;
+            id_ns.ncap   = ns->nsze;
+            id_ns.nuse   = ns->nsze;
+            id_ns.nlbaf  = 0;                    // a single LBA format
+            id_ns.flbas  = ns->ms ? 0x10 : 0;    // metadata at the end of each block
+            id_ns.lbaf[0].ds = ns->lba_shift;
+            id_ns.lbaf[0].ms = ns->ms;
+            id_ns.mc     = ns->ms ? 0x1 : 0;     // extended LBAs only, fabrics have no MPTR
+            id_ns.nsattr = ns->wp;               // write protected
+            if (ns->pi_type) {
+                id_ns.dpc = (1 << (ns->pi_type - 1)) | 0x10;  // PI in the last 8 bytes
+                id_ns.dps = ns->pi_type;
+            }
             send_data(socket, cmd->cid, &id_ns, NVME_ID_NS_LEN);
-			}
-			else{
-				log_warn("Namespace ID %d is not supported", cmd->nsid);
-				status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
-			}
             break;
         }
         case CNS_ID_CTRL: {
@@ -137,32 +166,85 @@ void admin_identify(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* sta
 			strcpy(id_ctrl.mn, "CSL NVMe-TCP Model");     // 여기에 실제 Model 값을 입력
             strcpy(id_ctrl.fr, "0.0.1");
             strcpy(id_ctrl.subnqn, SUBSYS_NQN);
+            id_ctrl.rab    = ARB_RAB;
             id_ctrl.mdts   = 11;
-            id_ctrl.cntlid = 1;
+            id_ctrl.cntlid = ctrl->cntlid;
             id_ctrl.maxcmd = 128;
-            id_ctrl.nn     = 1;
+            id_ctrl.nn     = ns_max_nsid();
             id_ctrl.ver    = 0x10400;
-            id_ctrl.kas    = 0x1111;
+            id_ctrl.kas    = KA_TICK_NS / 100000000;  // in 100ms units
+            id_ctrl.ctratt = 1 << 6;  // TBKAS: any command restarts the keep-alive timer
+            id_ctrl.aerl   = AER_SLOTS - 1;
+            id_ctrl.oaes   = AEC_NS_ATTR;
 			id_ctrl.sqes = 0x66;
 			id_ctrl.cqes = 0x44;
 			id_ctrl.sgls = 1;
+            id_ctrl.oncs   = 1 << 0;  // Compare
+            id_ctrl.fuses  = 1 << 0;  // Compare and Write
+            id_ctrl.acwu   = 0xffff;  // atomic over any length, under the range locks
+            id_ctrl.apl    = 1 << 1;  // LPA: Commands Supported and Effects log
             send_data(socket, cmd->cid, &id_ctrl, NVME_ID_CTRL_LEN);
             break;
         }
         case CNS_ID_ACTIVE_NSID: {
             struct identify_active_namespace_list_data id_active_ns = {0};
-            id_active_ns.cns[0] = htole32(0x1); // NSID=1
+            int n = 0;
+            for (u32 nsid = cmd->nsid + 1; nsid && nsid <= ns_max_nsid() && n < 1024; nsid++)
+                if (ns_get(nsid))
+                    id_active_ns.cns[n++] = htole32(nsid);
             send_data(socket, cmd->cid, &id_active_ns, sizeof(id_active_ns));
             break;
         }
-		case CNS_ID_NS_LIST: {
-			struct identify_namespace_descriptor id_ns_desc = {0};
-			id_ns_desc.NIDT = htole32(0x3);
-			id_ns_desc.NIDL = htole32(16);
-			memcpy(id_ns_desc.NID, SUBSYS_NQN, sizeof(SUBSYS_NQN));
-			send_data(socket, cmd->cid, &id_ns_desc, sizeof(id_ns_desc));
-			break;
-		}
+        case CNS_ID_NS_DESC: {
+            struct nvme_ns* ns = ns_get(cmd->nsid);
+            u8 list[4096] = {0};
+            struct identify_namespace_descriptor* uuid = (void*) list;
+            struct identify_namespace_descriptor* csi = (void*) (list + 4 + 16);
+            if (!ns) {
+                status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+                break;
+            }
+            // UUID: the subsystem's, with the NSID in the last four bytes
+            uuid->NIDT = NIDT_UUID;
+            uuid->NIDL = 16;
+            memcpy(uuid->NID, SUBSYS_NQN + sizeof(SUBSYS_NQN) - 1 - 16, 16);
+            memcpy(uuid->NID + 12, &ns->nsid, 4);
+            csi->NIDT = NIDT_CSI;
+            csi->NIDL = 1;
+            csi->NID[0] = ns->csi;
+            send_data(socket, cmd->cid, list, sizeof(list));
+            break;
+        }
+        case CNS_ID_CS_NS: {
+            struct nvme_ns* ns = ns_get(cmd->nsid);
+            u8 csi = cmd->cdw11 >> 24;
+            struct nvme_id_ns_zns id_zns = {0};
+            if (!ns) {
+                status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+                break;
+            }
+            if (csi != ns->csi) {
+                status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+                break;
+            }
+            if (csi == CSI_ZNS) {
+                id_zns.mar = ns->mar ? ns->mar - 1 : 0xffffffff;  // 0's based
+                id_zns.mor = ns->mor ? ns->mor - 1 : 0xffffffff;
+                id_zns.lbafe[0].zsze = ns->zsze;
+            }
+            send_data(socket, cmd->cid, &id_zns, sizeof(id_zns));
+            break;
+        }
+        case CNS_ID_CS_CTRL: {
+            u8 csi = cmd->cdw11 >> 24;
+            struct nvme_id_ctrl_zns id_ctrl_zns = {0};  // ZASL 0: limited by MDTS
+            if (csi != CSI_NVM && csi != CSI_ZNS) {
+                status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+                break;
+            }
+            send_data(socket, cmd->cid, &id_ctrl_zns, sizeof(id_ctrl_zns));
+            break;
+        }
         default:
             status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
             break;
@@ -180,7 +262,7 @@ void admin_identify(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* sta
  *   지원하는 경우 status->sf에 결과값을 채워 넣습니다.
  * - 여기서는 Number of Queues, Async Event Config, Controller Reset을 예시로 함.
  */
-void admin_set_features(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
+void admin_set_features(struct nvme_ctrl* ctrl, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
     uint8_t fid = cmd->cdw10 & 0xff;
     uint32_t result = 0;
     
@@ -193,6 +275,11 @@ void admin_set_features(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
             // 추가적인 Reset 처리가 필요하면 이곳에 구현
             break;
 
+        case FEATURE_ARBITRATION:
+            // the arbiter is shared by every host, its weights come from the command line
+            status->sf = make_sf(SCT_CMD_SPEC, SC_FEATURE_NOT_CHANGEABLE);
+            break;
+
         case FEATURE_NUMBER_OF_QUEUES: {
             /* NVMe 스펙상, 설정 값은 (큐 개수 - 1)로 표현됨.
                CDW11의 하위 16비트: Submission Queues Requested,
@@ -205,19 +292,16 @@ void admin_set_features(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
             NSQR = 0x0;  // 0은 1개 큐 의미
             NCQR = 0x0;
             result = ((uint32_t)NCQR << 16) | NSQR;
-            status->sf = result;
+            status->dw0 = result;
             break;
         }
 
         case FEATURE_ASYNC_EVENT_CONFIG: {
             uint32_t AEC = cmd->cdw11;  // Async Event Config 값
             log_debug("Async Event Configuration requested: 0x%x", AEC);
-            if (AEC & (1U << 31)) {
-                // Async Notification 활성화 처리 (필요 시 구현)
-                log_debug("Async Discovery Notification Enabled.");
-            }
-            result = AEC;
-            status->sf = result;
+            // only Namespace Attribute Notices are reported
+            result = aer_set_config(&ctrl->aer, AEC);
+            status->dw0 = result;
             break;
         }
 
@@ -232,37 +316,144 @@ void admin_set_features(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
  * Keep Alive 명령 처리.
  * - 데이터 전송 단계는 없으며, 단순히 명령을 수신했음을 확인하는 용도입니다.
  * - 상태 구조체에 별도의 변경 없이, 이후 admin queue 루프에서 응답(status)이 전송됩니다.
+ * - The keep-alive timer is restarted by the queue loops for every command
+ *   received, Keep Alive included, so there is nothing left to do here.
  */
 void response_keep_alive(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
     log_debug("Keep Alive requested.");
     /* 특별한 처리 없이 상태(status)는 그대로 유지 */
 }
 
-void admin_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
-    int size;
-    struct nvme_discovery_log_page* page;
-    u8 lid = cmd->cdw10 & 0xff;
-    int bytes = ((cmd->cdw10 >> 16) & 0x0fff) * 4 + 4;
-    log_debug("Discovery Get log page: LID=0x%02x (%s), %d bytes", lid, log_page_name(lid), bytes);
+/*
+ * Clone Namespace (vendor specific): creates a copy-on-write clone of the
+ * namespace in NSID, or a read-only snapshot if bit 0 of cdw10 is set, and
+ * returns its NSID in dw0. Only namespace types that support cloning
+ * accept it.
+ */
+void admin_clone_ns(struct nvme_cmd* cmd, struct nvme_status* status) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    int readonly = cmd->cdw10 & 0x1;
+    int nsid;
 
-    if (bytes > NVME_DISCOVERY_LOG_PAGE_LEN)
-        size = bytes;
+    log_debug("Clone namespace: NSID=%u, read-only=%d", cmd->nsid, readonly);
+    if (!ns) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+        return;
+    }
+    if (!ns->type->clone) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+        return;
+    }
+    nsid = ns_clone(cmd->nsid, readonly);
+    if (nsid > 0) {
+        status->dw0 = nsid;
+        // the subsystem has a namespace more; its discovery entries stay the same
+        aer_ns_changed(nsid);
+    }
+    else if (!nsid)
+        status->sf = make_sf(SCT_CMD_SPEC, SC_NSID_UNAVAILABLE);
     else
-        size = NVME_DISCOVERY_LOG_PAGE_LEN;
+        status->sf = make_sf(SCT_GENERIC, SC_INTERNAL);
+}
 
-    switch (lid) {
-        case LOG_HEALTH_INFO: {
-            // Smart
+static u64 power_on_ns;
+
+static void __attribute__((constructor)) record_power_on(void) {
+    power_on_ns = clock_ns();
+}
+
+/* Stores a counter into one of the 128-bit little-endian SMART fields. */
+static void put_u128(u8 field[16], u64 value) {
+    memset(field, 0, 16);
+    for (int i = 0; i < 8; i++)
+        field[i] = (value >> (8 * i)) & 0xff;
+}
+
+static void fill_smart_log(struct nvme_ctrl* ctrl, struct nvme_smart_log* log) {
+    struct stats_counters sum = {0};
+    u16 temp = 313;  // Kelvin, a constant 40 degrees Celsius
+
+    /* Counters are kept per queue and only added up when asked for */
+    stats_sum(&sum, ctrl->cntlid, &ctrl->retired);
 
-            // send_data(socket, cmd->cid, page, bytes);
+    log->temperature[0] = temp & 0xff;
+    log->temperature[1] = temp >> 8;
+    log->avail_spare  = 100;
+    log->spare_thresh = 10;
+    /* data units are thousands of 512-byte units, rounded up */
+    put_u128(log->data_units_read, (sum.read_bytes / 512 + 999) / 1000);
+    put_u128(log->data_units_written, (sum.write_bytes / 512 + 999) / 1000);
+    put_u128(log->host_reads, sum.reads);
+    put_u128(log->host_writes, sum.writes);
+    put_u128(log->ctrl_busy_time, sum.busy_ns / 60000000000UL);
+    put_u128(log->power_cycles, 1);
+    put_u128(log->power_on_hours, (clock_ns() - power_on_ns) / 3600000000000UL);
+}
+
+static void fill_effects_log(struct nvme_effects_log* log, u8 csi) {
+    log->acs[OPC_GET_LOG]      = EFFECTS_CSUPP;
+    log->acs[OPC_IDENTIFY]     = EFFECTS_CSUPP;
+    log->acs[OPC_SET_FEATURES] = EFFECTS_CSUPP;
+    log->acs[OPC_ASYNC_EVENT]  = EFFECTS_CSUPP;
+    log->acs[OPC_KEEP_ALIVE]   = EFFECTS_CSUPP;
+    log->acs[OPC_VS_CLONE_NS]  = EFFECTS_CSUPP | EFFECTS_NIC;
+    log->iocs[IO_CMD_FLUSH]    = EFFECTS_CSUPP;
+    log->iocs[IO_CMD_WRITE]    = EFFECTS_CSUPP | EFFECTS_LBCC;
+    log->iocs[IO_CMD_READ]     = EFFECTS_CSUPP;
+    log->iocs[IO_CMD_COMPARE]  = EFFECTS_CSUPP;
+    if (csi == CSI_ZNS) {
+        log->iocs[IO_CMD_ZONE_MGMT_SEND] = EFFECTS_CSUPP | EFFECTS_LBCC;
+        log->iocs[IO_CMD_ZONE_MGMT_RECV] = EFFECTS_CSUPP;
+        log->iocs[IO_CMD_ZONE_APPEND]    = EFFECTS_CSUPP | EFFECTS_LBCC;
+    }
+}
+
+/*
+ * Processes a Get Log Page command for the SMART / Health Information,
+ * Changed Namespace List and Commands Supported and Effects pages.
+ */
+void admin_get_log(struct nvme_ctrl* ctrl, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
+    u8 lid = cmd->cdw10 & 0xff;
+    u32 numd = ((cmd->cdw10 >> 16) & 0xffff) | ((cmd->cdw11 & 0xffff) << 16);
+    u64 offset = cmd->cdw12 | ((u64)cmd->cdw13 << 32);
+    u64 bytes = ((u64)numd + 1) * 4;
+    size_t len;
+    u8* page;
+    log_debug("Get log page: LID=0x%02x (%s), %lu bytes at offset %lu", lid, log_page_name(lid), bytes, offset);
+
+    switch (lid) {
+        case LOG_HEALTH_INFO:
+            len = NVME_SMART_LOG_LEN;
             break;
-        }
-        case LOG_COMMANDS_SUPPORTED: {
-            // Supported Commands
+        case LOG_CHANGED_NS:
+            len = AER_CHANGED_MAX * sizeof(u32);
             break;
-        }
+        case LOG_COMMANDS_SUPPORTED:
+            len = NVME_EFFECTS_LOG_LEN;
+            break;
+        default:
+            status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+            return;
+    }
+    if ((offset & 3) || offset >= len || bytes > (1 << 20)) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+        return;
     }
 
-    free(page);
+    /* room for the whole page plus whatever the host asks for beyond it */
+    page = calloc(1, offset + bytes > len ? offset + bytes : len);
+    if (!page) {
+        log_warn("malloc failed (log page)");
+        status->sf = make_sf(SCT_GENERIC, SC_INTERNAL);
+        return;
+    }
+    if (lid == LOG_HEALTH_INFO)
+        fill_smart_log(ctrl, (struct nvme_smart_log*) page);
+    else if (lid == LOG_CHANGED_NS)
+        aer_changed_log(&ctrl->aer, (u32*) page, (cmd->cdw10 >> 15) & 0x1);
+    else
+        fill_effects_log((struct nvme_effects_log*) page, cmd->cdw14 >> 24);
 
-}
\ No newline at end of file
+    send_data(socket, cmd->cid, page + offset, bytes);
+    free(page);
+}
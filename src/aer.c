@@ -0,0 +1,208 @@
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "aer.h"
+
+/* Event Type Notice, Asynchronous Event Information and Log Page Identifier */
+#define AER_TYPE_NOTICE     0x2
+#define AER_INFO_NS_CHANGED 0x00
+#define AER_INFO_DISC       0xf0
+
+static struct aer* aers;
+static pthread_mutex_t aers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int aer_open(struct aer* a, int discovery) {
+	memset(a, 0, sizeof(*a));
+	a->wake = eventfd(0, EFD_NONBLOCK);
+	if (a->wake < 0) {
+		log_warn("Cannot create AER eventfd: %s", strerror(errno));
+		return -1;
+	}
+	a->discovery = discovery;
+	pthread_mutex_init(&a->lock, NULL);
+
+	pthread_mutex_lock(&aers_lock);
+	a->next = aers;
+	aers = a;
+	pthread_mutex_unlock(&aers_lock);
+	return 0;
+}
+
+void aer_close(struct aer* a) {
+	struct aer** link;
+	pthread_mutex_lock(&aers_lock);
+	for (link = &aers; *link; link = &(*link)->next)
+		if (*link == a) {
+			*link = a->next;
+			break;
+		}
+	pthread_mutex_unlock(&aers_lock);
+	close(a->wake);
+	pthread_mutex_destroy(&a->lock);
+}
+
+/*
+ * Returns whether the host enabled events of kind ev. Call with the lock
+ * held.
+ */
+static int aer_enabled(const struct aer* a, u32 ev) {
+	if (ev == AER_NS_CHANGED)
+		return (a->config & AEC_NS_ATTR) != 0;
+	return (a->config & AEC_DISC_CHANGE) != 0;
+}
+
+/*
+ * Makes ev pending unless it is masked or disabled and wakes the queue if
+ * an AER is there to report it. Call with the lock held.
+ */
+static void aer_post(struct aer* a, u32 ev) {
+	if (!aer_enabled(a, ev) || (a->masked & ev) || (a->pending & ev))
+		return;
+	a->pending |= ev;
+	if (a->nr_slots)
+		eventfd_write(a->wake, 1);
+}
+
+u16 aer_submit(struct aer* a, u16 cid) {
+	pthread_mutex_lock(&a->lock);
+	if (a->nr_slots == AER_SLOTS) {
+		pthread_mutex_unlock(&a->lock);
+		return make_sf(SCT_CMD_SPEC, SC_AER_LIMIT);
+	}
+	a->slots[a->nr_slots].cid = cid;
+	stats_cmd_park(&a->slots[a->nr_slots].st);
+	// an event that found no AER parked is reported by this one
+	if (!a->nr_slots++ && a->pending)
+		eventfd_write(a->wake, 1);
+	pthread_mutex_unlock(&a->lock);
+	return 0;
+}
+
+u32 aer_set_config(struct aer* a, u32 config) {
+	pthread_mutex_lock(&a->lock);
+	a->config = config & (a->discovery ? AEC_DISC_CHANGE : AEC_NS_ATTR);
+	if (!aer_enabled(a, AER_NS_CHANGED))
+		a->pending &= ~AER_NS_CHANGED;
+	if (!aer_enabled(a, AER_DISC_CHANGED))
+		a->pending &= ~AER_DISC_CHANGED;
+	config = a->config;
+	pthread_mutex_unlock(&a->lock);
+	return config;
+}
+
+/*
+ * Completes parked AERs with the pending events, one event each. Returns
+ * 0 on success or -1 if the connection failed.
+ */
+static int aer_complete(struct aer* a, sock_t socket, u16 sqhd) {
+	struct aer_slot done[AER_SLOTS];
+	u32 info[AER_SLOTS];
+	u32 n = 0;
+	eventfd_t count;
+
+	eventfd_read(a->wake, &count);
+	pthread_mutex_lock(&a->lock);
+	while (a->nr_slots && a->pending) {
+		u32 ev = a->pending & -a->pending;
+		a->pending &= ~ev;
+		a->masked |= ev;
+		info[n] = ev == AER_NS_CHANGED ?
+			AER_TYPE_NOTICE | (AER_INFO_NS_CHANGED << 8) | (LOG_CHANGED_NS << 16) :
+			AER_TYPE_NOTICE | (AER_INFO_DISC << 8) | (LOG_DISCOVERY << 16);
+		done[n++] = a->slots[0];
+		memmove(&a->slots[0], &a->slots[1], --a->nr_slots * sizeof(a->slots[0]));
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	for (u32 i = 0; i < n; i++) {
+		struct nvme_status status = {
+			.dw0  = info[i],
+			.sqhd = sqhd,
+			.cid  = done[i].cid,
+		};
+		log_debug("Asynchronous event 0x%06x for command %u", info[i], done[i].cid);
+		stats_cmd_resume(&done[i].st);
+		stats_stamp_once(STAMP_DONE);
+		if (send_status(socket, &status)) {
+			log_warn("Failed to send asynchronous event");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int aer_wait(struct aer* a, sock_t socket, u16 sqhd) {
+	struct pollfd pfd[2] = {
+		{ .fd = socket, .events = POLLIN },
+		{ .fd = a->wake, .events = POLLIN },
+	};
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_warn("poll failed: %s", strerror(errno));
+			return -1;
+		}
+		if ((pfd[1].revents & POLLIN) && aer_complete(a, socket, sqhd))
+			return -1;
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+			return 0;
+	}
+}
+
+void aer_ns_changed(u32 nsid) {
+	pthread_mutex_lock(&aers_lock);
+	for (struct aer* a = aers; a; a = a->next) {
+		if (a->discovery)
+			continue;
+		u32 i = 0;
+		pthread_mutex_lock(&a->lock);
+		// a list that overflowed stays so until it is read
+		while (i < a->nr_changed && i < AER_CHANGED_MAX && a->changed[i] != nsid)
+			i++;
+		if (i == a->nr_changed && i < AER_CHANGED_MAX)
+			a->changed[a->nr_changed++] = nsid;
+		else if (i == a->nr_changed)
+			a->nr_changed = AER_CHANGED_MAX + 1;
+		aer_post(a, AER_NS_CHANGED);
+		pthread_mutex_unlock(&a->lock);
+	}
+	pthread_mutex_unlock(&aers_lock);
+}
+
+void aer_disc_changed(void) {
+	pthread_mutex_lock(&aers_lock);
+	for (struct aer* a = aers; a; a = a->next) {
+		if (!a->discovery)
+			continue;
+		pthread_mutex_lock(&a->lock);
+		aer_post(a, AER_DISC_CHANGED);
+		pthread_mutex_unlock(&a->lock);
+	}
+	pthread_mutex_unlock(&aers_lock);
+}
+
+void aer_changed_log(struct aer* a, u32* list, int rae) {
+	pthread_mutex_lock(&a->lock);
+	if (a->nr_changed > AER_CHANGED_MAX)
+		list[0] = 0xffffffff;
+	else
+		memcpy(list, a->changed, a->nr_changed * sizeof(*list));
+	if (!rae) {
+		a->nr_changed = 0;
+		a->masked &= ~AER_NS_CHANGED;
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+void aer_disc_log_read(struct aer* a, int rae) {
+	pthread_mutex_lock(&a->lock);
+	if (!rae)
+		a->masked &= ~AER_DISC_CHANGED;
+	pthread_mutex_unlock(&a->lock);
+}
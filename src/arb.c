@@ -0,0 +1,210 @@
+#include <string.h>
+
+#include "log.h"
+#include "arb.h"
+
+static struct {
+	pthread_mutex_t lock;
+	u32 slots;                      /* 0 while disabled */
+	u32 free;
+	u32 waiting[ARB_CLASSES];
+	struct arb_queue* cursor[ARB_CLASSES];  /* queue being served in each class */
+	u32 burst_left[ARB_CLASSES];    /* commands the cursor may still take */
+	u32 credits[ARB_CLASSES];       /* commands each class may still take this round */
+	u8  ab;
+	u8  weight[ARB_CLASSES];        /* 0's based, urgent unused */
+} arb = {
+	.lock   = PTHREAD_MUTEX_INITIALIZER,
+	.ab     = ARB_RAB,
+	.weight = { 0, 7, 3, 0 },
+};
+
+static inline int arb_enabled(void) {
+	return __atomic_load_n(&arb.slots, __ATOMIC_RELAXED) != 0;
+}
+
+static inline u32 arb_burst(void) {
+	return arb.ab == 7 ? (u32) -1 : 1U << arb.ab;
+}
+
+/*
+ * Enables the arbiter with slots commands executing at once.
+ */
+void arb_init(u32 slots) {
+	if (!slots)
+		return;
+	arb.free = slots;
+	__atomic_store_n(&arb.slots, slots, __ATOMIC_RELAXED);
+	log_info("Arbitration: %u commands at once, weighted round robin", slots);
+}
+
+/*
+ * Adds a queue of the given class.
+ */
+void arb_queue_add(struct arb_queue* aq, int class) {
+	struct arb_queue* head;
+	memset(aq, 0, sizeof(*aq));
+	if (!arb_enabled())
+		return;
+	aq->class = class;
+	pthread_cond_init(&aq->cond, NULL);
+	pthread_mutex_lock(&arb.lock);
+	head = arb.cursor[class];
+	if (head) {
+		aq->next = head;
+		aq->prev = head->prev;
+		head->prev->next = aq;
+		head->prev = aq;
+	}
+	else {
+		aq->next = aq->prev = aq;
+		arb.cursor[class] = aq;
+	}
+	pthread_mutex_unlock(&arb.lock);
+}
+
+/*
+ * Removes a queue, which must not be waiting.
+ */
+void arb_queue_del(struct arb_queue* aq) {
+	if (!aq->next)
+		return;
+	pthread_mutex_lock(&arb.lock);
+	if (aq->next == aq) {
+		arb.cursor[aq->class] = NULL;
+	}
+	else {
+		aq->prev->next = aq->next;
+		aq->next->prev = aq->prev;
+		if (arb.cursor[aq->class] == aq) {
+			arb.cursor[aq->class] = aq->next;
+			arb.burst_left[aq->class] = 0;
+		}
+	}
+	pthread_mutex_unlock(&arb.lock);
+	pthread_cond_destroy(&aq->cond);
+	aq->next = aq->prev = NULL;
+}
+
+/*
+ * Picks the next waiting queue of class c: the current one while it has
+ * burst left, otherwise the next waiting one in the ring.
+ */
+static struct arb_queue* arb_pick_queue(int c) {
+	struct arb_queue* aq = arb.cursor[c];
+	if (aq->waiting && arb.burst_left[c]) {
+		arb.burst_left[c]--;
+		return aq;
+	}
+	do
+		aq = aq->next;
+	while (!aq->waiting);
+	arb.cursor[c] = aq;
+	arb.burst_left[c] = arb_burst() - 1;
+	return aq;
+}
+
+/*
+ * Picks the class to serve next. At least one queue is waiting.
+ */
+static int arb_pick_class(void) {
+	int c;
+	if (arb.waiting[ARB_URGENT])
+		return ARB_URGENT;
+	for (;;) {
+		for (c = ARB_HIGH; c < ARB_CLASSES; c++) {
+			if (arb.waiting[c] && arb.credits[c]) {
+				arb.credits[c]--;
+				return c;
+			}
+		}
+		// every class with work has used up its weight: next round
+		for (c = ARB_HIGH; c < ARB_CLASSES; c++)
+			arb.credits[c] = arb.weight[c] + 1;
+	}
+}
+
+/*
+ * Hands free slots to waiting queues. Called with the lock held.
+ */
+static void arb_dispatch(void) {
+	u32 waiting = 0;
+	for (int c = 0; c < ARB_CLASSES; c++)
+		waiting += arb.waiting[c];
+	while (arb.free && waiting) {
+		int c = arb_pick_class();
+		struct arb_queue* aq = arb_pick_queue(c);
+		aq->waiting = 0;
+		aq->granted = 1;
+		arb.waiting[c]--;
+		waiting--;
+		arb.free--;
+		pthread_cond_signal(&aq->cond);
+	}
+}
+
+/*
+ * Waits until the arbiter lets the queue execute a command.
+ */
+void arb_enter(struct arb_queue* aq) {
+	if (!aq->next)
+		return;
+	pthread_mutex_lock(&arb.lock);
+	aq->waiting = 1;
+	arb.waiting[aq->class]++;
+	arb_dispatch();
+	while (!aq->granted)
+		pthread_cond_wait(&aq->cond, &arb.lock);
+	aq->granted = 0;
+	pthread_mutex_unlock(&arb.lock);
+}
+
+/*
+ * Gives back the slot taken by arb_enter.
+ */
+void arb_exit(struct arb_queue* aq) {
+	if (!aq->next)
+		return;
+	pthread_mutex_lock(&arb.lock);
+	arb.free++;
+	arb_dispatch();
+	pthread_mutex_unlock(&arb.lock);
+}
+
+/*
+ * Sets the arbitration burst.
+ */
+int arb_set_burst(u32 ab) {
+	if (ab > 7) {
+		log_error("Arbitration burst must be 0-7");
+		return -1;
+	}
+	arb.ab = ab;
+	return 0;
+}
+
+/*
+ * Sets the class weights, kept 0's based like the feature has them.
+ */
+int arb_set_weights(u32 high, u32 medium, u32 low) {
+	if (!high || high > 256 || !medium || medium > 256 || !low || low > 256) {
+		log_error("Arbitration weights must be 1-256");
+		return -1;
+	}
+	arb.weight[ARB_HIGH] = high - 1;
+	arb.weight[ARB_MEDIUM] = medium - 1;
+	arb.weight[ARB_LOW] = low - 1;
+	return 0;
+}
+
+/*
+ * Returns the class named by name, or -1.
+ */
+int arb_class_parse(const char* name) {
+	static const char* names[] = { "urgent", "high", "medium", "low" };
+	for (int c = 0; c < ARB_CLASSES; c++)
+		if (!strncmp(name, names[c], strlen(names[c])) &&
+		    (!name[strlen(names[c])] || name[strlen(names[c])] == ','))
+			return c;
+	return -1;
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "clock.h"
+#include "stats.h"
+#include "capture.h"
+
+struct capture_file_hdr* capture_map;
+
+static u8* slots;
+static u64 start_ns;
+static u32 next_conn;
+static __thread u32 conn_id;
+
+/*
+ * Creates the capture file at path with room for nr_slots slots, sampling
+ * up to payload_bytes of each PDU's data. Connect data is always kept in
+ * full so that captures can be replayed. Returns 0 on success or -1.
+ */
+int capture_open(const char* path, u64 nr_slots, u32 payload_bytes) {
+	struct capture_file_hdr* map;
+	struct timespec now;
+	size_t size = CAPTURE_HDR_SIZE + nr_slots * CAPTURE_SLOT_SIZE;
+	int fd;
+
+	if (nr_slots < 256) {
+		log_error("Capture needs at least 256 slots");
+		return -1;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error("Failed to open capture file %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, size)) {
+		log_error("Failed to size capture file %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("Failed to map capture file %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(map->magic, CAPTURE_MAGIC, sizeof(map->magic));
+	map->slot_size = CAPTURE_SLOT_SIZE;
+	map->payload_bytes = payload_bytes;
+	map->nr_slots = nr_slots;
+	map->head = 0;
+	map->start_realtime = now.tv_sec * 1000000000UL + now.tv_nsec;
+	slots = (u8*) map + CAPTURE_HDR_SIZE;
+	start_ns = clock_ns();
+	__atomic_store_n(&capture_map, map, __ATOMIC_RELEASE);
+	log_info("Capturing PDUs to %s (%lu slots, %u payload bytes)", path, nr_slots, payload_bytes);
+	return 0;
+}
+
+/* Copies len bytes to byte offset off of the slot area, wrapping at its end. */
+static void ring_copy(u64 off, const void* src, size_t len) {
+	u64 size = capture_map->nr_slots * CAPTURE_SLOT_SIZE;
+	size_t first;
+	off %= size;
+	first = size - off < len ? size - off : len;
+	memcpy(slots + off, src, first);
+	memcpy(slots, (const u8*) src + first, len - first);
+}
+
+void capture_write(int dir, const struct pdu_header* hdr, const void* psh, const void* data) {
+	struct capture_record rec;
+	const struct nvme_cmd* cmd = psh;
+	u32 hlen = hdr->hlen > PDU_HDR_LEN ? hdr->hlen - PDU_HDR_LEN : 0;
+	u32 data_len = hdr->plen > hdr->hlen ? hdr->plen - hdr->hlen : 0;
+	u32 sampled = capture_map->payload_bytes;
+	u32 nslots;
+	u64 idx;
+
+	if (!conn_id)
+		conn_id = __atomic_add_fetch(&next_conn, 1, __ATOMIC_RELAXED);
+	if (hlen > CAPTURE_PSH_MAX)
+		hlen = CAPTURE_PSH_MAX;
+	if (hdr->type == PDU_TYPE_CMD && psh && hlen >= NVME_CMD_LEN &&
+	    cmd->opcode == OPC_FABRICS && cmd->nsid == FCTYPE_CONNECT)
+		sampled = data_len;
+	if (sampled > data_len || !data)
+		sampled = data ? data_len : 0;
+	if (sampled > 255 * CAPTURE_SLOT_SIZE - sizeof(rec))
+		sampled = 255 * CAPTURE_SLOT_SIZE - sizeof(rec);
+	nslots = (sizeof(rec) + sampled + CAPTURE_SLOT_SIZE - 1) / CAPTURE_SLOT_SIZE;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ts = clock_ns() - start_ns;
+	rec.conn = conn_id;
+	rec.qid = stats_cur ? stats_cur->qid : 0xffff;
+	rec.dir = dir;
+	rec.nslots = nslots;
+	rec.data_len = data_len;
+	rec.sampled = sampled;
+	rec.hdr = *hdr;
+	if (hlen)
+		memcpy(rec.psh, psh, hlen);
+
+	idx = __atomic_fetch_add(&capture_map->head, nslots, __ATOMIC_RELAXED);
+	ring_copy(idx * CAPTURE_SLOT_SIZE, &rec, sizeof(rec));
+	if (sampled)
+		ring_copy(idx * CAPTURE_SLOT_SIZE + sizeof(rec), data, sampled);
+	__atomic_store_n((u64*) (slots + (idx % capture_map->nr_slots) * CAPTURE_SLOT_SIZE),
+		idx + 1, __ATOMIC_RELEASE);
+}
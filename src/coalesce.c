@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "ns.h"
+#include "clock.h"
+#include "coalesce.h"
+#include "readahead.h"
+#include "rangelock.h"
+
+struct coalesce_write {
+	struct coalesce_write* next;
+	void* buf;
+	u32 nlb;
+	void (*done)(void* arg, u16 sf);
+	void* arg;
+};
+
+/*
+ * LBA-contiguous writes, in LBA order.
+ */
+struct coalesce_run {
+	struct coalesce_run* next;
+	u64 lba;
+	u32 nlb;
+	u32 nr_writes;
+	int closed;                 /* takes no more writes, write it now */
+	u64 deadline;
+	struct coalesce_write* head;
+	struct coalesce_write* tail;
+};
+
+/*
+ * Writes run r to the backend and completes its writes.
+ */
+static void coalesce_flush(struct coalesce* c, struct coalesce_run* r) {
+	struct nvme_ns* ns = c->ns;
+	struct iovec* iov = malloc(r->nr_writes * sizeof(*iov));
+	struct coalesce_write* w;
+	struct rl_held held;
+	u8* buf = NULL;
+	u16 sf;
+	u32 i = 0;
+
+	for (w = r->head; iov && w; w = w->next) {
+		iov[i].iov_base = w->buf;
+		iov[i++].iov_len = (size_t) w->nlb << ns->lba_shift;
+	}
+	range_lock(ns->locks, &held, r->lba, r->nlb, 1);
+	if (!iov)
+		sf = make_sf(SCT_GENERIC, SC_INTERNAL);
+	else if (r->nr_writes == 1)
+		sf = ns->ops->write(ns, r->head->buf, r->lba, r->nlb);
+	else if (ns->ops->writev)
+		sf = ns->ops->writev(ns, iov, r->nr_writes, r->lba, r->nlb);
+	else if ((buf = malloc((size_t) r->nlb << ns->lba_shift))) {
+		size_t off = 0;
+		for (i = 0; i < r->nr_writes; i++) {
+			memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+		sf = ns->ops->write(ns, buf, r->lba, r->nlb);
+	}
+	else
+		sf = make_sf(SCT_GENERIC, SC_INTERNAL);
+	if (ns->ra)
+		ra_invalidate(ns->ra, r->lba, r->nlb);
+	range_unlock(ns->locks, &held);
+	free(buf);
+	free(iov);
+
+	__atomic_add_fetch(&c->writes, r->nr_writes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->batches, 1, __ATOMIC_RELAXED);
+	for (w = r->head; w; ) {
+		struct coalesce_write* next = w->next;
+		w->done(w->arg, sf);
+		free(w->buf);
+		free(w);
+		w = next;
+	}
+	free(r);
+}
+
+static void* coalesce_main(void* arg) {
+	struct coalesce* c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		struct coalesce_run** pr = &c->runs;
+		struct coalesce_run* prev = NULL;
+		struct coalesce_run* r;
+		u64 now = clock_ns();
+
+		// the oldest run that is due; a run that a younger one overlaps is always due
+		while (*pr && !(*pr)->closed && (*pr)->deadline > now) {
+			prev = *pr;
+			pr = &(*pr)->next;
+		}
+		if (!*pr) {
+			if (c->stop)
+				break;
+			if (!c->runs)
+				pthread_cond_wait(&c->cond, &c->lock);
+			else {
+				struct timespec ts = {
+					.tv_sec = c->runs->deadline / 1000000000,
+					.tv_nsec = c->runs->deadline % 1000000000,
+				};
+				pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+			}
+			continue;
+		}
+		r = *pr;
+		*pr = r->next;
+		if (c->last == r)
+			c->last = prev;
+		c->nr_runs--;
+		pthread_mutex_unlock(&c->lock);
+		coalesce_flush(c, r);
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+int coalesce_submit(struct coalesce* c, void* buf, u64 lba, u32 nlb,
+		void (*done)(void* arg, u16 sf), void* arg) {
+	struct coalesce_write* w = malloc(sizeof(*w));
+	struct coalesce_run* into = NULL;
+	struct coalesce_run* r;
+	int overlaps = 0;
+
+	if (!w)
+		return -1;
+	w->buf = buf;
+	w->nlb = nlb;
+	w->done = done;
+	w->arg = arg;
+	w->next = NULL;
+
+	pthread_mutex_lock(&c->lock);
+	for (r = c->runs; r; r = r->next) {
+		if (r->lba < lba + nlb && lba < r->lba + r->nlb) {
+			r->closed = 1;
+			overlaps = 1;
+		}
+		else if (!into && !r->closed && r->nlb + nlb <= c->max_nlb &&
+		         (r->lba + r->nlb == lba || lba + nlb == r->lba))
+			into = r;
+	}
+	// merging into a run older than one the write overlaps could reorder them
+	if (into && !overlaps) {
+		if (into->lba + into->nlb == lba) {
+			into->tail->next = w;
+			into->tail = w;
+		}
+		else {
+			w->next = into->head;
+			into->head = w;
+			into->lba = lba;
+		}
+		into->nlb += nlb;
+		into->nr_writes++;
+		if (into->nlb >= c->max_nlb)
+			into->closed = 1;
+	}
+	else {
+		r = calloc(1, sizeof(*r));
+		if (!r) {
+			pthread_mutex_unlock(&c->lock);
+			free(w);
+			return -1;
+		}
+		r->lba = lba;
+		r->nlb = nlb;
+		r->nr_writes = 1;
+		r->head = r->tail = w;
+		r->deadline = clock_ns() + c->window_ns;
+		r->closed = nlb >= c->max_nlb;
+		if (c->last)
+			c->last->next = r;
+		else
+			c->runs = r;
+		c->last = r;
+		// too many runs open: start writing the oldest
+		if (++c->nr_runs > COALESCE_MAX_RUNS)
+			c->runs->closed = 1;
+	}
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+struct coalesce* coalesce_create(struct nvme_ns* ns, const char* opts) {
+	u64 window = ns_opt_u64(opts, "coalesce_us", 100);
+	u64 max = ns_opt_u64(opts, "coalesce_max", 1 << 20);
+	struct coalesce* c;
+	pthread_condattr_t attr;
+	sigset_t all, old;
+	int err;
+
+	if (max < (1U << ns->lba_shift) || max > (64 << 20)) {
+		log_error("Invalid write coalescing parameters");
+		return NULL;
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->ns = ns;
+	c->window_ns = window * 1000;
+	c->max_nlb = max >> ns->lba_shift;
+	pthread_mutex_init(&c->lock, NULL);
+	// deadlines are CLOCK_MONOTONIC times
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&c->thread, NULL, coalesce_main, c);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		log_error("Cannot start the write coalescer: %s", strerror(err));
+		free(c);
+		return NULL;
+	}
+
+	log_info("Namespace %u: writes coalesced for %luus, up to %lu bytes", ns->nsid, window, max);
+	return c;
+}
+
+void coalesce_destroy(struct coalesce* c) {
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	free(c);
+}
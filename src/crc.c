@@ -0,0 +1,103 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc.h"
+
+#define CRC_T10DIF_POLY 0x8BB7
+
+static u16 crc_table[256];
+
+static u16 crc_t10dif_table(u16 crc, const u8* p, size_t len) {
+	while (len--)
+		crc = (crc << 8) ^ crc_table[(crc >> 8) ^ *p++];
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * Folding with PCLMULQDQ. A 128-bit block, read big-endian, is the
+ * polynomial H x^64 + L; moving it n bits further along the message
+ * multiplies it by x^n, which modulo P is H (x^(n+64) mod P) + L (x^n mod P),
+ * two 64x16-bit carry-less products that fit in 128 bits again. Four
+ * accumulators advance 64 bytes per step to hide the multiplier latency,
+ * are folded into one at the end, and the last 128 bits and the tail are
+ * reduced with the table.
+ */
+static __m128i k_512, k_384, k_256, k_128;
+
+static u64 xpow_mod(u32 n) {
+	u32 r = 1;
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x10000 | CRC_T10DIF_POLY;
+	}
+	return r;
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i fold(__m128i a, __m128i k) {
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11), _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static u16 crc_t10dif_pclmul(u16 crc, const u8* p, size_t len) {
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i a0, a1, a2, a3;
+	u8 last[16];
+
+#define LOAD(off) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + (off))), bswap)
+	a0 = _mm_xor_si128(LOAD(0), _mm_set_epi64x((u64) crc << 48, 0));
+	a1 = LOAD(16);
+	a2 = LOAD(32);
+	a3 = LOAD(48);
+	for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+		a0 = _mm_xor_si128(fold(a0, k_512), LOAD(0));
+		a1 = _mm_xor_si128(fold(a1, k_512), LOAD(16));
+		a2 = _mm_xor_si128(fold(a2, k_512), LOAD(32));
+		a3 = _mm_xor_si128(fold(a3, k_512), LOAD(48));
+	}
+	a0 = _mm_xor_si128(_mm_xor_si128(fold(a0, k_384), fold(a1, k_256)),
+		_mm_xor_si128(fold(a2, k_128), a3));
+	for (; len >= 16; p += 16, len -= 16)
+		a0 = _mm_xor_si128(fold(a0, k_128), LOAD(0));
+#undef LOAD
+
+	_mm_storeu_si128((__m128i*) last, _mm_shuffle_epi8(a0, bswap));
+	crc = crc_t10dif_table(0, last, sizeof(last));
+	return crc_t10dif_table(crc, p, len);
+}
+#endif
+
+static int crc_use_pclmul;
+
+static void __attribute__((constructor)) crc_init(void) {
+	for (int i = 0; i < 256; i++) {
+		u16 c = i << 8;
+		for (int bit = 0; bit < 8; bit++)
+			c = c & 0x8000 ? (c << 1) ^ CRC_T10DIF_POLY : c << 1;
+		crc_table[i] = c;
+	}
+#if defined(__x86_64__)
+	// high lane multiplies the upper 64 bits, low lane the lower ones
+	k_512 = _mm_set_epi64x(xpow_mod(512 + 64), xpow_mod(512));
+	k_384 = _mm_set_epi64x(xpow_mod(384 + 64), xpow_mod(384));
+	k_256 = _mm_set_epi64x(xpow_mod(256 + 64), xpow_mod(256));
+	k_128 = _mm_set_epi64x(xpow_mod(128 + 64), xpow_mod(128));
+	__builtin_cpu_init();
+	crc_use_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#endif
+}
+
+/*
+ * CRC-16/T10-DIF of len bytes at buf, continuing from crc.
+ */
+u16 crc_t10dif(u16 crc, const void* buf, size_t len) {
+#if defined(__x86_64__)
+	if (crc_use_pclmul && len >= 64)
+		return crc_t10dif_pclmul(crc, buf, len);
+#endif
+	return crc_t10dif_table(crc, buf, len);
+}
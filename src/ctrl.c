@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "log.h"
+#include "ctrl.h"
+
+static struct nvme_ctrl* ctrls;
+static pthread_mutex_t ctrls_lock = PTHREAD_MUTEX_INITIALIZER;
+static u16 next_cntlid = 1;
+
+#define CNTLID_MAX  0xffef  /* 0xfff0 and above are reserved */
+
+/*
+ * Returns whether a controller still holds cntlid. Call with the registry
+ * lock held.
+ */
+static int ctrl_cntlid_used(u16 cntlid) {
+	for (struct nvme_ctrl* ctrl = ctrls; ctrl; ctrl = ctrl->next)
+		if (ctrl->cntlid == cntlid)
+			return 1;
+	return 0;
+}
+
+/*
+ * Allocates a controller with a new cntlid for the host in params. Returns
+ * NULL on error.
+ */
+struct nvme_ctrl* ctrl_create(const struct nvme_connect_params* params) {
+	struct nvme_ctrl* ctrl = calloc(1, sizeof(*ctrl));
+	if (!ctrl) {
+		log_warn("malloc failed (controller)");
+		return NULL;
+	}
+	ctrl->refs = 1;
+	strncpy(ctrl->hostnqn, params->hostnqn, sizeof(ctrl->hostnqn) - 1);
+	ctrl->qos = qos_host_get(ctrl->hostnqn);
+
+	pthread_mutex_lock(&ctrls_lock);
+	// once the ids wrap, skip those of controllers that are still around
+	for (u32 n = 1; !ctrl->cntlid && n < CNTLID_MAX; n++) {
+		u16 cntlid = next_cntlid++;
+		if (next_cntlid >= CNTLID_MAX)
+			next_cntlid = 1;
+		if (!ctrl_cntlid_used(cntlid))
+			ctrl->cntlid = cntlid;
+	}
+	if (!ctrl->cntlid) {
+		pthread_mutex_unlock(&ctrls_lock);
+		log_warn("No free controller ID for %s", ctrl->hostnqn);
+		free(ctrl);
+		return NULL;
+	}
+	ctrl->next = ctrls;
+	ctrls = ctrl;
+	pthread_mutex_unlock(&ctrls_lock);
+
+	log_info("Created controller %u for %s", ctrl->cntlid, ctrl->hostnqn);
+	return ctrl;
+}
+
+/*
+ * Looks up the controller an I/O queue connect refers to and takes a
+ * reference. Returns NULL if no such controller exists for that host.
+ */
+struct nvme_ctrl* ctrl_get(const struct nvme_connect_params* params) {
+	struct nvme_ctrl* ctrl;
+	pthread_mutex_lock(&ctrls_lock);
+	for (ctrl = ctrls; ctrl; ctrl = ctrl->next) {
+		if (ctrl->cntlid == params->cntlid && !ctrl->dead &&
+		    !strncmp(ctrl->hostnqn, params->hostnqn, sizeof(ctrl->hostnqn))) {
+			ctrl->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctrls_lock);
+	return ctrl;
+}
+
+/*
+ * Drops a queue's reference to the controller.
+ */
+void ctrl_put(struct nvme_ctrl* ctrl) {
+	struct nvme_ctrl** link;
+	pthread_mutex_lock(&ctrls_lock);
+	if (--ctrl->refs) {
+		pthread_mutex_unlock(&ctrls_lock);
+		return;
+	}
+	for (link = &ctrls; *link; link = &(*link)->next) {
+		if (*link == ctrl) {
+			*link = ctrl->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctrls_lock);
+	ka_stop(&ctrl->ka);
+	log_info("Destroyed controller %u", ctrl->cntlid);
+	free(ctrl);
+}
+
+/*
+ * Registers the connection of a queue of ctrl, shutting it down right away
+ * if the controller is dead, and unregisters it once the queue is done.
+ */
+void ctrl_queue_add(struct nvme_ctrl* ctrl, struct ctrl_queue* q, sock_t socket) {
+	q->socket = socket;
+	pthread_mutex_lock(&ctrls_lock);
+	q->next = ctrl->queues;
+	ctrl->queues = q;
+	if (ctrl->dead)
+		shutdown(socket, SHUT_RDWR);
+	pthread_mutex_unlock(&ctrls_lock);
+}
+
+void ctrl_queue_del(struct nvme_ctrl* ctrl, struct ctrl_queue* q) {
+	struct ctrl_queue** link;
+	pthread_mutex_lock(&ctrls_lock);
+	for (link = &ctrl->queues; *link; link = &(*link)->next) {
+		if (*link == q) {
+			*link = q->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctrls_lock);
+}
+
+/*
+ * Tears down a controller whose host went quiet for longer than its KATO:
+ * shutting down the connections of its queues wakes their threads, which
+ * then drop their references as on a disconnect.
+ */
+static void ctrl_expire(struct keepalive* ka) {
+	struct nvme_ctrl* ctrl = (struct nvme_ctrl*) ((char*) ka - offsetof(struct nvme_ctrl, ka));
+	pthread_mutex_lock(&ctrls_lock);
+	log_warn("Keep alive timeout on controller %u of %s, tearing it down", ctrl->cntlid, ctrl->hostnqn);
+	ctrl->dead = 1;
+	for (struct ctrl_queue* q = ctrl->queues; q; q = q->next)
+		shutdown(q->socket, SHUT_RDWR);
+	pthread_mutex_unlock(&ctrls_lock);
+}
+
+/*
+ * Starts enforcing the Keep Alive Timeout of the admin queue's Connect
+ * command, in milliseconds; 0 disables it. Returns 0 on success or -1 on
+ * error.
+ */
+int ctrl_set_kato(struct nvme_ctrl* ctrl, u32 kato_ms) {
+	if (kato_ms)
+		log_info("Controller %u: keep alive timeout %ums", ctrl->cntlid, kato_ms);
+	return ka_start(&ctrl->ka, kato_ms, ctrl_expire);
+}
+
+/*
+ * Calls fn for every live controller with the registry lock held.
+ */
+void ctrl_for_each(void (*fn)(struct nvme_ctrl* ctrl, void* arg), void* arg) {
+	pthread_mutex_lock(&ctrls_lock);
+	for (struct nvme_ctrl* ctrl = ctrls; ctrl; ctrl = ctrl->next)
+		fn(ctrl, arg);
+	pthread_mutex_unlock(&ctrls_lock);
+}
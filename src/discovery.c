@@ -1,4 +1,40 @@
 #include "discovery.h"
+#include "admin.h"
+#include "stats.h"
+
+static char trsvcid[32] = PORT_ASCII;
+static u64 genctr;
+
+/*
+ * Keep-alive timer of a discovery controller, which has just the one
+ * queue to shut down when it expires.
+ */
+struct discovery_ka {
+	struct keepalive ka;
+	sock_t socket;
+};
+
+static void discovery_expire(struct keepalive* ka) {
+	log_warn("Keep alive timeout on a discovery controller, tearing it down");
+	shutdown(((struct discovery_ka*) ka)->socket, SHUT_RDWR);
+}
+
+/*
+ * Sets the port advertised in the discovery log page entries.
+ */
+void discovery_set_port(int port) {
+	snprintf(trsvcid, sizeof(trsvcid), "%d", port);
+	discovery_changed();
+}
+
+/*
+ * Bumps the generation counter of the discovery log and posts Discovery
+ * Log Page Change to the discovery controllers that asked for it.
+ */
+void discovery_changed(void) {
+	__atomic_add_fetch(&genctr, 1, __ATOMIC_RELAXED);
+	aer_disc_changed();
+}
 
 /*
  * Starts command processing loop for the admin queue of the discovery
@@ -8,6 +44,8 @@ void start_discovery_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
 	u16 qsize = conn_cmd->cdw11 & 0xffff;
 	log_debug("Received NVME_CONNECT command, qsize=%u", qsize);
 	u16 sqhd = 2;
+	struct aer aer;
+	struct discovery_ka dka = { .socket = socket };
 	struct nvme_properties props = {
 		.cap  = ((u64)1<<37) | (4<<24) | (1<<16) | 63,
 		.vs   = 0x10400,
@@ -22,25 +60,39 @@ void start_discovery_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
 		.cid  = conn_cmd->cid,
 		.sf   = 0,
 	};
+	stats_queue_open(QUEUE_DISCOVERY, 0, 0, NULL);
+	if (aer_open(&aer, 1)) {
+		stats_queue_close();
+		return;
+	}
+	if (ka_start(&dka.ka, conn_cmd->cdw12, discovery_expire))
+		status.sf = make_sf(SCT_GENERIC, SC_INTERNAL);
 	int err = send_status(socket, &status);
 	if (err) {
 		log_warn("Failed to send response");
-		return;
+		goto out;
 	}
+	// the host was told the Connect failed
+	if (status.sf)
+		goto out;
 
 	// processing loop
 	struct nvme_cmd* cmd;
 	while (1) {
+		if (aer_wait(&aer, socket, sqhd ? sqhd - 1 : qsize - 1))
+			goto out;
 		memset(&status, 0, NVME_STATUS_LEN);
 		status.sqhd = sqhd++;
 		if (sqhd >= qsize) sqhd = 0;
 		cmd = recv_cmd(socket, NULL);
 		if (!cmd) {
 			log_warn("Failed to receive command");
-			return;
+			goto out;
 		}
 		status.cid = cmd->cid;
 		log_debug("Got command: 0x%02x (%s)", cmd->opcode, nvme_opcode_name(cmd->opcode));
+		stats_cmd_begin(cmd->opcode);
+		ka_touch(&dka.ka);
 
 		if (cmd->opcode == OPC_FABRICS)
 			fabric_cmd(&props, cmd, &status);
@@ -50,7 +102,19 @@ void start_discovery_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
 					discovery_identify(socket, cmd, &status);
 					break;
 				case OPC_GET_LOG:
-					discovery_get_log(socket, cmd, &status);
+					discovery_get_log(&aer, socket, cmd, &status);
+					break;
+				case OPC_SET_FEATURES:
+					discovery_set_features(&aer, cmd, &status);
+					break;
+				case OPC_KEEP_ALIVE:
+					break;  // the timer was restarted on receipt
+				case OPC_ASYNC_EVENT:
+					// parked until the log changes, completed by aer_wait
+					if (!(status.sf = aer_submit(&aer, cmd->cid))) {
+						free(cmd);
+						continue;
+					}
 					break;
 				default:
 					status.sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
@@ -58,14 +122,20 @@ void start_discovery_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
 		}
 		else
 			status.sf = make_sf(SCT_GENERIC, SC_COMMAND_SEQ);
+		stats_stamp_once(STAMP_DONE);
 
 		free(cmd);
 		err = send_status(socket, &status);
 		if (err) {
 			log_warn("Failed to send response");
-			return;
+			goto out;
 		}
 	}
+
+out:
+	ka_stop(&dka.ka);
+	aer_close(&aer);
+	stats_queue_close();
 }
 
 /*
@@ -84,14 +154,19 @@ void discovery_identify(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
 	id_ctrl.cntlid = 1;
 	id_ctrl.maxcmd = 128;
 	id_ctrl.ver = 0x10400;
+	id_ctrl.aerl = AER_SLOTS - 1;
+	id_ctrl.kas = KA_TICK_NS / 100000000;
+	id_ctrl.ctratt = 1 << 6;  // TBKAS
+	id_ctrl.oaes = AEC_DISC_CHANGE;
 
 	send_data(socket, cmd->cid, &id_ctrl, NVME_ID_CTRL_LEN);
 }
 
 /*
- * Processes a get log page command.
+ * Processes a get log page command, which unmasks Discovery Log Page
+ * Change events in a.
  */
-void discovery_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
+void discovery_get_log(struct aer* a, sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
 	int size;
 	struct nvme_discovery_log_page* page;
 	u8 lid = cmd->cdw10 & 0xff;
@@ -110,7 +185,7 @@ void discovery_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
 	page = (struct nvme_discovery_log_page*) calloc(1, size);
 
 	// fill out the data structure
-	page->genctr = 0;
+	page->genctr = __atomic_load_n(&genctr, __ATOMIC_RELAXED);
 	page->numrec = 1;
 	page->recfmt = 0;
 	page->entries[0].trtype = 3; // tcp
@@ -121,7 +196,7 @@ void discovery_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
 	page->entries[0].cntlid = 1;
 	page->entries[0].asqsz = 64;
     page->entries[0].eflags   = 0;
-	strcpy(page->entries[0].trsvcid, PORT_ASCII);
+	strcpy(page->entries[0].trsvcid, trsvcid);
 	strcpy(page->entries[0].subnqn, SUBSYS_NQN);
 	strcpy(page->entries[0].traddr, "127.0.0.1");
     page->entries[1].tsas.tcp.sectype = 0;
@@ -134,7 +209,7 @@ void discovery_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
     page->entries[1].cntlid   = 1;    // Controller ID
     page->entries[1].asqsz    = 128;  // IO 큐 사이즈 (예시)
     page->entries[1].eflags   = 0;
-	strcpy(page->entries[1].trsvcid, PORT_ASCII); // 4420
+	strcpy(page->entries[1].trsvcid, trsvcid);
 	strcpy(page->entries[1].subnqn, IO_NQN);
 	strcpy(page->entries[1].traddr, "127.0.0.1");
     page->entries[1].tsas.tcp.sectype = 0;
@@ -142,5 +217,20 @@ void discovery_get_log(sock_t socket, struct nvme_cmd* cmd, struct nvme_status*
 
 	send_data(socket, cmd->cid, page, bytes);
 	free(page);
+	aer_disc_log_read(a, (cmd->cdw10 >> 15) & 0x1);
+}
+
+/*
+ * Processes a set features command; only Asynchronous Event Configuration
+ * is supported.
+ */
+void discovery_set_features(struct aer* a, struct nvme_cmd* cmd, struct nvme_status* status) {
+	u8 fid = cmd->cdw10 & 0xff;
+	log_debug("Discovery Set Features: FID=0x%02x (%s), CDW11=0x%08x", fid, feature_name(fid), cmd->cdw11);
+	if (fid != FEATURE_ASYNC_EVENT_CONFIG) {
+		status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+		return;
+	}
+	status->dw0 = aer_set_config(a, cmd->cdw11);
 }
 
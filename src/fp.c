@@ -0,0 +1,160 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "fp.h"
+
+#define FP_LANES   8
+#define FP_STRIPE  64
+#define FP_SCRAMBLE_STRIPES 16  /* stripes between accumulator scrambles */
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static const u64 fp_key[FP_LANES] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static const u64 fp_init[FP_LANES] = {
+	PRIME32_1, PRIME64_1, PRIME64_2, 0x165667B19E3779F9ULL,
+	0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL, 0x27D4EB2F165667C5ULL ^ PRIME64_1, PRIME32_1 ^ PRIME64_2,
+};
+
+/*
+ * Every lane adds the product of the two halves of its keyed input, and
+ * the neighbouring lane adds the raw input so no bits are lost to the
+ * 32x32 multiply. Scrambling folds the high bits back in before the sums
+ * grow long enough to lose entropy. On x86-64 each SSE2 register holds a
+ * pair of lanes, and the input is added to the neighbour by swapping its
+ * halves.
+ */
+#if !defined(__x86_64__)
+static void fp_accumulate(u64* acc, const u8* p, size_t stripes) {
+	for (size_t s = 0; s < stripes; s++, p += FP_STRIPE) {
+		for (int i = 0; i < FP_LANES; i++) {
+			u64 d, k;
+			memcpy(&d, p + 8 * i, sizeof(d));
+			k = d ^ fp_key[i];
+			acc[i ^ 1] += d;
+			acc[i] += (k & 0xffffffff) * (k >> 32);
+		}
+		if (s % FP_SCRAMBLE_STRIPES == FP_SCRAMBLE_STRIPES - 1)
+			for (int i = 0; i < FP_LANES; i++)
+				acc[i] = ((acc[i] ^ (acc[i] >> 47)) ^ fp_key[i]) * PRIME32_1;
+	}
+}
+#else
+static void fp_accumulate(u64* acc, const u8* p, size_t stripes) {
+	const __m128i prime = _mm_set1_epi32(PRIME32_1);
+	__m128i a[4], key[4];
+
+	for (int i = 0; i < 4; i++) {
+		a[i] = _mm_loadu_si128((const __m128i*) (acc + 2 * i));
+		key[i] = _mm_loadu_si128((const __m128i*) (fp_key + 2 * i));
+	}
+	for (size_t s = 0; s < stripes; s++, p += FP_STRIPE) {
+		for (int i = 0; i < 4; i++) {
+			__m128i d = _mm_loadu_si128((const __m128i*) (p + 16 * i));
+			__m128i k = _mm_xor_si128(d, key[i]);
+			__m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(swapped,
+				_mm_mul_epu32(k, _mm_srli_epi64(k, 32))));
+		}
+		if (s % FP_SCRAMBLE_STRIPES == FP_SCRAMBLE_STRIPES - 1) {
+			for (int i = 0; i < 4; i++) {
+				__m128i x = _mm_xor_si128(_mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47)), key[i]);
+				__m128i lo = _mm_mul_epu32(x, prime);
+				__m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+				a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+			}
+		}
+	}
+	for (int i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i*) (acc + 2 * i), a[i]);
+}
+#endif
+
+static inline u64 fold64(u64 a, u64 b) {
+	unsigned __int128 m = (unsigned __int128) a * b;
+	return (u64) m ^ (u64) (m >> 64);
+}
+
+/*
+ * 64-bit fingerprint of len bytes at buf.
+ */
+u64 fp_hash(const void* buf, size_t len) {
+	u64 acc[FP_LANES], h = len * PRIME64_1;
+
+	memcpy(acc, fp_init, sizeof(acc));
+	fp_accumulate(acc, buf, len / FP_STRIPE);
+	for (int i = 0; i < FP_LANES; i += 2)
+		h += fold64(acc[i] ^ fp_key[i], acc[i + 1] ^ fp_key[i + 1] ^ PRIME64_2);
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	return h ^ (h >> 32);
+}
+
+/*
+ * Returns whether len bytes at buf are all zero, stopping at the first
+ * 64-byte stripe that is not.
+ */
+int fp_is_zero(const void* buf, size_t len) {
+	const u8* p = buf;
+#if defined(__x86_64__)
+	for (; len; p += FP_STRIPE, len -= FP_STRIPE) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i*) p), _mm_loadu_si128((const __m128i*) (p + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i*) (p + 32)), _mm_loadu_si128((const __m128i*) (p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+	return 1;
+#else
+	for (; len; p += FP_STRIPE, len -= FP_STRIPE) {
+		u64 v[FP_STRIPE / 8], acc = 0;
+		memcpy(v, p, sizeof(v));
+		for (int i = 0; i < FP_STRIPE / 8; i++)
+			acc |= v[i];
+		if (acc)
+			return 0;
+	}
+	return 1;
+#endif
+}
+
+/*
+ * Returns whether len bytes at a and b are equal, stopping at the first
+ * 64-byte stripe that differs. A tail shorter than a stripe, as with
+ * extended LBAs, is left to memcmp.
+ */
+int fp_equal(const void* a, const void* b, size_t len) {
+	const u8* p = a;
+	const u8* q = b;
+#if defined(__x86_64__)
+	for (; len >= FP_STRIPE; p += FP_STRIPE, q += FP_STRIPE, len -= FP_STRIPE) {
+		__m128i v = _mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), _mm_loadu_si128((const __m128i*) q)),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 16)), _mm_loadu_si128((const __m128i*) (q + 16)))),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 32)), _mm_loadu_si128((const __m128i*) (q + 32))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 48)), _mm_loadu_si128((const __m128i*) (q + 48)))));
+		if (_mm_movemask_epi8(v) != 0xffff)
+			return 0;
+	}
+#else
+	for (; len >= FP_STRIPE; p += FP_STRIPE, q += FP_STRIPE, len -= FP_STRIPE) {
+		u64 v[FP_STRIPE / 8], w[FP_STRIPE / 8], acc = 0;
+		memcpy(v, p, sizeof(v));
+		memcpy(w, q, sizeof(w));
+		for (int i = 0; i < FP_STRIPE / 8; i++)
+			acc |= v[i] ^ w[i];
+		if (acc)
+			return 0;
+	}
+#endif
+	return !memcmp(p, q, len);
+}
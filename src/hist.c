@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "hist.h"
+
+static inline int bucket_of(u64 value) {
+	int msb, shift;
+	if (value < (1UL << HIST_SUB_BITS))
+		return value;
+	if (value >= (1UL << HIST_MAX_BITS))
+		return HIST_BUCKETS - 1;
+	msb = 63 - __builtin_clzl(value);
+	shift = msb - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static inline u64 bucket_max(int idx) {
+	int shift;
+	u64 mant;
+	if (idx < (1 << HIST_SUB_BITS))
+		return idx;
+	shift = (idx >> HIST_SUB_BITS) - 1;
+	mant = (idx & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS);
+	return ((mant + 1) << shift) - 1;
+}
+
+/*
+ * Adds a value to the histogram. Must only be called by its owner thread.
+ */
+void hist_record(struct hist* h, u64 value) {
+	u32* b = &h->buckets[bucket_of(value)];
+	__atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the value at percentile p (0..100), i.e. the highest value
+ * equivalent to the bucket holding it. Returns 0 for an empty histogram.
+ */
+u64 hist_percentile(const struct hist* h, double p) {
+	u64 total = 0, seen = 0, target;
+	u64 max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+	if (!total)
+		return 0;
+	target = (u64) (p / 100.0 * total + 0.5);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return bucket_max(i) < max ? bucket_max(i) : max;
+	}
+	return max;
+}
+
+/*
+ * Adds the contents of src to dst. dst must not be shared.
+ */
+void hist_merge(struct hist* dst, const struct hist* src) {
+	u64 max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+}
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "host.h"
+
+/*
+ * Opens a TCP connection to addr:port and exchanges ICReq/ICResp. Returns
+ * the socket or -1 on error.
+ */
+sock_t host_open(const char* addr, int port) {
+	struct sockaddr_in in = { .sin_family = AF_INET, .sin_port = htons(port) };
+	u8 psh[120] = {0};
+	struct pdu_header hdr = {
+		.type  = PDU_TYPE_ICREQ,
+		.flags = 0,
+		.hlen  = PDU_HDR_LEN + 120,
+		.pdo   = 0,
+		.plen  = PDU_HDR_LEN + 120,
+	};
+	sock_t sock;
+	int one = 1;
+
+	if (inet_pton(AF_INET, addr, &in.sin_addr) != 1) {
+		log_error("Invalid address: %s", addr);
+		return -1;
+	}
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(sock, (struct sockaddr*) &in, sizeof(in))) {
+		log_error("Failed to connect to %s:%d", addr, port);
+		close(sock);
+		return -1;
+	}
+	if (send_pdu(sock, &hdr, psh, NULL) || recv_pdu(sock, NULL, NULL) != PDU_TYPE_ICRESP) {
+		log_error("ICReq/ICResp exchange failed");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Sends a Fabrics Connect for queue qid of subsystem subnqn and waits for
+ * its response. cntlid must be 0xffff for an admin queue and the value
+ * returned in *cntlid_out by the admin Connect for I/O queues. Returns the
+ * NVMe status code of the response, or -1 on a transport error.
+ */
+int host_connect(sock_t socket, const char* subnqn, const char* hostnqn, u16 qid,
+		u16 qsize, u16 cntlid, u32 kato, u16* cntlid_out) {
+	struct nvme_connect_params params;
+	struct nvme_status status;
+	struct nvme_cmd cmd = {
+		.opcode = OPC_FABRICS,
+		.nsid   = FCTYPE_CONNECT,
+		.cdw10  = (u32) qid << 16,
+		.cdw11  = qsize - 1,
+		.cdw12  = kato,
+	};
+
+	memset(&params, 0, sizeof(params));
+	params.cntlid = cntlid;
+	strncpy(params.subnqn, subnqn, sizeof(params.subnqn) - 1);
+	strncpy(params.hostnqn, hostnqn, sizeof(params.hostnqn) - 1);
+	if (host_send_cmd(socket, &cmd, &params, NVME_CONNPARAMS_LEN) ||
+	    host_wait(socket, &status, NULL, 0))
+		return -1;
+	if (cntlid_out)
+		*cntlid_out = status.dw0 & 0xffff;
+	return (status.sf >> 1) & 0x7ff;
+}
+
+/*
+ * Sends a command capsule, with in-capsule data if len is not 0. Returns 0
+ * on success or -1 on error.
+ */
+int host_send_cmd(sock_t socket, struct nvme_cmd* cmd, void* data, u32 len) {
+	struct pdu_header hdr = {
+		.type  = PDU_TYPE_CMD,
+		.flags = 0,
+		.hlen  = PDU_HDR_LEN + NVME_CMD_LEN,
+		.pdo   = len ? PDU_HDR_LEN + NVME_CMD_LEN : 0,
+		.plen  = PDU_HDR_LEN + NVME_CMD_LEN + len,
+	};
+	cmd->sgl.address = 0;
+	cmd->sgl.length = len;
+	cmd->sgl.sglid = len ? 0x01 : 0;  // data block, offset from in-capsule data
+	return send_pdu(socket, &hdr, cmd, len ? data : NULL);
+}
+
+/*
+ * Sends an admin or fabrics command and waits for its completion. Returns
+ * the NVMe status code or -1 on a transport error.
+ */
+int host_admin_cmd(sock_t socket, struct nvme_cmd* cmd, void* data, u32 len) {
+	struct nvme_status status;
+	if (host_send_cmd(socket, cmd, NULL, 0) || host_wait(socket, &status, data, len))
+		return -1;
+	return (status.sf >> 1) & 0x7ff;
+}
+
+int host_enable(sock_t socket) {
+	struct nvme_cmd cmd = {
+		.opcode = OPC_FABRICS,
+		.nsid   = FCTYPE_SET_PROP,
+		.cdw11  = 0x14,
+		.cdw12  = 0x460001,
+	};
+	return host_admin_cmd(socket, &cmd, NULL, 0);
+}
+
+/*
+ * Receives PDUs until a response capsule arrives and copies it to status.
+ * C2H data, if any, is copied to data as long as it fits in len bytes.
+ * Returns 0 on success or -1 on error.
+ */
+int host_wait(sock_t socket, struct nvme_status* status, void* data, u32 len) {
+	void *psh, *buf;
+	int type;
+	while (1) {
+		type = recv_pdu(socket, &psh, &buf);
+		if (type < 0)
+			return -1;
+		if (type == PDU_TYPE_C2HDATA && data && psh) {
+			struct psh_c2hdata* c2h = psh;
+			if (buf && c2h->datao + c2h->datal <= len)
+				memcpy((u8*) data + c2h->datao, buf, c2h->datal);
+		}
+		else if (type == PDU_TYPE_RESP && psh) {
+			memcpy(status, psh, NVME_STATUS_LEN);
+			free(psh);
+			free(buf);
+			return 0;
+		}
+		free(psh);
+		free(buf);
+	}
+}
@@ -1,41 +1,597 @@
+#define _GNU_SOURCE  /* ppoll */
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include "nvme.h"
 #include "io.h"
+#include "stats.h"
+#include "ns.h"
+#include "model.h"
+#include "qos.h"
+#include "arb.h"
+#include "pi.h"
+#include "timer.h"
+#include "mirror.h"
+#include "readahead.h"
+#include "coalesce.h"
+#include "rangelock.h"
+#include "fp.h"
 
 /* Forward declaration */
 void response_keep_alive(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status);
 
 
-void start_io_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
+/*
+ * The first command of a fused pair, a Compare, held until the Write that
+ * has to follow it arrives.
+ */
+struct io_fused {
+    struct nvme_cmd* cmd;           /* NULL if there is none */
+    void* data;
+    struct nvme_status status;
+    struct stats_cmd st;
+};
+
+/*
+ * Per-connection state of an I/O queue that commands and completions
+ * deferred by QoS limits, a device model, a mirror or the write coalescer
+ * need once their timer fires or their write is done. Writes parked with
+ * a mirror or coalescer thread are handed back through the unparked list,
+ * which wakes the queue's thread with the eventfd, so only that thread
+ * ever sends on the socket.
+ */
+struct io_queue {
+    sock_t socket;
+    int broken;
+    struct nvme_ctrl* ctrl;
+    struct nvme_properties props;
+    struct arb_queue arb;
+    struct timer_wheel wheel;
+    int wake;                       /* eventfd, created on the first parked write */
+    u32 parked;                     /* writes waiting for the mirror peer or the coalescer */
+    pthread_mutex_t lock;
+    struct io_pending* unparked;    /* done with there, not yet completed */
+    struct io_fused fused;
+};
+
+/*
+ * A completed command whose response is held back until the time the
+ * device model computed for it, or until the mirror peer or the coalescer
+ * is done with the data.
+ */
+struct io_pending {
+    struct timer timer;
+    struct io_queue* q;
+    struct io_pending* next;        /* on the unparked list */
+    void* data;
+    u32 len;
+    struct nvme_status status;
+    struct stats_cmd st;
+};
+
+/*
+ * A command held back by a QoS limit until it conforms. The Write of a
+ * fused pair takes the Compare held for it along.
+ */
+struct io_throttled {
+    struct timer timer;
+    struct io_queue* q;
+    struct nvme_cmd* cmd;
+    void* data;
+    struct nvme_status status;
+    struct stats_cmd st;
+    struct io_fused fused;
+};
+
+static int io_exec(struct io_queue* q, struct nvme_cmd* cmd, void* data_buffer, struct nvme_status* status);
+
+static void io_pending_fire(struct timer* t) {
+    struct io_pending* p = (struct io_pending*) t;
+    struct io_queue* q = p->q;
+    if (!q->broken) {
+        stats_cmd_resume(&p->st);
+        stats_stamp(STAMP_DONE);
+        if ((p->data && send_data(q->socket, p->status.cid, p->data, p->len)) ||
+            send_status(q->socket, &p->status)) {
+            log_warn("Failed to send deferred response");
+            q->broken = 1;
+        }
+    }
+    free(p->data);
+    free(p);
+}
+
+/*
+ * Returns the time the device model of the command's namespace completes
+ * it, or 0 if the namespace is not modeled. Only called for commands that
+ * succeeded, so NSID and LBA range are valid.
+ */
+static u64 io_model_due(struct nvme_cmd* cmd, u64 now) {
+    u64 lba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
+    u32 nlb = (cmd->cdw12 & 0xFFFF) + 1;
+    struct nvme_ns* ns;
+    u64 due = 0;
+
+    if (cmd->opcode == IO_CMD_FLUSH && cmd->nsid == 0xffffffff) {
+        for (u32 nsid = 1; nsid <= ns_max_nsid(); nsid++) {
+            ns = ns_get(nsid);
+            if (ns && ns->model) {
+                u64 t = model_flush(ns->model, now);
+                due = t > due ? t : due;
+            }
+        }
+        return due;
+    }
+    ns = ns_get(cmd->nsid);
+    if (!ns || !ns->model)
+        return 0;
+    switch (cmd->opcode) {
+        case IO_CMD_READ:
+        case IO_CMD_COMPARE:
+            return model_submit(ns->model, 0, lba, nlb, now);
+        case IO_CMD_WRITE:
+        case IO_CMD_ZONE_APPEND:
+            return model_submit(ns->model, 1, lba, nlb, now);
+        case IO_CMD_FLUSH:
+            return model_flush(ns->model, now);
+    }
+    return 0;
+}
+
+static void io_throttled_fire(struct timer* t) {
+    struct io_throttled* p = (struct io_throttled*) t;
+    struct io_queue* q = p->q;
+    struct io_fused held = q->fused;
+    int second = (p->cmd->flags & FUSE_MASK) == FUSE_SECOND;
+    if (q->broken) {
+        free(p->fused.cmd);
+        free(p->fused.data);
+        free(p->cmd);
+        free(p->data);
+        free(p);
+        return;
+    }
+    // the pair executes back to back, around a Compare held since
+    if (second)
+        q->fused = p->fused;
+    stats_cmd_resume(&p->st);
+    if (io_exec(q, p->cmd, p->data, &p->status))
+        q->broken = 1;
+    if (second)
+        q->fused = held;
+    free(p);
+}
+
+/*
+ * Returns the time at which the QoS limits of the command's host and
+ * namespace let it execute, or 0 if they do not apply to it. A fused pair
+ * is admitted as a whole when its Write arrives, charged for both halves.
+ */
+static u64 io_qos_due(struct io_queue* q, struct nvme_cmd* cmd, u64 now) {
+    struct nvme_ns* ns;
+    u64 bytes, due;
+    if (cmd->opcode != IO_CMD_READ && cmd->opcode != IO_CMD_WRITE &&
+        cmd->opcode != IO_CMD_ZONE_APPEND && cmd->opcode != IO_CMD_COMPARE)
+        return 0;
+    if ((cmd->flags & FUSE_MASK) == FUSE_FIRST)
+        return 0;
+    ns = ns_get(cmd->nsid);
+    if (!ns || (!ns->qos && !q->ctrl->qos))
+        return 0;
+    bytes = (u64) ((cmd->cdw12 & 0xFFFF) + 1) << ns->lba_shift;
+    due = qos_admit(q->ctrl->qos, ns->qos, bytes, now);
+    if ((cmd->flags & FUSE_MASK) == FUSE_SECOND && q->fused.cmd) {
+        u64 cmp_due;
+        bytes = (u64) ((q->fused.cmd->cdw12 & 0xFFFF) + 1) << ns->lba_shift;
+        cmp_due = qos_admit(q->ctrl->qos, ns->qos, bytes, now);
+        due = cmp_due > due ? cmp_due : due;
+    }
+    return due;
+}
+
+static void io_timer_add(struct io_queue* q, struct timer* t, u64 due) {
+    if (!q->wheel.count)
+        prctl(PR_SET_TIMERSLACK, 1000);  // the default 50us would swamp modeled latencies
+    t->expires = due;
+    timer_add(&q->wheel, t);
+}
+
+/*
+ * Parks a completion, with its read data if any, until due. Returns 0 on
+ * success or -1 if it has to be sent right away.
+ */
+static int io_defer(struct io_queue* q, struct nvme_status* status, void* data, u32 len, u64 due) {
+    struct io_pending* p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    stats_alloc(sizeof(*p));
+    p->q = q;
+    p->data = data;
+    p->len = len;
+    p->status = *status;
+    stats_cmd_park(&p->st);
+    p->timer.fn = io_pending_fire;
+    io_timer_add(q, &p->timer, due);
+    return 0;
+}
+
+/*
+ * Parks a command, with its in-capsule data if any, until due. Returns 0 on
+ * success or -1 if it has to be executed right away.
+ */
+static int io_throttle(struct io_queue* q, struct nvme_cmd* cmd, void* data, struct nvme_status* status, u64 due) {
+    struct io_throttled* p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    stats_alloc(sizeof(*p));
+    stats_add(c.throttled, 1);
+    p->q = q;
+    p->cmd = cmd;
+    p->data = data;
+    p->status = *status;
+    if ((cmd->flags & FUSE_MASK) == FUSE_SECOND) {
+        p->fused = q->fused;
+        memset(&q->fused, 0, sizeof(q->fused));
+    }
+    stats_cmd_park(&p->st);
+    p->timer.fn = io_throttled_fire;
+    io_timer_add(q, &p->timer, due);
+    return 0;
+}
+
+/*
+ * Called from a mirror or coalescer thread once it is done with a parked
+ * write.
+ */
+static void io_park_done(void* arg, u16 sf) {
+    struct io_pending* p = arg;
+    struct io_queue* q = p->q;
+    if (sf && !p->status.sf)
+        p->status.sf = sf;
+    // the queue may be gone as soon as it sees p, so wake it under the lock
+    pthread_mutex_lock(&q->lock);
+    p->next = q->unparked;
+    q->unparked = p;
+    if (!p->next)
+        eventfd_write(q->wake, 1);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Completes the parked writes that are done, or holds them until the
+ * device model is done with them too.
+ */
+static void io_unpark(struct io_queue* q) {
+    struct io_pending* p;
+    eventfd_t n;
+    eventfd_read(q->wake, &n);
+    pthread_mutex_lock(&q->lock);
+    p = q->unparked;
+    q->unparked = NULL;
+    pthread_mutex_unlock(&q->lock);
+    while (p) {
+        struct io_pending* next = p->next;
+        q->parked--;
+        if (p->timer.expires > clock_ns())
+            io_timer_add(q, &p->timer, p->timer.expires);
+        else
+            io_pending_fire(&p->timer);
+        p = next;
+    }
+}
+
+/*
+ * Sets up the completion of a write to be parked, due no earlier than due,
+ * until another thread is done with its data. Returns NULL if it cannot be
+ * parked.
+ */
+static struct io_pending* io_park(struct io_queue* q, struct nvme_status* status, u64 due) {
+    struct io_pending* p;
+    if (q->wake < 0)
+        q->wake = eventfd(0, EFD_NONBLOCK);
+    p = q->wake >= 0 ? calloc(1, sizeof(*p)) : NULL;
+    if (!p)
+        return NULL;
+    stats_alloc(sizeof(*p));
+    p->q = q;
+    p->status = *status;
+    p->timer.fn = io_pending_fire;
+    p->timer.expires = due;
+    stats_cmd_park(&p->st);
+    return p;
+}
+
+/*
+ * Passes a write that succeeded locally on to the mirror of its namespace,
+ * which takes data. Returns 1 if the completion is parked until the peer
+ * has the data, 0 if it is to be sent now.
+ */
+static int io_mirror(struct io_queue* q, struct nvme_cmd* cmd, struct nvme_status* status, void* data, u64 due) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    u64 lba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
+    u32 nlb = (cmd->cdw12 & 0xFFFF) + 1;
+    struct io_pending* p = io_park(q, status, due);
+
+    if (!p) {
+        mirror_submit(ns->mirror, data, lba, nlb, NULL, NULL);
+        return 0;
+    }
+    if (!mirror_submit(ns->mirror, data, lba, nlb, io_park_done, p)) {
+        stats_cmd_resume(&p->st);
+        free(p);
+        return 0;
+    }
+    q->parked++;
+    return 1;
+}
+
+/*
+ * Hands a write on to the coalescer of its namespace, which takes data.
+ * Returns 1 if the completion is parked until the coalescer has written
+ * it, 0 if it was written here instead and is to be completed now.
+ */
+static int io_coalesce(struct io_queue* q, struct nvme_cmd* cmd, struct nvme_status* status, void* data, u64 due) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    struct rl_held held;
+    u64 lba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
+    u32 nlb = (cmd->cdw12 & 0xFFFF) + 1;
+    struct io_pending* p = io_park(q, status, due);
+
+    if (p && !coalesce_submit(ns->coalesce, data, lba, nlb, io_park_done, p)) {
+        q->parked++;
+        return 1;
+    }
+    if (p) {
+        stats_cmd_resume(&p->st);
+        free(p);
+    }
+    range_lock(ns->locks, &held, lba, nlb, 1);
+    status->sf = ns->ops->write(ns, data, lba, nlb);
+    if (ns->ra)
+        ra_invalidate(ns->ra, lba, nlb);
+    range_unlock(ns->locks, &held);
+    free(data);
+    return 0;
+}
+
+/*
+ * Holds the Compare that opens a fused pair until its Write arrives. Takes
+ * cmd and data.
+ */
+static void io_fuse(struct io_queue* q, struct nvme_cmd* cmd, void* data, struct nvme_status* status) {
+    q->fused.cmd = cmd;
+    q->fused.data = data;
+    q->fused.status = *status;
+    stats_cmd_park(&q->fused.st);
+}
+
+/*
+ * Executes the Write that closes a fused pair together with the Compare
+ * held for it, which completes with it. Without one, or if cmd is no
+ * Write, the pair fails.
+ */
+static void io_fused_exec(struct io_queue* q, struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer,
+                          struct rl_held* held) {
+    if (!q->fused.cmd) {
+        status->sf = make_sf(SCT_GENERIC, SC_ABORTED_MISSING_FUSED);
+        free(*data_buffer);
+        *data_buffer = NULL;
+    }
+    else if (cmd->opcode != IO_CMD_WRITE) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+        q->fused.status.sf = make_sf(SCT_GENERIC, SC_ABORTED_FAILED_FUSED);
+        free(*data_buffer);
+        *data_buffer = NULL;
+    }
+    else
+        io_cmd_compare_write(q->fused.cmd, &q->fused.status, &q->fused.data, cmd, status, data_buffer, held);
+}
+
+/*
+ * Sends the completion of the held Compare, or parks it until due, ahead
+ * of that of the current command.
+ */
+static void io_fused_complete(struct io_queue* q, u64 due) {
+    struct io_fused* f = &q->fused;
+    struct stats_cmd st;
+
+    stats_cmd_park(&st);
+    stats_cmd_resume(&f->st);
+    if (due <= clock_ns() || io_defer(q, &f->status, NULL, 0, due)) {
+        stats_stamp_once(STAMP_DONE);
+        if (send_status(q->socket, &f->status)) {
+            log_warn("Failed to send fused response");
+            q->broken = 1;
+        }
+    }
+    stats_cmd_resume(&st);
+    free(f->cmd);
+    free(f->data);
+    f->cmd = NULL;
+    f->data = NULL;
+}
+
+/*
+ * Waits until a command arrives, the next deferred completion is due or
+ * parked writes are done, which are completed here. Returns 1
+ * if the socket is readable, 0 otherwise and -1 on error.
+ */
+static int io_wait(struct io_queue* q) {
+    struct pollfd pfd[2] = {
+        { .fd = q->socket, .events = POLLIN },
+        { .fd = q->wake, .events = POLLIN },
+    };
+    u64 next = timer_next(&q->wheel), now = clock_ns();
+    u64 wait = next > now ? next - now : 0;
+    struct timespec ts = { .tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000 };
+    int ret = ppoll(pfd, q->wake >= 0 ? 2 : 1, next == (u64) -1 ? NULL : &ts, NULL);
+    if (ret < 0 && errno == EINTR)
+        return 0;
+    if (ret > 0 && (pfd[1].revents & POLLIN))
+        io_unpark(q);
+    return ret < 0 ? -1 : (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
+/*
+ * Executes a command and sends its completion, or parks the completion
+ * until the device model is done with the command. Frees cmd and
+ * data_buffer. Returns 0 on success or -1 if the connection failed.
+ */
+static int io_exec(struct io_queue* q, struct nvme_cmd* cmd, void* data_buffer, struct nvme_status* status) {
+    struct rl_held held;
+    void* read_data = NULL;
+    u32 read_len = 0;
+    int fused = 0, parked = 0;
+    u64 due;
+
+    if (cmd->opcode == OPC_FABRICS) {
+        /* Fabrics 전용 처리 */
+        fabric_cmd(&q->props, cmd, status);
+    }
+    else if (q->props.cc & 0x1) {
+        if ((cmd->flags & FUSE_MASK) == FUSE_FIRST && cmd->opcode == IO_CMD_COMPARE) {
+            io_fuse(q, cmd, data_buffer, status);
+            return 0;
+        }
+        arb_enter(&q->arb);
+        stats_stamp(STAMP_SUBMIT);
+        if ((cmd->flags & FUSE_MASK) == FUSE_SECOND) {
+            fused = q->fused.cmd != NULL;
+            io_fused_exec(q, cmd, status, &data_buffer, &held);
+        }
+        else if (cmd->flags & FUSE_MASK) {
+            status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+        }
+        else switch (cmd->opcode) {
+            case IO_CMD_FLUSH:
+                io_cmd_flush(cmd, status);
+                break;
+            case IO_CMD_WRITE:
+                io_cmd_write(q->socket, cmd, status, &data_buffer, &held);
+                break;
+            case IO_CMD_READ:
+                read_data = io_cmd_read_prepare(cmd, status, &read_len);
+                break;
+            case IO_CMD_COMPARE:
+                io_cmd_compare(cmd, status, &data_buffer);
+                break;
+            case IO_CMD_ZONE_APPEND:
+                io_cmd_zone_append(cmd, status, &data_buffer);
+                break;
+            case IO_CMD_ZONE_MGMT_SEND:
+                io_cmd_zone_send(cmd, status);
+                break;
+            case IO_CMD_ZONE_MGMT_RECV:
+                read_data = io_cmd_zone_recv(cmd, status, &read_len);
+                break;
+            default:
+                status->sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
+                break;
+        }
+        arb_exit(&q->arb);
+    }
+    else {
+        status->sf = make_sf(SCT_GENERIC, SC_COMMAND_SEQ);
+    }
+
+    due = status->sf || cmd->opcode == OPC_FABRICS ? 0 : io_model_due(cmd, clock_ns());
+    if (cmd->opcode == IO_CMD_WRITE && data_buffer) {
+        // only left over by a successful write to a mirrored or coalescing namespace
+        struct nvme_ns* ns = ns_get(cmd->nsid);
+        if (ns->coalesce)
+            parked = io_coalesce(q, cmd, status, data_buffer, due);
+        else {
+            // queued for the peer before the range is unlocked, so that
+            // overlapping writes reach it in the order they were written here
+            parked = io_mirror(q, cmd, status, data_buffer, due);
+            range_unlock(ns->locks, &held);
+        }
+        data_buffer = NULL;
+    }
+    if (fused)
+        io_fused_complete(q, due);
+    if (parked) {
+        free(cmd);
+        return 0;
+    }
+    free(cmd);
+    free(data_buffer);
+    if (due > clock_ns() && !io_defer(q, status, read_data, read_len, due))
+        return 0;
+
+    stats_stamp_once(STAMP_DONE);
+    if (read_data) {
+        int err = send_data(q->socket, status->cid, read_data, read_len);
+        free(read_data);
+        if (err) {
+            log_warn("Failed to send data");
+            return -1;
+        }
+    }
+    if (send_status(q->socket, status)) {
+        log_warn("Failed to send response");
+        return -1;
+    }
+    return 0;
+}
+
+void start_io_queue(sock_t socket, struct nvme_cmd* conn_cmd, struct nvme_ctrl* ctrl) {
     log_info("Starting io queue");
     u16 qsize = conn_cmd->cdw11 & 0xffff;
+    u16 qid = (conn_cmd->cdw10 >> 16) & 0xffff;
     u16 sqhd = 2;
-    struct nvme_properties props = {
-        .cap  = ((u64)1 << 37) | (4 << 24) | (1 << 16) | 127,
-        .vs   = 0x10400,
-        .cc   = 0x460001,
-        .csts = 0,
+    struct io_queue q = {
+        .socket = socket,
+        .ctrl = ctrl,
+        .wake = -1,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .props = {
+            .cap  = ((u64)1 << 37) | (4 << 24) | (1 << 16) | 127,
+            .vs   = 0x10400,
+            .cc   = 0x460001,
+            .csts = 0,
+        },
     };
+    timer_wheel_init(&q.wheel, 1000, clock_ns());
+    arb_queue_add(&q.arb, ctrl->qos ? ctrl->qos->arb_class : ARB_MEDIUM);
 
     /* 초기 응답 전송 (예: Admin Queue 생성 완료) */
     struct nvme_status status = {
-        .dw0  = 1,
+        .dw0  = ctrl->cntlid,
         .dw1  = 0,
         .sqhd = 1,
         .sqid = 0,
         .cid  = conn_cmd->cid,
         .sf   = 0,
     };
+    stats_queue_open(QUEUE_IO, ctrl->cntlid, qid, &ctrl->retired);
     if (send_status(socket, &status)) {
         log_warn("Failed to send initial response");
-        return;
+        goto out;
     }
 
     struct nvme_cmd* cmd;
-    void *data_buffer;
+    void* data_buffer;
+    u64 due;
+
+    while (!q.broken) {
+        // with commands or completions pending, wait for whichever comes first
+        if (q.wheel.count || q.parked) {
+            int ready = io_wait(&q);
+            if (ready < 0) {
+                log_warn("poll failed: %s", strerror(errno));
+                goto out;
+            }
+            timer_run(&q.wheel, clock_ns());
+            if (!ready)
+                continue;
+        }
 
-    while (1) {
         /* 상태 구조체 초기화 및 큐 헤드 업데이트 */
         memset(&status, 0, sizeof(status));
         status.sqhd = sqhd++;
@@ -44,72 +600,364 @@ void start_io_queue(sock_t socket, struct nvme_cmd* conn_cmd) {
         cmd = recv_cmd(socket, &data_buffer);
         if (!cmd) {
             log_warn("Failed to receive command");
-            return;
+            goto out;
         }
         status.cid = cmd->cid;
         log_debug("Got command: 0x%02x (%s)", cmd->opcode, nvme_io_opcode_name(cmd->opcode));
+        stats_cmd_begin(cmd->opcode);
+        ka_touch(&ctrl->ka);
 
-        if (cmd->opcode == OPC_FABRICS) {
-            /* Fabrics 전용 처리 */
-            fabric_cmd(&props, cmd, &status);
-        }
-        else if (props.cc & 0x1) {
-            switch (cmd->opcode) {
-                case IO_CMD_FLUSH:
-                    break;
-                case IO_CMD_WRITE:
-                    io_cmd_write(socket, cmd, &status, &data_buffer);
-                    break;
-                case IO_CMD_READ:
-                    io_cmd_read(socket, cmd, &status);
-                    break;
-                default:
-                    status.sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
-                    break;
-            }
-        }
-        else {
-            status.sf = make_sf(SCT_GENERIC, SC_COMMAND_SEQ);
+        // the Write of a fused pair has to come right after its Compare
+        if (q.fused.cmd && (cmd->flags & FUSE_MASK) != FUSE_SECOND) {
+            q.fused.status.sf = make_sf(SCT_GENERIC, SC_ABORTED_MISSING_FUSED);
+            io_fused_complete(&q, 0);
         }
 
-        free(cmd);
-        if (send_status(socket, &status)) {
-            log_warn("Failed to send response");
-            return;
-        }
+        due = q.props.cc & 0x1 ? io_qos_due(&q, cmd, clock_ns()) : 0;
+        if (due > clock_ns() && !io_throttle(&q, cmd, data_buffer, &status, due))
+            continue;
+        if (io_exec(&q, cmd, data_buffer, &status))
+            goto out;
+    }
+
+out:
+    // drop commands and completions that can no longer be delivered
+    q.broken = 1;
+    free(q.fused.cmd);
+    free(q.fused.data);
+    // the mirror fails writes its peer leaves unanswered, so this ends
+    while (q.parked) {
+        struct pollfd pfd = { .fd = q.wake, .events = POLLIN };
+        poll(&pfd, 1, -1);
+        io_unpark(&q);
     }
+    if (q.wake >= 0)
+        close(q.wake);
+    timer_run(&q.wheel, (u64) -1);
+    arb_queue_del(&q.arb);
+    stats_queue_close();
 }
 
-void io_cmd_read(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
+/*
+ * Looks up the namespace of an I/O command and checks that the LBA range in
+ * cdw10-12 lies within it. Returns NULL with the status set otherwise.
+ */
+static struct nvme_ns* io_cmd_ns(struct nvme_cmd* cmd, struct nvme_status* status, u64* lba, u32* nlb) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    if (!ns) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+        return NULL;
+    }
+    *lba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
+    *nlb = (cmd->cdw12 & 0xFFFF) + 1;
+    if (*lba >= ns->nsze || ns->nsze - *lba < *nlb) {
+        status->sf = make_sf(SCT_GENERIC, SC_LBA_RANGE);
+        return NULL;
+    }
+    return ns;
+}
 
-    log_debug("IO Read command");
-    u64 lba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
-    u64 lba_count = (cmd->cdw12 & 0xFFFF) + 1;
-    u32 payload_len = lba_count * 4096;
+/*
+ * Reads the data of a Read command from its namespace into a new buffer
+ * of *len bytes, which the caller sends and frees. Returns NULL with the
+ * status set on error.
+ */
+void* io_cmd_read_prepare(struct nvme_cmd* cmd, struct nvme_status* status, u32* len) {
+    struct rl_held held;
+    u64 lba;
+    u32 nlb;
+    struct nvme_ns* ns = io_cmd_ns(cmd, status, &lba, &nlb);
+    if (!ns)
+        return NULL;
+    u32 payload_len = ns->ms ? pi_xfer_len(ns, cmd, nlb) : nlb << ns->lba_shift;
 
-    log_debug("IO Read command: LBA=0x%lx, LBA Count=%lu, Payload Length=%u", lba, lba_count, payload_len);
+    log_debug("IO Read command: NSID=%u, LBA=0x%lx, LBA Count=%u, Payload Length=%u", cmd->nsid, lba, nlb, payload_len);
 
     char *buffer = (char*) malloc(payload_len);
+    if (!buffer) {
+        status->sf = make_sf(SCT_GENERIC, SC_INTERNAL);
+        return NULL;
+    }
+    stats_alloc(payload_len);
+    range_lock(ns->locks, &held, lba, nlb, 0);
+    if (ns->ms)
+        status->sf = pi_read(ns, cmd, buffer, lba, nlb);
+    else if (ns->ra)
+        status->sf = ra_read(ns->ra, buffer, lba, nlb);
+    else
+        status->sf = ns->ops->read(ns, buffer, lba, nlb);
+    range_unlock(ns->locks, &held);
+    if (status->sf) {
+        free(buffer);
+        return NULL;
+    }
+    stats_add(c.reads, 1);
+    stats_add(c.read_bytes, payload_len);
+    *len = payload_len;
+    return buffer;
+}
+
+void io_cmd_read(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status) {
+    u32 len;
+    void* buffer = io_cmd_read_prepare(cmd, status, &len);
+    stats_stamp(STAMP_DONE);
+    if (buffer)
+        send_data(socket, cmd->cid, buffer, len);
+    free(buffer);
+}
 
-    send_data(socket, cmd->cid, buffer, payload_len);
 
+void io_cmd_write(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer,
+                  struct rl_held* held) {
+    u64 lba;
+    u32 nlb;
+    struct nvme_ns* ns = io_cmd_ns(cmd, status, &lba, &nlb);
+    if (!ns)
+        goto out;
+    u32 payload_len = ns->ms ? pi_xfer_len(ns, cmd, nlb) : nlb << ns->lba_shift;
 
-    free(buffer);
+    log_debug("IO Write command: NSID=%u, LBA=0x%lx, LBA Count=%u, Payload Length=%u", cmd->nsid, lba, nlb, payload_len);
+    if (!*data_buffer || cmd->sgl.length != payload_len) {
+        status->sf = make_sf(SCT_GENERIC, SC_SGL_LENGTH);
+        goto out;
+    }
+    if (ns->wp) {
+        status->sf = make_sf(SCT_GENERIC, SC_NS_WRITE_PROTECTED);
+        goto out;
+    }
+
+    u8* data = *data_buffer;
+    log_trace("Data[0..7]: %02x %02x %02x %02x %02x %02x %02x %02x",
+              data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
+    // the coalescer writes, and locks, the data of coalesced writes itself
+    if (!ns->coalesce) {
+        range_lock(ns->locks, held, lba, nlb, 1);
+        if (ns->ms)
+            status->sf = pi_write(ns, cmd, data, lba, nlb);
+        else
+            status->sf = ns->ops->write(ns, data, lba, nlb);
+        if (ns->ra)
+            ra_invalidate(ns->ra, lba, nlb);
+        if (status->sf || !ns->mirror)
+            range_unlock(ns->locks, held);
+    }
+    if (!status->sf) {
+        stats_add(c.writes, 1);
+        stats_add(c.write_bytes, payload_len);
+        if (ns->mirror || ns->coalesce)
+            return;  // the caller hands the data on to the mirror or the coalescer
+    }
+
+out:
+    free(*data_buffer);
+    *data_buffer = NULL;
 }
 
+/*
+ * Compares the data of cmd with the len bytes of nlb blocks at lba, read
+ * the way cmd would read them. Call with the range locked.
+ */
+static u16 io_compare(struct nvme_ns* ns, struct nvme_cmd* cmd, const void* data, u64 lba, u32 nlb, u32 len) {
+    void* stored = malloc(len);
+    u16 sf;
+    if (!stored)
+        return make_sf(SCT_GENERIC, SC_INTERNAL);
+    stats_alloc(len);
+    sf = ns->ms ? pi_read(ns, cmd, stored, lba, nlb) : ns->ops->read(ns, stored, lba, nlb);
+    if (!sf && !fp_equal(stored, data, len))
+        sf = make_sf(SCT_MEDIA, SC_COMPARE_FAILURE);
+    free(stored);
+    return sf;
+}
 
-void io_cmd_write(sock_t socket, struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer) {
+void io_cmd_compare(struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer) {
+    struct rl_held held;
+    u64 lba;
+    u32 nlb;
+    struct nvme_ns* ns = io_cmd_ns(cmd, status, &lba, &nlb);
+    if (!ns)
+        goto out;
+    u32 payload_len = ns->ms ? pi_xfer_len(ns, cmd, nlb) : nlb << ns->lba_shift;
 
-    log_debug("IO Write command");
-    u64 lba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
-    u64 lba_count = (cmd->cdw12 & 0xFFFF) + 1;
-    u32 payload_len = lba_count * 4096;
+    log_debug("IO Compare command: NSID=%u, LBA=0x%lx, LBA Count=%u", cmd->nsid, lba, nlb);
+    if (!*data_buffer || cmd->sgl.length != payload_len) {
+        status->sf = make_sf(SCT_GENERIC, SC_SGL_LENGTH);
+        goto out;
+    }
+    range_lock(ns->locks, &held, lba, nlb, 0);
+    status->sf = io_compare(ns, cmd, *data_buffer, lba, nlb, payload_len);
+    range_unlock(ns->locks, &held);
+
+out:
+    free(*data_buffer);
+    *data_buffer = NULL;
+}
+
+void io_cmd_compare_write(struct nvme_cmd* cmp, struct nvme_status* cmp_status, void** cmp_data,
+                          struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer,
+                          struct rl_held* held) {
+    u64 lba;
+    u32 nlb;
+    struct nvme_ns* ns = io_cmd_ns(cmp, cmp_status, &lba, &nlb);
+    if (!ns)
+        goto out;
+    u32 cmp_len = ns->ms ? pi_xfer_len(ns, cmp, nlb) : nlb << ns->lba_shift;
+    u32 payload_len = ns->ms ? pi_xfer_len(ns, cmd, nlb) : nlb << ns->lba_shift;
 
-    log_debug("IO Write command: LBA=0x%lx, LBA Count=%lu, Payload Length=%u", lba, lba_count, payload_len);
+    log_debug("IO Compare and Write: NSID=%u, LBA=0x%lx, LBA Count=%u", cmd->nsid, lba, nlb);
+    if (!*cmp_data || cmp->sgl.length != cmp_len) {
+        cmp_status->sf = make_sf(SCT_GENERIC, SC_SGL_LENGTH);
+        goto out;
+    }
+    // both halves cover the same blocks
+    if (cmd->nsid != cmp->nsid || cmd->cdw10 != cmp->cdw10 || cmd->cdw11 != cmp->cdw11 ||
+        (cmd->cdw12 & 0xFFFF) != (cmp->cdw12 & 0xFFFF)) {
+        cmp_status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+        goto out;
+    }
+    if (!*data_buffer || cmd->sgl.length != payload_len) {
+        status->sf = make_sf(SCT_GENERIC, SC_SGL_LENGTH);
+        cmp_status->sf = make_sf(SCT_GENERIC, SC_ABORTED_FAILED_FUSED);
+        goto out;
+    }
+    if (ns->wp) {
+        status->sf = make_sf(SCT_GENERIC, SC_NS_WRITE_PROTECTED);
+        cmp_status->sf = make_sf(SCT_GENERIC, SC_ABORTED_FAILED_FUSED);
+        goto out;
+    }
 
-    for (u32 i = 0; i < payload_len; i++) {
-        log_debug("Data[%u]: 0x%02x", i, ((char*)(*data_buffer))[i]);
+    // exclusive from the read to the write, and past the coalescer, so
+    // nothing sees or changes the blocks in between
+    range_lock(ns->locks, held, lba, nlb, 1);
+    cmp_status->sf = io_compare(ns, cmp, *cmp_data, lba, nlb, cmp_len);
+    if (!cmp_status->sf) {
+        if (ns->ms)
+            status->sf = pi_write(ns, cmd, *data_buffer, lba, nlb);
+        else
+            status->sf = ns->ops->write(ns, *data_buffer, lba, nlb);
+        if (ns->ra)
+            ra_invalidate(ns->ra, lba, nlb);
+    }
+    if (!cmp_status->sf && !status->sf) {
+        stats_add(c.writes, 1);
+        stats_add(c.write_bytes, payload_len);
+        if (ns->mirror) {
+            free(*cmp_data);
+            *cmp_data = NULL;
+            return;  // the caller hands the data on to the mirror and unlocks
+        }
     }
+    range_unlock(ns->locks, held);
 
+out:
+    // a Compare that failed, or did not match, aborts the Write
+    if (cmp_status->sf && !status->sf)
+        status->sf = make_sf(SCT_GENERIC, SC_ABORTED_FAILED_FUSED);
+    free(*cmp_data);
+    *cmp_data = NULL;
     free(*data_buffer);
+    *data_buffer = NULL;
+}
+
+void io_cmd_flush(struct nvme_cmd* cmd, struct nvme_status* status) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    if (!ns && cmd->nsid != 0xffffffff) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+        return;
+    }
+    for (u32 nsid = 1; !ns && nsid <= ns_max_nsid(); nsid++) {
+        struct nvme_ns* each = ns_get(nsid);
+        if (each && each->ops->flush && (status->sf = each->ops->flush(each)))
+            return;
+    }
+    if (ns && ns->ops->flush)
+        status->sf = ns->ops->flush(ns);
+}
+
+void io_cmd_zone_append(struct nvme_cmd* cmd, struct nvme_status* status, void** data_buffer) {
+    u64 zslba, lba;
+    u32 nlb;
+    struct nvme_ns* ns = io_cmd_ns(cmd, status, &zslba, &nlb);
+    if (!ns)
+        goto out;
+    if (!ns->ops->append) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
+        goto out;
+    }
+    u32 payload_len = nlb << ns->lba_shift;
+    if (!*data_buffer || cmd->sgl.length != payload_len) {
+        status->sf = make_sf(SCT_GENERIC, SC_SGL_LENGTH);
+        goto out;
+    }
+    status->sf = ns->ops->append(ns, *data_buffer, zslba, nlb, &lba);
+    if (!status->sf && ns->ra)
+        ra_invalidate(ns->ra, lba, nlb);
+    if (!status->sf) {
+        log_debug("Zone Append: NSID=%u, ZSLBA=0x%lx, LBA=0x%lx, LBA Count=%u", cmd->nsid, zslba, lba, nlb);
+        status->dw0 = lba & 0xffffffff;
+        status->dw1 = lba >> 32;
+        stats_add(c.writes, 1);
+        stats_add(c.write_bytes, payload_len);
+    }
+
+out:
+    free(*data_buffer);
+    *data_buffer = NULL;
+}
+
+void io_cmd_zone_send(struct nvme_cmd* cmd, struct nvme_status* status) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    u64 slba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
+    u8 action = cmd->cdw13 & 0xff;
+    int all = (cmd->cdw13 >> 8) & 0x1;
+    if (!ns) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+        return;
+    }
+    if (!ns->ops->zone_send) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
+        return;
+    }
+    log_debug("Zone Management Send: NSID=%u, SLBA=0x%lx, action=0x%x, all=%d", cmd->nsid, slba, action, all);
+    status->sf = ns->ops->zone_send(ns, slba, action, all);
+    // a reset zone reads back as zeroes
+    if (ns->ra)
+        ra_invalidate(ns->ra, 0, ns->nsze);
+}
+
+void* io_cmd_zone_recv(struct nvme_cmd* cmd, struct nvme_status* status, u32* len) {
+    struct nvme_ns* ns = ns_get(cmd->nsid);
+    u64 slba = cmd->cdw10 | ((u64)cmd->cdw11 << 32);
+    u32 bytes = (cmd->cdw12 + 1) * 4;
+    u8 action = cmd->cdw13 & 0xff;
+    u8 filter = (cmd->cdw13 >> 8) & 0xff;
+    int partial = (cmd->cdw13 >> 16) & 0x1;
+    void* buffer;
+    if (!ns) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_NS);
+        return NULL;
+    }
+    if (!ns->ops->zone_recv) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_OPCODE);
+        return NULL;
+    }
+    // only the plain report; there are no zone descriptor extensions
+    if (action != 0 || !cmd->cdw12 || bytes > (1U << 23)) {
+        status->sf = make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+        return NULL;
+    }
+    log_debug("Zone Management Receive: NSID=%u, SLBA=0x%lx, %u bytes, filter=%u, partial=%d", cmd->nsid, slba, bytes, filter, partial);
+    buffer = calloc(1, bytes);
+    if (!buffer) {
+        status->sf = make_sf(SCT_GENERIC, SC_INTERNAL);
+        return NULL;
+    }
+    stats_alloc(bytes);
+    status->sf = ns->ops->zone_recv(ns, buffer, bytes, slba, filter, partial);
+    if (status->sf) {
+        free(buffer);
+        return NULL;
+    }
+    *len = bytes;
+    return buffer;
 }
@@ -0,0 +1,101 @@
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "log.h"
+#include "keepalive.h"
+
+static struct timer_wheel wheel;
+static pthread_mutex_t ka_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ka_cond;
+static pthread_once_t ka_once = PTHREAD_ONCE_INIT;
+static int ka_running;
+
+/*
+ * Re-queues a timer whose controller saw traffic since it was queued, or
+ * expires the controller. The last traffic may be stamped up to a tick
+ * late, which the deadline allows for.
+ */
+static void ka_fire(struct timer* t) {
+	struct keepalive* ka = (struct keepalive*) t;
+	u64 due = __atomic_load_n(&ka->last, __ATOMIC_RELAXED) + ka->kato_ns + KA_TICK_NS;
+
+	if (due > clock_ns()) {
+		t->expires = due;
+		timer_add(&wheel, t);
+		return;
+	}
+	ka->expire(ka);
+}
+
+static void* ka_main(void* arg) {
+	pthread_mutex_lock(&ka_lock);
+	while (1) {
+		u64 next = timer_next(&wheel);
+		if (next == (u64) -1)
+			pthread_cond_wait(&ka_cond, &ka_lock);
+		else {
+			struct timespec ts = {
+				.tv_sec = next / 1000000000,
+				.tv_nsec = next % 1000000000,
+			};
+			pthread_cond_timedwait(&ka_cond, &ka_lock, &ts);
+		}
+		timer_run(&wheel, clock_ns());
+	}
+	return NULL;
+}
+
+static void ka_init(void) {
+	pthread_condattr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int err;
+
+	timer_wheel_init(&wheel, KA_TICK_NS, clock_ns());
+	// deadlines are CLOCK_MONOTONIC times
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ka_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&thread, NULL, ka_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		log_error("Cannot start the keep-alive reaper: %s", strerror(err));
+		return;
+	}
+	pthread_detach(thread);
+	ka_running = 1;
+}
+
+int ka_start(struct keepalive* ka, u32 kato_ms, void (*expire)(struct keepalive* ka)) {
+	if (!kato_ms)
+		return 0;
+	pthread_once(&ka_once, ka_init);
+	if (!ka_running)
+		return -1;
+	ka->kato_ns = (u64) kato_ms * 1000000;
+	ka->last = clock_ns();
+	ka->expire = expire;
+	ka->timer.fn = ka_fire;
+	ka->timer.expires = ka->last + ka->kato_ns + KA_TICK_NS;
+
+	pthread_mutex_lock(&ka_lock);
+	timer_add(&wheel, &ka->timer);
+	pthread_cond_signal(&ka_cond);
+	pthread_mutex_unlock(&ka_lock);
+	return 0;
+}
+
+void ka_stop(struct keepalive* ka) {
+	if (!ka->kato_ns)
+		return;
+	pthread_mutex_lock(&ka_lock);
+	timer_del(&wheel, &ka->timer);
+	pthread_mutex_unlock(&ka_lock);
+	ka->kato_ns = 0;
+}
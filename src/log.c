@@ -25,16 +25,69 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "log.h"
 
+/*
+ * Asynchronous mode: every thread owns a single-producer ring that only it
+ * writes to, the background writer is the single consumer. Records are laid
+ * out back to back; a record that would straddle the end of the buffer is
+ * preceded by a filler record so that each one is contiguous.
+ */
+#define RING_SIZE   (1 << 16)
+#define REC_MAX     1024
+#define REC_STR_MAX 128
+#define REC_FILLER  0xff
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct record {
+  unsigned short size;
+  unsigned char level;
+  unsigned char resvd;
+  int line;
+  const char *file;
+  const char *fmt;
+  unsigned long ts;
+};
+
+struct ring {
+  unsigned long head;
+  char pad1[56];
+  unsigned long tail;
+  char pad2[56];
+  unsigned long dropped;
+  int closed;
+  struct ring *next;
+  char buf[RING_SIZE];
+};
+
+enum { ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_DOUBLE, ARG_STR, ARG_PTR };
+
+struct spec {
+  const char *start;
+  int len;
+  int stars;
+  int type;
+};
+
 static struct {
   void *udata;
   log_LockFn lock;
   FILE *fp;
   int level;
   int quiet;
-} L;
+  int async;
+  int running;
+  pthread_t writer;
+  pthread_mutex_t rings_lock;
+  pthread_key_t ring_key;
+  struct ring *rings;
+  unsigned long dropped;
+} L = { .rings_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct ring *tls_ring;
 
 
 static const char *level_names[] = {
@@ -87,11 +140,475 @@ void log_set_quiet(int enable) {
 }
 
 
+/*
+ * Parses the conversion specification starting at p, which points at a '%',
+ * and returns a pointer just past it.
+ */
+static const char *parse_spec(const char *p, struct spec *s) {
+  int lmod = 0;
+
+  s->start = p++;
+  s->stars = 0;
+  while (*p && strchr("-+ #0'", *p)) {
+    p++;
+  }
+  if (*p == '*') {
+    s->stars++;
+    p++;
+  }
+  while (isdigit((unsigned char) *p)) {
+    p++;
+  }
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      s->stars++;
+      p++;
+    }
+    while (isdigit((unsigned char) *p)) {
+      p++;
+    }
+  }
+  for (;; p++) {
+    if (*p == 'h' || *p == 'L') {
+      continue;
+    } else if (*p == 'l') {
+      lmod++;
+    } else if (*p == 'z' || *p == 'j' || *p == 't') {
+      lmod = 3;
+    } else {
+      break;
+    }
+  }
+
+  switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      s->type = lmod == 0 ? ARG_INT : lmod == 1 ? ARG_LONG :
+                lmod == 2 ? ARG_LLONG : ARG_SIZE;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      s->type = ARG_DOUBLE;
+      break;
+    case 's':
+      s->type = ARG_STR;
+      break;
+    case 'p':
+      s->type = ARG_PTR;
+      break;
+    default:
+      s->type = ARG_NONE;
+  }
+  if (*p) {
+    p++;
+  }
+  s->len = p - s->start;
+  return p;
+}
+
+
+/*
+ * Serializes the arguments of fmt into out, which has room for cap bytes.
+ * Returns the number of bytes used.
+ */
+static size_t pack_args(char *out, size_t cap, const char *fmt, va_list ap) {
+  size_t used = 0;
+  struct spec s;
+  const char *p = fmt;
+
+  while ((p = strchr(p, '%'))) {
+    p = parse_spec(p, &s);
+    if (s.type == ARG_NONE) {
+      continue;
+    }
+    if (used + 8 * (s.stars + 1) + REC_STR_MAX + 8 > cap) {
+      break;
+    }
+    for (int i = 0; i < s.stars; i++) {
+      long long w = va_arg(ap, int);
+      memcpy(out + used, &w, 8);
+      used += 8;
+    }
+    switch (s.type) {
+      case ARG_INT: {
+        long long v = va_arg(ap, int);
+        memcpy(out + used, &v, 8);
+        break;
+      }
+      case ARG_LONG: {
+        long long v = va_arg(ap, long);
+        memcpy(out + used, &v, 8);
+        break;
+      }
+      case ARG_LLONG: {
+        long long v = va_arg(ap, long long);
+        memcpy(out + used, &v, 8);
+        break;
+      }
+      case ARG_SIZE: {
+        long long v = va_arg(ap, size_t);
+        memcpy(out + used, &v, 8);
+        break;
+      }
+      case ARG_DOUBLE: {
+        double v = va_arg(ap, double);
+        memcpy(out + used, &v, 8);
+        break;
+      }
+      case ARG_PTR: {
+        void *v = va_arg(ap, void *);
+        memcpy(out + used, &v, sizeof(v));
+        break;
+      }
+      case ARG_STR: {
+        const char *str = va_arg(ap, const char *);
+        unsigned long len;
+        if (!str) {
+          str = "(null)";
+        }
+        len = strnlen(str, REC_STR_MAX - 1);
+        memcpy(out + used, &len, 8);
+        memcpy(out + used + 8, str, len);
+        out[used + 8 + len] = '\0';
+        used += REC_ALIGN(len + 1);
+        break;
+      }
+    }
+    used += 8;
+  }
+  return used;
+}
+
+
+/*
+ * Formats a record's message from its format string and packed arguments.
+ */
+static void unpack_message(char *out, size_t cap, const struct record *rec) {
+  const char *args = (const char *) (rec + 1);
+  const char *end = (const char *) rec + rec->size;
+  const char *p = rec->fmt, *lit;
+  struct spec s;
+  char spec[32];
+  long long star[2];
+  size_t n = 0;
+  int ret;
+
+  while (*p && n + 1 < cap) {
+    lit = strchr(p, '%');
+    if (!lit) {
+      lit = p + strlen(p);
+    }
+    while (p < lit && n + 1 < cap) {
+      out[n++] = *p++;
+    }
+    if (!*p) {
+      break;
+    }
+    p = parse_spec(p, &s);
+    if (s.type == ARG_NONE) {
+      if (s.start[s.len - 1] == '%') {
+        out[n++] = '%';
+      }
+      continue;
+    }
+    if (args + 8 * (s.stars + 1) > end || s.len >= (int) sizeof(spec)) {
+      break;
+    }
+    memcpy(spec, s.start, s.len);
+    spec[s.len] = '\0';
+    for (int i = 0; i < s.stars; i++) {
+      memcpy(&star[i], args, 8);
+      args += 8;
+    }
+
+#define EMIT(val) \
+    (s.stars == 0 ? snprintf(out + n, cap - n, spec, val) : \
+     s.stars == 1 ? snprintf(out + n, cap - n, spec, (int) star[0], val) : \
+     snprintf(out + n, cap - n, spec, (int) star[0], (int) star[1], val))
+
+    switch (s.type) {
+      case ARG_INT: {
+        long long v;
+        memcpy(&v, args, 8);
+        ret = EMIT((int) v);
+        break;
+      }
+      case ARG_LONG: {
+        long long v;
+        memcpy(&v, args, 8);
+        ret = EMIT((long) v);
+        break;
+      }
+      case ARG_LLONG: {
+        long long v;
+        memcpy(&v, args, 8);
+        ret = EMIT(v);
+        break;
+      }
+      case ARG_SIZE: {
+        long long v;
+        memcpy(&v, args, 8);
+        ret = EMIT((size_t) v);
+        break;
+      }
+      case ARG_DOUBLE: {
+        double v;
+        memcpy(&v, args, 8);
+        ret = EMIT(v);
+        break;
+      }
+      case ARG_PTR: {
+        void *v;
+        memcpy(&v, args, sizeof(v));
+        ret = EMIT(v);
+        break;
+      }
+      default: {
+        unsigned long len;
+        memcpy(&len, args, 8);
+        ret = EMIT(args + 8);
+        args += REC_ALIGN(len + 1);
+        break;
+      }
+    }
+#undef EMIT
+    args += 8;
+    if (ret < 0) {
+      break;
+    }
+    n += (size_t) ret < cap - n ? (size_t) ret : cap - n - 1;
+  }
+  out[n] = '\0';
+}
+
+
+static void write_record(const struct record *rec, char *tbuf, char *dbuf) {
+  char msg[1024];
+  const char *name = level_names[rec->level];
+
+  unpack_message(msg, sizeof(msg), rec);
+  if (!L.quiet) {
+#ifdef LOG_USE_COLOR
+    fprintf(
+      stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m %s\n",
+      tbuf, level_colors[rec->level], name, rec->file, rec->line, msg);
+#else
+    fprintf(stderr, "%s %-5s %s:%d: %s\n", tbuf, name, rec->file, rec->line, msg);
+#endif
+  }
+  if (L.fp) {
+    fprintf(L.fp, "%s %-5s %s:%d: %s\n", dbuf, name, rec->file, rec->line, msg);
+  }
+}
+
+
+/*
+ * Formats and writes all records currently queued in every ring, and frees
+ * rings whose threads have exited. Returns the number of records written.
+ */
+static int drain(void) {
+  static time_t last_sec = -1;
+  static char tbuf[16], dbuf[32];
+  struct ring *r, **link;
+  unsigned long head, dropped = 0;
+  int count = 0;
+
+  pthread_mutex_lock(&L.rings_lock);
+  for (link = &L.rings; (r = *link);) {
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (r->tail != head) {
+      const struct record *rec =
+        (const struct record *) (r->buf + (r->tail & (RING_SIZE - 1)));
+      if (rec->level != REC_FILLER) {
+        time_t sec = rec->ts / 1000000000UL;
+        if (sec != last_sec) {
+          struct tm lt;
+          localtime_r(&sec, &lt);
+          tbuf[strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &lt)] = '\0';
+          dbuf[strftime(dbuf, sizeof(dbuf), "%Y-%m-%d %H:%M:%S", &lt)] = '\0';
+          last_sec = sec;
+        }
+        write_record(rec, tbuf, dbuf);
+        count++;
+      }
+      __atomic_store_n(&r->tail, r->tail + rec->size, __ATOMIC_RELEASE);
+    }
+    dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) &&
+        r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+      *link = r->next;
+      free(r);
+    } else {
+      link = &r->next;
+    }
+  }
+  if (dropped) {
+    L.dropped += dropped;
+    fprintf(stderr, "log: %lu messages dropped (ring full)\n", dropped);
+  }
+  if (count || dropped) {
+    fflush(stderr);
+    if (L.fp) {
+      fflush(L.fp);
+    }
+  }
+  pthread_mutex_unlock(&L.rings_lock);
+  return count;
+}
+
+
+static void *writer_main(void *arg) {
+  struct timespec idle = { 0, 1000000 };
+  (void) arg;
+
+  while (__atomic_load_n(&L.running, __ATOMIC_ACQUIRE)) {
+    if (!drain()) {
+      nanosleep(&idle, NULL);
+    }
+  }
+  drain();
+  return NULL;
+}
+
+
+static void ring_release(void *ring) {
+  __atomic_store_n(&((struct ring *) ring)->closed, 1, __ATOMIC_RELEASE);
+}
+
+
+static struct ring *ring_get(void) {
+  struct ring *r = tls_ring;
+  if (r) {
+    return r;
+  }
+  r = calloc(1, sizeof(*r));
+  if (!r) {
+    return NULL;
+  }
+  pthread_setspecific(L.ring_key, r);
+  pthread_mutex_lock(&L.rings_lock);
+  r->next = L.rings;
+  L.rings = r;
+  pthread_mutex_unlock(&L.rings_lock);
+  tls_ring = r;
+  return r;
+}
+
+
+/*
+ * Appends a record to the calling thread's ring. Returns -1 rather than
+ * blocking the caller if the writer has fallen behind.
+ */
+static int ring_push(struct ring *r, const struct record *rec) {
+  unsigned long head = r->head;
+  unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  size_t off = head & (RING_SIZE - 1);
+  size_t contig = RING_SIZE - off;
+  size_t need = contig < rec->size ? contig + rec->size : rec->size;
+
+  if (head + need - tail > RING_SIZE) {
+    return -1;
+  }
+  if (contig < rec->size) {
+    struct record *filler = (struct record *) (r->buf + off);
+    filler->size = contig;
+    filler->level = REC_FILLER;
+    head += contig;
+    off = 0;
+  }
+  memcpy(r->buf + off, rec, rec->size);
+  __atomic_store_n(&r->head, head + rec->size, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+/*
+ * Queues a message for the writer thread. Returns -1 if it could not be
+ * queued, in which case warnings and errors are written synchronously and
+ * anything less severe is dropped and counted.
+ */
+static int log_async(int level, const char *file, int line, const char *fmt, va_list ap) {
+  union {
+    struct record rec;
+    char raw[REC_MAX];
+  } u;
+  struct timespec ts;
+  struct ring *r = ring_get();
+  if (!r) {
+    return -1;
+  }
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  u.rec.level = level;
+  u.rec.resvd = 0;
+  u.rec.line = line;
+  u.rec.file = file;
+  u.rec.fmt = fmt;
+  u.rec.ts = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  u.rec.size = sizeof(u.rec) +
+    pack_args(u.raw + sizeof(u.rec), REC_MAX - sizeof(u.rec), fmt, ap);
+  if (ring_push(r, &u.rec)) {
+    if (level < LOG_WARN) {
+      __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+
+int log_set_async(int enable) {
+  static int key_created;
+
+  if (enable == L.async) {
+    return 0;
+  }
+  if (enable) {
+    if (!key_created) {
+      if (pthread_key_create(&L.ring_key, ring_release)) {
+        return -1;
+      }
+      key_created = 1;
+      atexit(log_flush);
+    }
+    L.running = 1;
+    if (pthread_create(&L.writer, NULL, writer_main, NULL)) {
+      L.running = 0;
+      return -1;
+    }
+    __atomic_store_n(&L.async, 1, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&L.async, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&L.running, 0, __ATOMIC_RELEASE);
+    pthread_join(L.writer, NULL);
+  }
+  return 0;
+}
+
+
+void log_flush(void) {
+  if (L.rings) {
+    drain();
+  }
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
   if (level < L.level) {
     return;
   }
 
+  if (__atomic_load_n(&L.async, __ATOMIC_ACQUIRE)) {
+    va_list args;
+    int err;
+    va_start(args, fmt);
+    err = log_async(level, file, line, fmt, args);
+    va_end(args);
+    if (!err || level < LOG_WARN) {
+      return;
+    }
+  }
+
   /* Acquire lock */
   lock();
 
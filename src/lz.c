@@ -0,0 +1,170 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS  12
+#define LZ_MIN_MATCH  4
+#define LZ_LAST_LITERALS 5          /* the format ends with at least this many literals */
+#define LZ_MF_LIMIT   12            /* no match may start closer to the end */
+#define LZ_MAX_OFFSET 65535
+
+static inline u32 read32(const u8* p) {
+	u32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u64 read64(const u8* p) {
+	u64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Returns how far the bytes at a and b agree, up to limit, comparing eight
+ * at a time (the first differing byte is the lowest set one on
+ * little-endian machines).
+ */
+static inline u32 match_len(const u8* a, const u8* b, u32 limit) {
+	u32 n = 0;
+	while (n + 8 <= limit) {
+		u64 diff = read64(a + n) ^ read64(b + n);
+		if (diff)
+			return n + (__builtin_ctzll(diff) >> 3);
+		n += 8;
+	}
+	while (n < limit && a[n] == b[n])
+		n++;
+	return n;
+}
+
+static inline u32 lz_hash(u32 seq) {
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extra bytes of a length that did not fit in its token nibble. */
+static inline u8* put_len(u8* op, u32 len) {
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ * Emits literals [lit, lit + nlit) followed by a match of mlen bytes at
+ * offset, or just the literals if mlen is 0. Returns the new output
+ * position, or NULL if the sequence does not fit before end.
+ */
+static u8* put_seq(u8* op, u8* end, const u8* lit, u32 nlit, u32 offset, u32 mlen) {
+	u8* token = op;
+	if (op + 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0) > end)
+		return NULL;
+	op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = put_len(op, mlen - 15);
+	return op;
+}
+
+/*
+ * Compresses len bytes at src into at most cap bytes at dst. Returns the
+ * compressed size, or 0 if it would not fit.
+ */
+u32 lz_compress(const void* src, u32 len, void* dst, u32 cap) {
+	const u8* in = src;
+	u8 *op = dst, *end = op + cap;
+	u32 table[1 << LZ_HASH_BITS];
+	u32 ip = 0, anchor = 0, misses = 0;
+
+	memset(table, 0xff, sizeof(table));
+	while (len > LZ_MF_LIMIT && ip < len - LZ_MF_LIMIT) {
+		u32 seq = read32(in + ip), h = lz_hash(seq), ref = table[h], mlen;
+		table[h] = ip;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+			// skip faster through data that does not compress
+			ip += 1 + (misses++ >> 5);
+			continue;
+		}
+		misses = 0;
+		mlen = LZ_MIN_MATCH + match_len(in + ref + LZ_MIN_MATCH, in + ip + LZ_MIN_MATCH,
+			len - LZ_LAST_LITERALS - ip - LZ_MIN_MATCH);
+		op = put_seq(op, end, in + anchor, ip - anchor, ip - ref, mlen);
+		if (!op)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+	op = put_seq(op, end, in + anchor, len - anchor, 0, 0);
+	return op ? op - (u8*) dst : 0;
+}
+
+/* Reads the extra bytes of a length; returns -1 past the end of the input. */
+static inline int get_len(const u8** ip, const u8* end, u32* len) {
+	u8 b;
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/*
+ * Decompresses clen bytes at src into exactly len bytes at dst. Returns 0
+ * on success or -1 if the input is corrupt.
+ */
+int lz_decompress(const void* src, u32 clen, void* dst, u32 len) {
+	const u8 *ip = src, *iend = ip + clen;
+	u8 *op = dst, *oend = op + len;
+
+	while (ip < iend) {
+		u8 token = *ip++;
+		u32 nlit = token >> 4, mlen = token & 15, offset;
+		if (nlit == 15 && get_len(&ip, iend, &nlit))
+			return -1;
+		if (nlit > (u32) (iend - ip) || nlit > (u32) (oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == iend)
+			break;  // the last sequence has no match
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (mlen == 15 && get_len(&ip, iend, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (!offset || offset > (u32) (op - (u8*) dst) || mlen > (u32) (oend - op))
+			return -1;
+		if (offset >= mlen) {
+			memcpy(op, op - offset, mlen);
+			op += mlen;
+		}
+		else {
+			// overlapping match repeats the last offset bytes; every copy
+			// doubles the length of pattern available to the next one
+			const u8* ref = op - offset;
+			while (mlen) {
+				u32 n = op - ref < mlen ? op - ref : mlen;
+				memcpy(op, ref, n);
+				op += n;
+				mlen -= n;
+			}
+		}
+	}
+	return op == oend ? 0 : -1;
+}
@@ -5,8 +5,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <string.h>
+#include <getopt.h>
+#include <signal.h>
 
 #include "log.h"
 #include "transport.h"
@@ -14,6 +17,12 @@
 #include "discovery.h"
 #include "admin.h"
 #include "io.h"
+#include "stats.h"
+#include "metrics.h"
+#include "capture.h"
+#include "ns.h"
+#include "qos.h"
+#include "arb.h"
 
 
 /*
@@ -22,12 +31,13 @@
  * processing loop of the appropriate queue pair.
  */
 void* handle_connection(void* client_sock) {
-	sock_t socket = *((sock_t*) client_sock);
+	sock_t socket = (sock_t) (long) client_sock;
 	int err;
-	struct nvme_cmd* cmd;
-	struct nvme_connect_params* params;
+	struct nvme_cmd* cmd = NULL;
+	struct nvme_connect_params* params = NULL;
 	struct nvme_status status = {0};
 	log_info("Starting thread to handle new connection");
+	stats_conn_open();
 	
 	// establish PDU-level connection
 	err = init_connection(socket);
@@ -39,6 +49,8 @@ void* handle_connection(void* client_sock) {
 	
 	// receive commands until valid connection request is received
 	while (1) {
+		free(cmd);
+		free(params);
 		cmd = recv_cmd(socket, (void**) &params);
 		// print cmd
 		if (cmd) {
@@ -55,7 +67,7 @@ void* handle_connection(void* client_sock) {
 		status.cid = cmd->cid;
 
 		// check parameters, if valid start appropriate queue processing
-		if (cmd->opcode == OPC_FABRICS && cmd->nsid == FCTYPE_CONNECT) {
+		if (cmd->opcode == OPC_FABRICS && cmd->nsid == FCTYPE_CONNECT && params) {
 			log_info("Connect subnqn: %s", (char*) &(params->subnqn));
 			log_info("cmd opcode=0x%x, nsid=0x%x, qid=%u, subnqn=[%s]", 
 				cmd->opcode, cmd->nsid, cmd->cdw10 & 0xffff, params->subnqn);
@@ -67,14 +79,25 @@ void* handle_connection(void* client_sock) {
 			else if (!strcmp(SUBSYS_NQN, (char*) &(params->subnqn))) {
 				
 				u16 qid = (cmd->cdw10 >> 16) & 0xffff;
+				struct nvme_ctrl* ctrl = qid ? ctrl_get(params) : ctrl_create(params);
 				log_debug("qid: %d", qid);
-				if (qid == 0) {
-					start_admin_queue(socket, cmd);
+				if (!ctrl) {
+					log_warn("No controller %u for host %s", params->cntlid, params->hostnqn);
+					status.sf = make_sf(SCT_CMD_SPEC, SC_CONNECT_INVALID);
 				}
 				else {
-					start_io_queue(socket, cmd);
+					struct ctrl_queue queue;
+					ctrl_queue_add(ctrl, &queue, socket);
+					if (qid == 0) {
+						start_admin_queue(socket, cmd, ctrl);
+					}
+					else {
+						start_io_queue(socket, cmd, ctrl);
+					}
+					ctrl_queue_del(ctrl, &queue);
+					ctrl_put(ctrl);
+					break;
 				}
-				break;
 			}
 			else if (!strcmp(IO_NQN, (char*) &(params->subnqn))) {
 				log_warn("IO queue not implemented");
@@ -102,17 +125,176 @@ void* handle_connection(void* client_sock) {
 
 exit:
 	log_warn("Closing connection and terminating thread");
+	free(cmd);
+	free(params);
 	close(socket);
+	stats_conn_close();
 	return 0;
 }
 
+/*
+ * Waits for SIGUSR1 and writes a per-queue latency breakdown to stderr each
+ * time it is received.
+ */
+static void* report_main(void* arg) {
+	sigset_t* set = arg;
+	int sig;
+	while (!sigwait(set, &sig)) {
+		log_flush();
+		stats_report(stderr);
+	}
+	return NULL;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -p, --port PORT         listen on PORT (default %d)\n"
+		"  -n, --ns SPEC           add a namespace, TYPE[:OPTION,...] (default null:size=1G)\n"
+		"                          common options: size=BYTES, bs=BYTES, model (SSD timing\n"
+		"                          model; channels=, dies=, planes=, page=, ppb=, t_read=,\n"
+		"                          t_prog=, t_erase=, xfer=, wbuf=, op=, precondition)\n"
+		"                          null     reads return zeroes, writes are discarded\n"
+		"                          pattern  reads return a pattern of (NSID, LBA, generation);\n"
+		"                                   extent=BLOCKS, verify (check written data)\n"
+		"                          zns      zoned, in memory; zone=BYTES, zcap=BYTES, mar=N, mor=N\n"
+		"                          compress in memory, LZ-compressed in chunks; chunk=BYTES\n"
+		"                          dedup    in memory, identical blocks stored once\n"
+		"                          cow      in memory, thin; clones and snapshots are made at\n"
+		"                                   runtime with admin opcode 0xc0 (cdw10 bit 0: read-only)\n"
+		"                          stripe   striped over files or block devices, files=PATH:PATH:...,\n"
+		"                                   unit=BYTES (default 128K), workers=N\n"
+		"                          tier     hot extents moved to a fast tier; slow=PATH, fast=PATH\n"
+		"                                   (default in memory), fast_size=BYTES, extent=BYTES,\n"
+		"                                   migrate_bw=BYTES, hot=N\n"
+		"                          QoS limits: iops=N, bw=BYTES per second, burst=MS\n"
+		"                          metadata: ms=8, or pi=1|2|3 for protection information\n"
+		"                          mirroring: mirror=ADDR:PORT, mirror_nsid=N, mirror_mode=sync|\n"
+		"                          async, mirror_log=BYTES, mirror_conns=N, mirror_qd=N,\n"
+		"                          mirror_timeout=MS\n"
+		"                          read-ahead: readahead, ra_cache=BYTES, ra_seg=BYTES,\n"
+		"                          ra_max=BYTES, ra_streams=N, ra_workers=N\n"
+		"                          write coalescing: coalesce, coalesce_us=N, coalesce_max=BYTES\n"
+		"      --qos-host NQN,OPT  limit a host: iops=N, bw=BYTES, burst=MS, and a guaranteed\n"
+		"                          floor exempt from namespace limits: min_iops=N, min_bw=BYTES,\n"
+		"                          and an arbitration class: prio=urgent|high|medium|low\n"
+		"      --arb-slots N       arbitrate I/O across queues, N commands executing at once\n"
+		"      --arb-weights H,M,L commands the high, medium and low classes take per round\n"
+		"                          (default 8,4,1)\n"
+		"      --arb-burst AB      take up to 2^AB commands from a queue at a time, 7 for no\n"
+		"                          limit (default 3)\n"
+		"  -l, --log-level LEVEL   minimum runtime log level (0=trace .. 5=fatal)\n"
+		"  -A, --async-log         format and write log messages on a background thread\n"
+		"  -m, --metrics ADDR      serve Prometheus metrics on [HOST:]PORT or unix:PATH\n"
+		"  -c, --capture FILE      record every PDU header into a memory-mapped ring file\n"
+		"      --capture-slots N   capture ring size in 256-byte slots (default 65536)\n"
+		"      --capture-payload N sample up to N bytes of each PDU's data (default 0)\n"
+		"  -h, --help              show this help\n",
+		prog, PORT);
+}
+
 /*
  * Initializes a virtual namespace file and sets up a listener socket, then
  * launches new threads to handle each client connection.
  */
 int main(int argc, char** argv) {
-	int sockfd, err, client;
+	int sockfd, err, client, opt, one = 1, port = PORT;
+	const char* metrics_addr = NULL;
+	const char* capture_path = NULL;
+	u64 capture_slots = 65536;
+	u32 capture_payload = 0;
 	pthread_t thread;
+	static sigset_t report_set;
+	static const struct option longopts[] = {
+		{ "port",      required_argument, NULL, 'p' },
+		{ "ns",        required_argument, NULL, 'n' },
+		{ "log-level", required_argument, NULL, 'l' },
+		{ "async-log", no_argument,       NULL, 'A' },
+		{ "metrics",   required_argument, NULL, 'm' },
+		{ "capture",   required_argument, NULL, 'c' },
+		{ "capture-slots",   required_argument, NULL, 1000 },
+		{ "capture-payload", required_argument, NULL, 1001 },
+		{ "qos-host",  required_argument, NULL, 1002 },
+		{ "arb-slots", required_argument, NULL, 1003 },
+		{ "arb-weights", required_argument, NULL, 1004 },
+		{ "arb-burst", required_argument, NULL, 1005 },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "p:n:l:Am:c:h", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi(optarg);
+				discovery_set_port(port);
+				break;
+			case 'n':
+				if (ns_add(optarg) < 0)
+					return -1;
+				break;
+			case 'l':
+				log_set_level(atoi(optarg));
+				break;
+			case 'A':
+				if (log_set_async(1)) {
+					log_error("Failed to start asynchronous logging");
+					return -1;
+				}
+				break;
+			case 'm':
+				metrics_addr = optarg;
+				break;
+			case 'c':
+				capture_path = optarg;
+				break;
+			case 1000:
+				capture_slots = strtoul(optarg, NULL, 0);
+				break;
+			case 1001:
+				capture_payload = strtoul(optarg, NULL, 0);
+				break;
+			case 1002:
+				if (qos_host_add(optarg))
+					return -1;
+				break;
+			case 1003:
+				arb_init(strtoul(optarg, NULL, 0));
+				break;
+			case 1004: {
+				u32 high, medium, low;
+				if (sscanf(optarg, "%u,%u,%u", &high, &medium, &low) != 3) {
+					log_error("Invalid arbitration weights: %s", optarg);
+					return -1;
+				}
+				if (arb_set_weights(high, medium, low))
+					return -1;
+				break;
+			}
+			case 1005:
+				if (arb_set_burst(strtoul(optarg, NULL, 0)))
+					return -1;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if (!ns_max_nsid() && ns_add("null:size=1G") < 0)
+		return -1;
+
+	// all threads inherit the blocked SIGUSR1, only the reporter waits on it
+	sigemptyset(&report_set);
+	sigaddset(&report_set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &report_set, NULL);
+	if (pthread_create(&thread, NULL, report_main, &report_set)) {
+		log_error("Failed to create report thread");
+		return -1;
+	}
+	if (metrics_addr && metrics_start(metrics_addr))
+		return -1;
+	if (capture_path && capture_open(capture_path, capture_slots, capture_payload))
+		return -1;
 
 	// create listener socket
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -120,9 +302,10 @@ int main(int argc, char** argv) {
 		log_error("Socket creation error: %s", strerror(errno));
 		return -1;
 	}
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 	struct sockaddr_in addr = {
 		.sin_family = AF_INET,
-		.sin_port = htons(PORT),
+		.sin_port = htons(port),
 		.sin_addr.s_addr = INADDR_ANY,
 	};
 	err = bind(sockfd, (struct sockaddr*) &addr, sizeof(addr));
@@ -131,17 +314,23 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 	listen(sockfd, 16);
-	log_info("Listening on port %d", PORT);
+	log_info("Listening on port %d", port);
 
 	// accept new connections
 	while (1) {
 		client = accept(sockfd, NULL, NULL);
-		err = pthread_create(&thread, NULL, handle_connection, &client);
+		if (client < 0) {
+			log_warn("Accept failed: %s", strerror(errno));
+			continue;
+		}
+		// responses are single small writes, don't let Nagle hold them back
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		err = pthread_create(&thread, NULL, handle_connection, (void*) (long) client);
 		if (err) {
 			log_error("Failed to create new thread");
 			return -1;
 		}
-		sleep(1);
+		pthread_detach(thread);
 	}
 }
 
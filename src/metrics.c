@@ -0,0 +1,507 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "transport.h"
+#include "ctrl.h"
+#include "stats.h"
+#include "metrics.h"
+#include "ns.h"
+#include "qos.h"
+#include "mirror.h"
+#include "readahead.h"
+#include "coalesce.h"
+
+#define PREFIX "nvme_tcp_"
+
+static const struct counter_family {
+	const char* name;
+	const char* help;
+	size_t offset;
+} counters[] = {
+	{ "commands_total",      "Commands processed.",             offsetof(struct stats_counters, commands) },
+	{ "reads_total",         "Read commands processed.",        offsetof(struct stats_counters, reads) },
+	{ "writes_total",        "Write commands processed.",       offsetof(struct stats_counters, writes) },
+	{ "read_bytes_total",    "Bytes read by hosts.",            offsetof(struct stats_counters, read_bytes) },
+	{ "written_bytes_total", "Bytes written by hosts.",         offsetof(struct stats_counters, write_bytes) },
+	{ "allocs_total",        "Buffer allocations.",             offsetof(struct stats_counters, allocs) },
+	{ "alloc_bytes_total",   "Bytes allocated for buffers.",    offsetof(struct stats_counters, alloc_bytes) },
+	{ "throttled_total",     "Commands held back by QoS.",      offsetof(struct stats_counters, throttled) },
+};
+#define NR_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+struct ctrl_snapshot {
+	u16 cntlid;
+	u64 outstanding;
+	struct stats_counters sum;
+};
+
+struct snapshot {
+	struct ctrl_snapshot* ctrls;
+	int nr;
+	int cap;
+};
+
+static inline u64 counter(const struct stats_counters* c, size_t offset) {
+	return __atomic_load_n((const u64*) ((const char*) c + offset), __ATOMIC_RELAXED);
+}
+
+static void fprint_queue_labels(FILE* fp, const struct queue_stats* qs) {
+	fprintf(fp, "cntlid=\"%u\",qid=\"%u\",kind=\"%s\"", qs->cntlid, qs->qid,
+		stats_kind_name(qs->kind));
+}
+
+static void snapshot_ctrl(struct nvme_ctrl* ctrl, void* arg) {
+	struct snapshot* snap = arg;
+	struct ctrl_snapshot* cs;
+	if (snap->nr == snap->cap) {
+		int cap = snap->cap ? snap->cap * 2 : 16;
+		struct ctrl_snapshot* grown = realloc(snap->ctrls, cap * sizeof(*grown));
+		if (!grown)
+			return;
+		snap->ctrls = grown;
+		snap->cap = cap;
+	}
+	cs = &snap->ctrls[snap->nr++];
+	memset(cs, 0, sizeof(*cs));
+	cs->cntlid = ctrl->cntlid;
+	stats_sum(&cs->sum, ctrl->cntlid, &ctrl->retired);
+}
+
+static void snapshot_outstanding(const struct queue_stats* qs, void* arg) {
+	struct snapshot* snap = arg;
+	for (int i = 0; i < snap->nr; i++)
+		if (qs->kind != QUEUE_DISCOVERY && snap->ctrls[i].cntlid == qs->cntlid)
+			snap->ctrls[i].outstanding += __atomic_load_n(&qs->outstanding, __ATOMIC_RELAXED);
+}
+
+struct family_arg {
+	FILE* fp;
+	size_t offset;
+	const char* name;
+};
+
+static void write_queue_counter(const struct queue_stats* qs, void* arg) {
+	struct family_arg* fa = arg;
+	fprintf(fa->fp, PREFIX "queue_%s{", fa->name);
+	fprint_queue_labels(fa->fp, qs);
+	fprintf(fa->fp, "} %lu\n", counter(&qs->c, fa->offset));
+}
+
+static void write_queue_outstanding(const struct queue_stats* qs, void* arg) {
+	FILE* fp = ((struct family_arg*) arg)->fp;
+	fprintf(fp, PREFIX "queue_outstanding{");
+	fprint_queue_labels(fp, qs);
+	fprintf(fp, "} %lu\n", __atomic_load_n(&qs->outstanding, __ATOMIC_RELAXED));
+}
+
+static void write_queue_pdus(const struct queue_stats* qs, void* arg) {
+	FILE* fp = ((struct family_arg*) arg)->fp;
+	for (int dir = 0; dir < 2; dir++) {
+		const u64* pdus = dir ? qs->c.pdus_tx : qs->c.pdus_rx;
+		for (int type = 0; type < 16; type++) {
+			u64 n = __atomic_load_n(&pdus[type], __ATOMIC_RELAXED);
+			if (!n)
+				continue;
+			fprintf(fp, PREFIX "queue_pdus_total{");
+			fprint_queue_labels(fp, qs);
+			fprintf(fp, ",dir=\"%s\",type=\"%s\"} %lu\n", dir ? "tx" : "rx",
+				pdu_type_name(type), n);
+		}
+	}
+}
+
+static void write_queue_latency(const struct queue_stats* qs, void* arg) {
+	static const double quantiles[] = { 50, 99, 99.9 };
+	FILE* fp = ((struct family_arg*) arg)->fp;
+	for (int op = 0; op < 256; op++) {
+		const struct stats_opcode* ops = __atomic_load_n(&qs->opcodes[op], __ATOMIC_ACQUIRE);
+		const char* name;
+		if (!ops)
+			continue;
+		name = qs->kind == QUEUE_IO ? nvme_io_opcode_name(op) : nvme_opcode_name(op);
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			const struct hist* h = &ops->stages[s];
+			u64 count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+			if (!count)
+				continue;
+			for (int q = 0; q < 3; q++) {
+				fprintf(fp, PREFIX "queue_latency_seconds{");
+				fprint_queue_labels(fp, qs);
+				fprintf(fp, ",opcode=\"%s\",stage=\"%s\",quantile=\"%g\"} %.9f\n", name,
+					stats_stage_name(s), quantiles[q] / 100, hist_percentile(h, quantiles[q]) / 1e9);
+			}
+			fprintf(fp, PREFIX "queue_latency_seconds_sum{");
+			fprint_queue_labels(fp, qs);
+			fprintf(fp, ",opcode=\"%s\",stage=\"%s\"} %.9f\n", name, stats_stage_name(s),
+				__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+			fprintf(fp, PREFIX "queue_latency_seconds_count{");
+			fprint_queue_labels(fp, qs);
+			fprintf(fp, ",opcode=\"%s\",stage=\"%s\"} %lu\n", name, stats_stage_name(s), count);
+		}
+	}
+}
+
+static void fprint_qos_counter(FILE* fp, const struct qos_limit* lim, size_t offset) {
+	u64 n = __atomic_load_n((const u64*) ((const char*) lim + offset), __ATOMIC_RELAXED);
+	if (offset == offsetof(struct qos_limit, throttle_ns))
+		fprintf(fp, "%.9f\n", n / 1e9);
+	else
+		fprintf(fp, "%lu\n", n);
+}
+
+/*
+ * Writes a label value with backslash, double quote and newline escaped as
+ * the text format requires.
+ */
+static void fprint_label_value(FILE* fp, const char* v) {
+	for (; *v; v++) {
+		if (*v == '\\' || *v == '"')
+			fputc('\\', fp);
+		if (*v == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*v, fp);
+	}
+}
+
+static void write_qos_host(const char* hostnqn, const struct qos_limit* lim, void* arg) {
+	struct family_arg* fa = arg;
+	fprintf(fa->fp, PREFIX "qos_%s{host=\"", fa->name);
+	fprint_label_value(fa->fp, hostnqn);
+	fputs("\"} ", fa->fp);
+	fprint_qos_counter(fa->fp, lim, fa->offset);
+}
+
+/*
+ * Writes the space and codec time of every namespace that reduces data.
+ */
+static void write_reduction(FILE* fp) {
+	static const struct counter_family families[] = {
+		{ "logical_bytes",           "Host data held by the namespace.",
+			offsetof(struct ns_reduction, logical_bytes) },
+		{ "physical_bytes",          "Space the data takes after reduction.",
+			offsetof(struct ns_reduction, physical_bytes) },
+		{ "compress_seconds_total",  "Time spent compressing.",
+			offsetof(struct ns_reduction, compress_ns) },
+		{ "decompress_seconds_total", "Time spent decompressing.",
+			offsetof(struct ns_reduction, decompress_ns) },
+	};
+
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+		fprintf(fp, "# HELP " PREFIX "ns_%s %s\n", families[i].name, families[i].help);
+		fprintf(fp, "# TYPE " PREFIX "ns_%s %s\n", families[i].name, i < 2 ? "gauge" : "counter");
+		for (u32 nsid = 1; nsid <= ns_max_nsid(); nsid++) {
+			struct nvme_ns* ns = ns_get(nsid);
+			u64 n;
+			if (!ns || !ns->reduction)
+				continue;
+			n = __atomic_load_n((u64*) ((char*) ns->reduction + families[i].offset), __ATOMIC_RELAXED);
+			fprintf(fp, PREFIX "ns_%s{nsid=\"%u\"} ", families[i].name, nsid);
+			if (i < 2)
+				fprintf(fp, "%lu\n", n);
+			else
+				fprintf(fp, "%.9f\n", n / 1e9);
+		}
+	}
+}
+
+/*
+ * Writes the replication counters and lag of every mirrored namespace.
+ * Families before MIRROR_GAUGES are counters, the ones from it on gauges,
+ * and lag_seconds is kept in ns.
+ */
+#define MIRROR_GAUGES 3
+
+static void write_mirror(FILE* fp) {
+	static const struct counter_family families[] = {
+		{ "writes_total",   "Writes sent to the mirror peer.",
+			offsetof(struct mirror, writes) },
+		{ "errors_total",   "Writes the mirror peer failed or never received.",
+			offsetof(struct mirror, errors) },
+		{ "stalls_total",   "Async writes that waited for room in the replication log.",
+			offsetof(struct mirror, stalls) },
+		{ "lag_bytes",      "Async data not yet acknowledged by the mirror peer.",
+			offsetof(struct mirror, lag_bytes) },
+		{ "lag_writes",     "Async writes not yet acknowledged by the mirror peer.",
+			offsetof(struct mirror, lag_writes) },
+		{ "lag_seconds",    "Replication delay of the last async write.",
+			offsetof(struct mirror, lag_ns) },
+		{ "connections",    "Connections to the mirror peer still up.",
+			offsetof(struct mirror, connected) },
+	};
+
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+		fprintf(fp, "# HELP " PREFIX "mirror_%s %s\n", families[i].name, families[i].help);
+		fprintf(fp, "# TYPE " PREFIX "mirror_%s %s\n", families[i].name,
+			i < MIRROR_GAUGES ? "counter" : "gauge");
+		for (u32 nsid = 1; nsid <= ns_max_nsid(); nsid++) {
+			struct nvme_ns* ns = ns_get(nsid);
+			u64 n;
+			if (!ns || !ns->mirror)
+				continue;
+			n = __atomic_load_n((u64*) ((char*) ns->mirror + families[i].offset), __ATOMIC_RELAXED);
+			fprintf(fp, PREFIX "mirror_%s{nsid=\"%u\"} ", families[i].name, nsid);
+			if (families[i].offset == offsetof(struct mirror, lag_ns))
+				fprintf(fp, "%.9f\n", n / 1e9);
+			else
+				fprintf(fp, "%lu\n", n);
+		}
+	}
+}
+
+/*
+ * Writes the read-ahead counters of every namespace that has it.
+ */
+static void write_readahead(FILE* fp) {
+	static const struct counter_family families[] = {
+		{ "hits_total",             "Reads served from prefetched data.",
+			offsetof(struct readahead, hits) },
+		{ "misses_total",           "Reads of sequential streams that were not.",
+			offsetof(struct readahead, misses) },
+		{ "prefetched_bytes_total", "Data read ahead of sequential streams.",
+			offsetof(struct readahead, prefetched_bytes) },
+		{ "wasted_bytes_total",     "Prefetched data dropped before it was read.",
+			offsetof(struct readahead, wasted_bytes) },
+	};
+
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+		fprintf(fp, "# HELP " PREFIX "readahead_%s %s\n", families[i].name, families[i].help);
+		fprintf(fp, "# TYPE " PREFIX "readahead_%s counter\n", families[i].name);
+		for (u32 nsid = 1; nsid <= ns_max_nsid(); nsid++) {
+			struct nvme_ns* ns = ns_get(nsid);
+			if (!ns || !ns->ra)
+				continue;
+			fprintf(fp, PREFIX "readahead_%s{nsid=\"%u\"} %lu\n", families[i].name, nsid,
+				__atomic_load_n((u64*) ((char*) ns->ra + families[i].offset), __ATOMIC_RELAXED));
+		}
+	}
+}
+
+/*
+ * Writes how many backend writes the host writes of every namespace with
+ * write coalescing took.
+ */
+static void write_coalesce(FILE* fp) {
+	static const struct counter_family families[] = {
+		{ "writes_total",  "Host writes passed through the coalescer.",
+			offsetof(struct coalesce, writes) },
+		{ "batches_total", "Backend writes they were merged into.",
+			offsetof(struct coalesce, batches) },
+	};
+
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+		fprintf(fp, "# HELP " PREFIX "coalesce_%s %s\n", families[i].name, families[i].help);
+		fprintf(fp, "# TYPE " PREFIX "coalesce_%s counter\n", families[i].name);
+		for (u32 nsid = 1; nsid <= ns_max_nsid(); nsid++) {
+			struct nvme_ns* ns = ns_get(nsid);
+			if (!ns || !ns->coalesce)
+				continue;
+			fprintf(fp, PREFIX "coalesce_%s{nsid=\"%u\"} %lu\n", families[i].name, nsid,
+				__atomic_load_n((u64*) ((char*) ns->coalesce + families[i].offset), __ATOMIC_RELAXED));
+		}
+	}
+}
+
+/*
+ * Writes the throttling counters of every namespace and host with QoS
+ * limits.
+ */
+static void write_qos(FILE* fp) {
+	static const struct counter_family families[] = {
+		{ "throttled_total",        "Commands held back by a QoS limit.",
+			offsetof(struct qos_limit, throttled) },
+		{ "throttle_seconds_total", "Time commands were held back by a QoS limit.",
+			offsetof(struct qos_limit, throttle_ns) },
+	};
+	struct family_arg fa = { .fp = fp };
+
+	for (size_t i = 0; i < 2; i++) {
+		fprintf(fp, "# HELP " PREFIX "qos_%s %s\n", families[i].name, families[i].help);
+		fprintf(fp, "# TYPE " PREFIX "qos_%s counter\n", families[i].name);
+		for (u32 nsid = 1; nsid <= ns_max_nsid(); nsid++) {
+			struct nvme_ns* ns = ns_get(nsid);
+			if (!ns || !ns->qos)
+				continue;
+			fprintf(fp, PREFIX "qos_%s{nsid=\"%u\"} ", families[i].name, nsid);
+			fprint_qos_counter(fp, ns->qos, families[i].offset);
+		}
+		fa.name = families[i].name;
+		fa.offset = families[i].offset;
+		qos_host_for_each(write_qos_host, &fa);
+	}
+}
+
+/*
+ * Writes all connection, controller and queue metrics to fp in the
+ * Prometheus text exposition format.
+ */
+void metrics_write(FILE* fp) {
+	struct snapshot snap = { 0 };
+	struct family_arg fa = { .fp = fp };
+	u64 total, active;
+
+	stats_conns(&total, &active);
+	fprintf(fp, "# HELP " PREFIX "connections_total Connections accepted.\n");
+	fprintf(fp, "# TYPE " PREFIX "connections_total counter\n");
+	fprintf(fp, PREFIX "connections_total %lu\n", total);
+	fprintf(fp, "# HELP " PREFIX "connections_active Connections currently open.\n");
+	fprintf(fp, "# TYPE " PREFIX "connections_active gauge\n");
+	fprintf(fp, PREFIX "connections_active %lu\n", active);
+
+	ctrl_for_each(snapshot_ctrl, &snap);
+	stats_for_each(snapshot_outstanding, &snap);
+	fprintf(fp, "# HELP " PREFIX "controllers_active Controllers currently connected.\n");
+	fprintf(fp, "# TYPE " PREFIX "controllers_active gauge\n");
+	fprintf(fp, PREFIX "controllers_active %d\n", snap.nr);
+
+	for (size_t i = 0; i < NR_COUNTERS; i++) {
+		fprintf(fp, "# HELP " PREFIX "ctrl_%s %s\n", counters[i].name, counters[i].help);
+		fprintf(fp, "# TYPE " PREFIX "ctrl_%s counter\n", counters[i].name);
+		for (int c = 0; c < snap.nr; c++)
+			fprintf(fp, PREFIX "ctrl_%s{cntlid=\"%u\"} %lu\n", counters[i].name,
+				snap.ctrls[c].cntlid, counter(&snap.ctrls[c].sum, counters[i].offset));
+	}
+	fprintf(fp, "# HELP " PREFIX "ctrl_outstanding Commands in flight.\n");
+	fprintf(fp, "# TYPE " PREFIX "ctrl_outstanding gauge\n");
+	for (int c = 0; c < snap.nr; c++)
+		fprintf(fp, PREFIX "ctrl_outstanding{cntlid=\"%u\"} %lu\n", snap.ctrls[c].cntlid,
+			snap.ctrls[c].outstanding);
+	free(snap.ctrls);
+
+	for (size_t i = 0; i < NR_COUNTERS; i++) {
+		fprintf(fp, "# HELP " PREFIX "queue_%s %s\n", counters[i].name, counters[i].help);
+		fprintf(fp, "# TYPE " PREFIX "queue_%s counter\n", counters[i].name);
+		fa.name = counters[i].name;
+		fa.offset = counters[i].offset;
+		stats_for_each(write_queue_counter, &fa);
+	}
+	fprintf(fp, "# HELP " PREFIX "queue_outstanding Commands in flight.\n");
+	fprintf(fp, "# TYPE " PREFIX "queue_outstanding gauge\n");
+	stats_for_each(write_queue_outstanding, &fa);
+	fprintf(fp, "# HELP " PREFIX "queue_pdus_total PDUs by direction and type.\n");
+	fprintf(fp, "# TYPE " PREFIX "queue_pdus_total counter\n");
+	stats_for_each(write_queue_pdus, &fa);
+	fprintf(fp, "# HELP " PREFIX "queue_latency_seconds Command latency by opcode and stage.\n");
+	fprintf(fp, "# TYPE " PREFIX "queue_latency_seconds summary\n");
+	stats_for_each(write_queue_latency, &fa);
+	write_qos(fp);
+	write_reduction(fp);
+	write_mirror(fp);
+	write_readahead(fp);
+	write_coalesce(fp);
+}
+
+static void serve(int client) {
+	char req[4096], *body = NULL, hdr[160];
+	size_t len = 0;
+	int hlen, n;
+	FILE* fp;
+
+	// the request itself does not matter, every path returns the metrics
+	n = recv(client, req, sizeof(req), 0);
+	if (n <= 0)
+		return;
+	fp = open_memstream(&body, &len);
+	if (!fp)
+		return;
+	metrics_write(fp);
+	fclose(fp);
+
+	hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	if (send(client, hdr, hlen, MSG_NOSIGNAL) == hlen)
+		send(client, body, len, MSG_NOSIGNAL);
+	free(body);
+}
+
+/* A scrape that stalls this long is dropped so it cannot hold up the others. */
+#define METRICS_TIMEOUT_SEC  5
+
+static void* metrics_main(void* arg) {
+	int sockfd = (int) (long) arg, client;
+	struct timeval tv = { .tv_sec = METRICS_TIMEOUT_SEC };
+	while (1) {
+		client = accept(sockfd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			log_warn("Metrics accept failed: %s", strerror(errno));
+			continue;
+		}
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		serve(client);
+		close(client);
+	}
+	return NULL;
+}
+
+/*
+ * Starts a thread serving Prometheus text-format metrics over HTTP. addr is
+ * either "unix:PATH" for a Unix domain socket or "[HOST:]PORT" for TCP, with
+ * HOST defaulting to 127.0.0.1. Returns 0 on success or -1 on error.
+ */
+int metrics_start(const char* addr) {
+	int sockfd, err, one = 1;
+	pthread_t thread;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		struct sockaddr_un un = { .sun_family = AF_UNIX };
+		strncpy(un.sun_path, addr + 5, sizeof(un.sun_path) - 1);
+		sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sockfd < 0)
+			goto fail;
+		unlink(un.sun_path);
+		err = bind(sockfd, (struct sockaddr*) &un, sizeof(un));
+	}
+	else {
+		struct sockaddr_in in = { .sin_family = AF_INET };
+		const char* port = strrchr(addr, ':');
+		char host[64] = "127.0.0.1";
+		if (port) {
+			snprintf(host, sizeof(host), "%.*s", (int) (port - addr), addr);
+			port++;
+		}
+		else
+			port = addr;
+		in.sin_port = htons(atoi(port));
+		if (inet_pton(AF_INET, host, &in.sin_addr) != 1) {
+			log_error("Invalid metrics address: %s", addr);
+			return -1;
+		}
+		sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sockfd < 0)
+			goto fail;
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		err = bind(sockfd, (struct sockaddr*) &in, sizeof(in));
+	}
+	if (err || listen(sockfd, 16))
+		goto fail_close;
+
+	if (pthread_create(&thread, NULL, metrics_main, (void*) (long) sockfd)) {
+		log_error("Failed to create metrics thread");
+		close(sockfd);
+		return -1;
+	}
+	pthread_detach(thread);
+	log_info("Serving metrics on %s", addr);
+	return 0;
+
+fail_close:
+	close(sockfd);
+fail:
+	log_error("Metrics endpoint %s: %s", addr, strerror(errno));
+	return -1;
+}
@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "clock.h"
+#include "host.h"
+#include "ns.h"
+#include "mirror.h"
+
+#define MIRROR_REGION_SHIFT 20  /* bytes per routing region, log2 */
+
+/*
+ * A write being replicated. It is split at region boundaries into parts
+ * that may go over different connections, and completes with the last.
+ */
+struct mirror_io {
+	struct mirror_write* w;
+	struct mirror_io* next;
+	u64 lba;
+	u32 nlb;
+	u8* data;
+};
+
+struct mirror_write {
+	void* buf;
+	u64 bytes;
+	u64 submitted;
+	void (*done)(void* arg, u16 sf);
+	void* arg;
+	u32 parts;
+	u16 sf;
+	int lagged;                 /* counted in the replication log */
+	struct mirror_io ios[];
+};
+
+struct mirror_conn {
+	struct mirror* m;
+	sock_t socket;
+	pthread_t sender;
+	pthread_t receiver;
+	int running;                /* sender and receiver started */
+	pthread_mutex_t send_lock;  /* held across taking a write off the queue and sending it */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;        /* work queued or a command slot freed */
+	int dead;
+	struct mirror_io* head;     /* queued, not yet sent */
+	struct mirror_io* tail;
+	struct mirror_io** inflight;  /* by CID */
+	u16* free_cids;
+	u32 nr_free;
+};
+
+static void mirror_io_finish(struct mirror* m, struct mirror_io* io, u16 sf) {
+	struct mirror_write* w = io->w;
+	if (sf)
+		__atomic_store_n(&w->sf, sf, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&w->parts, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (w->sf)
+		__atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+	if (w->done) {
+		w->done(w->arg, w->sf);
+	}
+	else if (w->lagged) {
+		__atomic_sub_fetch(&m->lag_bytes, w->bytes, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&m->lag_writes, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&m->lag_ns, clock_ns() - w->submitted, __ATOMIC_RELAXED);
+	}
+	free(w->buf);
+	free(w);
+}
+
+/*
+ * Takes a connection down and completes everything queued on it or in
+ * flight without the peer. Later writes routed to it complete the same way.
+ * Call without send_lock held.
+ */
+static void mirror_conn_fail(struct mirror_conn* c) {
+	struct mirror* m = c->m;
+	struct mirror_io* list;
+	u32 lost = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->dead) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	c->dead = 1;
+	list = c->head;
+	c->head = c->tail = NULL;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	__atomic_sub_fetch(&m->connected, 1, __ATOMIC_RELAXED);
+	log_error("Mirror connection to the peer failed, replication degraded");
+	shutdown(c->socket, SHUT_RDWR);  // wakes the other thread of the connection
+
+	// a write still being sent is in flight too; wait for its sender to let go
+	pthread_mutex_lock(&c->send_lock);
+	pthread_mutex_lock(&c->lock);
+	for (u32 cid = 0; cid < m->qd; cid++) {
+		if (c->inflight[cid]) {
+			c->inflight[cid]->next = list;
+			list = c->inflight[cid];
+			c->inflight[cid] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_unlock(&c->send_lock);
+	while (list) {
+		struct mirror_io* next = list->next;
+		mirror_io_finish(m, list, 0);
+		list = next;
+		lost++;
+	}
+	__atomic_add_fetch(&m->errors, lost, __ATOMIC_RELAXED);
+}
+
+/*
+ * Takes the first queued write and a free CID, if there are both. Call
+ * with lock held.
+ */
+static struct mirror_io* mirror_take(struct mirror_conn* c, u16* cid) {
+	struct mirror_io* io = c->head;
+	if (c->dead || !io || !c->nr_free)
+		return NULL;
+	c->head = io->next;
+	if (!c->head)
+		c->tail = NULL;
+	*cid = c->free_cids[--c->nr_free];
+	c->inflight[*cid] = io;
+	return io;
+}
+
+/*
+ * Sends io as command cid. Call with send_lock held. Returns 0 on success
+ * or -1 if the connection failed.
+ */
+static int mirror_send(struct mirror_conn* c, struct mirror_io* io, u16 cid) {
+	struct mirror* m = c->m;
+	struct nvme_cmd cmd = {
+		.opcode = IO_CMD_WRITE,
+		.cid    = cid,
+		.nsid   = m->nsid,
+		.cdw10  = io->lba & 0xffffffff,
+		.cdw11  = io->lba >> 32,
+		.cdw12  = io->nlb - 1,
+	};
+	return host_send_cmd(c->socket, &cmd, io->data, io->nlb << m->lba_shift);
+}
+
+/*
+ * Sends the writes that could not be sent right away, because the
+ * connection was busy sending or out of CIDs, in queue order.
+ */
+static void* mirror_sender_main(void* arg) {
+	struct mirror_conn* c = arg;
+	int err = 0;
+
+	while (!err) {
+		struct mirror_io* io;
+		u16 cid;
+
+		pthread_mutex_lock(&c->lock);
+		while (!c->dead && (!c->head || !c->nr_free))
+			pthread_cond_wait(&c->cond, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+		if (c->dead)
+			break;
+
+		pthread_mutex_lock(&c->send_lock);
+		do {
+			pthread_mutex_lock(&c->lock);
+			io = mirror_take(c, &cid);
+			pthread_mutex_unlock(&c->lock);
+		} while (io && !(err = mirror_send(c, io, cid)));
+		pthread_mutex_unlock(&c->send_lock);
+	}
+	mirror_conn_fail(c);
+	return NULL;
+}
+
+/*
+ * Returns whether c has writes the peer has not acknowledged yet.
+ */
+static int mirror_busy(struct mirror_conn* c) {
+	int busy;
+	pthread_mutex_lock(&c->lock);
+	busy = c->head || c->nr_free < c->m->qd;
+	pthread_mutex_unlock(&c->lock);
+	return busy;
+}
+
+static void* mirror_receiver_main(void* arg) {
+	struct mirror_conn* c = arg;
+	struct mirror* m = c->m;
+	struct pollfd pfd = { .fd = c->socket, .events = POLLIN };
+	void *psh, *data;
+	int type, waited = 0;
+
+	while (1) {
+		int ready = poll(&pfd, 1, m->timeout_ms);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready < 0)
+			break;
+		// a peer that stops answering without closing would hold the
+		// writes waiting for it, and the queues they belong to, forever:
+		// fail it once writes went a whole timeout without an answer
+		if (!ready) {
+			if (!mirror_busy(c))
+				waited = 0;
+			else if (waited++) {
+				log_error("Mirror peer did not answer for %u ms", m->timeout_ms);
+				break;
+			}
+			continue;
+		}
+		waited = 0;
+		if ((type = recv_pdu(c->socket, &psh, &data)) < 0)
+			break;
+		if (type == PDU_TYPE_RESP && psh) {
+			struct nvme_status* st = psh;
+			struct mirror_io* io = NULL;
+
+			pthread_mutex_lock(&c->lock);
+			if (st->cid < m->qd && (io = c->inflight[st->cid])) {
+				c->inflight[st->cid] = NULL;
+				c->free_cids[c->nr_free++] = st->cid;
+				pthread_cond_signal(&c->cond);
+			}
+			pthread_mutex_unlock(&c->lock);
+			if (io)
+				mirror_io_finish(m, io, st->sf);
+		}
+		free(psh);
+		free(data);
+	}
+	mirror_conn_fail(c);
+	return NULL;
+}
+
+/*
+ * Queues io on c. If nothing is queued ahead of it and the connection is
+ * idle, the calling thread sends it itself, saving the hand-over to the
+ * sender thread.
+ */
+static void mirror_queue(struct mirror_conn* c, struct mirror_io* io) {
+	if (!pthread_mutex_trylock(&c->send_lock)) {
+		u16 cid;
+		pthread_mutex_lock(&c->lock);
+		if (!c->head && c->nr_free && !c->dead) {
+			c->head = c->tail = io;
+			io->next = NULL;
+			mirror_take(c, &cid);
+			pthread_mutex_unlock(&c->lock);
+			if (mirror_send(c, io, cid)) {
+				pthread_mutex_unlock(&c->send_lock);
+				mirror_conn_fail(c);
+				return;
+			}
+			pthread_mutex_unlock(&c->send_lock);
+			return;
+		}
+		pthread_mutex_unlock(&c->lock);
+		pthread_mutex_unlock(&c->send_lock);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	if (c->dead) {
+		pthread_mutex_unlock(&c->lock);
+		__atomic_add_fetch(&c->m->errors, 1, __ATOMIC_RELAXED);
+		mirror_io_finish(c->m, io, 0);
+		return;
+	}
+	io->next = NULL;
+	if (c->tail)
+		c->tail->next = io;
+	else
+		c->head = io;
+	c->tail = io;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Replicates nlb blocks at lba from buf. Returns 1 if done will be called
+ * once the peer has them, or 0 if the write can complete now.
+ */
+int mirror_submit(struct mirror* m, void* buf, u64 lba, u32 nlb,
+		void (*done)(void* arg, u16 sf), void* arg) {
+	u64 bytes = (u64) nlb << m->lba_shift;
+	u64 first = lba >> m->region_shift;
+	u32 parts = ((lba + nlb - 1) >> m->region_shift) - first + 1;
+	struct mirror_write* w = malloc(sizeof(*w) + parts * sizeof(w->ios[0]));
+	int wait = done != NULL;
+
+	if (!w) {
+		log_warn("malloc failed (mirror write)");
+		__atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+		free(buf);
+		return 0;
+	}
+	w->buf = buf;
+	w->bytes = bytes;
+	w->submitted = clock_ns();
+	w->done = done;
+	w->arg = arg;
+	w->parts = parts;
+	w->sf = 0;
+	w->lagged = 0;
+	if (wait && m->mode == MIRROR_ASYNC) {
+		u64 lag = __atomic_load_n(&m->lag_bytes, __ATOMIC_RELAXED);
+		do {
+			if (lag + bytes > m->log_max)
+				break;
+		} while (!__atomic_compare_exchange_n(&m->lag_bytes, &lag, lag + bytes, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		if (lag + bytes <= m->log_max) {
+			__atomic_add_fetch(&m->lag_writes, 1, __ATOMIC_RELAXED);
+			w->lagged = 1;
+			w->done = NULL;
+			wait = 0;
+		}
+		else {
+			__atomic_add_fetch(&m->stalls, 1, __ATOMIC_RELAXED);
+		}
+	}
+	else if (!wait) {
+		w->done = NULL;
+	}
+	__atomic_add_fetch(&m->writes, 1, __ATOMIC_RELAXED);
+
+	// w may be gone as soon as its last part is queued
+	for (u32 i = 0; i < parts; i++) {
+		struct mirror_io* io = &w->ios[i];
+		u64 start = i ? (first + i) << m->region_shift : lba;
+		u64 end = (first + i + 1) << m->region_shift;
+		io->w = w;
+		io->lba = start;
+		io->nlb = (end < lba + nlb ? end : lba + nlb) - start;
+		io->data = (u8*) buf + ((start - lba) << m->lba_shift);
+	}
+	for (u32 i = 0; i < parts; i++)
+		mirror_queue(&m->conns[(first + i) % m->nr_conns], &w->ios[i]);
+	return wait;
+}
+
+/*
+ * Brings up the admin queue on the peer and checks that its namespace can
+ * hold ns. Returns the admin socket, which stays open for the peer's
+ * controller to live on, or -1 on error.
+ */
+static sock_t mirror_connect_admin(struct mirror* m, const struct nvme_ns* ns,
+		const char* addr, int port, u16* cntlid) {
+	struct nvme_id_ns* id_ns = calloc(1, NVME_ID_NS_LEN);
+	struct nvme_cmd cmd = {
+		.opcode = OPC_IDENTIFY,
+		.nsid   = m->nsid,
+		.cdw10  = CNS_ID_NS,
+	};
+	sock_t sock = host_open(addr, port);
+
+	if (sock < 0 || !id_ns || host_connect(sock, SUBSYS_NQN, MIRROR_NQN, 0, 32, 0xffff, 0, cntlid) ||
+	    host_enable(sock) || host_admin_cmd(sock, &cmd, id_ns, NVME_ID_NS_LEN)) {
+		log_error("Mirror peer %s:%d: admin queue setup failed", addr, port);
+		goto err;
+	}
+	if (id_ns->lbaf[id_ns->flbas & 0xf].ds != ns->lba_shift || id_ns->nsze < ns->nsze) {
+		log_error("Mirror peer %s:%d: namespace %u has a different block size or is too small",
+			addr, port, m->nsid);
+		goto err;
+	}
+	free(id_ns);
+	return sock;
+
+err:
+	free(id_ns);
+	if (sock >= 0)
+		close(sock);
+	return -1;
+}
+
+/*
+ * Stops the threads of m, closes its connections and frees it. Only for a
+ * mirror that never had writes submitted.
+ */
+void mirror_destroy(struct mirror* m) {
+	for (u32 i = 0; m->conns && i < m->nr_conns; i++) {
+		struct mirror_conn* c = &m->conns[i];
+		if (c->running) {
+			// marked dead first so that going down is not reported as a failure
+			pthread_mutex_lock(&c->lock);
+			c->dead = 1;
+			pthread_cond_broadcast(&c->cond);
+			pthread_mutex_unlock(&c->lock);
+			shutdown(c->socket, SHUT_RDWR);
+			pthread_join(c->sender, NULL);
+			pthread_join(c->receiver, NULL);
+			pthread_mutex_destroy(&c->send_lock);
+			pthread_mutex_destroy(&c->lock);
+			pthread_cond_destroy(&c->cond);
+		}
+		if (c->socket >= 0)
+			close(c->socket);
+		free(c->inflight);
+		free(c->free_cids);
+	}
+	if (m->admin >= 0)
+		close(m->admin);
+	free(m->conns);
+	free(m);
+}
+
+/*
+ * Connects to the peer named in the options of ns. Returns NULL on error.
+ */
+struct mirror* mirror_create(const struct nvme_ns* ns, const char* opts) {
+	const char* peer = ns_opt(opts, "mirror");
+	const char* mode = ns_opt(opts, "mirror_mode");
+	char addr[64];
+	size_t len = peer ? strcspn(peer, ",") : 0;
+	const char* colon = peer ? memchr(peer, ':', len) : NULL;
+	struct mirror* m;
+	sigset_t all, old;
+	u16 cntlid;
+	int port;
+
+	if (!colon || colon - peer >= (long) sizeof(addr)) {
+		log_error("Mirror peer must be given as mirror=ADDR:PORT");
+		return NULL;
+	}
+	memcpy(addr, peer, colon - peer);
+	addr[colon - peer] = 0;
+	port = atoi(colon + 1);
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	m->mode = mode && !strncmp(mode, "async", 5) ? MIRROR_ASYNC : MIRROR_SYNC;
+	m->nsid = ns_opt_u64(opts, "mirror_nsid", ns->nsid);
+	m->lba_shift = ns->lba_shift;
+	m->region_shift = MIRROR_REGION_SHIFT > ns->lba_shift ? MIRROR_REGION_SHIFT - ns->lba_shift : 0;
+	m->log_max = ns_opt_u64(opts, "mirror_log", 64 << 20);
+	m->nr_conns = ns_opt_u64(opts, "mirror_conns", 4);
+	m->qd = ns_opt_u64(opts, "mirror_qd", 32);
+	m->timeout_ms = ns_opt_u64(opts, "mirror_timeout", 10000);
+	if (mode && m->mode == MIRROR_SYNC && strncmp(mode, "sync", 4)) {
+		log_error("Mirror mode must be sync or async");
+		free(m);
+		return NULL;
+	}
+	if (!m->nr_conns || m->nr_conns > 64 || !m->qd || m->qd > 1024 || !m->timeout_ms) {
+		log_error("Mirror needs 1-64 connections with a queue depth of 1-1024 and a timeout");
+		free(m);
+		return NULL;
+	}
+	m->admin = mirror_connect_admin(m, ns, addr, port, &cntlid);
+	m->conns = calloc(m->nr_conns, sizeof(*m->conns));
+	for (u32 i = 0; m->conns && i < m->nr_conns; i++)
+		m->conns[i].socket = -1;
+	if (m->admin < 0 || !m->conns) {
+		mirror_destroy(m);
+		return NULL;
+	}
+
+	for (u32 i = 0; i < m->nr_conns; i++) {
+		struct mirror_conn* c = &m->conns[i];
+		c->m = m;
+		c->inflight = calloc(m->qd, sizeof(*c->inflight));
+		c->free_cids = calloc(m->qd, sizeof(*c->free_cids));
+		c->socket = host_open(addr, port);
+		if (!c->inflight || !c->free_cids || c->socket < 0 ||
+		    host_connect(c->socket, SUBSYS_NQN, MIRROR_NQN, i + 1, m->qd + 1, cntlid, 0, NULL)) {
+			log_error("Mirror peer %s:%d: I/O queue %u setup failed", addr, port, i + 1);
+			mirror_destroy(m);
+			return NULL;
+		}
+		for (u32 cid = 0; cid < m->qd; cid++)
+			c->free_cids[cid] = cid;
+		c->nr_free = m->qd;
+		pthread_mutex_init(&c->send_lock, NULL);
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		// mirror threads take no signals, SIGUSR1 is for the report thread
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		pthread_create(&c->sender, NULL, mirror_sender_main, c);
+		pthread_create(&c->receiver, NULL, mirror_receiver_main, c);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		c->running = 1;
+		m->connected++;
+	}
+
+	log_info("Namespace %u: mirrored %s to namespace %u at %s:%d over %u connections",
+		ns->nsid, m->mode == MIRROR_ASYNC ? "asynchronously" : "synchronously",
+		m->nsid, addr, port, m->nr_conns);
+	return m;
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+
+#include "log.h"
+#include "ns.h"
+#include "model.h"
+
+static inline u64 max_u64(u64 a, u64 b) {
+	return a > b ? a : b;
+}
+
+/* Time the channel bus needs to move bytes between controller and die. */
+static inline u64 xfer_ns(const struct model* m, u64 bytes) {
+	return bytes * 1000 / m->xfer_mbps;
+}
+
+/*
+ * Creates a model for ns from the options of its spec. Returns NULL on
+ * error.
+ */
+struct model* model_create(const struct nvme_ns* ns, const char* opts) {
+	struct model* m = calloc(1, sizeof(*m));
+	u64 page, planes, dies, wbuf, op, phys_pages, valid, interval;
+	if (!m)
+		return NULL;
+
+	m->channels  = ns_opt_u64(opts, "channels", 8);
+	dies         = ns_opt_u64(opts, "dies", 4);
+	planes       = ns_opt_u64(opts, "planes", 2);
+	page         = ns_opt_u64(opts, "page", 16 << 10);
+	m->ppb       = ns_opt_u64(opts, "ppb", 256);
+	m->t_read    = ns_opt_u64(opts, "t_read", 50) * 1000;
+	m->t_prog    = ns_opt_u64(opts, "t_prog", 500) * 1000;
+	m->t_erase   = ns_opt_u64(opts, "t_erase", 3000) * 1000;
+	m->xfer_mbps = ns_opt_u64(opts, "xfer", 800);
+	wbuf         = ns_opt_u64(opts, "wbuf", 16 << 20);
+	op           = ns_opt_u64(opts, "op", 25);
+	if (!m->channels || !dies || !planes || !page || !m->ppb || !m->xfer_mbps ||
+	    op < 1 || op > 100) {
+		log_error("Invalid device model parameters");
+		free(m);
+		return NULL;
+	}
+	m->nr_dies = m->channels * dies;
+	m->page_bytes = page * planes;
+	m->lba_shift = ns->lba_shift;
+
+	/*
+	 * Steady-state greedy garbage collection under uniform random writes
+	 * has a write amplification of about (1 + op) / (2 op), so a reclaimed
+	 * block still holds a fraction (1 - op) / (1 + op) of valid pages that
+	 * have to be copied, and it frees the rest for host writes.
+	 */
+	phys_pages = ((ns->nsze << ns->lba_shift) / m->page_bytes) * (100 + op) / 100;
+	m->free_pages = phys_pages / m->nr_dies;
+	valid = m->ppb * (100 - op) / (100 + op);
+	interval = m->ppb - valid;
+	m->gc_stall = m->t_erase + valid * (m->t_read + m->t_prog + 2 * xfer_ns(m, m->page_bytes));
+	m->ppb = interval ? interval : 1;  // from here on: host pages per reclaimed block
+
+	m->chan_busy = calloc(m->channels, sizeof(*m->chan_busy));
+	m->dies = calloc(m->nr_dies, sizeof(*m->dies));
+	m->wbuf_slots = wbuf / m->page_bytes;
+	m->wbuf = calloc(m->wbuf_slots ? m->wbuf_slots : 1, sizeof(*m->wbuf));
+	if (!m->chan_busy || !m->dies || !m->wbuf) {
+		free(m->chan_busy);
+		free(m->dies);
+		free(m->wbuf);
+		free(m);
+		return NULL;
+	}
+	if (ns_opt(opts, "precondition"))
+		for (u32 i = 0; i < m->nr_dies; i++)
+			m->dies[i].programmed = m->free_pages;
+	pthread_mutex_init(&m->lock, NULL);
+
+	log_info("Namespace %u device model: %u dies on %u channels, %lu-byte pages, "
+		"read %luus, program %luus, GC stall %luus every %u pages per die",
+		ns->nsid, m->nr_dies, m->channels, m->page_bytes, m->t_read / 1000,
+		m->t_prog / 1000, m->gc_stall / 1000, m->ppb);
+	return m;
+}
+
+/*
+ * Programs one page at the write point, no earlier than at. Returns the
+ * time the program completes; a garbage-collection cycle it triggers keeps
+ * the die busy beyond that.
+ */
+static u64 model_program(struct model* m, u64 at) {
+	u32 die = m->next_die++ % m->nr_dies;
+	struct model_die* d = &m->dies[die];
+	u64* chan = &m->chan_busy[die % m->channels];
+	u64 x = max_u64(at, *chan), done;
+
+	*chan = x + xfer_ns(m, m->page_bytes);
+	done = max_u64(*chan, d->busy_until) + m->t_prog;
+	d->busy_until = done;
+	d->programmed++;
+	if (d->programmed > m->free_pages && !((d->programmed - m->free_pages) % m->ppb))
+		d->busy_until += m->gc_stall;
+	m->last_program = max_u64(m->last_program, done);
+	return done;
+}
+
+static u64 model_read(struct model* m, u64 off, u64 len, u64 now) {
+	u64 complete = now;
+	while (len) {
+		u64 page = off / m->page_bytes;
+		u64 bytes = m->page_bytes - off % m->page_bytes;
+		u32 die = page % m->nr_dies;
+		struct model_die* d = &m->dies[die];
+		u64* chan = &m->chan_busy[die % m->channels];
+		u64 sensed, done;
+
+		if (bytes > len)
+			bytes = len;
+		sensed = max_u64(now, d->busy_until) + m->t_read;
+		done = max_u64(sensed, *chan) + xfer_ns(m, bytes);
+		*chan = done;
+		d->busy_until = done;
+		complete = max_u64(complete, done);
+		off += bytes;
+		len -= bytes;
+	}
+	return complete;
+}
+
+static u64 model_write(struct model* m, u64 len, u64 now) {
+	u64 complete = now;
+	if (!m->wbuf_slots) {
+		for (u64 pages = (len + m->page_bytes - 1) / m->page_bytes; pages; pages--)
+			complete = max_u64(complete, model_program(m, now));
+		return complete;
+	}
+
+	// data enters the buffer once the slot's previous page is on flash
+	m->partial += len;
+	while (m->partial >= m->page_bytes) {
+		u64* slot = &m->wbuf[m->programs++ % m->wbuf_slots];
+		u64 at = max_u64(now, *slot);
+		m->partial -= m->page_bytes;
+		complete = max_u64(complete, at);
+		*slot = model_program(m, at);
+	}
+	return complete;
+}
+
+/*
+ * Accounts a read or write of nlb blocks at lba submitted at now and
+ * returns the time at which it completes.
+ */
+u64 model_submit(struct model* m, int write, u64 lba, u32 nlb, u64 now) {
+	u64 len = (u64) nlb << m->lba_shift, complete;
+	pthread_mutex_lock(&m->lock);
+	if (write)
+		complete = model_write(m, len, now);
+	else
+		complete = model_read(m, lba << m->lba_shift, len, now);
+	pthread_mutex_unlock(&m->lock);
+	return complete;
+}
+
+/*
+ * Returns the time at which everything buffered before now is on flash. A
+ * partially filled page is programmed padded.
+ */
+u64 model_flush(struct model* m, u64 now) {
+	u64 complete;
+	pthread_mutex_lock(&m->lock);
+	if (m->partial) {
+		m->partial = 0;
+		if (m->wbuf_slots)
+			m->wbuf[m->programs++ % m->wbuf_slots] = model_program(m, now);
+	}
+	complete = max_u64(now, m->last_program);
+	pthread_mutex_unlock(&m->lock);
+	return complete;
+}
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "log.h"
+#include "ns.h"
+#include "model.h"
+#include "qos.h"
+#include "mirror.h"
+#include "readahead.h"
+#include "coalesce.h"
+#include "rangelock.h"
+
+static const struct ns_type* ns_types[] = {
+	&ns_null_type,
+	&ns_pattern_type,
+	&ns_zns_type,
+	&ns_compress_type,
+	&ns_dedup_type,
+	&ns_cow_type,
+	&ns_stripe_type,
+	&ns_tier_type,
+};
+
+static struct nvme_ns* ns_table[NS_MAX];
+static u32 max_nsid;
+static pthread_mutex_t ns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Looks up key in a comma-separated option list. Returns a pointer to its
+ * value, to an empty string for a flag without a value, or NULL if the key
+ * is not present. The value ends at the next comma.
+ */
+const char* ns_opt(const char* opts, const char* key) {
+	size_t len = strlen(key);
+	const char* p = opts;
+	while (p && *p) {
+		if (!strncmp(p, key, len)) {
+			if (p[len] == '=')
+				return p + len + 1;
+			if (p[len] == ',' || !p[len])
+				return "";
+		}
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+	return NULL;
+}
+
+/*
+ * Returns the numeric value of key, accepting K/M/G/T suffixes, or def if
+ * the key is not present.
+ */
+u64 ns_opt_u64(const char* opts, const char* key, u64 def) {
+	const char* val = ns_opt(opts, key);
+	char* end;
+	u64 n;
+	if (!val || !*val)
+		return def;
+	n = strtoull(val, &end, 0);
+	switch (*end) {
+		case 'T': case 't': n <<= 10;  /* fall through */
+		case 'G': case 'g': n <<= 10;  /* fall through */
+		case 'M': case 'm': n <<= 10;  /* fall through */
+		case 'K': case 'k': n <<= 10;
+	}
+	return n;
+}
+
+/*
+ * Opens a backing file or block device for reading and writing, which has
+ * to hold bytes; a regular file is created or extended as needed. Returns
+ * the descriptor or -1 on error.
+ */
+int ns_file_open(const char* path, u64 bytes) {
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	struct stat st;
+	u64 size;
+
+	if (fd < 0 || fstat(fd, &st)) {
+		log_error("Cannot open %s: %s", path, strerror(errno));
+		goto err;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size))
+			goto err;
+	}
+	else {
+		size = st.st_size;
+		if (size < bytes && !ftruncate(fd, bytes))
+			size = bytes;
+	}
+	if (size < bytes) {
+		log_error("%s holds %lu bytes, %lu needed", path, size, bytes);
+		goto err;
+	}
+	return fd;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/* Returns the lowest free NSID, or 0 if there is none. Call with ns_lock held. */
+static u32 ns_free_nsid(void) {
+	for (u32 nsid = 1; nsid <= NS_MAX; nsid++)
+		if (!ns_table[nsid - 1])
+			return nsid;
+	return 0;
+}
+
+/* Makes ns active under its NSID. Call with ns_lock held. */
+static void ns_publish(struct nvme_ns* ns) {
+	__atomic_store_n(&ns_table[ns->nsid - 1], ns, __ATOMIC_RELEASE);
+	if (ns->nsid > max_nsid)
+		__atomic_store_n(&max_nsid, ns->nsid, __ATOMIC_RELAXED);
+}
+
+/*
+ * Frees a namespace that failed to come up, before its backend was
+ * created, along with everything ns_add set up for it so far.
+ */
+static void ns_discard(struct nvme_ns* ns) {
+	if (ns->coalesce)
+		coalesce_destroy(ns->coalesce);
+	if (ns->ra)
+		ra_destroy(ns->ra);
+	if (ns->mirror)
+		mirror_destroy(ns->mirror);
+	if (ns->meta)
+		munmap(ns->meta, ns->nsze * ns->ms);
+	range_lock_destroy(ns->locks);
+	free(ns);
+}
+
+/*
+ * Creates a namespace from a spec of the form TYPE[:OPTION,...] and gives
+ * it the next free NSID. Returns the NSID or -1 on error.
+ */
+int ns_add(const char* spec) {
+	const struct ns_type* type = NULL;
+	const char* opts = strchr(spec, ':');
+	size_t len = opts ? (size_t) (opts - spec) : strlen(spec);
+	struct nvme_ns* ns;
+	u64 size, bs, pi, ms;
+	u32 nsid;
+
+	for (size_t i = 0; i < sizeof(ns_types) / sizeof(ns_types[0]); i++)
+		if (strlen(ns_types[i]->name) == len && !strncmp(ns_types[i]->name, spec, len))
+			type = ns_types[i];
+	if (!type) {
+		log_error("Unknown namespace type in '%s'", spec);
+		return -1;
+	}
+	opts = opts ? opts + 1 : "";
+	size = ns_opt_u64(opts, "size", 1UL << 30);
+	bs = ns_opt_u64(opts, "bs", 4096);
+	if (bs < 512 || bs > (1 << 16) || (bs & (bs - 1)) || size < bs) {
+		log_error("Invalid size or block size in '%s'", spec);
+		return -1;
+	}
+	pi = ns_opt_u64(opts, "pi", 0);
+	ms = ns_opt_u64(opts, "ms", pi ? 8 : 0);
+	if (pi > 3 || (ms != 0 && ms != 8) || (pi && !ms) || (ms && (type == &ns_zns_type || type->clone || ns_opt(opts, "mirror") ||
+	    ns_opt(opts, "readahead") || ns_opt(opts, "coalesce")))) {
+		log_error("Invalid metadata or protection information in '%s'", spec);
+		return -1;
+	}
+	// zoned writes and mirrored ones have to reach the backend one by one
+	if (ns_opt(opts, "coalesce") && (type == &ns_zns_type || ns_opt(opts, "mirror"))) {
+		log_error("Write coalescing cannot be combined with zones or mirroring in '%s'", spec);
+		return -1;
+	}
+	// the peer would need its zones driven too, appends and Zone Send Actions included
+	if (ns_opt(opts, "mirror") && type == &ns_zns_type) {
+		log_error("Mirroring cannot be combined with zones in '%s'", spec);
+		return -1;
+	}
+
+	ns = calloc(1, sizeof(*ns));
+	if (!ns) {
+		log_error("malloc failed (namespace)");
+		return -1;
+	}
+	ns->lba_shift = __builtin_ctzl(bs);
+	ns->nsze = size >> ns->lba_shift;
+	ns->type = type;
+	ns->locks = range_lock_create(ns->lba_shift);
+	if (!ns->locks) {
+		log_error("malloc failed (range locks)");
+		free(ns);
+		return -1;
+	}
+	ns->ms = ms;
+	ns->pi_type = pi;
+	// the null backend drops metadata along with the data
+	if (ms && type != &ns_null_type) {
+		ns->meta = mmap(NULL, ns->nsze * ms, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (ns->meta == MAP_FAILED) {
+			log_error("Failed to map metadata for '%s'", spec);
+			ns->meta = NULL;
+			ns_discard(ns);
+			return -1;
+		}
+	}
+	if ((ns_opt(opts, "iops") || ns_opt(opts, "bw")) && !(ns->qos = qos_create(opts))) {
+		ns_discard(ns);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ns_lock);
+	nsid = ns_free_nsid();
+	if (!nsid) {
+		pthread_mutex_unlock(&ns_lock);
+		log_error("No free namespace ID for '%s'", spec);
+		ns_discard(ns);
+		return -1;
+	}
+	ns->nsid = nsid;
+	if (ns_opt(opts, "model") && !(ns->model = model_create(ns, opts))) {
+		pthread_mutex_unlock(&ns_lock);
+		ns_discard(ns);
+		return -1;
+	}
+	// set up before the backend, which has no way to be torn down again
+	if (ns_opt(opts, "mirror") && !(ns->mirror = mirror_create(ns, opts))) {
+		pthread_mutex_unlock(&ns_lock);
+		ns_discard(ns);
+		return -1;
+	}
+	if (ns_opt(opts, "readahead") && !(ns->ra = ra_create(ns, opts))) {
+		pthread_mutex_unlock(&ns_lock);
+		ns_discard(ns);
+		return -1;
+	}
+	if (ns_opt(opts, "coalesce") && !(ns->coalesce = coalesce_create(ns, opts))) {
+		pthread_mutex_unlock(&ns_lock);
+		ns_discard(ns);
+		return -1;
+	}
+	if (type->create(ns, opts)) {
+		pthread_mutex_unlock(&ns_lock);
+		log_error("Failed to create namespace '%s'", spec);
+		ns_discard(ns);
+		return -1;
+	}
+	ns_publish(ns);
+	pthread_mutex_unlock(&ns_lock);
+
+	log_info("Namespace %u: %s, %lu blocks of %lu bytes", nsid, type->name, ns->nsze, bs);
+	if (ms)
+		log_info("Namespace %u: %lu bytes of metadata per block, PI type %lu", nsid, ms, pi);
+	return nsid;
+}
+
+/*
+ * Creates a clone or read-only snapshot of namespace nsid under the next
+ * free NSID. Returns the NSID, 0 if no NSID is free, or -1 on error.
+ */
+int ns_clone(u32 nsid, int readonly) {
+	struct nvme_ns* parent = ns_get(nsid);
+	struct nvme_ns* ns;
+
+	if (!parent || !parent->type->clone)
+		return -1;
+	ns = calloc(1, sizeof(*ns));
+	if (!ns) {
+		log_error("malloc failed (namespace)");
+		return -1;
+	}
+	ns->lba_shift = parent->lba_shift;
+	ns->nsze = parent->nsze;
+	ns->type = parent->type;
+	ns->csi = parent->csi;
+	ns->locks = range_lock_create(ns->lba_shift);
+	if (!ns->locks) {
+		log_error("malloc failed (range locks)");
+		free(ns);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ns_lock);
+	ns->nsid = ns_free_nsid();
+	if (!ns->nsid) {
+		pthread_mutex_unlock(&ns_lock);
+		range_lock_destroy(ns->locks);
+		free(ns);
+		return 0;
+	}
+	if (parent->type->clone(ns, parent, readonly)) {
+		pthread_mutex_unlock(&ns_lock);
+		log_error("Failed to clone namespace %u", nsid);
+		range_lock_destroy(ns->locks);
+		free(ns);
+		return -1;
+	}
+	ns_publish(ns);
+	pthread_mutex_unlock(&ns_lock);
+
+	log_info("Namespace %u: %s of namespace %u", ns->nsid, readonly ? "snapshot" : "clone", nsid);
+	return ns->nsid;
+}
+
+/*
+ * Returns the namespace with the given NSID, or NULL if it is not active.
+ */
+struct nvme_ns* ns_get(u32 nsid) {
+	if (nsid < 1 || nsid > NS_MAX)
+		return NULL;
+	return __atomic_load_n(&ns_table[nsid - 1], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the highest NSID in use.
+ */
+u32 ns_max_nsid(void) {
+	return __atomic_load_n(&max_nsid, __ATOMIC_RELAXED);
+}
+
+/*
+ * Null backend: reads return zeroes and writes are discarded.
+ */
+static u16 null_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	memset(buf, 0, (size_t) nlb << ns->lba_shift);
+	return 0;
+}
+
+static u16 null_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	return 0;
+}
+
+static const struct ns_ops null_ops = {
+	.read  = null_read,
+	.write = null_write,
+};
+
+static int null_create(struct nvme_ns* ns, const char* opts) {
+	ns->ops = &null_ops;
+	return 0;
+}
+
+const struct ns_type ns_null_type = {
+	.name   = "null",
+	.create = null_create,
+};
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "clock.h"
+#include "ns.h"
+#include "lz.h"
+#include "fp.h"
+
+/*
+ * Compressing backend, keeping its data in memory. The namespace is cut
+ * into fixed-size chunks and the chunk map holds, per chunk, a pointer to
+ * its extent and the extent's length: 0 for a chunk that is all zeroes and
+ * takes no space, the chunk size for one stored raw because it did not
+ * compress by at least 1/8, anything else for LZ-compressed data. Writes
+ * that cover part of a chunk decompress, patch and recompress it.
+ *
+ * Chunks are guarded by a fixed set of striped locks, so commands on
+ * different chunks run in parallel; the codec runs with the lock held.
+ *
+ * Options: chunk=BYTES (power of two, at least the block size, default
+ * 16K).
+ */
+#define CHUNK_LOCKS 64
+
+struct chunk {
+	u8* ext;
+	u32 len;
+};
+
+struct compress_ns {
+	u32 chunk_shift;            /* log2 of chunk size in blocks */
+	u32 chunk_bytes;
+	u64 nr_chunks;
+	struct chunk* map;
+	pthread_mutex_t locks[CHUNK_LOCKS];
+};
+
+/* Per-thread buffers for a whole chunk and for its compressed form. */
+static __thread u8* scratch;
+static __thread u8* cbuf;
+static __thread u32 scratch_len;
+
+static int scratch_get(u32 len) {
+	if (scratch_len >= len)
+		return 0;
+	free(scratch);
+	free(cbuf);
+	scratch = malloc(len);
+	cbuf = malloc(len);
+	scratch_len = scratch && cbuf ? len : 0;
+	return scratch_len ? 0 : -1;
+}
+
+static inline pthread_mutex_t* chunk_lock(struct compress_ns* cns, u64 idx) {
+	return &cns->locks[idx % CHUNK_LOCKS];
+}
+
+/*
+ * Expands chunk c into dst, which holds a whole chunk. Returns 0 on success
+ * or -1 if its extent is corrupt.
+ */
+static int chunk_load(struct nvme_ns* ns, const struct chunk* c, u8* dst) {
+	struct compress_ns* cns = ns->priv;
+	u64 start;
+	int err;
+
+	if (!c->len) {
+		memset(dst, 0, cns->chunk_bytes);
+		return 0;
+	}
+	if (c->len == cns->chunk_bytes) {
+		memcpy(dst, c->ext, c->len);
+		return 0;
+	}
+	start = clock_ns();
+	err = lz_decompress(c->ext, c->len, dst, cns->chunk_bytes);
+	__atomic_add_fetch(&ns->reduction->decompress_ns, clock_ns() - start, __ATOMIC_RELAXED);
+	return err;
+}
+
+/*
+ * Replaces the contents of chunk c with the whole chunk at src.
+ */
+static int chunk_store(struct nvme_ns* ns, struct chunk* c, const u8* src) {
+	struct compress_ns* cns = ns->priv;
+	struct ns_reduction* r = ns->reduction;
+	const u8* from = src;
+	u32 len = 0, old_len = c->len;
+	u8* ext = NULL;
+
+	if (!fp_is_zero(src, cns->chunk_bytes)) {
+		u64 start = clock_ns();
+		len = lz_compress(src, cns->chunk_bytes, cbuf, cns->chunk_bytes - cns->chunk_bytes / 8);
+		__atomic_add_fetch(&r->compress_ns, clock_ns() - start, __ATOMIC_RELAXED);
+		if (len)
+			from = cbuf;
+		else
+			len = cns->chunk_bytes;  // not worth it, store raw
+		ext = malloc(len);
+		if (!ext)
+			return -1;
+		memcpy(ext, from, len);
+	}
+	free(c->ext);
+	c->ext = ext;
+	c->len = len;
+	// unsigned wrap-around takes care of shrinking
+	__atomic_add_fetch(&r->physical_bytes, (u64) len - old_len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->logical_bytes, ((u64) !!len - !!old_len) * cns->chunk_bytes,
+		__ATOMIC_RELAXED);
+	return 0;
+}
+
+static u16 compress_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	struct compress_ns* cns = ns->priv;
+	u32 bs_shift = ns->lba_shift;
+	u8* p = buf;
+
+	if (scratch_get(cns->chunk_bytes))
+		return make_sf(SCT_GENERIC, SC_INTERNAL);
+	while (nlb) {
+		u64 idx = lba >> cns->chunk_shift;
+		u32 off = lba & ((1U << cns->chunk_shift) - 1);
+		u32 n = (1U << cns->chunk_shift) - off;
+		struct chunk* c = &cns->map[idx];
+		int whole, err;
+
+		if (n > nlb)
+			n = nlb;
+		whole = n == 1U << cns->chunk_shift;
+		pthread_mutex_lock(chunk_lock(cns, idx));
+		err = chunk_load(ns, c, whole ? p : scratch);
+		pthread_mutex_unlock(chunk_lock(cns, idx));
+		if (err) {
+			log_error("Namespace %u: corrupt chunk %lu", ns->nsid, idx);
+			return make_sf(SCT_MEDIA, SC_UNRECOVERED_READ);
+		}
+		if (!whole)
+			memcpy(p, scratch + ((size_t) off << bs_shift), (size_t) n << bs_shift);
+		p += (size_t) n << bs_shift;
+		lba += n;
+		nlb -= n;
+	}
+	return 0;
+}
+
+static u16 compress_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	struct compress_ns* cns = ns->priv;
+	u32 bs_shift = ns->lba_shift;
+	const u8* p = buf;
+
+	if (scratch_get(cns->chunk_bytes))
+		return make_sf(SCT_GENERIC, SC_INTERNAL);
+	while (nlb) {
+		u64 idx = lba >> cns->chunk_shift;
+		u32 off = lba & ((1U << cns->chunk_shift) - 1);
+		u32 n = (1U << cns->chunk_shift) - off;
+		struct chunk* c = &cns->map[idx];
+		int err = 0;
+
+		if (n > nlb)
+			n = nlb;
+		pthread_mutex_lock(chunk_lock(cns, idx));
+		if (n == 1U << cns->chunk_shift) {
+			err = chunk_store(ns, c, p);
+		}
+		else {
+			// read-modify-write of a partial chunk
+			err = chunk_load(ns, c, scratch);
+			if (!err) {
+				memcpy(scratch + ((size_t) off << bs_shift), p, (size_t) n << bs_shift);
+				err = chunk_store(ns, c, scratch);
+			}
+		}
+		pthread_mutex_unlock(chunk_lock(cns, idx));
+		if (err)
+			return make_sf(SCT_GENERIC, SC_INTERNAL);
+		p += (size_t) n << bs_shift;
+		lba += n;
+		nlb -= n;
+	}
+	return 0;
+}
+
+static const struct ns_ops compress_ops = {
+	.read  = compress_read,
+	.write = compress_write,
+};
+
+static int compress_create(struct nvme_ns* ns, const char* opts) {
+	u64 chunk = ns_opt_u64(opts, "chunk", 16 << 10);
+	struct compress_ns* cns;
+
+	if (chunk < (1U << ns->lba_shift) || (chunk & (chunk - 1)) || chunk > (1 << 20)) {
+		log_error("Chunk size must be a power of two between the block size and 1M");
+		return -1;
+	}
+	cns = calloc(1, sizeof(*cns));
+	if (!cns)
+		return -1;
+	cns->chunk_bytes = chunk;
+	cns->chunk_shift = __builtin_ctzl(chunk) - ns->lba_shift;
+	cns->nr_chunks = (ns->nsze + (1U << cns->chunk_shift) - 1) >> cns->chunk_shift;
+	cns->map = calloc(cns->nr_chunks, sizeof(*cns->map));
+	ns->reduction = calloc(1, sizeof(*ns->reduction));
+	if (!cns->map || !ns->reduction) {
+		free(cns->map);
+		free(ns->reduction);
+		free(cns);
+		return -1;
+	}
+	for (int i = 0; i < CHUNK_LOCKS; i++)
+		pthread_mutex_init(&cns->locks[i], NULL);
+	ns->ops = &compress_ops;
+	ns->priv = cns;
+	log_info("Namespace %u: %lu chunks of %lu bytes", ns->nsid, cns->nr_chunks, chunk);
+	return 0;
+}
+
+const struct ns_type ns_compress_type = {
+	.name   = "compress",
+	.create = compress_create,
+};
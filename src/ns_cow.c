@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "ns.h"
+#include "fp.h"
+
+/*
+ * Thin in-memory backend with copy-on-write snapshots and clones. Its data
+ * is a chain of layers, each a sparse two-level map from LBA to the blocks
+ * written while it was the top of some namespace; a read walks down the
+ * chain to the first layer that holds the block, and zeroes if none does.
+ * Blocks written with zeroes are kept as a marker so they still hide the
+ * layers below.
+ *
+ * Cloning freezes the top layer of the source: from then on it is shared,
+ * and the source and a writable clone each write into a new empty layer on
+ * top of it, while a read-only snapshot reads the frozen layer directly.
+ * That costs two small allocations, whatever the size of the namespace. If
+ * nothing was written since the previous clone, the existing top layer is
+ * still empty and the clone goes on top of the layer below it, so cloning
+ * one image many times does not deepen its chain.
+ *
+ * Writes cover whole blocks, so they never copy anything up from the
+ * layers below. Leaves and blocks are installed with compare-and-swap
+ * under a shared lock; cloning takes it exclusively to swap the top layer.
+ */
+#define COW_LEAF_SHIFT 9
+#define COW_LEAF (1U << COW_LEAF_SHIFT)
+
+static u8 cow_zero_block[1];
+#define COW_ZERO cow_zero_block
+
+struct cow_layer {
+	struct cow_layer* parent;
+	u64 used;                   /* blocks written into this layer */
+	u8** leaves[];              /* COW_LEAF block pointers each */
+};
+
+struct cow_ns {
+	pthread_rwlock_t lock;
+	struct cow_layer* top;      /* NULL for an empty read-only snapshot */
+};
+
+static struct cow_layer* layer_new(const struct nvme_ns* ns, struct cow_layer* parent) {
+	u64 nr_leaves = (ns->nsze + COW_LEAF - 1) >> COW_LEAF_SHIFT;
+	struct cow_layer* l = calloc(1, sizeof(*l) + nr_leaves * sizeof(l->leaves[0]));
+	if (l)
+		l->parent = parent;
+	return l;
+}
+
+static u8* layer_get(struct cow_layer* l, u64 lba) {
+	u8** leaf = __atomic_load_n(&l->leaves[lba >> COW_LEAF_SHIFT], __ATOMIC_ACQUIRE);
+	return leaf ? __atomic_load_n(&leaf[lba & (COW_LEAF - 1)], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/*
+ * Returns the block pointer slot of lba in l, allocating its leaf if
+ * needed, or NULL if out of memory.
+ */
+static u8** layer_slot(struct cow_layer* l, u64 lba) {
+	u8*** dir = &l->leaves[lba >> COW_LEAF_SHIFT];
+	u8** leaf = __atomic_load_n(dir, __ATOMIC_ACQUIRE);
+	if (!leaf) {
+		u8** fresh = calloc(COW_LEAF, sizeof(*fresh));
+		if (!fresh)
+			return NULL;
+		if (__atomic_compare_exchange_n(dir, &leaf, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			leaf = fresh;
+		else
+			free(fresh);
+	}
+	return &leaf[lba & (COW_LEAF - 1)];
+}
+
+static u16 cow_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	struct cow_ns* c = ns->priv;
+	size_t bs = (size_t) 1 << ns->lba_shift;
+	u8* p = buf;
+
+	pthread_rwlock_rdlock(&c->lock);
+	for (u32 i = 0; i < nlb; i++, p += bs) {
+		u8* blk = NULL;
+		for (struct cow_layer* l = c->top; l && !blk; l = l->parent)
+			blk = layer_get(l, lba + i);
+		if (blk && blk != COW_ZERO)
+			memcpy(p, blk, bs);
+		else
+			memset(p, 0, bs);
+	}
+	pthread_rwlock_unlock(&c->lock);
+	return 0;
+}
+
+static u16 cow_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	struct cow_ns* c = ns->priv;
+	size_t bs = (size_t) 1 << ns->lba_shift;
+	const u8* p = buf;
+	u16 status = 0;
+
+	pthread_rwlock_rdlock(&c->lock);
+	for (u32 i = 0; i < nlb && !status; i++, p += bs) {
+		u8** slot = layer_slot(c->top, lba + i);
+		u8* old = slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+		int zero = fp_is_zero(p, bs);
+
+		if (!slot) {
+			status = make_sf(SCT_GENERIC, SC_INTERNAL);
+			break;
+		}
+		// a block this layer already owns is overwritten in place
+		while (!old || old == COW_ZERO) {
+			u8* blk = COW_ZERO;
+			if (zero && old == COW_ZERO)
+				break;
+			if (!zero) {
+				blk = malloc(bs);
+				if (!blk) {
+					status = make_sf(SCT_GENERIC, SC_INTERNAL);
+					break;
+				}
+				memcpy(blk, p, bs);
+			}
+			if (__atomic_compare_exchange_n(slot, &old, blk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				if (!old)
+					__atomic_add_fetch(&c->top->used, 1, __ATOMIC_RELAXED);
+				old = blk;
+				break;
+			}
+			if (blk != COW_ZERO)
+				free(blk);
+		}
+		if (old && old != COW_ZERO)
+			memcpy(old, p, bs);
+	}
+	pthread_rwlock_unlock(&c->lock);
+	return status;
+}
+
+static const struct ns_ops cow_ops = {
+	.read  = cow_read,
+	.write = cow_write,
+};
+
+/*
+ * Makes ns a clone of parent, or a read-only snapshot of it.
+ */
+static int cow_clone(struct nvme_ns* ns, struct nvme_ns* parent, int readonly) {
+	struct cow_ns* pc = parent->priv;
+	struct cow_ns* c = calloc(1, sizeof(*c));
+	struct cow_layer* fresh = layer_new(parent, NULL);
+	struct cow_layer* own = readonly ? NULL : layer_new(ns, NULL);
+	struct cow_layer* base;
+
+	if (!c || !fresh || (!readonly && !own)) {
+		free(c);
+		free(fresh);
+		free(own);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&pc->lock);
+	if (parent->wp) {
+		base = pc->top;
+	}
+	else if (!pc->top->used) {
+		base = pc->top->parent;  // nothing written since the last clone
+	}
+	else {
+		fresh->parent = pc->top;
+		base = pc->top;
+		pc->top = fresh;
+		fresh = NULL;
+	}
+	pthread_rwlock_unlock(&pc->lock);
+	free(fresh);
+
+	if (own)
+		own->parent = base;
+	c->top = readonly ? base : own;
+	pthread_rwlock_init(&c->lock, NULL);
+	ns->wp = readonly;
+	ns->ops = &cow_ops;
+	ns->priv = c;
+	return 0;
+}
+
+static int cow_create(struct nvme_ns* ns, const char* opts) {
+	struct cow_ns* c = calloc(1, sizeof(*c));
+	if (!c)
+		return -1;
+	c->top = layer_new(ns, NULL);
+	if (!c->top) {
+		free(c);
+		return -1;
+	}
+	pthread_rwlock_init(&c->lock, NULL);
+	ns->ops = &cow_ops;
+	ns->priv = c;
+	return 0;
+}
+
+const struct ns_type ns_cow_type = {
+	.name   = "cow",
+	.create = cow_create,
+	.clone  = cow_clone,
+};
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "ns.h"
+#include "fp.h"
+
+/*
+ * Deduplicating backend, keeping its data in memory. Every block written
+ * is fingerprinted and looked up in an open-addressing index of the blocks
+ * already stored; a block whose contents are already there only takes a
+ * reference, and a new one is copied into its own allocation. The LBA map
+ * holds a block number per LBA, with 0 for blocks that are all zeroes,
+ * which take no space at all. Blocks are freed when their last reference
+ * is overwritten.
+ *
+ * Fingerprints are computed before taking the lock, so only the index
+ * lookup and the comparison with the matching block run under it. Reads
+ * share the lock.
+ */
+#define DEDUP_INDEX_MIN  4096
+#define DEDUP_BLKS_MIN   1024
+
+struct dedup_blk {
+	u64 fp;
+	u8* data;
+	u32 refs;
+	u32 next_free;              /* free list link while refs is 0 */
+};
+
+struct dedup_slot {
+	u64 fp;
+	u32 blk;                    /* 0 for an empty slot */
+};
+
+struct dedup_ns {
+	pthread_rwlock_t lock;
+	u32* map;                   /* block number of every LBA */
+	struct dedup_blk* blks;     /* entry 0 is unused */
+	u32 nr_blks;
+	u32 max_blks;
+	u32 free_blk;               /* head of the free list, 0 if empty */
+	struct dedup_slot* index;
+	u32 index_mask;
+	u32 index_used;
+};
+
+/* Per-thread fingerprints of the blocks of a write, 0 for zero blocks. */
+static __thread u64* fps;
+static __thread u32 fps_len;
+
+static int index_grow(struct dedup_ns* d) {
+	u32 size = (d->index_mask + 1) * 2;
+	struct dedup_slot* index = calloc(size, sizeof(*index));
+	if (!index)
+		return -1;
+	for (u32 i = 0; i <= d->index_mask; i++) {
+		u32 j;
+		if (!d->index[i].blk)
+			continue;
+		for (j = d->index[i].fp & (size - 1); index[j].blk; j = (j + 1) & (size - 1))
+			;
+		index[j] = d->index[i];
+	}
+	free(d->index);
+	d->index = index;
+	d->index_mask = size - 1;
+	return 0;
+}
+
+/*
+ * Removes the slot at i, moving later slots of the same probe run back so
+ * that lookups never stop early at the hole.
+ */
+static void index_del(struct dedup_ns* d, u32 i) {
+	u32 mask = d->index_mask;
+	for (u32 j = (i + 1) & mask; d->index[j].blk; j = (j + 1) & mask) {
+		u32 home = d->index[j].fp & mask;
+		// the slot can move unless its home lies in (i, j]
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			d->index[i] = d->index[j];
+			i = j;
+		}
+	}
+	d->index[i].blk = 0;
+	d->index_used--;
+}
+
+/*
+ * Returns the number of the block holding data, which has fingerprint fp,
+ * with a reference taken, storing it first if needed. Returns 0 if out of
+ * memory.
+ */
+static u32 blk_get(struct nvme_ns* ns, u64 fp, const u8* data) {
+	struct dedup_ns* d = ns->priv;
+	size_t bs = (size_t) 1 << ns->lba_shift;
+	struct dedup_blk* blk;
+	u32 i, b;
+
+	for (i = fp & d->index_mask; d->index[i].blk; i = (i + 1) & d->index_mask) {
+		blk = &d->blks[d->index[i].blk];
+		if (d->index[i].fp == fp && !memcmp(blk->data, data, bs)) {
+			blk->refs++;
+			return d->index[i].blk;
+		}
+	}
+
+	if (d->free_blk) {
+		b = d->free_blk;
+		d->free_blk = d->blks[b].next_free;
+	}
+	else {
+		if (d->nr_blks == d->max_blks) {
+			struct dedup_blk* blks = realloc(d->blks, 2 * sizeof(*blks) * d->max_blks);
+			if (!blks)
+				return 0;
+			d->blks = blks;
+			d->max_blks *= 2;
+		}
+		b = d->nr_blks++;
+	}
+	blk = &d->blks[b];
+	blk->data = malloc(bs);
+	if (!blk->data) {
+		blk->next_free = d->free_blk;
+		d->free_blk = b;
+		return 0;
+	}
+	memcpy(blk->data, data, bs);
+	blk->fp = fp;
+	blk->refs = 1;
+	d->index[i].fp = fp;
+	d->index[i].blk = b;
+	__atomic_add_fetch(&ns->reduction->physical_bytes, bs, __ATOMIC_RELAXED);
+	// keep the load factor below 0.7; a failed resize only makes probing slower
+	if (++d->index_used * 10 > (d->index_mask + 1) * 7)
+		index_grow(d);
+	return b;
+}
+
+static void blk_put(struct nvme_ns* ns, u32 b) {
+	struct dedup_ns* d = ns->priv;
+	struct dedup_blk* blk = &d->blks[b];
+	u32 i;
+
+	if (--blk->refs)
+		return;
+	for (i = blk->fp & d->index_mask; d->index[i].blk != b; i = (i + 1) & d->index_mask)
+		;
+	index_del(d, i);
+	free(blk->data);
+	blk->data = NULL;
+	blk->next_free = d->free_blk;
+	d->free_blk = b;
+	__atomic_sub_fetch(&ns->reduction->physical_bytes, (u64) 1 << ns->lba_shift, __ATOMIC_RELAXED);
+}
+
+static u16 dedup_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	struct dedup_ns* d = ns->priv;
+	size_t bs = (size_t) 1 << ns->lba_shift;
+	u8* p = buf;
+
+	pthread_rwlock_rdlock(&d->lock);
+	for (u32 i = 0; i < nlb; i++, p += bs) {
+		u32 b = d->map[lba + i];
+		if (b)
+			memcpy(p, d->blks[b].data, bs);
+		else
+			memset(p, 0, bs);
+	}
+	pthread_rwlock_unlock(&d->lock);
+	return 0;
+}
+
+static u16 dedup_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	struct dedup_ns* d = ns->priv;
+	size_t bs = (size_t) 1 << ns->lba_shift;
+	u64 blocks = 0;
+	const u8* p;
+	u16 status = 0;
+
+	if (fps_len < nlb) {
+		free(fps);
+		fps = malloc(nlb * sizeof(*fps));
+		fps_len = fps ? nlb : 0;
+		if (!fps)
+			return make_sf(SCT_GENERIC, SC_INTERNAL);
+	}
+	p = buf;
+	for (u32 i = 0; i < nlb; i++, p += bs) {
+		u64 fp = 0;
+		// a real fingerprint of 0 is moved to 1, which lookups still verify
+		if (!fp_is_zero(p, bs) && !(fp = fp_hash(p, bs)))
+			fp = 1;
+		fps[i] = fp;
+	}
+
+	p = buf;
+	pthread_rwlock_wrlock(&d->lock);
+	for (u32 i = 0; i < nlb; i++, p += bs) {
+		u32 b = 0, old = d->map[lba + i];
+		if (fps[i] && !(b = blk_get(ns, fps[i], p))) {
+			status = make_sf(SCT_GENERIC, SC_INTERNAL);
+			break;
+		}
+		// the new reference is taken first, so rewriting a block keeps it
+		d->map[lba + i] = b;
+		if (old)
+			blk_put(ns, old);
+		blocks += (u64) !!b - !!old;  // wraps around when shrinking
+	}
+	pthread_rwlock_unlock(&d->lock);
+	__atomic_add_fetch(&ns->reduction->logical_bytes, blocks * bs, __ATOMIC_RELAXED);
+	return status;
+}
+
+static const struct ns_ops dedup_ops = {
+	.read  = dedup_read,
+	.write = dedup_write,
+};
+
+static int dedup_create(struct nvme_ns* ns, const char* opts) {
+	struct dedup_ns* d;
+
+	if (ns->nsze > 0xffffffffUL) {
+		log_error("Deduplicated namespaces are limited to 2^32 blocks");
+		return -1;
+	}
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return -1;
+	d->map = calloc(ns->nsze, sizeof(*d->map));
+	d->max_blks = DEDUP_BLKS_MIN;
+	d->nr_blks = 1;
+	d->blks = calloc(d->max_blks, sizeof(*d->blks));
+	d->index_mask = DEDUP_INDEX_MIN - 1;
+	d->index = calloc(DEDUP_INDEX_MIN, sizeof(*d->index));
+	ns->reduction = calloc(1, sizeof(*ns->reduction));
+	if (!d->map || !d->blks || !d->index || !ns->reduction) {
+		free(d->map);
+		free(d->blks);
+		free(d->index);
+		free(ns->reduction);
+		free(d);
+		return -1;
+	}
+	pthread_rwlock_init(&d->lock, NULL);
+	ns->ops = &dedup_ops;
+	ns->priv = d;
+	return 0;
+}
+
+const struct ns_type ns_dedup_type = {
+	.name   = "dedup",
+	.create = dedup_create,
+};
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+
+#include "log.h"
+#include "ns.h"
+#include "pattern.h"
+
+/*
+ * Pattern backend: stores nothing but a generation number per extent of
+ * 2^ext_shift blocks. Reads synthesise every block from (NSID, LBA,
+ * generation of its extent). A write moves each extent it touches to the
+ * next generation, so a host that writes the pattern of that generation
+ * reads back what it wrote; with the verify option, writes whose data does
+ * not match the pattern of the next generation fail with Compare Failure.
+ * Extents are checked and moved on one at a time, each in a single step, so
+ * a write that fails may already have moved the extents before the one
+ * that did not match.
+ *
+ * Options: extent=BLOCKS (power of two, default 1) and verify.
+ */
+struct pattern_ns {
+	u16* gens;
+	u32 ext_shift;
+	int verify;
+};
+
+static u16 pattern_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	struct pattern_ns* pns = ns->priv;
+	u32 bs = 1U << ns->lba_shift;
+	u8* p = buf;
+	for (u32 i = 0; i < nlb; i++, p += bs) {
+		u16 gen = __atomic_load_n(&pns->gens[(lba + i) >> pns->ext_shift], __ATOMIC_RELAXED);
+		pattern_fill(p, bs, pattern_seed(ns->nsid, lba + i, gen));
+	}
+	return 0;
+}
+
+static u16 pattern_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	struct pattern_ns* pns = ns->priv;
+	u32 bs = 1U << ns->lba_shift;
+	u64 ext;
+
+	for (ext = lba >> pns->ext_shift; ext <= (lba + nlb - 1) >> pns->ext_shift; ext++) {
+		u64 start = ext << pns->ext_shift > lba ? ext << pns->ext_shift : lba;
+		u64 end = (ext + 1) << pns->ext_shift < lba + nlb ? (ext + 1) << pns->ext_shift : lba + nlb;
+		u16 gen;
+
+		if (!pns->verify) {
+			__atomic_add_fetch(&pns->gens[ext], 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		// checked and moved on in one step, so that of two writes carrying
+		// the same generation of an extent only the first gets through
+		gen = __atomic_load_n(&pns->gens[ext], __ATOMIC_RELAXED);
+		for (u64 b = start; b < end; b++) {
+			if (pattern_check((const u8*) buf + ((b - lba) << ns->lba_shift), bs,
+			    pattern_seed(ns->nsid, b, (u16) (gen + 1)))) {
+				log_warn("Namespace %u: write data at LBA 0x%lx does not match generation %u",
+					ns->nsid, b, (u16) (gen + 1));
+				return make_sf(SCT_MEDIA, SC_COMPARE_FAILURE);
+			}
+		}
+		if (!__atomic_compare_exchange_n(&pns->gens[ext], &gen, (u16) (gen + 1), 0,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			log_warn("Namespace %u: extent at LBA 0x%lx moved to generation %u during the write",
+				ns->nsid, ext << pns->ext_shift, gen);
+			return make_sf(SCT_MEDIA, SC_COMPARE_FAILURE);
+		}
+	}
+	return 0;
+}
+
+static const struct ns_ops pattern_ops = {
+	.read  = pattern_read,
+	.write = pattern_write,
+};
+
+static int pattern_create(struct nvme_ns* ns, const char* opts) {
+	struct pattern_ns* pns;
+	u64 extent = ns_opt_u64(opts, "extent", 1);
+
+	if (!extent || (extent & (extent - 1))) {
+		log_error("Pattern extent must be a power of two");
+		return -1;
+	}
+	if ((1U << ns->lba_shift) % 32) {
+		log_error("Pattern block size must be a multiple of 32 bytes");
+		return -1;
+	}
+	pns = calloc(1, sizeof(*pns));
+	if (!pns)
+		return -1;
+	pns->ext_shift = __builtin_ctzl(extent);
+	pns->verify = ns_opt(opts, "verify") != NULL;
+	pns->gens = calloc(((ns->nsze - 1) >> pns->ext_shift) + 1, sizeof(*pns->gens));
+	if (!pns->gens) {
+		free(pns);
+		return -1;
+	}
+	ns->ops = &pattern_ops;
+	ns->priv = pns;
+	return 0;
+}
+
+const struct ns_type ns_pattern_type = {
+	.name   = "pattern",
+	.create = pattern_create,
+};
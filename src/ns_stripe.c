@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "ns.h"
+
+/*
+ * Striped backend over files or block devices. LBAs are laid out in
+ * stripe units across the members round robin, so the blocks a command
+ * touches on one member are contiguous there and every command becomes at
+ * most one vectored read or write per member. The submitting thread does
+ * the first member's part itself and hands the others to a pool of worker
+ * threads, so they run in parallel, then waits for all of them.
+ *
+ * Options: files=PATH:PATH:... (members, created or extended if they are
+ * regular files), unit=BYTES (stripe unit, a multiple of the block size,
+ * default 128K), workers=N (pool size, default one per member but the
+ * first).
+ */
+#define STRIPE_MAX_MEMBERS 64
+#define STRIPE_IOV_MAX     1024  /* vectors per preadv/pwritev, as in Linux */
+
+enum stripe_op {
+	STRIPE_READ,
+	STRIPE_WRITE,
+	STRIPE_FLUSH,
+};
+
+/*
+ * A command in progress; the submitter waits until remaining drops to 0.
+ */
+struct stripe_req {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u32 remaining;
+	int err;                    /* errno of the first failed part */
+};
+
+struct stripe_part {
+	struct stripe_req* req;
+	struct stripe_part* next;
+	int fd;
+	int op;
+	u64 off;                    /* byte offset on the member */
+	struct iovec* iov;
+	int iovcnt;
+};
+
+struct stripe_ns {
+	u32 nr_members;
+	u32 unit_shift;             /* log2 of the stripe unit in blocks */
+	int fds[STRIPE_MAX_MEMBERS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct stripe_part* head;   /* parts waiting for a worker */
+	struct stripe_part* tail;
+};
+
+/* Per-thread parts and I/O vectors of the command being split. */
+static __thread struct stripe_part* parts;
+static __thread struct iovec* iovs;
+static __thread u32 iovs_len;
+
+/*
+ * Runs one part, retrying short transfers. Returns 0 or an errno value.
+ */
+static int stripe_part_run(struct stripe_part* p) {
+	struct iovec* iov = p->iov;
+	int cnt = p->iovcnt;
+	u64 off = p->off;
+
+	if (p->op == STRIPE_FLUSH)
+		return fdatasync(p->fd) ? errno : 0;
+	while (cnt) {
+		int n = cnt < STRIPE_IOV_MAX ? cnt : STRIPE_IOV_MAX;
+		ssize_t done = p->op == STRIPE_WRITE ? pwritev(p->fd, iov, n, off) : preadv(p->fd, iov, n, off);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			return errno;
+		if (!done) {
+			if (p->op == STRIPE_WRITE)
+				return EIO;
+			// past the end of a member that was never written: zeroes
+			for (int i = 0; i < cnt; i++)
+				memset(iov[i].iov_base, 0, iov[i].iov_len);
+			return 0;
+		}
+		off += done;
+		while (cnt && (size_t) done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (u8*) iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return 0;
+}
+
+static void stripe_part_done(struct stripe_part* p, int err) {
+	struct stripe_req* req = p->req;
+	pthread_mutex_lock(&req->lock);
+	if (err && !req->err)
+		req->err = err;
+	if (!--req->remaining)
+		pthread_cond_signal(&req->cond);
+	pthread_mutex_unlock(&req->lock);
+}
+
+static void* stripe_worker_main(void* arg) {
+	struct stripe_ns* s = arg;
+	while (1) {
+		struct stripe_part* p;
+		pthread_mutex_lock(&s->lock);
+		while (!s->head)
+			pthread_cond_wait(&s->cond, &s->lock);
+		p = s->head;
+		s->head = p->next;
+		if (!s->head)
+			s->tail = NULL;
+		pthread_mutex_unlock(&s->lock);
+		stripe_part_done(p, stripe_part_run(p));
+	}
+	return NULL;
+}
+
+/*
+ * Runs n parts in parallel: all but the first on the workers, the first
+ * on the calling thread. Returns 0 or the errno of a failed part.
+ */
+static int stripe_submit(struct stripe_ns* s, struct stripe_part* p, u32 n) {
+	struct stripe_req req = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.remaining = n,
+	};
+	for (u32 i = 0; i < n; i++)
+		p[i].req = &req;
+	if (n > 1) {
+		pthread_mutex_lock(&s->lock);
+		for (u32 i = 1; i < n; i++) {
+			p[i].next = NULL;
+			if (s->tail)
+				s->tail->next = &p[i];
+			else
+				s->head = &p[i];
+			s->tail = &p[i];
+		}
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+	stripe_part_done(&p[0], stripe_part_run(&p[0]));
+
+	pthread_mutex_lock(&req.lock);
+	while (req.remaining)
+		pthread_cond_wait(&req.cond, &req.lock);
+	pthread_mutex_unlock(&req.lock);
+	pthread_cond_destroy(&req.cond);
+	return req.err;
+}
+
+/*
+ * Splits nlb blocks at lba into one part per member touched, with the
+ * pieces of the srccnt buffers in src that member holds as its I/O vector.
+ * Returns the number of parts, or 0 if out of memory.
+ */
+static u32 stripe_split(struct nvme_ns* ns, const struct iovec* src, int srccnt, u64 lba, u32 nlb, int op) {
+	struct stripe_ns* s = ns->priv;
+	u32 unit = 1U << s->unit_shift;
+	u32 units = ((lba + nlb - 1) >> s->unit_shift) - (lba >> s->unit_shift) + 1;
+	u32 n = units < s->nr_members ? units : s->nr_members;
+	// every source buffer boundary can split one more piece
+	u32 per_part = (units + s->nr_members - 1) / s->nr_members + srccnt - 1;
+	u32 first = (lba >> s->unit_shift) % s->nr_members;
+	size_t src_off = 0;
+
+	if (iovs_len < n * per_part) {
+		free(iovs);
+		iovs = malloc(n * per_part * sizeof(*iovs));
+		iovs_len = iovs ? n * per_part : 0;
+		if (!iovs)
+			return 0;
+	}
+	if (!parts && !(parts = malloc(STRIPE_MAX_MEMBERS * sizeof(*parts))))
+		return 0;
+	for (u32 i = 0; i < n; i++) {
+		parts[i].fd = s->fds[(first + i) % s->nr_members];
+		parts[i].op = op;
+		parts[i].iov = iovs + i * per_part;
+		parts[i].iovcnt = 0;
+	}
+	for (u32 i = 0; nlb; i++) {
+		u64 stripe = lba >> s->unit_shift;
+		u32 off = lba & (unit - 1);
+		u32 len = unit - off < nlb ? unit - off : nlb;
+		size_t bytes = (size_t) len << ns->lba_shift;
+		struct stripe_part* p = &parts[i % n];
+		if (!p->iovcnt)
+			p->off = (((stripe / s->nr_members) << s->unit_shift) + off) << ns->lba_shift;
+		while (bytes) {
+			size_t piece = src->iov_len - src_off < bytes ? src->iov_len - src_off : bytes;
+			p->iov[p->iovcnt].iov_base = (u8*) src->iov_base + src_off;
+			p->iov[p->iovcnt].iov_len = piece;
+			p->iovcnt++;
+			bytes -= piece;
+			src_off += piece;
+			if (src_off == src->iov_len) {
+				src++;
+				src_off = 0;
+			}
+		}
+		lba += len;
+		nlb -= len;
+	}
+	return n;
+}
+
+static u16 stripe_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	struct iovec iov = { .iov_base = buf, .iov_len = (size_t) nlb << ns->lba_shift };
+	u32 n = stripe_split(ns, &iov, 1, lba, nlb, STRIPE_READ);
+	int err;
+	if (!n)
+		return make_sf(SCT_GENERIC, SC_INTERNAL);
+	err = stripe_submit(ns->priv, parts, n);
+	if (err) {
+		log_error("Namespace %u: read failed: %s", ns->nsid, strerror(err));
+		return make_sf(SCT_MEDIA, SC_UNRECOVERED_READ);
+	}
+	return 0;
+}
+
+static u16 stripe_writev(struct nvme_ns* ns, const struct iovec* iov, int iovcnt, u64 lba, u32 nlb) {
+	u32 n = stripe_split(ns, iov, iovcnt, lba, nlb, STRIPE_WRITE);
+	int err;
+	if (!n)
+		return make_sf(SCT_GENERIC, SC_INTERNAL);
+	err = stripe_submit(ns->priv, parts, n);
+	if (err) {
+		log_error("Namespace %u: write failed: %s", ns->nsid, strerror(err));
+		return make_sf(SCT_MEDIA, SC_WRITE_FAULT);
+	}
+	return 0;
+}
+
+static u16 stripe_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	struct iovec iov = { .iov_base = (void*) buf, .iov_len = (size_t) nlb << ns->lba_shift };
+	return stripe_writev(ns, &iov, 1, lba, nlb);
+}
+
+static u16 stripe_flush(struct nvme_ns* ns) {
+	struct stripe_ns* s = ns->priv;
+	struct stripe_part p[STRIPE_MAX_MEMBERS];
+	int err;
+
+	for (u32 i = 0; i < s->nr_members; i++) {
+		p[i].fd = s->fds[i];
+		p[i].op = STRIPE_FLUSH;
+	}
+	err = stripe_submit(s, p, s->nr_members);
+	if (err) {
+		log_error("Namespace %u: flush failed: %s", ns->nsid, strerror(err));
+		return make_sf(SCT_MEDIA, SC_WRITE_FAULT);
+	}
+	return 0;
+}
+
+static const struct ns_ops stripe_ops = {
+	.read   = stripe_read,
+	.write  = stripe_write,
+	.flush  = stripe_flush,
+	.writev = stripe_writev,
+};
+
+static int stripe_create(struct nvme_ns* ns, const char* opts) {
+	const char* files = ns_opt(opts, "files");
+	u64 unit = ns_opt_u64(opts, "unit", 128 << 10);
+	struct stripe_ns* s;
+	u64 units, member_bytes;
+	u32 workers;
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (!files || !*files) {
+		log_error("Striped namespace needs files=PATH:PATH:...");
+		return -1;
+	}
+	if (unit < (1U << ns->lba_shift) || (unit & (unit - 1))) {
+		log_error("Stripe unit must be a power of two of at least the block size");
+		return -1;
+	}
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+	s->unit_shift = __builtin_ctzl(unit) - ns->lba_shift;
+	for (const char* p = files; *p && *p != ','; ) {
+		size_t len = strcspn(p, ":,");
+		if (s->nr_members == STRIPE_MAX_MEMBERS || !len) {
+			log_error("Striped namespace takes 1-%d member paths", STRIPE_MAX_MEMBERS);
+			free(s);
+			return -1;
+		}
+		s->nr_members++;
+		p += len + (p[len] == ':');
+	}
+
+	// every member holds an equal share of the stripe units
+	units = (ns->nsze + (1U << s->unit_shift) - 1) >> s->unit_shift;
+	member_bytes = (units + s->nr_members - 1) / s->nr_members * unit;
+	for (u32 i = 0; i < s->nr_members; i++)
+		s->fds[i] = -1;
+	for (u32 i = 0; i < s->nr_members; i++) {
+		size_t len = strcspn(files, ":,");
+		char path[PATH_MAX];
+		if (len >= sizeof(path))
+			goto err;
+		memcpy(path, files, len);
+		path[len] = 0;
+		files += len + 1;
+		s->fds[i] = ns_file_open(path, member_bytes);
+		if (s->fds[i] < 0)
+			goto err;
+	}
+
+	workers = ns_opt_u64(opts, "workers", s->nr_members - 1);
+	if (!workers && s->nr_members > 1)
+		workers = 1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (u32 i = 0; i < workers; i++)
+		if (!pthread_create(&thread, NULL, stripe_worker_main, s))
+			pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ns->ops = &stripe_ops;
+	ns->priv = s;
+	log_info("Namespace %u: striped over %u members in units of %lu bytes",
+		ns->nsid, s->nr_members, unit);
+	return 0;
+
+err:
+	for (u32 i = 0; i < s->nr_members; i++)
+		if (s->fds[i] >= 0)
+			close(s->fds[i]);
+	free(s);
+	return -1;
+}
+
+const struct ns_type ns_stripe_type = {
+	.name   = "stripe",
+	.create = stripe_create,
+};
@@ -0,0 +1,384 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "ns.h"
+#include "qos.h"
+#include "clock.h"
+
+/*
+ * Tiered backend. The namespace is divided into fixed-size extents, each
+ * of which lives either on the capacity tier, a file or device holding the
+ * whole namespace at its own offsets, or in a slot of the smaller fast
+ * tier, in memory or on a faster file. Every read and write bumps the
+ * heat of the extents it touches, a saturating counter that is halved
+ * every second, and a background thread promotes the hottest extents into
+ * the fast tier, demoting the coldest ones when it is full, with the
+ * copies charged to a token bucket so they do not crowd out host I/O.
+ *
+ * Host I/O shares the lock and goes to wherever the extent is. An extent
+ * is copied without the lock and switched over under it; a write to the
+ * extent while it is being copied marks the copy stale and the move is
+ * abandoned until the next round.
+ *
+ * Options: slow=PATH (capacity tier), fast=PATH (fast tier, in memory if
+ * not given), fast_size=BYTES (default 1/8 of the namespace), extent=BYTES
+ * (default 1M), migrate_bw=BYTES (per second, default 64M) and hot=N (the
+ * heat at which an extent is promoted, default 4).
+ */
+#define TIER_NONE       ((u32) -1)
+#define TIER_ROUND_MS   100
+#define TIER_DECAY_NS   1000000000UL
+
+struct tier_dev {
+	u8* mem;                    /* in memory, or NULL for a file */
+	int fd;
+};
+
+struct tier_ns {
+	pthread_rwlock_t lock;
+	struct tier_dev fast;
+	struct tier_dev slow;
+	u32 lba_shift;
+	u32 extent_shift;           /* log2 of the extent size in blocks */
+	u64 nsze;
+	u32 nr_extents;
+	u32 nr_slots;
+	u32* slot;                  /* fast tier slot + 1 of every extent, 0 if slow */
+	u32* owner;                 /* extent + 1 in every fast tier slot, 0 if free */
+	u8* heat;                   /* heat map, one counter per extent */
+	u8* dirty;                  /* fast extents written since they were promoted */
+	u8 hot;
+	u32 migrating;              /* extent being copied, or TIER_NONE */
+	u32 raced;                  /* it was written while being copied */
+	struct token_bucket budget;
+	u64 promotions;
+	u64 demotions;
+	u64 abandoned;
+};
+
+/*
+ * Reads or writes len bytes at off on a tier. Returns 0 or an errno value.
+ */
+static int tier_io(const struct tier_dev* d, int write, void* buf, u64 off, size_t len) {
+	if (d->mem) {
+		if (write)
+			memcpy(d->mem + off, buf, len);
+		else
+			memcpy(buf, d->mem + off, len);
+		return 0;
+	}
+	while (len) {
+		ssize_t done = write ? pwrite(d->fd, buf, len, off) : pread(d->fd, buf, len, off);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			return errno;
+		if (!done) {
+			if (write)
+				return EIO;
+			memset(buf, 0, len);
+			return 0;
+		}
+		buf = (u8*) buf + done;
+		off += done;
+		len -= done;
+	}
+	return 0;
+}
+
+/* Returns the byte offset of block lba in fast tier slot, or on the slow tier for slot 0. */
+static inline u64 tier_off(const struct tier_ns* t, u32 slot, u64 lba) {
+	if (slot)
+		lba = ((u64) (slot - 1) << t->extent_shift) + (lba & ((1UL << t->extent_shift) - 1));
+	return lba << t->lba_shift;
+}
+
+static u16 tier_rw(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb, int write) {
+	struct tier_ns* t = ns->priv;
+	int err = 0;
+
+	pthread_rwlock_rdlock(&t->lock);
+	while (nlb && !err) {
+		u32 e = lba >> t->extent_shift;
+		u64 end = (u64) (e + 1) << t->extent_shift;
+		u32 len = end - lba < nlb ? end - lba : nlb;
+		u32 slot = t->slot[e];
+		u8 heat = __atomic_load_n(&t->heat[e], __ATOMIC_RELAXED);
+
+		err = tier_io(slot ? &t->fast : &t->slow, write, buf, tier_off(t, slot, lba),
+			(size_t) len << t->lba_shift);
+		// a lost update only costs a little heat
+		if (heat < 255)
+			__atomic_store_n(&t->heat[e], heat + 1, __ATOMIC_RELAXED);
+		if (write) {
+			// sequentially consistent, like tier_move's side, so that
+			// either the mover sees the extent dirty or we see it moving
+			if (slot)
+				__atomic_store_n(&t->dirty[e], 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&t->migrating, __ATOMIC_SEQ_CST) == e)
+				__atomic_store_n(&t->raced, 1, __ATOMIC_SEQ_CST);
+		}
+		buf = (u8*) buf + ((size_t) len << t->lba_shift);
+		lba += len;
+		nlb -= len;
+	}
+	pthread_rwlock_unlock(&t->lock);
+
+	if (err) {
+		log_error("Namespace %u: %s failed: %s", ns->nsid, write ? "write" : "read", strerror(err));
+		return write ? make_sf(SCT_MEDIA, SC_WRITE_FAULT) : make_sf(SCT_MEDIA, SC_UNRECOVERED_READ);
+	}
+	return 0;
+}
+
+static u16 tier_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	return tier_rw(ns, buf, lba, nlb, 0);
+}
+
+static u16 tier_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	return tier_rw(ns, (void*) buf, lba, nlb, 1);
+}
+
+static u16 tier_flush(struct nvme_ns* ns) {
+	struct tier_ns* t = ns->priv;
+	if ((!t->fast.mem && fdatasync(t->fast.fd)) || fdatasync(t->slow.fd)) {
+		log_error("Namespace %u: flush failed: %s", ns->nsid, strerror(errno));
+		return make_sf(SCT_MEDIA, SC_WRITE_FAULT);
+	}
+	return 0;
+}
+
+static const struct ns_ops tier_ops = {
+	.read  = tier_read,
+	.write = tier_write,
+	.flush = tier_flush,
+};
+
+/*
+ * Moves extent e into slot, 0 meaning back to the slow tier, copying it
+ * through buf within the migration budget. Returns 0 on success or -1 if
+ * the move was abandoned.
+ */
+static int tier_move(struct tier_ns* t, u32 e, u32 slot, u8* buf) {
+	u32 from = t->slot[e];
+	u64 lba = (u64) e << t->extent_shift;
+	u64 nlb = t->nsze - lba < (1UL << t->extent_shift) ? t->nsze - lba : 1UL << t->extent_shift;
+	size_t len = nlb << t->lba_shift;
+	u64 due = tb_charge(&t->budget, len, clock_ns()), now;
+	int err = 0;
+
+	while ((now = clock_ns()) < due) {
+		struct timespec ts = { .tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000 };
+		nanosleep(&ts, NULL);
+	}
+
+	// cleared first, so a writer that sees the move has its mark kept
+	__atomic_store_n(&t->raced, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&t->migrating, e, __ATOMIC_SEQ_CST);
+	// a demoted extent that was not written still matches its slow copy
+	if (slot || __atomic_load_n(&t->dirty[e], __ATOMIC_SEQ_CST)) {
+		err = tier_io(from ? &t->fast : &t->slow, 0, buf, tier_off(t, from, lba), len);
+		if (!err)
+			err = tier_io(slot ? &t->fast : &t->slow, 1, buf, tier_off(t, slot, lba), len);
+	}
+
+	pthread_rwlock_wrlock(&t->lock);
+	if (err || __atomic_load_n(&t->raced, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&t->migrating, TIER_NONE, __ATOMIC_SEQ_CST);
+		pthread_rwlock_unlock(&t->lock);
+		if (err)
+			log_error("Tier migration of extent %u failed: %s", e, strerror(err));
+		t->abandoned++;
+		return -1;
+	}
+	if (from)
+		t->owner[from - 1] = 0;
+	if (slot)
+		t->owner[slot - 1] = e + 1;
+	t->slot[e] = slot;
+	t->dirty[e] = 0;
+	__atomic_store_n(&t->migrating, TIER_NONE, __ATOMIC_SEQ_CST);
+	pthread_rwlock_unlock(&t->lock);
+
+	if (slot)
+		t->promotions++;
+	else
+		t->demotions++;
+	log_debug("Tier: extent %u %s, heat %u", e, slot ? "promoted" : "demoted", t->heat[e]);
+	return 0;
+}
+
+/*
+ * Promotes the hottest extent on the slow tier if it is hot enough, into a
+ * free slot or in place of the coldest fast extent if that is clearly
+ * colder. Returns 1 if an extent was promoted, 0 if there is nothing left
+ * to do this round.
+ */
+static int tier_rebalance(struct tier_ns* t, u8* buf) {
+	u32 hot = TIER_NONE, cold = TIER_NONE, to = 0;
+	u8 hot_heat = t->hot - 1, cold_heat = 255;
+
+	for (u32 e = 0; e < t->nr_extents; e++) {
+		u8 heat = __atomic_load_n(&t->heat[e], __ATOMIC_RELAXED);
+		if (!t->slot[e] && heat > hot_heat) {
+			hot = e;
+			hot_heat = heat;
+		}
+		else if (t->slot[e] && heat < cold_heat) {
+			cold = e;
+			cold_heat = heat;
+		}
+	}
+	if (hot == TIER_NONE)
+		return 0;
+	for (u32 s = 0; s < t->nr_slots && !to; s++)
+		if (!t->owner[s])
+			to = s + 1;
+	if (!to) {
+		// hysteresis, so that extents of similar heat do not swap back and forth
+		if (cold == TIER_NONE || cold_heat * 2 >= hot_heat)
+			return 0;
+		to = t->slot[cold];
+		if (tier_move(t, cold, 0, buf))
+			return 0;
+	}
+	return !tier_move(t, hot, to, buf);
+}
+
+static void* tier_main(void* arg) {
+	struct tier_ns* t = arg;
+	u8* buf = malloc((size_t) 1 << (t->extent_shift + t->lba_shift));
+	u64 decayed = clock_ns();
+
+	if (!buf) {
+		log_error("malloc failed (tier migration buffer)");
+		return NULL;
+	}
+	while (1) {
+		struct timespec ts = { .tv_nsec = TIER_ROUND_MS * 1000000 };
+		nanosleep(&ts, NULL);
+		if (clock_ns() - decayed >= TIER_DECAY_NS) {
+			for (u32 e = 0; e < t->nr_extents; e++)
+				__atomic_store_n(&t->heat[e], __atomic_load_n(&t->heat[e], __ATOMIC_RELAXED) >> 1,
+					__ATOMIC_RELAXED);
+			decayed = clock_ns();
+		}
+		while (tier_rebalance(t, buf))
+			;
+	}
+	return NULL;
+}
+
+/*
+ * Opens a tier at path, or maps it in memory if path is NULL. Returns 0 on
+ * success or -1 on error.
+ */
+static int tier_open(struct tier_dev* d, const char* path, u64 bytes) {
+	char name[256];
+	size_t len;
+
+	d->mem = NULL;
+	d->fd = -1;
+	if (!path) {
+		d->mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (d->mem == MAP_FAILED) {
+			d->mem = NULL;
+			return -1;
+		}
+		return 0;
+	}
+	len = strcspn(path, ",");
+	if (!len || len >= sizeof(name))
+		return -1;
+	memcpy(name, path, len);
+	name[len] = 0;
+	d->fd = ns_file_open(name, bytes);
+	return d->fd < 0 ? -1 : 0;
+}
+
+static int tier_create(struct nvme_ns* ns, const char* opts) {
+	const char* slow = ns_opt(opts, "slow");
+	u64 size = ns->nsze << ns->lba_shift;
+	u64 extent = ns_opt_u64(opts, "extent", 1 << 20);
+	u64 fast_size = ns_opt_u64(opts, "fast_size", size / 8);
+	u64 hot = ns_opt_u64(opts, "hot", 4);
+	struct tier_ns* t;
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (!slow || !*slow) {
+		log_error("Tiered namespace needs a capacity tier, slow=PATH");
+		return -1;
+	}
+	if (extent < (1U << ns->lba_shift) || (extent & (extent - 1)) || fast_size < extent ||
+	    !hot || hot > 255) {
+		log_error("Tiered namespace needs a power-of-two extent of at least a block, "
+			"a fast tier of at least one extent and a heat of 1-255");
+		return -1;
+	}
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->lba_shift = ns->lba_shift;
+	t->extent_shift = __builtin_ctzl(extent) - ns->lba_shift;
+	t->nsze = ns->nsze;
+	t->nr_extents = (ns->nsze + (1UL << t->extent_shift) - 1) >> t->extent_shift;
+	t->nr_slots = fast_size / extent;
+	if (t->nr_slots > t->nr_extents)
+		t->nr_slots = t->nr_extents;
+	t->hot = hot;
+	t->migrating = TIER_NONE;
+	t->slot = calloc(t->nr_extents, sizeof(*t->slot));
+	t->owner = calloc(t->nr_slots, sizeof(*t->owner));
+	t->heat = calloc(t->nr_extents, 1);
+	t->dirty = calloc(t->nr_extents, 1);
+	t->slow.fd = t->fast.fd = -1;
+	if (!t->slot || !t->owner || !t->heat || !t->dirty || tier_open(&t->slow, slow, size) ||
+	    tier_open(&t->fast, ns_opt(opts, "fast"), (u64) t->nr_slots * extent)) {
+		log_error("Cannot set up the tiers of namespace %u", ns->nsid);
+		goto err;
+	}
+	tb_init(&t->budget, ns_opt_u64(opts, "migrate_bw", 64 << 20), TIER_ROUND_MS);
+	pthread_rwlock_init(&t->lock, NULL);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&thread, NULL, tier_main, t)) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		goto err;
+	}
+	pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ns->ops = &tier_ops;
+	ns->priv = t;
+	log_info("Namespace %u: %u extents of %lu bytes, %u of them on the fast tier",
+		ns->nsid, t->nr_extents, extent, t->nr_slots);
+	return 0;
+
+err:
+	if (t->slow.fd >= 0)
+		close(t->slow.fd);
+	if (t->fast.fd >= 0)
+		close(t->fast.fd);
+	if (t->fast.mem)
+		munmap(t->fast.mem, (u64) t->nr_slots * extent);
+	free(t->slot);
+	free(t->owner);
+	free(t->heat);
+	free(t->dirty);
+	free(t);
+	return -1;
+}
+
+const struct ns_type ns_tier_type = {
+	.name   = "tier",
+	.create = tier_create,
+};
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "ns.h"
+
+/*
+ * Zoned namespace backend, keeping its data in anonymous memory. Every
+ * zone is sequential-write-required. Zone state and write pointers are
+ * only touched with the namespace lock held, and only for as long as it
+ * takes to reserve blocks: data is copied after the lock is dropped, so
+ * Zone Appends from many queues to one zone proceed in parallel.
+ *
+ * Options: zone=BYTES (power of two, default 64M), zcap=BYTES (default
+ * the zone size), mar=N and mor=N (max active and open zones, default no
+ * limit).
+ */
+struct zone {
+	u8  state;
+	u64 wp;
+};
+
+struct zns {
+	u8* data;
+	size_t data_len;
+	u32 zone_shift;             /* log2 of zone size in blocks */
+	u64 zcap;                   /* writable blocks per zone */
+	u64 nr_zones;
+	pthread_mutex_t lock;
+	u32 nr_open;
+	u32 nr_active;
+	struct zone* zones;
+};
+
+static inline int zone_is_open(u8 state) {
+	return state == ZONE_IMP_OPEN || state == ZONE_EXP_OPEN;
+}
+
+static inline int zone_is_active(u8 state) {
+	return zone_is_open(state) || state == ZONE_CLOSED;
+}
+
+static inline u64 zone_start(const struct zns* z, u64 idx) {
+	return idx << z->zone_shift;
+}
+
+/*
+ * Moves a zone to a new state, keeping the open and active counts.
+ */
+static void zone_set_state(struct zns* z, struct zone* zone, u8 state) {
+	z->nr_open += zone_is_open(state) - zone_is_open(zone->state);
+	z->nr_active += zone_is_active(state) - zone_is_active(zone->state);
+	zone->state = state;
+}
+
+/*
+ * Checks the resource limits for opening a zone, implicitly or explicitly.
+ * An implicit open may close another implicitly opened zone to make room.
+ * Returns a status field.
+ */
+static u16 zone_open_check(struct nvme_ns* ns, struct zns* z, struct zone* zone) {
+	if (ns->mar && !zone_is_active(zone->state) && z->nr_active >= ns->mar)
+		return make_sf(SCT_CMD_SPEC, SC_ZONE_TOO_MANY_ACTIVE);
+	if (ns->mor && z->nr_open >= ns->mor) {
+		for (u64 i = 0; i < z->nr_zones; i++) {
+			if (z->zones[i].state == ZONE_IMP_OPEN) {
+				zone_set_state(z, &z->zones[i], ZONE_CLOSED);
+				return 0;
+			}
+		}
+		return make_sf(SCT_CMD_SPEC, SC_ZONE_TOO_MANY_OPEN);
+	}
+	return 0;
+}
+
+/*
+ * Reserves nlb blocks at the write pointer of zone idx. A write must start
+ * at the write pointer; for an append, the LBA it gets is returned in *lba.
+ * Called with the lock held.
+ */
+static u16 zone_reserve(struct nvme_ns* ns, struct zns* z, u64 idx, u64* lba, u32 nlb, int append) {
+	struct zone* zone = &z->zones[idx];
+	u64 end = zone_start(z, idx) + z->zcap;
+	u16 sf;
+
+	switch (zone->state) {
+		case ZONE_FULL:      return make_sf(SCT_CMD_SPEC, SC_ZONE_FULL);
+		case ZONE_READ_ONLY: return make_sf(SCT_CMD_SPEC, SC_ZONE_READ_ONLY);
+		case ZONE_OFFLINE:   return make_sf(SCT_CMD_SPEC, SC_ZONE_OFFLINE);
+	}
+	if (!append && *lba != zone->wp)
+		return make_sf(SCT_CMD_SPEC, SC_ZONE_INVALID_WRITE);
+	if (end - zone->wp < nlb)
+		return make_sf(SCT_CMD_SPEC, append ? SC_ZONE_FULL : SC_ZONE_BOUNDARY);
+	if (!zone_is_open(zone->state)) {
+		if ((sf = zone_open_check(ns, z, zone)))
+			return sf;
+		zone_set_state(z, zone, ZONE_IMP_OPEN);
+	}
+	*lba = zone->wp;
+	zone->wp += nlb;
+	if (zone->wp == end)
+		zone_set_state(z, zone, ZONE_FULL);
+	return 0;
+}
+
+static u16 zns_read(struct nvme_ns* ns, void* buf, u64 lba, u32 nlb) {
+	struct zns* z = ns->priv;
+	memcpy(buf, z->data + (lba << ns->lba_shift), (size_t) nlb << ns->lba_shift);
+	return 0;
+}
+
+static u16 zns_write(struct nvme_ns* ns, const void* buf, u64 lba, u32 nlb) {
+	struct zns* z = ns->priv;
+	u16 sf;
+	pthread_mutex_lock(&z->lock);
+	sf = zone_reserve(ns, z, lba >> z->zone_shift, &lba, nlb, 0);
+	pthread_mutex_unlock(&z->lock);
+	if (!sf)
+		memcpy(z->data + (lba << ns->lba_shift), buf, (size_t) nlb << ns->lba_shift);
+	return sf;
+}
+
+static u16 zns_append(struct nvme_ns* ns, const void* buf, u64 zslba, u32 nlb, u64* lba) {
+	struct zns* z = ns->priv;
+	u16 sf;
+	if (zslba & ((1UL << z->zone_shift) - 1))
+		return make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+	pthread_mutex_lock(&z->lock);
+	sf = zone_reserve(ns, z, zslba >> z->zone_shift, lba, nlb, 1);
+	pthread_mutex_unlock(&z->lock);
+	if (!sf)
+		memcpy(z->data + (*lba << ns->lba_shift), buf, (size_t) nlb << ns->lba_shift);
+	return sf;
+}
+
+/*
+ * Applies a Zone Send Action to zone idx. With all set, zones the action
+ * does not apply to are skipped instead of failing. Called with the lock
+ * held.
+ */
+static u16 zone_action(struct nvme_ns* ns, struct zns* z, u64 idx, u8 action, int all) {
+	struct zone* zone = &z->zones[idx];
+	u8 state = zone->state;
+	u16 sf;
+
+	switch (action) {
+		case ZSA_OPEN:
+			if (state == ZONE_EXP_OPEN)
+				return 0;
+			if (state == ZONE_CLOSED || (!all && (state == ZONE_EMPTY || state == ZONE_IMP_OPEN))) {
+				if (state != ZONE_IMP_OPEN && (sf = zone_open_check(ns, z, zone)))
+					return sf;
+				zone_set_state(z, zone, ZONE_EXP_OPEN);
+				return 0;
+			}
+			break;
+		case ZSA_CLOSE:
+			if (state == ZONE_CLOSED)
+				return 0;
+			if (zone_is_open(state)) {
+				zone_set_state(z, zone, zone->wp == zone_start(z, idx) ? ZONE_EMPTY : ZONE_CLOSED);
+				return 0;
+			}
+			break;
+		case ZSA_FINISH:
+			if (state == ZONE_FULL)
+				return 0;
+			if (zone_is_active(state) || (!all && state == ZONE_EMPTY)) {
+				zone->wp = zone_start(z, idx) + z->zcap;
+				zone_set_state(z, zone, ZONE_FULL);
+				return 0;
+			}
+			break;
+		case ZSA_RESET:
+			if (state == ZONE_EMPTY)
+				return 0;
+			if (zone_is_active(state) || state == ZONE_FULL) {
+				size_t off = zone_start(z, idx) << ns->lba_shift;
+				madvise(z->data + off, z->zcap << ns->lba_shift, MADV_DONTNEED);
+				zone->wp = zone_start(z, idx);
+				zone_set_state(z, zone, ZONE_EMPTY);
+				return 0;
+			}
+			break;
+		case ZSA_OFFLINE:
+			if (state == ZONE_OFFLINE)
+				return 0;
+			if (state == ZONE_READ_ONLY) {
+				zone_set_state(z, zone, ZONE_OFFLINE);
+				return 0;
+			}
+			break;
+		default:
+			return make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+	}
+	return all ? 0 : make_sf(SCT_CMD_SPEC, SC_ZONE_INVALID_TRANSITION);
+}
+
+static u16 zns_zone_send(struct nvme_ns* ns, u64 slba, u8 action, int all) {
+	struct zns* z = ns->priv;
+	u16 sf = 0;
+	if (!all && (slba >= ns->nsze || (slba & ((1UL << z->zone_shift) - 1))))
+		return make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+	pthread_mutex_lock(&z->lock);
+	if (all)
+		for (u64 i = 0; i < z->nr_zones && !sf; i++)
+			sf = zone_action(ns, z, i, action, 1);
+	else
+		sf = zone_action(ns, z, slba >> z->zone_shift, action, 0);
+	pthread_mutex_unlock(&z->lock);
+	return sf;
+}
+
+/*
+ * Returns whether a zone state passes a Zone Receive Action filter.
+ */
+static int zone_filter(u8 filter, u8 state) {
+	switch (filter) {
+		case 0: return 1;
+		case 1: return state == ZONE_EMPTY;
+		case 2: return state == ZONE_IMP_OPEN;
+		case 3: return state == ZONE_EXP_OPEN;
+		case 4: return state == ZONE_CLOSED;
+		case 5: return state == ZONE_FULL;
+		case 6: return state == ZONE_READ_ONLY;
+		case 7: return state == ZONE_OFFLINE;
+	}
+	return 0;
+}
+
+static u16 zns_zone_recv(struct nvme_ns* ns, void* buf, u32 len, u64 slba, u8 filter, int partial) {
+	struct zns* z = ns->priv;
+	struct nvme_zone_report_hdr* hdr = buf;
+	struct nvme_zone_desc* desc = (struct nvme_zone_desc*) (hdr + 1);
+	u64 room = len > sizeof(*hdr) ? (len - sizeof(*hdr)) / sizeof(*desc) : 0;
+	u64 matched = 0, reported = 0;
+
+	if (slba >= ns->nsze)
+		return make_sf(SCT_GENERIC, SC_LBA_RANGE);
+	if (filter > 7)
+		return make_sf(SCT_GENERIC, SC_INVALID_FIELD);
+	pthread_mutex_lock(&z->lock);
+	for (u64 i = slba >> z->zone_shift; i < z->nr_zones; i++) {
+		struct zone* zone = &z->zones[i];
+		if (!zone_filter(filter, zone->state))
+			continue;
+		matched++;
+		if (reported < room) {
+			desc[reported].zt = 2;
+			desc[reported].zs = zone->state << 4;
+			desc[reported].zcap = z->zcap;
+			desc[reported].zslba = zone_start(z, i);
+			desc[reported].wp = zone->state == ZONE_FULL ? (u64) -1 : zone->wp;
+			reported++;
+		}
+		else if (partial)
+			break;
+	}
+	pthread_mutex_unlock(&z->lock);
+	if (len >= sizeof(hdr->nr_zones))
+		hdr->nr_zones = partial ? reported : matched;
+	return 0;
+}
+
+static const struct ns_ops zns_ops = {
+	.read      = zns_read,
+	.write     = zns_write,
+	.append    = zns_append,
+	.zone_send = zns_zone_send,
+	.zone_recv = zns_zone_recv,
+};
+
+static int zns_create(struct nvme_ns* ns, const char* opts) {
+	u64 zone = ns_opt_u64(opts, "zone", 64 << 20) >> ns->lba_shift;
+	u64 zcap = ns_opt_u64(opts, "zcap", zone << ns->lba_shift) >> ns->lba_shift;
+	struct zns* z;
+
+	if (!zone || (zone & (zone - 1)) || zone > ns->nsze || !zcap || zcap > zone) {
+		log_error("Zone size must be a power of two number of blocks, with 0 < zcap <= zone");
+		return -1;
+	}
+	z = calloc(1, sizeof(*z));
+	if (!z)
+		return -1;
+	z->zone_shift = __builtin_ctzl(zone);
+	z->zcap = zcap;
+	z->nr_zones = ns->nsze >> z->zone_shift;
+	ns->nsze = z->nr_zones << z->zone_shift;  // whole zones only
+	z->data_len = ns->nsze << ns->lba_shift;
+	z->data = mmap(NULL, z->data_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	z->zones = calloc(z->nr_zones, sizeof(*z->zones));
+	if (z->data == MAP_FAILED || !z->zones) {
+		if (z->data != MAP_FAILED)
+			munmap(z->data, z->data_len);
+		free(z->zones);
+		free(z);
+		return -1;
+	}
+	for (u64 i = 0; i < z->nr_zones; i++) {
+		z->zones[i].state = ZONE_EMPTY;
+		z->zones[i].wp = zone_start(z, i);
+	}
+	pthread_mutex_init(&z->lock, NULL);
+
+	ns->csi = CSI_ZNS;
+	ns->zsze = zone;
+	ns->mar = ns_opt_u64(opts, "mar", 0);
+	ns->mor = ns_opt_u64(opts, "mor", 0);
+	if (ns->mar && ns->mor > ns->mar)
+		ns->mor = ns->mar;
+	ns->ops = &zns_ops;
+	ns->priv = z;
+	log_info("Namespace %u: %lu zones of %lu blocks, capacity %lu", ns->nsid,
+		z->nr_zones, zone, zcap);
+	return 0;
+}
+
+const struct ns_type ns_zns_type = {
+	.name   = "zns",
+	.create = zns_create,
+};
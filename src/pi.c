@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "stats.h"
+#include "crc.h"
+#include "pi.h"
+
+/*
+ * What a command expects of the PI of its blocks: the checks to make, the
+ * application tag and mask (LBAT and LBATM in cdw15) and the reference tag
+ * of the first block (ILBRT in cdw14).
+ */
+struct pi_expect {
+	u32 prchk;
+	u16 app;
+	u16 app_mask;
+	u32 ref;
+};
+
+static inline int pi_pract(const struct nvme_ns* ns, const struct nvme_cmd* cmd) {
+	return ns->pi_type && (cmd->cdw12 & PRINFO_PRACT);
+}
+
+static void pi_expect(const struct nvme_ns* ns, const struct nvme_cmd* cmd, struct pi_expect* e) {
+	e->prchk = ns->pi_type ? cmd->cdw12 & (PRINFO_PRCHK_GUARD | PRINFO_PRCHK_APP | PRINFO_PRCHK_REF) : 0;
+	e->app = cmd->cdw15 & 0xffff;
+	e->app_mask = cmd->cdw15 >> 16;
+	e->ref = cmd->cdw14;
+}
+
+/* Reference tag of block i of a command; type 3 tags are opaque. */
+static inline u32 pi_ref(const struct nvme_ns* ns, const struct pi_expect* e, u32 i) {
+	return ns->pi_type == 3 ? e->ref : e->ref + i;
+}
+
+static u16 pi_check(const struct nvme_ns* ns, const struct pi_expect* e, const void* data,
+		const struct nvme_pi* pi, u32 i) {
+	u16 app = be16toh(pi->app_tag);
+	u32 ref = be32toh(pi->ref_tag);
+	if (app == 0xffff && (ns->pi_type != 3 || ref == 0xffffffff))
+		return 0;
+	if ((e->prchk & PRINFO_PRCHK_GUARD) &&
+	    be16toh(pi->guard) != crc_t10dif(0, data, 1U << ns->lba_shift))
+		return make_sf(SCT_MEDIA, SC_GUARD_CHECK);
+	if ((e->prchk & PRINFO_PRCHK_APP) && (app & e->app_mask) != (e->app & e->app_mask))
+		return make_sf(SCT_MEDIA, SC_APP_TAG_CHECK);
+	if ((e->prchk & PRINFO_PRCHK_REF) && ns->pi_type != 3 && ref != pi_ref(ns, e, i))
+		return make_sf(SCT_MEDIA, SC_REF_TAG_CHECK);
+	return 0;
+}
+
+/*
+ * The metadata of a namespace is kept inverted, so that the zero pages of
+ * a fresh mapping read back as all ones: the PI escape value that turns
+ * off checking for blocks never written.
+ */
+static inline void meta_store(struct nvme_ns* ns, u64 lba, u64 md) {
+	u64 v = ~md;
+	memcpy(ns->meta + lba * ns->ms, &v, sizeof(v));
+}
+
+static inline u64 meta_load(const struct nvme_ns* ns, u64 lba) {
+	u64 v = 0;
+	if (ns->meta)
+		memcpy(&v, ns->meta + lba * ns->ms, sizeof(v));
+	return ~v;
+}
+
+/*
+ * Returns the number of bytes a Read or Write of nlb blocks transfers.
+ */
+u32 pi_xfer_len(const struct nvme_ns* ns, const struct nvme_cmd* cmd, u32 nlb) {
+	u32 bs = 1U << ns->lba_shift;
+	return pi_pract(ns, cmd) ? nlb * bs : nlb * (bs + ns->ms);
+}
+
+/*
+ * Writes nlb blocks at lba from buf, checking and storing their metadata.
+ * The data of each block is moved down over the metadata before it, so the
+ * backend sees the blocks contiguous.
+ */
+u16 pi_write(struct nvme_ns* ns, const struct nvme_cmd* cmd, void* buf, u64 lba, u32 nlb) {
+	u32 bs = 1U << ns->lba_shift;
+	struct pi_expect e;
+	u8* p = buf;
+	u64* md;
+	u16 sf;
+
+	md = malloc((size_t) nlb * sizeof(*md));
+	if (!md)
+		return make_sf(SCT_GENERIC, SC_INTERNAL);
+	stats_alloc(nlb * sizeof(*md));
+	pi_expect(ns, cmd, &e);
+	for (u32 i = 0; i < nlb; i++) {
+		if (pi_pract(ns, cmd)) {
+			struct nvme_pi pi = {
+				.guard   = htobe16(crc_t10dif(0, p + (size_t) i * bs, bs)),
+				.app_tag = htobe16(e.app),
+				.ref_tag = htobe32(pi_ref(ns, &e, i)),
+			};
+			memcpy(&md[i], &pi, sizeof(pi));
+			continue;
+		}
+		u8* block = p + (size_t) i * (bs + ns->ms);
+		memcpy(&md[i], block + bs, sizeof(md[i]));
+		if (e.prchk && (sf = pi_check(ns, &e, block, (struct nvme_pi*) &md[i], i))) {
+			free(md);
+			return sf;
+		}
+		if (i)
+			memmove(p + (size_t) i * bs, block, bs);
+	}
+
+	sf = ns->ops->write(ns, p, lba, nlb);
+	if (!sf && ns->meta)
+		for (u32 i = 0; i < nlb; i++)
+			meta_store(ns, lba + i, md[i]);
+	free(md);
+	return sf;
+}
+
+/*
+ * Reads nlb blocks at lba into buf, checking their metadata. Without PRACT
+ * the blocks are spread out from the back so that each one is followed by
+ * its metadata.
+ */
+u16 pi_read(struct nvme_ns* ns, const struct nvme_cmd* cmd, void* buf, u64 lba, u32 nlb) {
+	u32 bs = 1U << ns->lba_shift;
+	int pract = pi_pract(ns, cmd);
+	struct pi_expect e;
+	u8* p = buf;
+	u16 sf;
+
+	sf = ns->ops->read(ns, buf, lba, nlb);
+	if (sf)
+		return sf;
+	pi_expect(ns, cmd, &e);
+	for (u32 i = nlb; i-- > 0;) {
+		u8* block = pract ? p + (size_t) i * bs : p + (size_t) i * (bs + ns->ms);
+		u64 md = meta_load(ns, lba + i);
+		if (!pract && i)
+			memmove(block, p + (size_t) i * bs, bs);
+		if (e.prchk && (sf = pi_check(ns, &e, block, (struct nvme_pi*) &md, i)))
+			return sf;
+		if (!pract)
+			memcpy(block + bs, &md, sizeof(md));
+	}
+	return 0;
+}
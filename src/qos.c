@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "ns.h"
+#include "qos.h"
+#include "arb.h"
+
+/*
+ * Hosts with limits. The list is built from the command line before the
+ * listener starts and never changes afterwards, so lookups take no lock.
+ */
+struct qos_host {
+	char hostnqn[256];
+	struct qos_limit* lim;
+	struct qos_host* next;
+};
+
+static struct qos_host* qos_hosts;
+
+static inline u64 max_u64(u64 a, u64 b) {
+	return a > b ? a : b;
+}
+
+void tb_init(struct token_bucket* tb, u64 rate, u64 burst_ms) {
+	tb->rate = rate;
+	tb->burst_ns = burst_ms * 1000000;
+}
+
+static inline u64 tb_cost_ns(const struct token_bucket* tb, u64 cost) {
+	return cost * 1000000000 / tb->rate;
+}
+
+/*
+ * Charges cost units at now and returns the time at which the charge
+ * conforms.
+ */
+u64 tb_charge(struct token_bucket* tb, u64 cost, u64 now) {
+	u64 tat, next;
+	if (!tb->rate)
+		return now;
+	tat = __atomic_load_n(&tb->tat, __ATOMIC_RELAXED);
+	do {
+		next = max_u64(tat, now) + tb_cost_ns(tb, cost);
+	} while (!__atomic_compare_exchange_n(&tb->tat, &tat, next, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return next > now + tb->burst_ns ? next - tb->burst_ns : now;
+}
+
+/*
+ * Returns whether a charge of cost units at now would conform, without
+ * making it.
+ */
+static int tb_conforms(const struct token_bucket* tb, u64 cost, u64 now) {
+	if (!tb->rate)
+		return 1;
+	return max_u64(__atomic_load_n(&tb->tat, __ATOMIC_RELAXED), now) +
+		tb_cost_ns(tb, cost) <= now + tb->burst_ns;
+}
+
+static void qos_account(struct qos_limit* lim, u64 due, u64 now) {
+	if (due <= now)
+		return;
+	__atomic_add_fetch(&lim->throttled, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&lim->throttle_ns, due - now, __ATOMIC_RELAXED);
+}
+
+/*
+ * Creates a limit from the options iops=N, bw=BYTES, min_iops=N, min_bw=BYTES,
+ * burst=MS and prio=CLASS. Returns NULL on error.
+ */
+struct qos_limit* qos_create(const char* opts) {
+	struct qos_limit* lim = calloc(1, sizeof(*lim));
+	u64 burst = ns_opt_u64(opts, "burst", 10);
+	const char* prio = ns_opt(opts, "prio");
+	if (!lim) {
+		log_error("malloc failed (QoS limit)");
+		return NULL;
+	}
+	if (!burst) {
+		log_error("Invalid QoS burst in '%s'", opts);
+		free(lim);
+		return NULL;
+	}
+	tb_init(&lim->iops, ns_opt_u64(opts, "iops", 0), burst);
+	tb_init(&lim->bw, ns_opt_u64(opts, "bw", 0), burst);
+	tb_init(&lim->min_iops, ns_opt_u64(opts, "min_iops", 0), burst);
+	tb_init(&lim->min_bw, ns_opt_u64(opts, "min_bw", 0), burst);
+	if ((lim->iops.rate && lim->min_iops.rate > lim->iops.rate) ||
+	    (lim->bw.rate && lim->min_bw.rate > lim->bw.rate)) {
+		log_error("QoS floor above ceiling in '%s'", opts);
+		free(lim);
+		return NULL;
+	}
+	lim->arb_class = prio ? arb_class_parse(prio) : ARB_MEDIUM;
+	if (lim->arb_class < 0) {
+		log_error("Invalid arbitration class in '%s'", opts);
+		free(lim);
+		return NULL;
+	}
+	return lim;
+}
+
+/*
+ * Adds the limits of a host from a spec of the form HOSTNQN,OPTION,...
+ * Returns 0 on success or -1 on error.
+ */
+int qos_host_add(const char* spec) {
+	const char* opts = strchr(spec, ',');
+	size_t len = opts ? (size_t) (opts - spec) : strlen(spec);
+	struct qos_host* host;
+
+	if (!len || len >= sizeof(host->hostnqn)) {
+		log_error("Invalid host NQN in QoS spec '%s'", spec);
+		return -1;
+	}
+	host = calloc(1, sizeof(*host));
+	if (!host) {
+		log_error("malloc failed (QoS host)");
+		return -1;
+	}
+	memcpy(host->hostnqn, spec, len);
+	host->lim = qos_create(opts ? opts + 1 : "");
+	if (!host->lim) {
+		free(host);
+		return -1;
+	}
+	host->next = qos_hosts;
+	qos_hosts = host;
+	log_info("QoS for %s: iops=%lu bw=%lu min_iops=%lu min_bw=%lu class=%d", host->hostnqn,
+		host->lim->iops.rate, host->lim->bw.rate, host->lim->min_iops.rate,
+		host->lim->min_bw.rate, host->lim->arb_class);
+	return 0;
+}
+
+/*
+ * Returns the limits of the host with the given NQN, or NULL if it has
+ * none.
+ */
+struct qos_limit* qos_host_get(const char* hostnqn) {
+	for (struct qos_host* host = qos_hosts; host; host = host->next)
+		if (!strncmp(host->hostnqn, hostnqn, sizeof(host->hostnqn)))
+			return host->lim;
+	return NULL;
+}
+
+/*
+ * Calls fn for every host with limits.
+ */
+void qos_host_for_each(void (*fn)(const char* hostnqn, const struct qos_limit* lim, void* arg), void* arg) {
+	for (struct qos_host* host = qos_hosts; host; host = host->next)
+		fn(host->hostnqn, host->lim, arg);
+}
+
+/*
+ * Charges a command transferring bytes to the limits of its host and its
+ * namespace and returns the time at which it may execute.
+ */
+u64 qos_admit(struct qos_limit* host, struct qos_limit* ns, u64 bytes, u64 now) {
+	u64 due = now, ns_due;
+	int floor = 0;
+
+	if (host) {
+		due = max_u64(tb_charge(&host->iops, 1, now), tb_charge(&host->bw, bytes, now));
+		qos_account(host, due, now);
+		// within the floor, the namespace limits are charged but not waited for
+		if ((host->min_iops.rate || host->min_bw.rate) &&
+		    tb_conforms(&host->min_iops, 1, now) && tb_conforms(&host->min_bw, bytes, now)) {
+			tb_charge(&host->min_iops, 1, now);
+			tb_charge(&host->min_bw, bytes, now);
+			floor = 1;
+		}
+	}
+	if (ns) {
+		ns_due = max_u64(tb_charge(&ns->iops, 1, now), tb_charge(&ns->bw, bytes, now));
+		if (!floor) {
+			qos_account(ns, ns_due, now);
+			due = max_u64(due, ns_due);
+		}
+	}
+	return due;
+}
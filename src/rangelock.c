@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "rangelock.h"
+
+#define RL_WRITER       0x80000000u
+#define RL_WAITERS      0x40000000u     /* someone sleeps on the futex */
+#define RL_WRITER_WAIT  0x20000000u     /* a writer waits, readers stay out */
+#define RL_READERS      0x1fffffffu
+
+static inline void futex_wait(u32* word, u32 val) {
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake_all(u32* word) {
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void rl_slot_lock(struct rl_slot* s, int excl) {
+	u32 v = __atomic_load_n(&s->word, __ATOMIC_RELAXED);
+	while (1) {
+		// a waiting writer holds back new readers, so reads cannot starve it
+		int busy = excl ? (v & (RL_WRITER | RL_READERS)) != 0 : (v & (RL_WRITER | RL_WRITER_WAIT)) != 0;
+		u32 wait = excl ? RL_WAITERS | RL_WRITER_WAIT : RL_WAITERS;
+		if (!busy) {
+			// the writer that gets in stops holding readers back for the others
+			if (__atomic_compare_exchange_n(&s->word, &v, excl ? (v | RL_WRITER) & ~RL_WRITER_WAIT : v + 1, 1,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+		// announce the wait first, so the holder knows to wake us
+		if ((v & wait) != wait && !__atomic_compare_exchange_n(&s->word, &v, v | wait, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		futex_wait(&s->word, v | wait);
+		v = __atomic_load_n(&s->word, __ATOMIC_RELAXED);
+	}
+}
+
+static void rl_slot_unlock(struct rl_slot* s, int excl) {
+	u32 v = __atomic_load_n(&s->word, __ATOMIC_RELAXED), next;
+	do {
+		next = excl ? v & ~RL_WRITER : v - 1;
+		// the last holder out wakes everyone waiting, still holding
+		// readers back if a writer is among them so it gets in first
+		if (!(next & (RL_WRITER | RL_READERS)))
+			next &= RL_WRITER_WAIT;
+	} while (!__atomic_compare_exchange_n(&s->word, &v, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if ((v & RL_WAITERS) && !(next & ~RL_WRITER_WAIT))
+		futex_wake_all(&s->word);
+}
+
+/* Fibonacci hashing, so that neighbouring granules land on different lines. */
+static inline u32 rl_hash(u64 granule) {
+	return (granule * 0x9e3779b97f4a7c15UL) >> (64 - __builtin_ctz(RL_SLOTS));
+}
+
+struct range_lock* range_lock_create(u32 lba_shift) {
+	struct range_lock* rl = malloc(sizeof(*rl));
+	if (!rl)
+		return NULL;
+	rl->granule_shift = lba_shift < __builtin_ctz(RL_GRANULE) ? __builtin_ctz(RL_GRANULE) - lba_shift : 0;
+	rl->slots = aligned_alloc(64, RL_SLOTS * sizeof(*rl->slots));
+	if (!rl->slots) {
+		free(rl);
+		return NULL;
+	}
+	memset(rl->slots, 0, RL_SLOTS * sizeof(*rl->slots));
+	return rl;
+}
+
+void range_lock_destroy(struct range_lock* rl) {
+	free(rl->slots);
+	free(rl);
+}
+
+void range_lock(struct range_lock* rl, struct rl_held* h, u64 lba, u64 nlb, int excl) {
+	u64 first = lba >> rl->granule_shift;
+	u64 last = (lba + nlb - 1) >> rl->granule_shift;
+
+	h->excl = excl;
+	h->nr = 0;
+	if (last - first >= RL_HELD_MAX)
+		h->nr = RL_SLOTS;
+	else
+		for (u64 g = first; g <= last; g++) {
+			u16 slot = rl_hash(g);
+			u32 i = h->nr;
+			// insertion sort; ranges are a handful of granules
+			while (i && h->slots[i - 1] > slot)
+				i--;
+			if (i && h->slots[i - 1] == slot)
+				continue;
+			memmove(&h->slots[i + 1], &h->slots[i], (h->nr - i) * sizeof(h->slots[0]));
+			h->slots[i] = slot;
+			h->nr++;
+		}
+	for (u32 i = 0; i < h->nr; i++)
+		rl_slot_lock(&rl->slots[h->nr == RL_SLOTS ? i : h->slots[i]], excl);
+}
+
+void range_unlock(struct range_lock* rl, struct rl_held* h) {
+	for (u32 i = 0; i < h->nr; i++)
+		rl_slot_unlock(&rl->slots[h->nr == RL_SLOTS ? i : h->slots[i]], h->excl);
+}
@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "log.h"
+#include "ns.h"
+#include "readahead.h"
+
+enum ra_seg_state {
+	RA_FREE,
+	RA_QUEUED,
+	RA_READING,
+	RA_READY,
+};
+
+struct ra_seg {
+	u64 lba;
+	u32 nlb;
+	u8 state;
+	u8 stale;                   /* overwritten or cancelled while in flight */
+	struct ra_seg* next;        /* on the prefetch queue */
+	u8* buf;
+};
+
+static inline int ra_overlaps(const struct ra_seg* s, u64 lba, u64 nlb) {
+	return s->state != RA_FREE && s->lba < lba + nlb && lba < s->lba + s->nlb;
+}
+
+/*
+ * Frees s if it holds data or marks it stale if it is in flight, in which
+ * case the worker frees it. Call with the lock held.
+ */
+static void ra_seg_drop(struct readahead* ra, struct ra_seg* s) {
+	if (s->state == RA_READY) {
+		ra->wasted_bytes += (u64) s->nlb << ra->ns->lba_shift;
+		s->state = RA_FREE;
+	}
+	else
+		s->stale = 1;
+}
+
+/*
+ * Returns the segment holding lba, NULL if no live one does. Call with the
+ * lock held.
+ */
+static struct ra_seg* ra_seg_find(struct readahead* ra, u64 lba) {
+	for (u32 i = 0; i < ra->nr_segs; i++) {
+		struct ra_seg* s = &ra->segs[i];
+		if (ra_overlaps(s, lba, 1) && !s->stale)
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * Returns the stream a read at lba continues, or replaces one with a new
+ * stream starting there. Call with the lock held.
+ */
+static struct ra_stream* ra_stream_get(struct readahead* ra, u64 lba) {
+	struct ra_stream* victim = NULL;
+
+	for (u32 i = 0; i < ra->nr_streams; i++) {
+		struct ra_stream* st = &ra->streams[i];
+		if (st->seq && st->next == lba) {
+			st->seq++;
+			return st;
+		}
+		if (!victim || (!st->seq && victim->seq) || (!st->seq == !victim->seq && st->used < victim->used))
+			victim = st;
+	}
+	for (u32 i = 0; i < ra->nr_streams; i++)
+		if (ra->streams[i].next == lba)
+			victim = &ra->streams[i];
+
+	// the stream went random or idle: its read-ahead is of no use any more
+	if (victim->seq && victim->ahead > victim->next)
+		for (u32 i = 0; i < ra->nr_segs; i++)
+			if (ra_overlaps(&ra->segs[i], victim->next, victim->ahead - victim->next))
+				ra_seg_drop(ra, &ra->segs[i]);
+	victim->seq = victim->next == lba;
+	victim->window = 2 * ra->seg_nlb;
+	victim->ahead = 0;
+	return victim;
+}
+
+/*
+ * Copies nlb blocks at lba into buf if they are all cached, waiting for
+ * prefetches in flight. Returns 1 if it did, 0 if some blocks are not
+ * cached. Call with the lock held.
+ */
+static int ra_copy(struct readahead* ra, u8* buf, u64 lba, u32 nlb) {
+	u32 shift = ra->ns->lba_shift;
+	u64 p;
+
+again:
+	for (p = lba; p < lba + nlb; ) {
+		struct ra_seg* s = ra_seg_find(ra, p);
+		if (!s)
+			return 0;
+		if (s->state != RA_READY) {
+			pthread_cond_wait(&ra->done, &ra->lock);
+			goto again;
+		}
+		p = s->lba + s->nlb;
+	}
+	for (p = lba; p < lba + nlb; ) {
+		struct ra_seg* s = ra_seg_find(ra, p);
+		u64 end = s->lba + s->nlb < lba + nlb ? s->lba + s->nlb : lba + nlb;
+		memcpy(buf + ((p - lba) << shift), s->buf + ((p - s->lba) << shift), (end - p) << shift);
+		if (end == s->lba + s->nlb)
+			s->state = RA_FREE;
+		p = end;
+	}
+	return 1;
+}
+
+/*
+ * Queues prefetches until the window ahead of st is covered or the cache
+ * is full. Call with the lock held.
+ */
+static void ra_prefetch(struct readahead* ra, struct ra_stream* st) {
+	u64 nsze = ra->ns->nsze;
+	u32 i = 0;
+
+	if (st->ahead < st->next)
+		st->ahead = st->next;
+	while (st->ahead < st->next + st->window && st->ahead < nsze) {
+		struct ra_seg* s;
+		while (i < ra->nr_segs && ra->segs[i].state != RA_FREE)
+			i++;
+		if (i == ra->nr_segs)
+			break;
+		s = &ra->segs[i];
+		s->lba = st->ahead;
+		s->nlb = nsze - st->ahead < ra->seg_nlb ? nsze - st->ahead : ra->seg_nlb;
+		s->state = RA_QUEUED;
+		s->stale = 0;
+		s->next = NULL;
+		if (ra->tail)
+			ra->tail->next = s;
+		else
+			ra->head = s;
+		ra->tail = s;
+		st->ahead += s->nlb;
+	}
+	pthread_cond_broadcast(&ra->work);
+}
+
+u16 ra_read(struct readahead* ra, void* buf, u64 lba, u32 nlb) {
+	struct nvme_ns* ns = ra->ns;
+	struct ra_stream* st;
+	u16 sf = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	st = ra_stream_get(ra, lba);
+	st->next = lba + nlb;
+	st->used = ++ra->clock;
+	if (ra_copy(ra, buf, lba, nlb)) {
+		ra->hits++;
+		st->window = st->window * 2 < ra->max_window ? st->window * 2 : ra->max_window;
+	}
+	else {
+		if (st->seq > 1)
+			ra->misses++;
+		pthread_mutex_unlock(&ra->lock);
+		sf = ns->ops->read(ns, buf, lba, nlb);
+		pthread_mutex_lock(&ra->lock);
+	}
+	if (st->seq && st->next == lba + nlb)
+		ra_prefetch(ra, st);
+	pthread_mutex_unlock(&ra->lock);
+	return sf;
+}
+
+void ra_invalidate(struct readahead* ra, u64 lba, u64 nlb) {
+	pthread_mutex_lock(&ra->lock);
+	for (u32 i = 0; i < ra->nr_segs; i++)
+		if (ra_overlaps(&ra->segs[i], lba, nlb))
+			ra_seg_drop(ra, &ra->segs[i]);
+	pthread_cond_broadcast(&ra->done);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void* ra_worker_main(void* arg) {
+	struct readahead* ra = arg;
+	struct nvme_ns* ns = ra->ns;
+
+	pthread_mutex_lock(&ra->lock);
+	while (1) {
+		struct ra_seg* s;
+		u16 sf;
+		while (!ra->head && !ra->stop)
+			pthread_cond_wait(&ra->work, &ra->lock);
+		if (ra->stop)
+			break;
+		s = ra->head;
+		ra->head = s->next;
+		if (!ra->head)
+			ra->tail = NULL;
+		if (s->stale) {
+			s->state = RA_FREE;
+			pthread_cond_broadcast(&ra->done);
+			continue;
+		}
+		s->state = RA_READING;
+		pthread_mutex_unlock(&ra->lock);
+		sf = ns->ops->read(ns, s->buf, s->lba, s->nlb);
+		pthread_mutex_lock(&ra->lock);
+		if (!sf)
+			ra->prefetched_bytes += (u64) s->nlb << ns->lba_shift;
+		s->state = sf || s->stale ? RA_FREE : RA_READY;
+		if (!sf && s->stale)
+			ra->wasted_bytes += (u64) s->nlb << ns->lba_shift;
+		pthread_cond_broadcast(&ra->done);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/*
+ * Sets up read-ahead for ns from the options of its spec. Returns NULL on
+ * error.
+ */
+struct readahead* ra_create(struct nvme_ns* ns, const char* opts) {
+	u64 cache = ns_opt_u64(opts, "ra_cache", 16 << 20);
+	u64 seg = ns_opt_u64(opts, "ra_seg", 128 << 10);
+	u64 max = ns_opt_u64(opts, "ra_max", 2 << 20);
+	u64 streams = ns_opt_u64(opts, "ra_streams", 8);
+	u64 workers = ns_opt_u64(opts, "ra_workers", 2);
+	struct readahead* ra;
+	sigset_t all, old;
+	u8* bufs;
+
+	if (seg < (1U << ns->lba_shift) || seg & ((1U << ns->lba_shift) - 1) || seg > (1 << 24) ||
+	    cache < 2 * seg || max < 2 * seg || !streams || streams > RA_MAX_STREAMS ||
+	    !workers || workers > 64) {
+		log_error("Invalid read-ahead parameters");
+		return NULL;
+	}
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return NULL;
+	ra->ns = ns;
+	ra->seg_nlb = seg >> ns->lba_shift;
+	ra->max_window = max >> ns->lba_shift;
+	ra->nr_streams = streams;
+	ra->nr_segs = cache / seg;
+	ra->segs = calloc(ra->nr_segs, sizeof(*ra->segs));
+	ra->workers = calloc(workers, sizeof(*ra->workers));
+	bufs = malloc(ra->nr_segs * seg);
+	if (!ra->segs || !ra->workers || !bufs) {
+		free(ra->segs);
+		free(ra->workers);
+		free(bufs);
+		free(ra);
+		return NULL;
+	}
+	for (u32 i = 0; i < ra->nr_segs; i++)
+		ra->segs[i].buf = bufs + i * seg;
+	for (u32 i = 0; i < ra->nr_streams; i++)
+		ra->streams[i].next = (u64) -1;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->done, NULL);
+	pthread_cond_init(&ra->work, NULL);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (u32 i = 0; i < workers; i++)
+		if (!pthread_create(&ra->workers[ra->nr_workers], NULL, ra_worker_main, ra))
+			ra->nr_workers++;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	log_info("Namespace %u read-ahead: %u segments of %lu bytes, up to %lu bytes ahead of %lu streams",
+		ns->nsid, ra->nr_segs, seg, max, streams);
+	return ra;
+}
+
+void ra_destroy(struct readahead* ra) {
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->work);
+	pthread_mutex_unlock(&ra->lock);
+	for (u32 i = 0; i < ra->nr_workers; i++)
+		pthread_join(ra->workers[i], NULL);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->done);
+	pthread_cond_destroy(&ra->work);
+	free(ra->segs[0].buf);
+	free(ra->segs);
+	free(ra->workers);
+	free(ra);
+}
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "stats.h"
+
+__thread struct queue_stats* stats_cur;
+
+static struct queue_stats* queues;
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static u64 conns_total;
+static u64 conns_active;
+
+static const char* stage_names[STAGE_COUNT] = {
+	[STAGE_CAPSULE]  = "capsule",
+	[STAGE_DISPATCH] = "dispatch",
+	[STAGE_BACKEND]  = "backend",
+	[STAGE_DATA]     = "first_data",
+	[STAGE_RESP]     = "response",
+	[STAGE_TOTAL]    = "total",
+};
+
+static const char* kind_names[] = {
+	[QUEUE_DISCOVERY] = "discovery",
+	[QUEUE_ADMIN]     = "admin",
+	[QUEUE_IO]        = "io",
+};
+
+static const char* opcode_name(int kind, u8 opcode) {
+	return kind == QUEUE_IO ? nvme_io_opcode_name(opcode) : nvme_opcode_name(opcode);
+}
+
+const char* stats_stage_name(int stage) {
+	return stage_names[stage];
+}
+
+const char* stats_kind_name(int kind) {
+	return kind_names[kind];
+}
+
+static void counters_add(struct stats_counters* dst, const struct stats_counters* src) {
+	const u64* from = (const u64*) src;
+	u64* to = (u64*) dst;
+	for (size_t i = 0; i < sizeof(*src) / sizeof(u64); i++)
+		to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static inline void record(struct stats_opcode* op, int stage, u64 from, u64 to) {
+	if (from && to >= from)
+		hist_record(&op->stages[stage], to - from);
+}
+
+/*
+ * Registers statistics for the queue run by the calling thread. The queue's
+ * counters are added to retired, if given, when it is closed.
+ */
+void stats_queue_open(int kind, u16 cntlid, u16 qid, struct stats_counters* retired) {
+	struct queue_stats* qs = calloc(1, sizeof(*qs));
+	if (!qs) {
+		log_warn("malloc failed (queue stats)");
+		return;
+	}
+	qs->kind = kind;
+	qs->cntlid = cntlid;
+	qs->qid = qid;
+	qs->opcode = -1;
+	qs->retired = retired;
+	pthread_mutex_lock(&queues_lock);
+	qs->next = queues;
+	queues = qs;
+	pthread_mutex_unlock(&queues_lock);
+	stats_cur = qs;
+}
+
+/*
+ * Unregisters and frees the calling thread's queue statistics, logging a
+ * latency summary.
+ */
+void stats_queue_close(void) {
+	struct queue_stats *qs = stats_cur, **link;
+	if (!qs)
+		return;
+	stats_cur = NULL;
+
+	pthread_mutex_lock(&queues_lock);
+	for (link = &queues; *link; link = &(*link)->next) {
+		if (*link == qs) {
+			*link = qs->next;
+			break;
+		}
+	}
+	if (qs->retired)
+		counters_add(qs->retired, &qs->c);
+	pthread_mutex_unlock(&queues_lock);
+
+	for (int i = 0; i < 256; i++) {
+		struct hist* total;
+		if (!qs->opcodes[i])
+			continue;
+		total = &qs->opcodes[i]->stages[STAGE_TOTAL];
+		log_info("%s queue %u %s: %lu commands, latency p50=%luus p99=%luus p99.9=%luus",
+			kind_names[qs->kind], qs->qid, opcode_name(qs->kind, i), total->count,
+			hist_percentile(total, 50) / 1000, hist_percentile(total, 99) / 1000,
+			hist_percentile(total, 99.9) / 1000);
+		free(qs->opcodes[i]);
+	}
+	free(qs);
+}
+
+/*
+ * Marks the command received by the calling thread as submitted to its
+ * handler with the given opcode.
+ */
+void stats_cmd_begin(u8 opcode) {
+	if (!stats_cur)
+		return;
+	stats_cur->opcode = opcode;
+	stats_cur->ts[STAMP_SUBMIT] = clock_ns();
+	stats_add(c.commands, 1);
+	stats_add(outstanding, 1);
+}
+
+/*
+ * Records the stage latencies of the current command once its response has
+ * been sent.
+ */
+void stats_cmd_complete(void) {
+	struct queue_stats* qs = stats_cur;
+	struct stats_opcode* op;
+	u64* ts;
+	if (!qs)
+		return;
+	ts = qs->ts;
+	ts[STAMP_RESP] = clock_ns();
+	if (qs->opcode < 0)
+		goto reset;
+	stats_add(outstanding, -1);
+
+	op = qs->opcodes[qs->opcode];
+	if (!op) {
+		op = calloc(1, sizeof(*op));
+		if (!op)
+			goto reset;
+		__atomic_store_n(&qs->opcodes[qs->opcode], op, __ATOMIC_RELEASE);
+	}
+	record(op, STAGE_CAPSULE,  ts[STAMP_HDR],     ts[STAMP_CAPSULE]);
+	record(op, STAGE_DISPATCH, ts[STAMP_CAPSULE], ts[STAMP_SUBMIT]);
+	record(op, STAGE_BACKEND,  ts[STAMP_SUBMIT],  ts[STAMP_DONE]);
+	record(op, STAGE_DATA,     ts[STAMP_DONE],    ts[STAMP_DATA]);
+	record(op, STAGE_RESP,     ts[STAMP_DONE],    ts[STAMP_RESP]);
+	record(op, STAGE_TOTAL,    ts[STAMP_HDR],     ts[STAMP_RESP]);
+	if (qs->kind == QUEUE_IO && ts[STAMP_HDR])
+		stats_add(c.busy_ns, ts[STAMP_RESP] - ts[STAMP_HDR]);
+
+reset:
+	for (int i = 0; i < STAMP_COUNT; i++)
+		ts[i] = 0;
+	qs->opcode = -1;
+}
+
+/*
+ * Moves the stamps of the current command into sc, leaving the queue free
+ * for the next command.
+ */
+void stats_cmd_park(struct stats_cmd* sc) {
+	if (!stats_cur)
+		return;
+	sc->opcode = stats_cur->opcode;
+	memcpy(sc->ts, stats_cur->ts, sizeof(sc->ts));
+	memset(stats_cur->ts, 0, sizeof(stats_cur->ts));
+	stats_cur->opcode = -1;
+}
+
+/*
+ * Makes a parked command current again before its response is sent.
+ */
+void stats_cmd_resume(const struct stats_cmd* sc) {
+	if (!stats_cur)
+		return;
+	stats_cur->opcode = sc->opcode;
+	memcpy(stats_cur->ts, sc->ts, sizeof(sc->ts));
+}
+
+/*
+ * Writes p50/p99/p99.9 per stage for every queue and opcode seen so far.
+ */
+void stats_report(FILE* fp) {
+	struct queue_stats* qs;
+	fprintf(fp, "%-9s %5s %-20s %-10s %10s %10s %10s %10s %10s\n", "queue", "qid",
+		"opcode", "stage", "count", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+
+	pthread_mutex_lock(&queues_lock);
+	for (qs = queues; qs; qs = qs->next) {
+		for (int i = 0; i < 256; i++) {
+			struct stats_opcode* op = __atomic_load_n(&qs->opcodes[i], __ATOMIC_ACQUIRE);
+			if (!op)
+				continue;
+			for (int s = 0; s < STAGE_COUNT; s++) {
+				const struct hist* h = &op->stages[s];
+				u64 count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+				if (!count)
+					continue;
+				fprintf(fp, "%-9s %5u %-20s %-10s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+					kind_names[qs->kind], qs->qid, opcode_name(qs->kind, i), stage_names[s],
+					count, hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+					hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+			}
+		}
+	}
+	pthread_mutex_unlock(&queues_lock);
+	fflush(fp);
+}
+
+/*
+ * Adds the counters of every live queue of controller cntlid, plus retired,
+ * to sum.
+ */
+void stats_sum(struct stats_counters* sum, u16 cntlid, const struct stats_counters* retired) {
+	pthread_mutex_lock(&queues_lock);
+	if (retired)
+		counters_add(sum, retired);
+	for (struct queue_stats* qs = queues; qs; qs = qs->next)
+		if (qs->kind != QUEUE_DISCOVERY && qs->cntlid == cntlid)
+			counters_add(sum, &qs->c);
+	pthread_mutex_unlock(&queues_lock);
+}
+
+/*
+ * Calls fn for every live queue with the registry lock held.
+ */
+void stats_for_each(void (*fn)(const struct queue_stats* qs, void* arg), void* arg) {
+	pthread_mutex_lock(&queues_lock);
+	for (struct queue_stats* qs = queues; qs; qs = qs->next)
+		fn(qs, arg);
+	pthread_mutex_unlock(&queues_lock);
+}
+
+/*
+ * Connection counters, updated once per accepted connection.
+ */
+void stats_conn_open(void) {
+	__atomic_fetch_add(&conns_total, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&conns_active, 1, __ATOMIC_RELAXED);
+}
+
+void stats_conn_close(void) {
+	__atomic_fetch_sub(&conns_active, 1, __ATOMIC_RELAXED);
+}
+
+void stats_conns(u64* total, u64* active) {
+	*total = __atomic_load_n(&conns_total, __ATOMIC_RELAXED);
+	*active = __atomic_load_n(&conns_active, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "timer.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/*
+ * Initializes an empty wheel with the given tick length, starting at now.
+ */
+void timer_wheel_init(struct timer_wheel* w, u64 tick_ns, u64 now) {
+	memset(w, 0, sizeof(*w));
+	w->tick_ns = tick_ns;
+	w->cur = now / tick_ns;
+}
+
+static void timer_link(struct timer_wheel* w, struct timer* t) {
+	u64 tick = t->expires / w->tick_ns;
+	struct timer** slot;
+	if (tick < w->cur)
+		tick = w->cur;
+	slot = &w->slots[tick & TIMER_WHEEL_MASK];
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void timer_unlink(struct timer* t) {
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * Queues t, whose expires and fn must be set. A timer that is already due
+ * fires on the next timer_run.
+ */
+void timer_add(struct timer_wheel* w, struct timer* t) {
+	if (t->pprev)
+		timer_del(w, t);
+	timer_link(w, t);
+	w->count++;
+}
+
+/*
+ * Removes t from the wheel if it is queued.
+ */
+void timer_del(struct timer_wheel* w, struct timer* t) {
+	if (!t->pprev)
+		return;
+	timer_unlink(t);
+	w->count--;
+}
+
+/*
+ * Calls fn for every timer that expired at or before now. Expired timers
+ * are first moved to a private list so that callbacks can freely re-arm
+ * timers; anything added from a callback fires on a later run at the
+ * earliest.
+ */
+void timer_run(struct timer_wheel* w, u64 now) {
+	u64 target = now / w->tick_ns, end;
+	struct timer* expired = NULL;
+
+	if (target < w->cur)
+		return;
+	if (!w->count) {
+		w->cur = target + 1;
+		return;
+	}
+	// after a long sleep every slot is visited at most once
+	end = target - w->cur >= TIMER_WHEEL_SLOTS ? w->cur + TIMER_WHEEL_SLOTS - 1 : target;
+	for (u64 tick = w->cur; tick <= end; tick++) {
+		struct timer *t = w->slots[tick & TIMER_WHEEL_MASK], *next;
+		for (; t; t = next) {
+			next = t->next;
+			if (t->expires / w->tick_ns > target)
+				continue;
+			timer_unlink(t);
+			w->count--;
+			t->next = expired;
+			expired = t;
+		}
+	}
+	w->cur = target + 1;
+
+	while (expired) {
+		struct timer* t = expired;
+		expired = t->next;
+		t->next = NULL;
+		t->fn(t);
+	}
+}
+
+/*
+ * Returns the start of the first non-empty slot, or (u64) -1 if the wheel
+ * is empty. A slot may only hold timers of later rounds, in which case the
+ * caller wakes up early and finds nothing to do.
+ */
+u64 timer_next(const struct timer_wheel* w) {
+	if (!w->count)
+		return (u64) -1;
+	for (u64 tick = w->cur; tick < w->cur + TIMER_WHEEL_SLOTS; tick++)
+		if (w->slots[tick & TIMER_WHEEL_MASK])
+			return tick * w->tick_ns;
+	return (u64) -1;
+}
@@ -1,9 +1,11 @@
 #include "transport.h"
+#include "stats.h"
+#include "capture.h"
 #include <stdint.h>
 #include <endian.h>
 #include <string.h>
 
-static const char* pdu_type_name(u8 opcode)
+const char* pdu_type_name(u8 opcode)
 {
     // 배열 인덱스는 0x0~0x09 정도만 쓰는 예시
     // 나머지(배열 범위 밖, 또는 미정의)는 "Unknown" 처리
@@ -61,8 +63,8 @@ int recv_all(sock_t socket, void *buffer, int length) {
  * if an error occurs.
  */
 int recv_pdu(sock_t socket, void** psh_buffer, void** data_buffer) {
-	void *psh, *data;
-	int received, len;
+	void *psh = NULL, *data = NULL;
+	int len;
 	struct pdu_header hdr;
 	if (psh_buffer)
 		*psh_buffer = NULL;
@@ -74,6 +76,8 @@ int recv_pdu(sock_t socket, void** psh_buffer, void** data_buffer) {
 		log_warn("recv_pdu failed (header)");
 		return -1;
 	}
+	stats_stamp(STAMP_HDR);
+	stats_add(c.pdus_rx[hdr.type & 0xf], 1);
 
 	len = hdr.hlen - PDU_HDR_LEN;
 	if (len > 0) {
@@ -82,15 +86,12 @@ int recv_pdu(sock_t socket, void** psh_buffer, void** data_buffer) {
 			log_warn("malloc failed (psh)");
 			return -1;
 		}
+		stats_alloc(len);
 		if (recv_all(socket, psh, len) != len) {
 			log_warn("recv_pdu failed (psh)");
 			free(psh);
 			return -1;
 		}
-		if (psh_buffer)
-			*psh_buffer = psh;
-		else
-			free(psh);
 	}
 	// get data
 	len = hdr.plen - hdr.hlen;
@@ -99,21 +100,30 @@ int recv_pdu(sock_t socket, void** psh_buffer, void** data_buffer) {
 		data = malloc(len);
 		if (!data) {
 			log_warn("malloc failed (data)");
-			if (psh_buffer && *psh_buffer) free(*psh_buffer);
+			free(psh);
 			return -1;
 		}
+		stats_alloc(len);
 		if (recv_all(socket, data, len) != len) {
 			log_warn("recv_pdu failed (data)");
 			free(data);
-			if (psh_buffer && *psh_buffer) free(*psh_buffer);
+			free(psh);
 			return -1;
 		}
-		if (data_buffer)
-			*data_buffer = data;
-		else
-			free(data);
 	}
 	print_pdu_header(&hdr);
+	capture_pdu(CAPTURE_RX, &hdr, psh, data);
+	if (hdr.type == PDU_TYPE_CMD)
+		stats_stamp(STAMP_CAPSULE);
+
+	if (psh_buffer)
+		*psh_buffer = psh;
+	else
+		free(psh);
+	if (data_buffer)
+		*data_buffer = data;
+	else
+		free(data);
 	return hdr.type;
 }
 
@@ -130,6 +140,7 @@ int send_pdu(sock_t socket, struct pdu_header* hdr, void* psh, void* data) {
         log_warn("Memory allocation failed");
         return -1;
     }
+    stats_alloc(total_len);
 
     int offset = 0;
 
@@ -155,14 +166,22 @@ int send_pdu(sock_t socket, struct pdu_header* hdr, void* psh, void* data) {
     int sent_total = 0;
     int sent;
     while (sent_total < total_len) {
-        sent = send(socket, buffer + sent_total, total_len - sent_total, 0);
+        // a peer that went away is an error, not a SIGPIPE for the process
+        sent = send(socket, buffer + sent_total, total_len - sent_total, MSG_NOSIGNAL);
         if (sent <= 0) {
             log_warn("send_pdu failed");
             free(buffer);
             return -1;
         }
+        if (!sent_total && hdr->type == PDU_TYPE_C2HDATA)
+            stats_stamp_once(STAMP_DATA);
         sent_total += sent;
     }
+    stats_add(c.pdus_tx[hdr->type & 0xf], 1);
+    capture_pdu(CAPTURE_TX, hdr, psh, data);
+    if (hdr->type == PDU_TYPE_RESP) {
+        stats_cmd_complete();
+    }
 
 	log_debug("Send pdu type: 0x%02x (%s), length: %d\n", hdr->type, pdu_type_name(hdr->type), sent_total);
     free(buffer);
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "transport.h"
+#include "io.h"
+#include "ns.h"
+#include "crc.h"
+#include "fp.h"
+#include "rangelock.h"
+#include "clock.h"
+
+/*
+ * Microbenchmarks for the pieces of the command hot path. Socket-level
+ * cases run over a socketpair with a helper thread on the other end that
+ * either drains everything the benchmarked side sends or keeps feeding it
+ * pre-framed PDUs, so only the target-side cost is measured.
+ *
+ * The binary is linked with --wrap for malloc/calloc/realloc and send/recv
+ * so that allocations and syscalls can be counted per operation. Counters
+ * are thread-local and only the benchmarking thread is reported.
+ */
+
+static __thread u64 nr_allocs;
+static __thread u64 nr_syscalls;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+ssize_t __real_send(int fd, const void* buf, size_t len, int flags);
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+
+void* __wrap_malloc(size_t size) {
+	nr_allocs++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+	nr_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+	nr_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+ssize_t __wrap_send(int fd, const void* buf, size_t len, int flags) {
+	nr_syscalls++;
+	return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags) {
+	nr_syscalls++;
+	return __real_recv(fd, buf, len, flags);
+}
+
+/*
+ * State shared by a benchmark and its helper thread. sock is the side the
+ * benchmarked code uses, peer is the helper's side.
+ */
+struct ctx {
+	int sock;
+	int peer;
+	pthread_t helper;
+	u8* frame;                  /* PDU the feeder sends repeatedly */
+	u32 frame_len;
+	u32 data_len;
+	struct nvme_properties props;
+};
+
+struct bench {
+	const char* name;
+	int sockets;                /* 0: in-memory, 1: drain, 2: feed */
+	u32 data_len;
+	void (*run)(struct ctx* ctx, u64 iterations);
+};
+
+static volatile u32 sink;
+
+static void* drain_main(void* arg) {
+	struct ctx* ctx = arg;
+	static __thread char buf[1 << 16];
+	while (__real_recv(ctx->peer, buf, sizeof(buf), 0) > 0)
+		;
+	return NULL;
+}
+
+static void* feed_main(void* arg) {
+	struct ctx* ctx = arg;
+	u8* batch;
+	u32 n = (1 << 16) / ctx->frame_len + 1, len = n * ctx->frame_len;
+
+	batch = __real_malloc(len);
+	for (u32 i = 0; i < n; i++)
+		memcpy(batch + i * ctx->frame_len, ctx->frame, ctx->frame_len);
+	while (1) {
+		for (u32 off = 0; off < len; ) {
+			ssize_t ret = __real_send(ctx->peer, batch + off, len - off, MSG_NOSIGNAL);
+			if (ret <= 0)
+				goto out;
+			off += ret;
+		}
+	}
+out:
+	free(batch);
+	return NULL;
+}
+
+/*
+ * Frames a command capsule with data_len bytes of in-capsule write data.
+ */
+static void build_capsule(struct ctx* ctx) {
+	struct pdu_header hdr = {
+		.type  = PDU_TYPE_CMD,
+		.hlen  = PDU_HDR_LEN + NVME_CMD_LEN,
+		.pdo   = ctx->data_len ? PDU_HDR_LEN + NVME_CMD_LEN : 0,
+		.plen  = PDU_HDR_LEN + NVME_CMD_LEN + ctx->data_len,
+	};
+	struct nvme_cmd cmd = {
+		.opcode = ctx->data_len ? IO_CMD_WRITE : IO_CMD_READ,
+		.nsid   = 1,
+		.cdw10  = 0x1000,
+		.cdw12  = ctx->data_len ? ctx->data_len / 4096 - 1 : 0,
+		.sgl.length = ctx->data_len,
+		.sgl.sglid  = ctx->data_len ? 0x01 : 0,
+	};
+	ctx->frame_len = hdr.plen;
+	ctx->frame = calloc(1, ctx->frame_len);
+	memcpy(ctx->frame, &hdr, PDU_HDR_LEN);
+	memcpy(ctx->frame + PDU_HDR_LEN, &cmd, NVME_CMD_LEN);
+}
+
+static void run_make_sf(struct ctx* ctx, u64 iterations) {
+	for (u64 i = 0; i < iterations; i++)
+		sink += make_sf(i & 1, i & 0xff);
+}
+
+static void run_fabric_get_prop(struct ctx* ctx, u64 iterations) {
+	struct nvme_cmd cmd = { .opcode = OPC_FABRICS, .nsid = FCTYPE_GET_PROP, .cdw10 = 1 };
+	static const u32 offsets[4] = { 0x0, 0x8, 0x14, 0x1c };
+	for (u64 i = 0; i < iterations; i++) {
+		struct nvme_status status = {0};
+		cmd.cdw11 = offsets[i & 3];
+		fabric_cmd(&ctx->props, &cmd, &status);
+		sink += status.dw0;
+	}
+}
+
+static void run_fabric_set_prop(struct ctx* ctx, u64 iterations) {
+	struct nvme_cmd cmd = { .opcode = OPC_FABRICS, .nsid = FCTYPE_SET_PROP, .cdw11 = 0x14 };
+	for (u64 i = 0; i < iterations; i++) {
+		struct nvme_status status = {0};
+		cmd.cdw12 = 0x460000 | (i & 1);
+		fabric_cmd(&ctx->props, &cmd, &status);
+		sink += status.dw0;
+	}
+}
+
+static void run_io_write_decode(struct ctx* ctx, u64 iterations) {
+	struct nvme_cmd cmd = { .opcode = IO_CMD_WRITE, .nsid = 1 };
+	struct rl_held held;
+	for (u64 i = 0; i < iterations; i++) {
+		struct nvme_status status = {0};
+		void* data = NULL;
+		cmd.cdw10 = i;
+		cmd.cdw11 = i >> 32;
+		cmd.cdw12 = i & 7;
+		io_cmd_write(ctx->sock, &cmd, &status, &data, &held);
+		sink += status.sf;
+	}
+}
+
+static void run_io_read(struct ctx* ctx, u64 iterations) {
+	struct nvme_cmd cmd = { .opcode = IO_CMD_READ, .nsid = 1, .cdw12 = ctx->data_len / 4096 - 1 };
+	for (u64 i = 0; i < iterations; i++) {
+		struct nvme_status status = {0};
+		cmd.cid = i;
+		cmd.cdw10 = i;
+		io_cmd_read(ctx->sock, &cmd, &status);
+	}
+}
+
+static void run_send_status(struct ctx* ctx, u64 iterations) {
+	struct nvme_status status = {0};
+	for (u64 i = 0; i < iterations; i++) {
+		status.cid = i;
+		status.sqhd = i;
+		if (send_status(ctx->sock, &status))
+			abort();
+	}
+}
+
+static void run_send_data(struct ctx* ctx, u64 iterations) {
+	void* buf = calloc(1, ctx->data_len);
+	for (u64 i = 0; i < iterations; i++)
+		if (send_data(ctx->sock, i, buf, ctx->data_len))
+			abort();
+	free(buf);
+}
+
+static void run_recv_cmd(struct ctx* ctx, u64 iterations) {
+	for (u64 i = 0; i < iterations; i++) {
+		void* data;
+		struct nvme_cmd* cmd = recv_cmd(ctx->sock, &data);
+		if (!cmd)
+			abort();
+		sink += cmd->cdw10;
+		free(cmd);
+		free(data);
+	}
+}
+
+static void run_crc_t10dif(struct ctx* ctx, u64 iterations) {
+	u8* buf = malloc(ctx->data_len);
+	memset(buf, 0xa5, ctx->data_len);
+	for (u64 i = 0; i < iterations; i++)
+		sink += crc_t10dif(0, buf, ctx->data_len);
+	free(buf);
+}
+
+static void run_fp_hash(struct ctx* ctx, u64 iterations) {
+	u8* buf = malloc(ctx->data_len);
+	memset(buf, 0xa5, ctx->data_len);
+	for (u64 i = 0; i < iterations; i++)
+		sink += fp_hash(buf, ctx->data_len);
+	free(buf);
+}
+
+static void run_range_lock(struct ctx* ctx, u64 iterations) {
+	struct range_lock* rl = range_lock_create(12);
+	struct rl_held held;
+	for (u64 i = 0; i < iterations; i++) {
+		range_lock(rl, &held, i * 32, ctx->data_len / 4096, i & 1);
+		range_unlock(rl, &held);
+	}
+	range_lock_destroy(rl);
+}
+
+static const struct bench benches[] = {
+	{ "make_sf",             0, 0,      run_make_sf },
+	{ "fabric_cmd/get_prop", 0, 0,      run_fabric_get_prop },
+	{ "fabric_cmd/set_prop", 0, 0,      run_fabric_set_prop },
+	{ "io_cmd_write/decode", 0, 0,      run_io_write_decode },
+	{ "io_cmd_read/4k",      1, 4096,   run_io_read },
+	{ "io_cmd_read/128k",    1, 131072, run_io_read },
+	{ "crc_t10dif/4k",       0, 4096,   run_crc_t10dif },
+	{ "fp_hash/4k",          0, 4096,   run_fp_hash },
+	{ "range_lock/4k",       0, 4096,   run_range_lock },
+	{ "range_lock/1m",       0, 1 << 20, run_range_lock },
+	{ "send_status",         1, 0,      run_send_status },
+	{ "send_data/4k",        1, 4096,   run_send_data },
+	{ "recv_cmd",            2, 0,      run_recv_cmd },
+	{ "recv_cmd/4k",         2, 4096,   run_recv_cmd },
+	{ "recv_cmd/128k",       2, 131072, run_recv_cmd },
+};
+#define NR_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int setup(const struct bench* b, struct ctx* ctx) {
+	int fds[2];
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->data_len = b->data_len;
+	ctx->sock = ctx->peer = -1;
+	ctx->props.cc = 0x460001;
+	if (!b->sockets)
+		return 0;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		return -1;
+	ctx->sock = fds[0];
+	ctx->peer = fds[1];
+	if (b->sockets == 2)
+		build_capsule(ctx);
+	return pthread_create(&ctx->helper, NULL, b->sockets == 1 ? drain_main : feed_main, ctx);
+}
+
+static void teardown(const struct bench* b, struct ctx* ctx) {
+	if (!b->sockets)
+		return;
+	shutdown(ctx->sock, SHUT_RDWR);
+	pthread_join(ctx->helper, NULL);
+	close(ctx->sock);
+	close(ctx->peer);
+	free(ctx->frame);
+}
+
+/*
+ * Runs one benchmark, doubling the iteration count until a batch takes at
+ * least min_ns, and reports the figures of that last batch.
+ */
+static void measure(const struct bench* b, u64 min_ns, int json) {
+	struct ctx ctx;
+	u64 iterations = 16, elapsed, allocs, syscalls;
+
+	if (setup(b, &ctx)) {
+		fprintf(stderr, "%s: setup failed\n", b->name);
+		exit(1);
+	}
+	b->run(&ctx, iterations);  // warm up
+	while (1) {
+		u64 start;
+		allocs = nr_allocs;
+		syscalls = nr_syscalls;
+		start = clock_ns();
+		b->run(&ctx, iterations);
+		elapsed = clock_ns() - start;
+		allocs = nr_allocs - allocs;
+		syscalls = nr_syscalls - syscalls;
+		if (elapsed >= min_ns)
+			break;
+		iterations *= 2;
+	}
+	teardown(b, &ctx);
+
+	if (json)
+		printf("{\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.2f,"
+			"\"allocs_per_op\":%.3f,\"syscalls_per_op\":%.3f}\n", b->name, iterations,
+			(double) elapsed / iterations, (double) allocs / iterations,
+			(double) syscalls / iterations);
+	else
+		printf("%-22s %12lu %12.2f %12.3f %12.3f\n", b->name, iterations,
+			(double) elapsed / iterations, (double) allocs / iterations,
+			(double) syscalls / iterations);
+	fflush(stdout);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"Usage: %s [options] [NAME...]\n"
+		"  -t, --min-time MS    minimum duration of the measured batch (default 200)\n"
+		"  -l, --list           list benchmark names\n"
+		"      --json           print one JSON object per benchmark\n"
+		"  -h, --help           show this help\n"
+		"NAME runs only the benchmarks whose name starts with it.\n",
+		prog);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "min-time", required_argument, NULL, 't' },
+		{ "list",     no_argument,       NULL, 'l' },
+		{ "json",     no_argument,       NULL, 1000 },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	u64 min_ns = 200 * 1000000UL;
+	int opt, json = 0;
+
+	while ((opt = getopt_long(argc, argv, "t:lh", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 't':
+				min_ns = strtoul(optarg, NULL, 0) * 1000000UL;
+				break;
+			case 'l':
+				for (size_t i = 0; i < NR_BENCHES; i++)
+					printf("%s\n", benches[i].name);
+				return 0;
+			case 1000:
+				json = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	log_set_quiet(1);
+	log_set_level(LOG_FATAL);
+	if (ns_add("null") != 1)
+		return 1;
+
+	if (!json)
+		printf("%-22s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op",
+			"allocs/op", "syscalls/op");
+	for (size_t i = 0; i < NR_BENCHES; i++) {
+		int selected = optind == argc;
+		for (int j = optind; j < argc && !selected; j++)
+			selected = !strncmp(benches[i].name, argv[j], strlen(argv[j]));
+		if (selected)
+			measure(&benches[i], min_ns, json);
+	}
+	return 0;
+}
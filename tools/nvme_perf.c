@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "transport.h"
+#include "discovery.h"
+#include "clock.h"
+#include "hist.h"
+#include "host.h"
+
+/*
+ * User-space NVMe/TCP load generator. It walks the same path a kernel
+ * host does (discovery, admin queue, I/O queues), then keeps --qd commands
+ * in flight on each of --queues I/O queues for --time seconds and reports
+ * IOPS, bandwidth and latency percentiles.
+ *
+ * Every I/O queue has a submitting and a completing thread so that large
+ * transfers in both directions cannot deadlock on full socket buffers.
+ */
+
+enum { OP_READ, OP_WRITE, NR_OPS };
+
+struct queue {
+	int qid;
+	sock_t socket;
+	pthread_t submitter;
+	pthread_t completer;
+
+	sem_t credits;
+	u16* free_cids;             /* ring of cids returned by the completer */
+	u32 free_head;              /* written by the completer */
+	u32 free_tail;              /* written by the submitter */
+	u64* sent_at;
+	u8* op;
+	int outstanding;
+	int submit_done;
+
+	u64 next_lba;
+	u64 seed;
+	void* wbuf;
+
+	u64 ios[NR_OPS];
+	u64 bytes[NR_OPS];
+	u64 errors;
+	struct hist lat[NR_OPS];
+};
+
+static struct {
+	const char* addr;
+	int port;
+	int qd;
+	int nr_queues;
+	u32 bs;
+	int read_pct;
+	int random;
+	int seconds;
+	u32 nsid;
+	const char* hostnqn;
+	int pract;
+	int json;
+
+	u32 lba_shift;
+	u64 nsze;
+	u16 cntlid;
+	volatile int stop;
+} P = {
+	.addr = "127.0.0.1",
+	.hostnqn = HOST_NQN,
+	.port = PORT,
+	.qd = 32,
+	.nr_queues = 1,
+	.bs = 4096,
+	.read_pct = 100,
+	.random = 1,
+	.seconds = 10,
+	.nsid = 1,
+};
+
+static u64 next_rand(u64* state) {
+	u64 x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/*
+ * Connects to the discovery controller and checks that the subsystem is
+ * listed in its log page.
+ */
+static int discover(void) {
+	struct nvme_discovery_log_page* page;
+	struct nvme_cmd cmd = {
+		.opcode = OPC_GET_LOG,
+		.cdw10  = LOG_DISCOVERY | ((NVME_DISCOVERY_LOG_PAGE_LEN / 4 - 1) << 16),
+	};
+	sock_t sock = host_open(P.addr, P.port);
+	int found = 0;
+	if (sock < 0)
+		return -1;
+	page = calloc(1, NVME_DISCOVERY_LOG_PAGE_LEN);
+	if (!page || host_connect(sock, DISCOVERY_NQN, HOST_NQN, 0, 32, 0xffff, 0, NULL) ||
+	    host_enable(sock) || host_admin_cmd(sock, &cmd, page, NVME_DISCOVERY_LOG_PAGE_LEN)) {
+		fprintf(stderr, "discovery failed\n");
+		free(page);
+		close(sock);
+		return -1;
+	}
+	for (u64 i = 0; i < page->numrec && i < 2; i++)
+		found |= !strcmp(page->entries[i].subnqn, SUBSYS_NQN);
+	free(page);
+	close(sock);
+	if (!found) {
+		fprintf(stderr, "subsystem not in discovery log\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Brings up the admin queue and reads the namespace geometry. Returns the
+ * admin socket, which has to stay open for the controller to live on.
+ */
+static sock_t setup_admin(void) {
+	struct nvme_id_ns* id_ns;
+	struct nvme_cmd cmd = {
+		.opcode = OPC_IDENTIFY,
+		.nsid   = P.nsid,
+		.cdw10  = CNS_ID_NS,
+	};
+	sock_t sock = host_open(P.addr, P.port);
+	if (sock < 0)
+		return -1;
+	id_ns = calloc(1, NVME_ID_NS_LEN);
+	if (!id_ns || host_connect(sock, SUBSYS_NQN, P.hostnqn, 0, 32, 0xffff, 0, &P.cntlid) ||
+	    host_enable(sock) || host_admin_cmd(sock, &cmd, id_ns, NVME_ID_NS_LEN)) {
+		fprintf(stderr, "admin queue setup failed\n");
+		free(id_ns);
+		close(sock);
+		return -1;
+	}
+	P.nsze = id_ns->nsze;
+	P.lba_shift = id_ns->lbaf[id_ns->flbas & 0xf].ds;
+	free(id_ns);
+	if (!P.nsze || P.lba_shift < 9 || P.bs % (1U << P.lba_shift)) {
+		fprintf(stderr, "block size %u does not fit namespace format (lba size %u)\n",
+			P.bs, 1U << P.lba_shift);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void* completer_main(void* arg) {
+	struct queue* q = arg;
+	void *psh, *data;
+	int type;
+
+	while ((type = recv_pdu(q->socket, &psh, &data)) >= 0) {
+		if (type == PDU_TYPE_RESP && psh) {
+			struct nvme_status* st = psh;
+			u16 cid = st->cid;
+			int op = q->op[cid];
+			if (st->sf >> 1)
+				q->errors++;
+			q->ios[op]++;
+			q->bytes[op] += P.bs;
+			hist_record(&q->lat[op], clock_ns() - q->sent_at[cid]);
+
+			q->free_cids[q->free_head % P.qd] = cid;
+			__atomic_store_n(&q->free_head, q->free_head + 1, __ATOMIC_RELEASE);
+			sem_post(&q->credits);
+			if (!__atomic_sub_fetch(&q->outstanding, 1, __ATOMIC_SEQ_CST) &&
+			    __atomic_load_n(&q->submit_done, __ATOMIC_SEQ_CST)) {
+				free(psh);
+				free(data);
+				break;
+			}
+		}
+		free(psh);
+		free(data);
+	}
+	return NULL;
+}
+
+static void* submitter_main(void* arg) {
+	struct queue* q = arg;
+	u32 nlb = P.bs >> P.lba_shift;
+	u64 span = P.nsze - nlb + 1;
+
+	while (!P.stop) {
+		struct nvme_cmd cmd = {0};
+		u64 lba;
+		u16 cid;
+		int op;
+
+		sem_wait(&q->credits);
+		if (P.stop)
+			break;
+		cid = q->free_cids[q->free_tail % P.qd];
+		__atomic_store_n(&q->free_tail, q->free_tail + 1, __ATOMIC_RELEASE);
+
+		op = (int) (next_rand(&q->seed) % 100) < P.read_pct ? OP_READ : OP_WRITE;
+		if (P.random) {
+			lba = (next_rand(&q->seed) % span) / nlb * nlb;
+		}
+		else {
+			lba = q->next_lba;
+			q->next_lba = lba + nlb < span ? lba + nlb : 0;
+		}
+		cmd.opcode = op == OP_READ ? IO_CMD_READ : IO_CMD_WRITE;
+		cmd.cid = cid;
+		cmd.nsid = P.nsid;
+		cmd.cdw10 = lba & 0xffffffff;
+		cmd.cdw11 = lba >> 32;
+		cmd.cdw12 = nlb - 1;
+		if (P.pract) {
+			// target generates and checks protection information
+			cmd.cdw12 |= PRINFO_PRACT | PRINFO_PRCHK_GUARD | PRINFO_PRCHK_REF;
+			cmd.cdw14 = lba & 0xffffffff;
+		}
+		q->op[cid] = op;
+		q->sent_at[cid] = clock_ns();
+		__atomic_add_fetch(&q->outstanding, 1, __ATOMIC_SEQ_CST);
+		if (host_send_cmd(q->socket, &cmd, q->wbuf, op == OP_WRITE ? P.bs : 0)) {
+			fprintf(stderr, "queue %d: send failed\n", q->qid);
+			break;
+		}
+	}
+
+	__atomic_store_n(&q->submit_done, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&q->outstanding, __ATOMIC_SEQ_CST))
+		shutdown(q->socket, SHUT_RD);
+	return NULL;
+}
+
+static int setup_queue(struct queue* q, int qid) {
+	q->qid = qid;
+	q->seed = 0x9e3779b97f4a7c15UL * qid;
+	q->next_lba = (P.nsze / P.nr_queues) * (qid - 1) / (P.bs >> P.lba_shift) * (P.bs >> P.lba_shift);
+	q->free_cids = calloc(P.qd, sizeof(*q->free_cids));
+	q->sent_at = calloc(P.qd, sizeof(*q->sent_at));
+	q->op = calloc(P.qd, sizeof(*q->op));
+	q->wbuf = malloc(P.bs);
+	if (!q->free_cids || !q->sent_at || !q->op || !q->wbuf)
+		return -1;
+	memset(q->wbuf, 0xa5, P.bs);
+	for (int i = 0; i < P.qd; i++)
+		q->free_cids[i] = i;
+	q->free_head = P.qd;
+	sem_init(&q->credits, 0, P.qd);
+
+	q->socket = host_open(P.addr, P.port);
+	if (q->socket < 0)
+		return -1;
+	if (host_connect(q->socket, SUBSYS_NQN, P.hostnqn, qid, P.qd + 1, P.cntlid, 0, NULL)) {
+		fprintf(stderr, "queue %d: connect failed\n", qid);
+		return -1;
+	}
+	return 0;
+}
+
+static void report(struct queue* queues, double elapsed) {
+	static const char* names[NR_OPS] = { "read", "write" };
+	struct hist lat[NR_OPS] = {{0}};
+	u64 ios[NR_OPS] = {0}, bytes[NR_OPS] = {0}, errors = 0;
+
+	for (int i = 0; i < P.nr_queues; i++) {
+		for (int op = 0; op < NR_OPS; op++) {
+			hist_merge(&lat[op], &queues[i].lat[op]);
+			ios[op] += queues[i].ios[op];
+			bytes[op] += queues[i].bytes[op];
+		}
+		errors += queues[i].errors;
+	}
+
+	if (P.json) {
+		printf("{\"queues\":%d,\"qd\":%d,\"bs\":%u,\"read_pct\":%d,\"random\":%d,"
+			"\"seconds\":%.3f,\"errors\":%lu,\"iops\":%.0f,\"mbps\":%.1f",
+			P.nr_queues, P.qd, P.bs, P.read_pct, P.random, elapsed, errors,
+			(ios[0] + ios[1]) / elapsed, (bytes[0] + bytes[1]) / elapsed / 1e6);
+		for (int op = 0; op < NR_OPS; op++)
+			printf(",\"%s\":{\"ios\":%lu,\"iops\":%.0f,\"mbps\":%.1f,\"lat_us\":{\"mean\":%.1f,"
+				"\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p99.9\":%.1f,\"max\":%.1f}}",
+				names[op], ios[op], ios[op] / elapsed, bytes[op] / elapsed / 1e6,
+				lat[op].count ? lat[op].sum / 1e3 / lat[op].count : 0.0,
+				hist_percentile(&lat[op], 50) / 1e3, hist_percentile(&lat[op], 90) / 1e3,
+				hist_percentile(&lat[op], 99) / 1e3, hist_percentile(&lat[op], 99.9) / 1e3,
+				lat[op].max / 1e3);
+		printf("}\n");
+		return;
+	}
+
+	printf("%d queue(s) x qd %d, %u-byte %s I/O, %d%% reads, %.2fs\n", P.nr_queues, P.qd,
+		P.bs, P.random ? "random" : "sequential", P.read_pct, elapsed);
+	printf("total: %.0f IOPS, %.1f MB/s, %lu errors\n", (ios[0] + ios[1]) / elapsed,
+		(bytes[0] + bytes[1]) / elapsed / 1e6, errors);
+	for (int op = 0; op < NR_OPS; op++) {
+		if (!ios[op])
+			continue;
+		printf("%-5s: %.0f IOPS, %.1f MB/s, latency(us) mean=%.1f p50=%.1f p90=%.1f "
+			"p99=%.1f p99.9=%.1f max=%.1f\n", names[op], ios[op] / elapsed,
+			bytes[op] / elapsed / 1e6, lat[op].sum / 1e3 / lat[op].count,
+			hist_percentile(&lat[op], 50) / 1e3, hist_percentile(&lat[op], 90) / 1e3,
+			hist_percentile(&lat[op], 99) / 1e3, hist_percentile(&lat[op], 99.9) / 1e3,
+			lat[op].max / 1e3);
+	}
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -a, --addr ADDR      target address (default 127.0.0.1)\n"
+		"  -p, --port PORT      target port (default %d)\n"
+		"  -q, --qd N           commands in flight per queue (default 32)\n"
+		"  -j, --queues N       number of I/O queues (default 1)\n"
+		"  -b, --bs BYTES       I/O size (default 4096)\n"
+		"  -w, --read-pct N     percentage of reads, the rest are writes (default 100)\n"
+		"  -s, --seq            sequential instead of random offsets\n"
+		"  -t, --time SECONDS   run time (default 10)\n"
+		"  -n, --nsid NSID      namespace (default 1)\n"
+		"      --hostnqn NQN    connect as host NQN (default " HOST_NQN ")\n"
+		"      --pract          set PRACT for namespaces with protection information\n"
+		"      --json           print results as one JSON object\n"
+		"  -h, --help           show this help\n",
+		prog, PORT);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "addr",     required_argument, NULL, 'a' },
+		{ "port",     required_argument, NULL, 'p' },
+		{ "qd",       required_argument, NULL, 'q' },
+		{ "queues",   required_argument, NULL, 'j' },
+		{ "bs",       required_argument, NULL, 'b' },
+		{ "read-pct", required_argument, NULL, 'w' },
+		{ "seq",      no_argument,       NULL, 's' },
+		{ "time",     required_argument, NULL, 't' },
+		{ "nsid",     required_argument, NULL, 'n' },
+		{ "json",     no_argument,       NULL, 1000 },
+		{ "hostnqn",  required_argument, NULL, 1001 },
+		{ "pract",    no_argument,       NULL, 1002 },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct queue* queues;
+	sock_t admin;
+	u64 start;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "a:p:q:j:b:w:st:n:h", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'a': P.addr = optarg; break;
+			case 'p': P.port = atoi(optarg); break;
+			case 'q': P.qd = atoi(optarg); break;
+			case 'j': P.nr_queues = atoi(optarg); break;
+			case 'b': P.bs = strtoul(optarg, NULL, 0); break;
+			case 'w': P.read_pct = atoi(optarg); break;
+			case 's': P.random = 0; break;
+			case 't': P.seconds = atoi(optarg); break;
+			case 'n': P.nsid = strtoul(optarg, NULL, 0); break;
+			case 1000: P.json = 1; break;
+			case 1001: P.hostnqn = optarg; break;
+			case 1002: P.pract = 1; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (P.qd < 1 || P.qd > 1024 || P.nr_queues < 1 || P.nr_queues > 128 || !P.bs ||
+	    P.read_pct < 0 || P.read_pct > 100 || P.seconds < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	log_set_level(LOG_ERROR);
+
+	if (discover())
+		return 1;
+	admin = setup_admin();
+	if (admin < 0)
+		return 1;
+	queues = calloc(P.nr_queues, sizeof(*queues));
+	if (!queues)
+		return 1;
+	for (int i = 0; i < P.nr_queues; i++)
+		if (setup_queue(&queues[i], i + 1))
+			return 1;
+
+	start = clock_ns();
+	for (int i = 0; i < P.nr_queues; i++) {
+		pthread_create(&queues[i].completer, NULL, completer_main, &queues[i]);
+		pthread_create(&queues[i].submitter, NULL, submitter_main, &queues[i]);
+	}
+	sleep(P.seconds);
+	P.stop = 1;
+	for (int i = 0; i < P.nr_queues; i++) {
+		sem_post(&queues[i].credits);
+		pthread_join(queues[i].submitter, NULL);
+		pthread_join(queues[i].completer, NULL);
+	}
+	report(queues, (clock_ns() - start) / 1e9);
+
+	for (int i = 0; i < P.nr_queues; i++)
+		close(queues[i].socket);
+	close(admin);
+	return 0;
+}
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "nvme.h"
+#include "transport.h"
+#include "capture.h"
+#include "clock.h"
+#include "hist.h"
+#include "host.h"
+
+/*
+ * Replays the host side of a PDU capture against a target. Every captured
+ * connection gets its own socket; its ICReq and Connect are regenerated
+ * (controller IDs differ from run to run) and all other host-to-target PDUs
+ * are sent as captured, at the original pacing divided by --speed. Data
+ * that was not sampled is sent as zeroes.
+ */
+
+struct entry {
+	struct capture_record rec;
+	u8* data;
+};
+
+struct conn {
+	u32 id;
+	struct entry** entries;
+	int nr;
+	int cap;
+	int connect;        /* index of the Connect command, or -1 */
+	u16 orig_cntlid;    /* cntlid the target returned in the capture */
+	pthread_t thread;
+
+	sock_t socket;
+	u64 sent_cmds;
+	u64 resps;
+	int sending;
+	u64 sent_at[65536];
+	struct hist lat;
+};
+
+static struct {
+	const char* addr;
+	int port;
+	double speed;
+	u64 t0;             /* replay start, monotonic */
+	u64 base;           /* capture timestamp of the first replayed record */
+	struct conn** conns;
+	int nr_conns;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u16 map_from[1024];
+	u16 map_to[1024];
+	int nr_map;
+} R = {
+	.addr = "127.0.0.1",
+	.port = PORT,
+	.speed = 1.0,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct conn* conn_of(u32 id) {
+	struct conn* c;
+	for (int i = 0; i < R.nr_conns; i++)
+		if (R.conns[i]->id == id)
+			return R.conns[i];
+	c = calloc(1, sizeof(*c));
+	R.conns = realloc(R.conns, (R.nr_conns + 1) * sizeof(*R.conns));
+	if (!c || !R.conns) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	c->id = id;
+	c->connect = -1;
+	c->orig_cntlid = 0xffff;
+	R.conns[R.nr_conns++] = c;
+	return c;
+}
+
+static void add_entry(struct conn* c, struct entry* e) {
+	if (c->nr == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 256;
+		c->entries = realloc(c->entries, c->cap * sizeof(*c->entries));
+		if (!c->entries) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	c->entries[c->nr++] = e;
+}
+
+static int is_connect(const struct capture_record* rec) {
+	const struct nvme_cmd* cmd = (const struct nvme_cmd*) rec->psh;
+	return rec->hdr.type == PDU_TYPE_CMD && cmd->opcode == OPC_FABRICS &&
+		cmd->nsid == FCTYPE_CONNECT;
+}
+
+/*
+ * Reads every complete record still present in the capture ring, oldest
+ * first, and sorts them into connections.
+ */
+static int load(const char* path) {
+	const struct capture_file_hdr* fh;
+	const u8* slots;
+	struct stat st;
+	u64 idx, head, ring;
+	int fd, first = 1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fh = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (fh == MAP_FAILED || memcmp(fh->magic, CAPTURE_MAGIC, 8) ||
+	    fh->slot_size != CAPTURE_SLOT_SIZE ||
+	    (u64) st.st_size < CAPTURE_HDR_SIZE + fh->nr_slots * CAPTURE_SLOT_SIZE) {
+		fprintf(stderr, "%s: not a capture file\n", path);
+		return -1;
+	}
+	slots = (const u8*) fh + CAPTURE_HDR_SIZE;
+	ring = fh->nr_slots * CAPTURE_SLOT_SIZE;
+	head = __atomic_load_n(&fh->head, __ATOMIC_ACQUIRE);
+
+	for (idx = head > fh->nr_slots ? head - fh->nr_slots : 0; idx < head;) {
+		const struct capture_record* rec =
+			(const void*) (slots + (idx % fh->nr_slots) * CAPTURE_SLOT_SIZE);
+		struct entry* e;
+		u64 off;
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != idx + 1 ||
+		    idx + rec->nslots > head) {
+			idx++;
+			continue;
+		}
+		if (first) {
+			R.base = rec->ts;
+			first = 0;
+		}
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return -1;
+		e->rec = *rec;
+		if (rec->sampled) {
+			e->data = malloc(rec->sampled);
+			if (!e->data)
+				return -1;
+			off = (idx * CAPTURE_SLOT_SIZE + sizeof(*rec)) % ring;
+			for (u32 i = 0; i < rec->sampled; i++)
+				e->data[i] = slots[(off + i) % ring];
+		}
+		add_entry(conn_of(rec->conn), e);
+		idx += rec->nslots;
+	}
+
+	for (int i = 0; i < R.nr_conns; i++) {
+		struct conn* c = R.conns[i];
+		for (int j = 0; j < c->nr; j++) {
+			struct entry* e = c->entries[j];
+			if (c->connect < 0 && e->rec.dir == CAPTURE_RX && is_connect(&e->rec))
+				c->connect = j;
+			else if (c->connect >= 0 && e->rec.dir == CAPTURE_TX &&
+				 e->rec.hdr.type == PDU_TYPE_RESP) {
+				c->orig_cntlid = ((struct nvme_status*) e->rec.psh)->dw0 & 0xffff;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+static void wait_until(u64 ts) {
+	struct timespec t;
+	u64 at;
+	if (R.speed <= 0 || ts < R.base)
+		return;
+	at = R.t0 + (u64) ((ts - R.base) / R.speed);
+	t.tv_sec = at / 1000000000UL;
+	t.tv_nsec = at % 1000000000UL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+		;
+}
+
+static void map_cntlid(u16 from, u16 to) {
+	pthread_mutex_lock(&R.lock);
+	if (R.nr_map < 1024) {
+		R.map_from[R.nr_map] = from;
+		R.map_to[R.nr_map++] = to;
+	}
+	pthread_cond_broadcast(&R.cond);
+	pthread_mutex_unlock(&R.lock);
+}
+
+/*
+ * Returns the cntlid the replayed admin queue got for the controller that
+ * had cntlid from in the capture, waiting for it to connect if needed.
+ */
+static int lookup_cntlid(u16 from) {
+	struct timespec deadline;
+	int ret = -1;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+	pthread_mutex_lock(&R.lock);
+	while (ret < 0) {
+		for (int i = R.nr_map - 1; i >= 0 && ret < 0; i--)
+			if (R.map_from[i] == from || from == 0xffff)
+				ret = R.map_to[i];
+		if (ret < 0 && pthread_cond_timedwait(&R.cond, &R.lock, &deadline))
+			break;
+	}
+	pthread_mutex_unlock(&R.lock);
+	return ret;
+}
+
+static void* reader_main(void* arg) {
+	struct conn* c = arg;
+	void *psh, *data;
+	int type;
+	while ((type = recv_pdu(c->socket, &psh, &data)) >= 0) {
+		if (type == PDU_TYPE_RESP && psh) {
+			struct nvme_status* st = psh;
+			u64 sent = c->sent_at[st->cid];
+			if (sent)
+				hist_record(&c->lat, clock_ns() - sent);
+			__atomic_add_fetch(&c->resps, 1, __ATOMIC_RELEASE);
+		}
+		free(psh);
+		free(data);
+	}
+	return NULL;
+}
+
+/*
+ * Regenerates the connection setup of a captured connection. Returns 0 on
+ * success or -1 on error.
+ */
+static int replay_connect(struct conn* c) {
+	const struct entry* e = c->entries[c->connect];
+	const struct nvme_cmd* cmd = (const struct nvme_cmd*) e->rec.psh;
+	const struct nvme_connect_params* params = NULL;
+	const char* subnqn = SUBSYS_NQN;
+	const char* hostnqn = HOST_NQN;
+	u16 qid = cmd->cdw10 >> 16, cntlid = 0xffff;
+	int sc;
+
+	if (e->rec.sampled >= NVME_CONNPARAMS_LEN) {
+		params = (const struct nvme_connect_params*) e->data;
+		subnqn = params->subnqn;
+		hostnqn = params->hostnqn;
+	}
+	if (qid) {
+		int mapped = lookup_cntlid(params ? params->cntlid : 0xffff);
+		if (mapped < 0) {
+			fprintf(stderr, "conn %u: no admin queue for I/O queue %u\n", c->id, qid);
+			return -1;
+		}
+		cntlid = mapped;
+	}
+
+	c->socket = host_open(R.addr, R.port);
+	if (c->socket < 0)
+		return -1;
+	sc = host_connect(c->socket, subnqn, hostnqn, qid, (cmd->cdw11 & 0xffff) + 1, cntlid,
+			cmd->cdw12, &cntlid);
+	if (sc) {
+		fprintf(stderr, "conn %u: connect failed (status 0x%x)\n", c->id, sc);
+		close(c->socket);
+		return -1;
+	}
+	if (!qid)
+		map_cntlid(c->orig_cntlid, cntlid);
+	return 0;
+}
+
+static void* conn_main(void* arg) {
+	struct conn* c = arg;
+	pthread_t reader;
+	u8* zeroes = NULL;
+	u32 zeroes_len = 0;
+	u64 deadline;
+
+	if (c->connect < 0) {
+		fprintf(stderr, "conn %u: no Connect captured, skipping\n", c->id);
+		return NULL;
+	}
+	wait_until(c->entries[c->connect]->rec.ts);
+	if (replay_connect(c))
+		return NULL;
+	if (pthread_create(&reader, NULL, reader_main, c)) {
+		close(c->socket);
+		return NULL;
+	}
+
+	for (int i = c->connect + 1; i < c->nr; i++) {
+		struct entry* e = c->entries[i];
+		struct pdu_header hdr = e->rec.hdr;
+		u8* data = NULL;
+		if (e->rec.dir != CAPTURE_RX || hdr.type == PDU_TYPE_ICREQ)
+			continue;
+		if (hdr.hlen > PDU_HDR_LEN + CAPTURE_PSH_MAX) {
+			fprintf(stderr, "conn %u: PDU header too long for replay\n", c->id);
+			break;
+		}
+		if (e->rec.data_len) {
+			if (e->rec.sampled == e->rec.data_len) {
+				data = e->data;
+			}
+			else {
+				if (zeroes_len < e->rec.data_len) {
+					free(zeroes);
+					zeroes = calloc(1, e->rec.data_len);
+					zeroes_len = zeroes ? e->rec.data_len : 0;
+					if (!zeroes)
+						break;
+				}
+				memset(zeroes, 0, e->rec.data_len);
+				if (e->rec.sampled)
+					memcpy(zeroes, e->data, e->rec.sampled);
+				data = zeroes;
+			}
+		}
+
+		wait_until(e->rec.ts);
+		if (hdr.type == PDU_TYPE_CMD) {
+			c->sent_at[((struct nvme_cmd*) e->rec.psh)->cid] = clock_ns();
+			c->sent_cmds++;
+		}
+		if (send_pdu(c->socket, &hdr, e->rec.psh, data)) {
+			fprintf(stderr, "conn %u: send failed\n", c->id);
+			break;
+		}
+	}
+
+	// give outstanding commands a moment to complete; AERs never will
+	deadline = clock_ns() + 2000000000UL;
+	while (__atomic_load_n(&c->resps, __ATOMIC_ACQUIRE) < c->sent_cmds && clock_ns() < deadline)
+		usleep(1000);
+	shutdown(c->socket, SHUT_RDWR);
+	pthread_join(reader, NULL);
+	close(c->socket);
+	free(zeroes);
+	return NULL;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"Usage: %s [options] CAPTURE\n"
+		"  -a, --addr ADDR    target address (default 127.0.0.1)\n"
+		"  -p, --port PORT    target port (default %d)\n"
+		"  -s, --speed X      replay X times faster than captured, 0 for no pacing (default 1)\n"
+		"  -h, --help         show this help\n",
+		prog, PORT);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "addr",  required_argument, NULL, 'a' },
+		{ "port",  required_argument, NULL, 'p' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "help",  no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct hist lat = {0};
+	u64 cmds = 0, resps = 0, start, elapsed, span = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "a:p:s:h", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'a': R.addr = optarg; break;
+			case 'p': R.port = atoi(optarg); break;
+			case 's': R.speed = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	log_set_level(LOG_ERROR);
+	if (load(argv[optind]))
+		return 1;
+
+	start = R.t0 = clock_ns();
+	for (int i = 0; i < R.nr_conns; i++)
+		pthread_create(&R.conns[i]->thread, NULL, conn_main, R.conns[i]);
+	for (int i = 0; i < R.nr_conns; i++) {
+		struct conn* c = R.conns[i];
+		pthread_join(c->thread, NULL);
+		hist_merge(&lat, &c->lat);
+		cmds += c->sent_cmds;
+		resps += c->resps;
+		if (c->nr && c->entries[c->nr - 1]->rec.ts - R.base > span)
+			span = c->entries[c->nr - 1]->rec.ts - R.base;
+	}
+	elapsed = clock_ns() - start;
+
+	printf("connections: %d\n", R.nr_conns);
+	printf("commands:    %lu sent, %lu completed\n", cmds, resps);
+	printf("duration:    %.3fs replayed, %.3fs captured\n", elapsed / 1e9, span / 1e9);
+	printf("latency(us): p50=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+		hist_percentile(&lat, 50) / 1e3, hist_percentile(&lat, 99) / 1e3,
+		hist_percentile(&lat, 99.9) / 1e3, lat.max / 1e3);
+	return 0;
+}